@@ -0,0 +1,4776 @@
+/**********************************************************************
+  Authors: Alexander Bajic and Georg T. Becker
+  E-Mail: bajic@me.com
+
+  Description:
+  Native counterpart of the Matlab scripts in this folder. It reads the
+  CAIDA AS relationship files the way readinASGraphDirected.m does, but
+  straight from the raw a|b|rel format, and keeps the graph in
+  compressed sparse row (CSR) form: for every AS the list of its
+  providers, its customers and its peers, with AS numbers remapped to
+  dense indices 0..n-1 in ascending order of the AS number, i.e. index i
+  here is listOfNodes(i+1) in Matlab. The parsed graph is written to a
+  binary snapshot next to the text file, which later runs map into memory
+  instead of parsing the text again. "asgraph reorder" writes snapshots
+  with the indices in another order, see reorderGraph.
+
+  Build with asgraph.sh, run without arguments for the list of modes.
+
+**********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define REL_PROVIDERS 0 /* sourceCellC in Matlab */
+#define REL_CUSTOMERS 1 /* sourceCellP */
+#define REL_PEERS 2     /* sourceCellPtoP */
+#define NUM_OF_RELS 3
+
+#define SNAPSHOT_MAGIC 0x3348505247534124ULL /* "$ASGRPH3" */
+#define SNAPSHOT_SUFFIX ".csr"
+
+static const char *relNames[NUM_OF_RELS]={"providers","customers","peers"};
+
+/* the graph, either on the heap or mapped from a snapshot */
+struct AsGraph {
+  uint32_t nodes;
+  uint64_t edges[NUM_OF_RELS]; /* entries in adj, peerings count twice */
+  uint32_t *asn;               /* AS number of every index */
+  uint32_t *byAsn;             /* index of listOfNodes(i+1), NULL if that is i */
+  uint32_t *off[NUM_OF_RELS];  /* nodes+1 offsets into adj */
+  uint32_t *adj[NUM_OF_RELS];
+  uint32_t *twin[NUM_OF_RELS]; /* per adj entry v->u, where v is in the list of u; see graphTwins */
+  void *map;                   /* the snapshot, if mapped */
+  size_t mapLen;
+};
+
+/**************************************************************************
+ Layout of a snapshot: this header, then asn, then offsets and adjacency
+ of every relation, then byAsn of a reordered graph (byAsnAt is 0 for
+ the ascending order). Every array starts at a multiple of 8 bytes, so
+ that a mapped snapshot can be used in place.
+**************************************************************************/
+struct SnapshotHeader {
+  uint64_t magic;
+  uint64_t nodes;
+  uint64_t edges[NUM_OF_RELS];
+  uint64_t asnAt;
+  uint64_t byAsnAt;
+  uint64_t offAt[NUM_OF_RELS];
+  uint64_t adjAt[NUM_OF_RELS];
+  uint64_t size;
+};
+
+/* an edge of the text file, already remapped once the nodes are known */
+struct Edge {
+  uint32_t a;
+  uint32_t b;
+  int32_t rel;
+};
+
+uint64_t nowNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+int compareU32(const void *x, const void *y)
+{
+  uint32_t a=*(const uint32_t *)x, b=*(const uint32_t *)y;
+  return a < b ? -1 : a > b;
+}
+
+/* the index of the AS at position i in ascending order, listOfNodes(i+1) */
+static inline uint32_t asAt(const struct AsGraph *g, uint32_t i)
+{
+  return g->byAsn != NULL ? g->byAsn[i] : i;
+}
+
+/* the position in ascending order of the first AS number >= asn */
+static uint32_t asRankOf(const struct AsGraph *g, uint32_t asn)
+{
+  uint32_t lo=0, hi=g->nodes;
+  while(lo < hi)
+  {
+    uint32_t mid=lo+(hi-lo)/2;
+    if(g->asn[asAt(g, mid)] < asn){
+      lo=mid+1;
+    }
+    else{
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+/**************************************************************************
+ Returns the dense index of AS number asn or -1 if it is not in the
+ graph. A binary search, where Matlab scans listOfNodes with find.
+**************************************************************************/
+int64_t asIndex(const struct AsGraph *g, uint32_t asn)
+{
+  uint32_t i=asRankOf(g, asn);
+  return i < g->nodes && g->asn[asAt(g, i)] == asn ? (int64_t)asAt(g, i) : -1;
+}
+
+/* the Matlab index of index v, minus one: v in the ascending order */
+static inline uint32_t asRank(const struct AsGraph *g, uint32_t v)
+{
+  return g->byAsn != NULL ? asRankOf(g, g->asn[v]) : v;
+}
+
+/* reads an unsigned or negative decimal number, returns where it stopped */
+static const char *parseNumber(const char *p, const char *end, int64_t *v)
+{
+  int neg=0;
+  int64_t x=0;
+  const char *start;
+
+  if(p < end && *p == '-'){
+    neg=1;
+    p++;
+  }
+  start=p;
+  while(p < end && *p >= '0' && *p <= '9')
+  {
+    x=x*10+(*p-'0');
+    p++;
+  }
+  *v=neg ? -x : x;
+  return p == start ? NULL : p;
+}
+
+/**************************************************************************
+ Parses a|b|rel lines (anything after a third | is ignored, as in the
+ as-rel2 files). Lines starting with # are the comment header CAIDA puts
+ on top, lines that do not parse are counted and skipped. Returns the
+ number of edges or -1.
+**************************************************************************/
+int64_t parseAsRel(const char *text, size_t len, struct Edge **edges, uint64_t *skipped)
+{
+  const char *p=text, *end=text+len;
+  uint64_t n=0, cap=1 << 16;
+  struct Edge *e=malloc(cap*sizeof *e);
+
+  *skipped=0;
+  if(e == NULL){
+    return -1;
+  }
+  while(p < end)
+  {
+    const char *eol=memchr(p, '\n', end-p);
+    const char *q;
+    int64_t a, b, rel;
+    if(eol == NULL){
+      eol=end;
+    }
+    if(p < eol && *p != '#' && *p != '\r'){
+      q=parseNumber(p, eol, &a);
+      if(q != NULL && q < eol && *q == '|'){
+        q=parseNumber(q+1, eol, &b);
+      }
+      else{
+        q=NULL;
+      }
+      if(q != NULL && q < eol && *q == '|'){
+        q=parseNumber(q+1, eol, &rel);
+      }
+      else{
+        q=NULL;
+      }
+      if(q == NULL || a < 0 || b < 0 || a > UINT32_MAX || b > UINT32_MAX || (rel != -1 && rel != 0)){
+        (*skipped)++;
+      }
+      else{
+        if(n == cap){
+          struct Edge *more=realloc(e, 2*cap*sizeof *e);
+          if(more == NULL){
+            free(e);
+            return -1;
+          }
+          e=more;
+          cap=2*cap;
+        }
+        e[n].a=(uint32_t)a;
+        e[n].b=(uint32_t)b;
+        e[n].rel=(int32_t)rel;
+        n++;
+      }
+    }
+    p=eol+1;
+  }
+  *edges=e;
+  return (int64_t)n;
+}
+
+/**************************************************************************
+ Builds the CSR arrays from the edges: a provider-to-customer edge a|b|-1
+ makes a a provider of b and b a customer of a, a peering a|b|0 makes
+ either a peer of the other. Within a list, neighbours keep the order of
+ the file, like the cell arrays of the Matlab import. As in sourceCellPtoP,
+ the peers of v are those of the lines x|v|0 followed by those of v|x|0;
+ the BFS below visits neighbours in list order, so that its first path
+ is also the first path of the Matlab tree.
+**************************************************************************/
+int buildGraph(struct AsGraph *g, struct Edge *e, uint64_t n)
+{
+  uint32_t *all=malloc(2*n*sizeof *all);
+  uint64_t unique=0;
+  uint32_t *fill[NUM_OF_RELS];
+
+  memset(g, 0, sizeof *g);
+  if(all == NULL){
+    return -1;
+  }
+  for(uint64_t i=0;i<n;i++)
+  {
+    all[2*i]=e[i].a;
+    all[2*i+1]=e[i].b;
+  }
+  qsort(all, 2*n, sizeof *all, compareU32);
+  for(uint64_t i=0;i<2*n;i++)
+  {
+    if(unique == 0 || all[unique-1] != all[i]){
+      all[unique++]=all[i];
+    }
+  }
+  g->nodes=(uint32_t)unique;
+  g->asn=realloc(all, (unique > 0 ? unique : 1)*sizeof *all);
+
+  // remapped once, every later step works on dense indices only
+  for(uint64_t i=0;i<n;i++)
+  {
+    e[i].a=(uint32_t)asIndex(g, e[i].a);
+    e[i].b=(uint32_t)asIndex(g, e[i].b);
+  }
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    if((g->off[r]=calloc(g->nodes+1, sizeof(uint32_t))) == NULL){
+      return -1;
+    }
+  }
+  for(uint64_t i=0;i<n;i++)
+  {
+    if(e[i].rel == -1){
+      g->off[REL_PROVIDERS][e[i].b+1]++;
+      g->off[REL_CUSTOMERS][e[i].a+1]++;
+    }
+    else{
+      g->off[REL_PEERS][e[i].a+1]++;
+      g->off[REL_PEERS][e[i].b+1]++;
+    }
+  }
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    for(uint32_t v=0;v<g->nodes;v++)
+    {
+      g->off[r][v+1]=g->off[r][v+1]+g->off[r][v];
+    }
+    g->edges[r]=g->off[r][g->nodes];
+    g->adj[r]=malloc((g->edges[r] > 0 ? g->edges[r] : 1)*sizeof(uint32_t));
+    fill[r]=malloc((g->nodes > 0 ? g->nodes : 1)*sizeof(uint32_t));
+    if(g->adj[r] == NULL || fill[r] == NULL){
+      return -1;
+    }
+    memcpy(fill[r], g->off[r], g->nodes*sizeof(uint32_t));
+  }
+  for(uint64_t i=0;i<n;i++)
+  {
+    if(e[i].rel == -1){
+      g->adj[REL_PROVIDERS][fill[REL_PROVIDERS][e[i].b]++]=e[i].a;
+      g->adj[REL_CUSTOMERS][fill[REL_CUSTOMERS][e[i].a]++]=e[i].b;
+    }
+    else{
+      g->adj[REL_PEERS][fill[REL_PEERS][e[i].b]++]=e[i].a;
+    }
+  }
+  for(uint64_t i=0;i<n;i++)
+  {
+    if(e[i].rel == 0){
+      g->adj[REL_PEERS][fill[REL_PEERS][e[i].a]++]=e[i].b;
+    }
+  }
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    free(fill[r]);
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Every relation is stored from both ends: u is a provider of v where v is
+ a customer of u, and peerings are in the lists of both peers. For the
+ entry u in list r of v, twin[r] holds the position of v in the opposite
+ list of u (the first one, should an edge be listed twice). The bottom-up
+ steps of bfsRun need it to tell when the top-down BFS would have found v.
+ One counting pass per relation: the entries pointing at u are gathered
+ in the space of the list of u, which has just as many.
+**************************************************************************/
+int graphTwins(struct AsGraph *g)
+{
+  static const int reverse[NUM_OF_RELS]={REL_CUSTOMERS,REL_PROVIDERS,REL_PEERS};
+  uint64_t *bucket=NULL;
+  uint32_t *fill=calloc(g->nodes+1, sizeof *fill), *at=malloc((g->nodes+1)*sizeof *at);
+  int ok=fill != NULL && at != NULL;
+
+  for(int r=0;r<NUM_OF_RELS && ok;r++)
+  {
+    int rr=reverse[r];
+    ok=g->edges[r] == g->edges[rr] && (g->twin[r]=malloc((g->edges[r] > 0 ? g->edges[r] : 1)*sizeof(uint32_t))) != NULL && (bucket=realloc(bucket, (g->edges[r] > 0 ? g->edges[r] : 1)*sizeof *bucket)) != NULL;
+    memset(fill, 0, g->nodes*sizeof *fill);
+    for(uint32_t v=0;v<g->nodes && ok;v++)
+    {
+      for(uint32_t e=g->off[r][v];e<g->off[r][v+1] && ok;e++)
+      {
+        uint32_t u=g->adj[r][e];
+        ok=g->off[rr][u]+fill[u] < g->off[rr][u+1];
+        if(ok){
+          bucket[g->off[rr][u]+fill[u]++]=(uint64_t)v << 32 | e;
+        }
+      }
+    }
+    for(uint32_t u=0;u<g->nodes && ok;u++)
+    {
+      for(uint32_t k=g->off[rr][u+1]-g->off[rr][u];k-- > 0;)
+      {
+        at[g->adj[rr][g->off[rr][u]+k]]=k;
+      }
+      for(uint32_t j=g->off[rr][u];j<g->off[rr][u+1];j++)
+      {
+        g->twin[r][(uint32_t)bucket[j]]=at[bucket[j] >> 32];
+      }
+    }
+  }
+  free(bucket);
+  free(fill);
+  free(at);
+  if(!ok){
+    for(int r=0;r<NUM_OF_RELS;r++)
+    {
+      free(g->twin[r]);
+      g->twin[r]=NULL;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+void freeGraph(struct AsGraph *g)
+{
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    free(g->twin[r]);
+  }
+  if(g->map != NULL){
+    munmap(g->map, g->mapLen);
+  }
+  else{
+    free(g->asn);
+    free(g->byAsn);
+    for(int r=0;r<NUM_OF_RELS;r++)
+    {
+      free(g->off[r]);
+      free(g->adj[r]);
+    }
+  }
+  memset(g, 0, sizeof *g);
+}
+
+static uint64_t align8(uint64_t x)
+{
+  return (x+7) & ~7ULL;
+}
+
+/**************************************************************************
+ Writes the graph to path as a snapshot. It goes to a temporary file
+ first, so that a concurrent reader never maps half a snapshot.
+**************************************************************************/
+int writeSnapshot(const struct AsGraph *g, const char *path)
+{
+  struct SnapshotHeader h;
+  char tmp[4096];
+  FILE *f;
+  static const uint8_t zero[8];
+  uint64_t at=align8(sizeof h);
+  int ok=1;
+
+  memset(&h, 0, sizeof h);
+  h.magic=SNAPSHOT_MAGIC;
+  h.nodes=g->nodes;
+  h.asnAt=at;
+  at=align8(at+(uint64_t)g->nodes*4);
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    h.edges[r]=g->edges[r];
+    h.offAt[r]=at;
+    at=align8(at+((uint64_t)g->nodes+1)*4);
+    h.adjAt[r]=at;
+    at=align8(at+g->edges[r]*4);
+  }
+  if(g->byAsn != NULL){
+    h.byAsnAt=at;
+    at=align8(at+(uint64_t)g->nodes*4);
+  }
+  h.size=at;
+
+  snprintf(tmp, sizeof tmp, "%s.tmp%d", path, (int)getpid());
+  if((f=fopen(tmp, "wb")) == NULL){
+    perror(tmp);
+    return -1;
+  }
+  ok=ok && fwrite(&h, sizeof h, 1, f) == 1;
+  ok=ok && fwrite(zero, align8(sizeof h)-sizeof h, 1, f) <= 1;
+  ok=ok && fwrite(g->asn, 4, g->nodes, f) == g->nodes;
+  ok=ok && (align8((uint64_t)g->nodes*4) == (uint64_t)g->nodes*4 || fwrite(zero, 4, 1, f) == 1);
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    uint64_t offLen=((uint64_t)g->nodes+1)*4;
+    ok=ok && fwrite(g->off[r], 4, g->nodes+1, f) == g->nodes+1;
+    ok=ok && (align8(offLen) == offLen || fwrite(zero, 4, 1, f) == 1);
+    ok=ok && fwrite(g->adj[r], 4, g->edges[r], f) == g->edges[r];
+    ok=ok && (align8(g->edges[r]*4) == g->edges[r]*4 || fwrite(zero, 4, 1, f) == 1);
+  }
+  if(g->byAsn != NULL){
+    ok=ok && fwrite(g->byAsn, 4, g->nodes, f) == g->nodes;
+    ok=ok && (align8((uint64_t)g->nodes*4) == (uint64_t)g->nodes*4 || fwrite(zero, 4, 1, f) == 1);
+  }
+  if(fclose(f) != 0 || !ok || rename(tmp, path) != 0){
+    perror(path);
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Maps a snapshot; the arrays of g point right into the mapping. Returns
+ -1 if path is not a (complete) snapshot.
+**************************************************************************/
+int mapSnapshot(struct AsGraph *g, const char *path)
+{
+  struct SnapshotHeader *h;
+  struct stat st;
+  int fd=open(path, O_RDONLY);
+  void *map;
+
+  memset(g, 0, sizeof *g);
+  if(fd < 0){
+    return -1;
+  }
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof *h){
+    close(fd);
+    return -1;
+  }
+  map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    return -1;
+  }
+  h=map;
+  if(h->magic != SNAPSHOT_MAGIC || h->size != (uint64_t)st.st_size){
+    munmap(map, st.st_size);
+    return -1;
+  }
+  g->map=map;
+  g->mapLen=st.st_size;
+  g->nodes=(uint32_t)h->nodes;
+  g->asn=(uint32_t *)((uint8_t *)map+h->asnAt);
+  g->byAsn=h->byAsnAt > 0 ? (uint32_t *)((uint8_t *)map+h->byAsnAt) : NULL;
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    g->edges[r]=h->edges[r];
+    g->off[r]=(uint32_t *)((uint8_t *)map+h->offAt[r]);
+    g->adj[r]=(uint32_t *)((uint8_t *)map+h->adjAt[r]);
+  }
+  return 0;
+}
+
+/**************************************************************************
+* Matlab files
+*
+* Just enough of the level 5 MAT-file format to exchange numeric arrays
+* with the Matlab scripts: matRead finds one variable by name in a file
+* saved by Matlab (compressed or not) and converts whatever numeric class
+* it was stored in to double; matWrite saves double matrices, compressed,
+* so that the plot scripts load native results like their own.
+**************************************************************************/
+
+#define MI_INT8 1
+#define MI_UINT8 2
+#define MI_INT16 3
+#define MI_UINT16 4
+#define MI_INT32 5
+#define MI_UINT32 6
+#define MI_SINGLE 7
+#define MI_DOUBLE 9
+#define MI_INT64 12
+#define MI_UINT64 13
+#define MI_MATRIX 14
+#define MI_COMPRESSED 15
+#define MX_DOUBLE_CLASS 6
+#define MX_UINT64_CLASS 15
+#define MAT_HEADER_SIZE 128
+
+struct MatArray {
+  char name[64];
+  uint32_t rows;
+  uint32_t cols;
+  double *data; /* column-major, as in Matlab */
+};
+
+/* reads a data element tag, in the normal or the small element format */
+static int matTag(const uint8_t *p, const uint8_t *end, uint32_t *type, uint32_t *len, const uint8_t **data, const uint8_t **next)
+{
+  uint32_t w[2];
+
+  if(end-p < 8){
+    return -1;
+  }
+  memcpy(w, p, 8);
+  if(w[0] >> 16){
+    *type=w[0] & 0xffff;
+    *len=w[0] >> 16;
+    *data=p+4;
+    *next=p+8;
+    return *len <= 4 ? 0 : -1;
+  }
+  *type=w[0];
+  *len=w[1];
+  *data=p+8;
+  if((uint64_t)(end-*data) < *len){
+    return -1;
+  }
+  *next=(uint64_t)(end-*data) < align8(*len) ? end : *data+align8(*len);
+  return 0;
+}
+
+static double matValue(const uint8_t *d, uint32_t type, size_t i)
+{
+  switch(type)
+  {
+    case MI_INT8: return ((const int8_t *)d)[i];
+    case MI_UINT8: return d[i];
+    case MI_INT16: { int16_t x; memcpy(&x, d+2*i, 2); return x; }
+    case MI_UINT16: { uint16_t x; memcpy(&x, d+2*i, 2); return x; }
+    case MI_INT32: { int32_t x; memcpy(&x, d+4*i, 4); return x; }
+    case MI_UINT32: { uint32_t x; memcpy(&x, d+4*i, 4); return x; }
+    case MI_SINGLE: { float x; memcpy(&x, d+4*i, 4); return x; }
+    case MI_INT64: { int64_t x; memcpy(&x, d+8*i, 8); return (double)x; }
+    case MI_UINT64: { uint64_t x; memcpy(&x, d+8*i, 8); return (double)x; }
+    default: { double x; memcpy(&x, d+8*i, 8); return x; }
+  }
+}
+
+static uint32_t matTypeSize(uint32_t type)
+{
+  switch(type)
+  {
+    case MI_INT8: case MI_UINT8: return 1;
+    case MI_INT16: case MI_UINT16: return 2;
+    case MI_INT32: case MI_UINT32: case MI_SINGLE: return 4;
+    case MI_DOUBLE: case MI_INT64: case MI_UINT64: return 8;
+    default: return 0;
+  }
+}
+
+/**************************************************************************
+ Parses the miMATRIX element at p into a. Returns 0 for a numeric array
+ called name, 1 for anything else and -1 if the element is broken.
+**************************************************************************/
+static int matParse(const uint8_t *p, const uint8_t *end, const char *name, struct MatArray *a)
+{
+  const uint8_t *d, *q, *mend;
+  uint32_t type, len, cls, dims[8], n;
+  uint64_t count=1;
+
+  if(matTag(p, end, &type, &len, &d, &q) != 0 || type != MI_MATRIX){
+    return -1;
+  }
+  mend=d+len;
+  // array flags, dimensions, name, then the real part
+  if(matTag(d, mend, &type, &len, &d, &q) != 0 || type != MI_UINT32 || len < 4){
+    return -1;
+  }
+  memcpy(&cls, d, 4);
+  cls=cls & 0xff;
+  if(matTag(q, mend, &type, &len, &d, &q) != 0 || type != MI_INT32 || len < 8 || len > sizeof dims){
+    return -1;
+  }
+  memcpy(dims, d, len);
+  for(uint32_t i=0;i<len/4;i++)
+  {
+    count=count*dims[i];
+  }
+  if(matTag(q, mend, &type, &n, &d, &q) != 0 || type != MI_INT8){
+    return -1;
+  }
+  if(n != strlen(name) || memcmp(d, name, n) != 0 || cls < MX_DOUBLE_CLASS || cls > MX_UINT64_CLASS){
+    return 1;
+  }
+  if(matTag(q, mend, &type, &len, &d, &q) != 0 || matTypeSize(type) == 0 || len/matTypeSize(type) != count){
+    return -1;
+  }
+  snprintf(a->name, sizeof a->name, "%s", name);
+  a->rows=dims[0];
+  a->cols=(uint32_t)(count/(dims[0] > 0 ? dims[0] : 1));
+  if((a->data=malloc((count > 0 ? count : 1)*sizeof(double))) == NULL){
+    return -1;
+  }
+  for(uint64_t i=0;i<count;i++)
+  {
+    a->data[i]=matValue(d, type, i);
+  }
+  return 0;
+}
+
+static uint8_t *matInflate(const uint8_t *src, uint32_t len, size_t *outLen)
+{
+  z_stream z;
+  size_t cap=4*(size_t)len+1024;
+  uint8_t *out=malloc(cap);
+  int ret=Z_OK;
+
+  memset(&z, 0, sizeof z);
+  if(out == NULL || inflateInit(&z) != Z_OK){
+    free(out);
+    return NULL;
+  }
+  z.next_in=(uint8_t *)src;
+  z.avail_in=len;
+  while(ret == Z_OK)
+  {
+    if(z.total_out == cap){
+      uint8_t *more=realloc(out, 2*cap);
+      if(more == NULL){
+        break;
+      }
+      out=more;
+      cap=2*cap;
+    }
+    z.next_out=out+z.total_out;
+    z.avail_out=(uInt)(cap-z.total_out);
+    ret=inflate(&z, Z_NO_FLUSH);
+  }
+  *outLen=z.total_out;
+  inflateEnd(&z);
+  if(ret != Z_STREAM_END){
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+/**************************************************************************
+ Reads variable name of the MAT-file path into a. Returns -1 (with a
+ message) if the file cannot be read or has no numeric variable name.
+**************************************************************************/
+int matRead(const char *path, const char *name, struct MatArray *a)
+{
+  FILE *f=fopen(path, "rb");
+  uint8_t *file;
+  const uint8_t *p, *end;
+  long size;
+  int found=-1;
+
+  memset(a, 0, sizeof *a);
+  if(f == NULL){
+    perror(path);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  size=ftell(f);
+  rewind(f);
+  if(size < MAT_HEADER_SIZE || (file=malloc(size)) == NULL || fread(file, 1, size, f) != (size_t)size){
+    fprintf(stderr,"%s: not a MAT-file\n",path);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  if(file[126] != 'I' || file[127] != 'M'){
+    fprintf(stderr,"%s: not a little endian level 5 MAT-file\n",path);
+    free(file);
+    return -1;
+  }
+  p=file+MAT_HEADER_SIZE;
+  end=file+size;
+  while(found != 0 && p < end)
+  {
+    const uint8_t *d, *next;
+    uint32_t type, len;
+    if(matTag(p, end, &type, &len, &d, &next) != 0){
+      break;
+    }
+    if(type == MI_COMPRESSED){
+      size_t n;
+      uint8_t *inner=matInflate(d, len, &n);
+      if(inner != NULL){
+        found=matParse(inner, inner+n, name, a) == 0 ? 0 : -1;
+        free(inner);
+      }
+      next=d+len; // compressed elements are not padded
+    }
+    else if(type == MI_MATRIX){
+      found=matParse(p, end, name, a) == 0 ? 0 : -1;
+    }
+    p=next;
+  }
+  free(file);
+  if(found != 0){
+    fprintf(stderr,"%s: no numeric variable %s\n",path,name);
+  }
+  return found;
+}
+
+static uint8_t *matPut(uint8_t *p, uint32_t type, uint32_t len, const void *data)
+{
+  memcpy(p, &type, 4);
+  memcpy(p+4, &len, 4);
+  memcpy(p+8, data, len);
+  memset(p+8+len, 0, align8(len)-len);
+  return p+8+align8(len);
+}
+
+/* saves n double matrices to path, like save(path,'name1',...) */
+int matWrite(const char *path, const struct MatArray *arrays, int n)
+{
+  char header[MAT_HEADER_SIZE];
+  FILE *f=fopen(path, "wb");
+  uint16_t version=0x0100;
+  time_t now=time(NULL);
+  int ok=1;
+
+  if(f == NULL){
+    perror(path);
+    return -1;
+  }
+  memset(header, ' ', 116);
+  memcpy(header, "MATLAB 5.0 MAT-file, written by asgraph, ", 41);
+  memcpy(header+41, ctime(&now), 24);
+  memset(header+116, 0, 8);
+  memcpy(header+124, &version, 2);
+  header[126]='I';
+  header[127]='M';
+  ok=fwrite(header, sizeof header, 1, f) == 1;
+  for(int i=0;i<n && ok;i++)
+  {
+    const struct MatArray *a=&arrays[i];
+    uint32_t flags[2]={MX_DOUBLE_CLASS,0}, dims[2]={a->rows,a->cols};
+    uint32_t nameLen=(uint32_t)strlen(a->name), dataLen=8*a->rows*a->cols;
+    uint32_t inner=16+16+8+(uint32_t)align8(nameLen)+8+dataLen, tag[2]={MI_COMPRESSED,0};
+    uint8_t *raw=malloc(8+inner), *p;
+    uLongf packedLen=compressBound(8+inner);
+    uint8_t *packed=malloc(packedLen);
+    if(raw == NULL || packed == NULL){
+      free(raw);
+      free(packed);
+      ok=0;
+      break;
+    }
+    tag[0]=MI_MATRIX;
+    tag[1]=inner;
+    memcpy(raw, tag, 8);
+    p=matPut(raw+8, MI_UINT32, 8, flags);
+    p=matPut(p, MI_INT32, 8, dims);
+    p=matPut(p, MI_INT8, nameLen, a->name);
+    matPut(p, MI_DOUBLE, dataLen, a->data);
+    ok=compress2(packed, &packedLen, raw, 8+inner, 6) == Z_OK;
+    tag[0]=MI_COMPRESSED;
+    tag[1]=(uint32_t)packedLen;
+    ok=ok && fwrite(tag, 8, 1, f) == 1 && fwrite(packed, packedLen, 1, f) == 1;
+    free(raw);
+    free(packed);
+  }
+  if(fclose(f) != 0 || !ok){
+    fprintf(stderr,"%s: write failed\n",path);
+    return -1;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ The relationships of a nographFrom<year>withAll.mat, as the edges of
+ the as-rel file benchShortestAllBGPtreeDestination.m writes from it:
+ listOfNodes(sourceListPtoC)|listOfNodes(destinationListPtoC)|-1, then
+ the peerings. Returns the number of edges or -1.
+**************************************************************************/
+int64_t matAsRel(const char *path, struct Edge **edges)
+{
+  static const char *names[4]={"sourceListPtoC","destinationListPtoC","sourceListPtoP","destinationListPtoP"};
+  struct MatArray nodes, list[4];
+  int64_t n=-1, at=0;
+  int ok;
+
+  *edges=NULL;
+  if(matRead(path, "listOfNodes", &nodes) != 0){
+    return -1;
+  }
+  memset(list, 0, sizeof list);
+  ok=1;
+  for(int i=0;i<4 && ok;i++)
+  {
+    ok=matRead(path, names[i], &list[i]) == 0;
+  }
+  if(!ok || (uint64_t)list[0].rows*list[0].cols != (uint64_t)list[1].rows*list[1].cols || (uint64_t)list[2].rows*list[2].cols != (uint64_t)list[3].rows*list[3].cols){
+    fprintf(stderr,"%s: no relationship lists\n",path);
+    goto done;
+  }
+  n=(int64_t)list[0].rows*list[0].cols+(int64_t)list[2].rows*list[2].cols;
+  if((*edges=malloc((n > 0 ? n : 1)*sizeof **edges)) == NULL){
+    n=-1;
+    goto done;
+  }
+  for(int i=0;i<4;i+=2)
+  {
+    uint64_t len=(uint64_t)list[i].rows*list[i].cols;
+    for(uint64_t k=0;k<len;k++)
+    {
+      double a=list[i].data[k], b=list[i+1].data[k];
+      uint64_t size=(uint64_t)nodes.rows*nodes.cols;
+      if(a < 1 || b < 1 || a > size || b > size){
+        fprintf(stderr,"%s: %s(%llu) is not in listOfNodes\n",path,names[i],(unsigned long long)k+1);
+        free(*edges);
+        *edges=NULL;
+        n=-1;
+        goto done;
+      }
+      (*edges)[at].a=(uint32_t)nodes.data[(uint64_t)a-1];
+      (*edges)[at].b=(uint32_t)nodes.data[(uint64_t)b-1];
+      (*edges)[at].rel=i == 0 ? -1 : 0;
+      at++;
+    }
+  }
+
+done:
+  free(nodes.data);
+  for(int i=0;i<4;i++)
+  {
+    free(list[i].data);
+  }
+  return n;
+}
+
+/* what every graph gets once it is open: the twins, if ASGRAPH_BFS=hybrid */
+static int graphOpened(struct AsGraph *g)
+{
+  const char *bfs=getenv("ASGRAPH_BFS");
+
+  if(bfs != NULL && strcmp(bfs, "hybrid") == 0){
+    graphTwins(g);
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Opens the graph at path, which is a snapshot, an as-rel text file or
+ the MAT-file of a topology (see matAsRel). For the latter two, a
+ snapshot path.csr that is at least as new is mapped instead; otherwise
+ the file is parsed and the snapshot (re)written.
+**************************************************************************/
+int openGraph(struct AsGraph *g, const char *path, int verbose)
+{
+  char snap[4096];
+  struct stat text, cached;
+  struct Edge *edges=NULL;
+  uint64_t skipped, t=nowNs();
+  int64_t n;
+  int fd;
+  void *map;
+
+  if(mapSnapshot(g, path) == 0){
+    if(verbose){
+      printf("Snapshot:\t %s mapped in %.2f ms\n",path,(nowNs()-t)/1e6);
+    }
+    return graphOpened(g);
+  }
+  snprintf(snap, sizeof snap, "%s%s", path, SNAPSHOT_SUFFIX);
+  if(stat(path, &text) != 0){
+    perror(path);
+    return -1;
+  }
+  if(stat(snap, &cached) == 0 && cached.st_mtime >= text.st_mtime && mapSnapshot(g, snap) == 0){
+    if(verbose){
+      printf("Snapshot:\t %s mapped in %.2f ms\n",snap,(nowNs()-t)/1e6);
+    }
+    return graphOpened(g);
+  }
+
+  skipped=0;
+  if(strlen(path) > 4 && strcmp(path+strlen(path)-4, ".mat") == 0){
+    if((n=matAsRel(path, &edges)) < 0){
+      return -1;
+    }
+  }
+  else{
+    if((fd=open(path, O_RDONLY)) < 0){
+      perror(path);
+      return -1;
+    }
+    map=text.st_size > 0 ? mmap(NULL, text.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if(map == MAP_FAILED){
+      perror("mmap");
+      return -1;
+    }
+    n=parseAsRel(map, text.st_size, &edges, &skipped);
+    if(map != NULL){
+      munmap(map, text.st_size);
+    }
+  }
+  if(n < 0 || buildGraph(g, edges, (uint64_t)n) != 0){
+    fprintf(stderr,"%s: out of memory\n",path);
+    free(edges);
+    return -1;
+  }
+  free(edges);
+  if(verbose){
+    printf("Parsed:\t\t %s, %lld relationships (%llu lines skipped) in %.2f ms\n",path,(long long)n,(unsigned long long)skipped,(nowNs()-t)/1e6);
+  }
+  if(writeSnapshot(g, snap) == 0 && verbose){
+    printf("Snapshot:\t %s written\n",snap);
+  }
+  return graphOpened(g);
+}
+
+/**************************************************************************
+* Reordering
+*
+* listOfNodes sorts the ASes by number, which says nothing about where
+* they are in the graph, so the neighbours of an AS are scattered over
+* the whole of every per-AS array a search touches. reorderGraph renumbers
+* the ASes so that neighbours get nearby indices:
+*
+* ORDER_DEGREE sorts them by degree (all three lists), highest first, so
+* that the ASes most searches pass through share a few cache lines.
+*
+* ORDER_RCM is the reverse Cuthill-McKee order: a BFS over all links from
+* an AS of least degree, visiting the neighbours of an AS by ascending
+* degree, reversed. Neighbours end up close to each other everywhere, not
+* only at the hubs.
+*
+* ORDER_HUB moves the ASes of more than average degree to the front and
+* otherwise keeps the order, so the hubs are packed while the rest keeps
+* what locality the AS numbers have.
+*
+* Every list keeps its entries in their order, only renumbered, so the
+* searches visit neighbours in the same order and every result is the
+* same as on the ascending order. byAsn keeps the way back: the index of
+* listOfNodes(i+1) in the reordered graph. asIndex, the Matlab indices of
+* -e and -m and the random experiments go through it, so the same seed
+* gives the same ASes in every order.
+**************************************************************************/
+
+#define ORDER_DEGREE 0
+#define ORDER_RCM 1
+#define ORDER_HUB 2
+#define NUM_OF_ORDERS 3
+
+static const char *orderNames[NUM_OF_ORDERS]={"degree","rcm","hub"};
+
+static uint32_t degreeOf(const struct AsGraph *g, uint32_t v)
+{
+  uint32_t d=0;
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    d=d+g->off[r][v+1]-g->off[r][v];
+  }
+  return d;
+}
+
+static int compareU64(const void *x, const void *y)
+{
+  uint64_t a=*(const uint64_t *)x, b=*(const uint64_t *)y;
+  return a < b ? -1 : a > b;
+}
+
+/* sorts the n ASes in v by degree (descending if down), ties by index */
+static void sortByDegree(const struct AsGraph *g, uint32_t *v, uint32_t n, int down, uint64_t *key)
+{
+  for(uint32_t i=0;i<n;i++)
+  {
+    uint32_t d=degreeOf(g, v[i]);
+    key[i]=(uint64_t)(down ? UINT32_MAX-d : d) << 32 | v[i];
+  }
+  qsort(key, n, sizeof *key, compareU64);
+  for(uint32_t i=0;i<n;i++)
+  {
+    v[i]=(uint32_t)key[i];
+  }
+}
+
+/* the reverse Cuthill-McKee order of g into perm, see above */
+static void orderRcm(const struct AsGraph *g, uint32_t *perm, uint64_t *key, uint8_t *seen)
+{
+  uint32_t *start=malloc((g->nodes+1)*sizeof *start);
+  uint32_t tail=0;
+
+  if(start == NULL){
+    return;
+  }
+  for(uint32_t v=0;v<g->nodes;v++)
+  {
+    start[v]=v;
+  }
+  sortByDegree(g, start, g->nodes, 0, key);
+  for(uint32_t k=0;k<g->nodes;k++)
+  {
+    if(seen[start[k]]){
+      continue;
+    }
+    seen[start[k]]=1;
+    perm[tail++]=start[k];
+    for(uint32_t head=tail-1;head<tail;head++)
+    {
+      uint32_t u=perm[head], first=tail;
+      for(int r=0;r<NUM_OF_RELS;r++)
+      {
+        for(uint32_t e=g->off[r][u];e<g->off[r][u+1];e++)
+        {
+          uint32_t v=g->adj[r][e];
+          if(!seen[v]){
+            seen[v]=1;
+            perm[tail++]=v;
+          }
+        }
+      }
+      sortByDegree(g, perm+first, tail-first, 0, key);
+    }
+  }
+  for(uint32_t i=0;i<g->nodes/2;i++)
+  {
+    uint32_t t=perm[i];
+    perm[i]=perm[g->nodes-1-i];
+    perm[g->nodes-1-i]=t;
+  }
+  free(start);
+}
+
+/**************************************************************************
+ Renumbers g in order (ORDER_*) into out, a graph on the heap. perm[i] is
+ the index in g of the AS that gets index i.
+**************************************************************************/
+int reorderGraph(const struct AsGraph *g, int order, struct AsGraph *out)
+{
+  uint32_t *perm=malloc((g->nodes+1)*sizeof *perm), *newOf=malloc((g->nodes+1)*sizeof *newOf);
+  uint64_t *key=malloc((g->nodes+1)*sizeof *key), all=0;
+  uint8_t *seen=calloc(g->nodes+1, 1);
+  uint32_t n=0;
+  int ok=perm != NULL && newOf != NULL && key != NULL && seen != NULL;
+
+  memset(out, 0, sizeof *out);
+  for(uint32_t v=0;ok && v<g->nodes;v++)
+  {
+    perm[v]=v;
+    all=all+degreeOf(g, v);
+  }
+  if(ok && order == ORDER_DEGREE){
+    sortByDegree(g, perm, g->nodes, 1, key);
+  }
+  else if(ok && order == ORDER_RCM){
+    orderRcm(g, perm, key, seen);
+  }
+  else if(ok && order == ORDER_HUB){
+    for(uint32_t v=0;v<g->nodes;v++)
+    {
+      if((uint64_t)degreeOf(g, v)*g->nodes > all){
+        perm[n++]=v;
+        seen[v]=1;
+      }
+    }
+    for(uint32_t v=0;v<g->nodes;v++)
+    {
+      if(!seen[v]){
+        perm[n++]=v;
+      }
+    }
+  }
+  for(uint32_t i=0;ok && i<g->nodes;i++)
+  {
+    newOf[perm[i]]=i;
+  }
+
+  out->nodes=g->nodes;
+  out->asn=malloc((g->nodes+1)*sizeof *out->asn);
+  out->byAsn=malloc((g->nodes+1)*sizeof *out->byAsn);
+  ok=ok && out->asn != NULL && out->byAsn != NULL;
+  for(uint32_t i=0;ok && i<g->nodes;i++)
+  {
+    out->asn[i]=g->asn[perm[i]];
+    out->byAsn[i]=newOf[asAt(g, i)];
+  }
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    out->edges[r]=g->edges[r];
+    out->off[r]=malloc(((size_t)g->nodes+1)*sizeof(uint32_t));
+    out->adj[r]=malloc((g->edges[r] > 0 ? g->edges[r] : 1)*sizeof(uint32_t));
+    ok=ok && out->off[r] != NULL && out->adj[r] != NULL;
+    for(uint32_t i=0;ok && i<g->nodes;i++)
+    {
+      uint32_t at=i > 0 ? out->off[r][i] : 0;
+      out->off[r][i]=at;
+      for(uint32_t e=g->off[r][perm[i]];e<g->off[r][perm[i]+1];e++)
+      {
+        out->adj[r][at++]=newOf[g->adj[r][e]];
+      }
+      out->off[r][i+1]=at;
+    }
+  }
+  free(perm);
+  free(newOf);
+  free(key);
+  free(seen);
+  if(!ok){
+    freeGraph(out);
+    return -1;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ How far apart neighbours are: the mean distance between the indices of
+ an AS and its list entries, and the share of entries within 32 indices
+ (a cache line of distances).
+**************************************************************************/
+static void orderGap(const struct AsGraph *g, double *mean, double *near)
+{
+  uint64_t entries=0, close=0;
+  double sum=0;
+
+  for(uint32_t v=0;v<g->nodes;v++)
+  {
+    for(int r=0;r<NUM_OF_RELS;r++)
+    {
+      for(uint32_t e=g->off[r][v];e<g->off[r][v+1];e++)
+      {
+        uint32_t u=g->adj[r][e], gap=u > v ? u-v : v-u;
+        sum=sum+gap;
+        close=close+(gap < 32);
+        entries++;
+      }
+    }
+  }
+  *mean=entries > 0 ? sum/entries : 0;
+  *near=entries > 0 ? 100.0*close/entries : 0;
+}
+
+/**************************************************************************
+* Valley-free shortest paths
+*
+* The BFS of shortestAllBGPtreeDestination.m, without the trees. It runs
+* from the destination with two states per AS, as the Matlab function:
+* STATE_CTOP (treeCtoP) for ASes reached over customer-to-provider links
+* only, which may continue over any link, and STATE_PTOC (treePtoC) for
+* ASes reached after a peering or a provider-to-customer link, which may
+* only continue to their customers. Instead of the paths themselves,
+* every AS keeps its distance and the number of shortest paths in either
+* state; the paths form a DAG layered by distance and are enumerated from
+* it lazily (bfsPaths) when they are needed, in the order the Matlab tree
+* lists them. Distances count the ASes on the path, the destination has 1.
+*
+* The policy selects the sibling functions instead: POLICY_CTOP_ONLY is
+* shortestAllBGPtreeCtoPonlyDestination.m (customer-to-provider links
+* only), POLICY_SHORTEST is shortestAllNoBGPtreeDestination.m (any link,
+* no valley-freeness); both only use STATE_CTOP. An ignored AS is never
+* entered, as with the ignoreNodesList of the ...IgnoreNodes variants.
+*
+* One deliberate difference: Matlab never sets the distance of the
+* destination itself, so it reaches itself again, e.g. as d p d. Here the
+* destination has distance 1 and the single path [d]; every other AS gets
+* exactly the distances and path counts of the Matlab function.
+*
+* Once a few Tier-1 ASes are in the frontier, the next distance reaches
+* most of the graph through their long customer and peer lists. Such
+* levels can be cheaper the other way round (bottom-up): every AS not yet
+* reached looks through its own, mostly short, lists in the opposite
+* direction for neighbours in the frontier, which is kept as a bitset.
+* The rules are those of the top-down steps read backwards: an AS enters
+* STATE_PTOC from a provider in STATE_PTOC. The frontier in STATE_CTOP is
+* no more than the providers above the destination, so its steps stay
+* top-down (with POLICY_SHORTEST, which has STATE_CTOP only, an AS looks
+* through all of its lists). As the path counts need all predecessors, a
+* bottom-up step cannot stop at the first one. bfsRun picks the direction
+* per distance by the work either way would do. A bottom-up step also
+* knows for every AS it reaches when the top-down step would have found
+* it (its first predecessor in frontier order, and its place in that
+* predecessor's list, see graphTwins), and sorts the ASes of the level by
+* it. Discoverers, discovery order and so the paths and their order are
+* therefore the same in both directions.
+*
+* On the CAIDA graphs the bottom-up steps do not pay off: with about two
+* providers per AS, a bottom-up step costs as much per AS and entry as a
+* top-down step per entry of the frontier, and even the widest level
+* (about 50000 entries for 2014) is not wider than the ASes and their
+* provider entries. "asgraph bfsdir" compares both per destination. Runs
+* therefore stay top-down unless ASGRAPH_BFS=hybrid, which builds the
+* twins when the graph is opened and lets bfsRun choose.
+**************************************************************************/
+
+#define STATE_CTOP 0
+#define STATE_PTOC 1
+#define NUM_OF_STATES 2
+#define DIST_INF UINT16_MAX
+#define NO_NODE UINT32_MAX
+
+#define POLICY_VALLEYFREE 0
+#define POLICY_CTOP_ONLY 1
+#define POLICY_SHORTEST 2
+
+/* what a bottom-up step costs, in bitset lookups: one per BOTTOM_UP_NODES
+ASes it passes and one per entry, against TOP_DOWN_ENTRY per entry of the
+frontier top-down */
+#define BOTTOM_UP_NODES 1
+#define TOP_DOWN_ENTRY 1
+#define LEVEL_RADIX 11
+
+struct ValleyFreeBfs {
+  uint32_t nodes;
+  uint32_t destination;
+  int policy;                   /* POLICY_*, for the next run */
+  uint32_t ignore;              /* AS that is never entered, or NO_NODE */
+  uint16_t maxDist;             /* largest finite distance of the last run */
+  uint16_t *dist[NUM_OF_STATES];
+  double *paths[NUM_OF_STATES]; /* shortest paths, exact up to 2^53 */
+  uint32_t *seq[NUM_OF_STATES]; /* discovery order, for the path order */
+  uint32_t *first[NUM_OF_STATES]; /* discoverer as node<<1|state */
+  uint32_t *order;              /* node<<1|state in discovery order */
+  uint32_t reached;             /* entries in order */
+  uint32_t *front[NUM_OF_STATES];
+  uint32_t *next[NUM_OF_STATES];
+  uint64_t scanned;             /* adjacency entries looked at */
+  int hybrid;                   /* bottom-up steps allowed, needs the twins of the graph */
+  uint16_t bottomUp;            /* distances of the last run done bottom-up */
+  uint64_t *frontBits[NUM_OF_STATES];
+  uint64_t *levelKey[2];        /* the ASes of a bottom-up step and the buffers to sort them */
+  uint32_t *levelNode[2];
+  int posBits;                  /* bits for a position in the longest list */
+  struct BfsCache *cache;       /* for bfsCached, or NULL */
+};
+
+int bfsCreate(struct ValleyFreeBfs *b, const struct AsGraph *g)
+{
+  memset(b, 0, sizeof *b);
+  b->nodes=g->nodes;
+  b->policy=POLICY_VALLEYFREE;
+  b->ignore=NO_NODE;
+  if((b->order=malloc((2*(size_t)g->nodes+1)*sizeof(uint32_t))) == NULL){
+    return -1;
+  }
+  if(g->twin[REL_PROVIDERS] != NULL){
+    uint32_t longest=1;
+    for(int r=0;r<NUM_OF_RELS;r++)
+    {
+      for(uint32_t v=0;v<g->nodes;v++)
+      {
+        longest=g->off[r][v+1]-g->off[r][v] > longest ? g->off[r][v+1]-g->off[r][v] : longest;
+      }
+    }
+    b->posBits=64-__builtin_clzll(longest);
+    for(int i=0;i<2;i++)
+    {
+      b->frontBits[i]=calloc((g->nodes+63)/64+1, sizeof(uint64_t));
+      b->levelKey[i]=malloc((2*(size_t)g->nodes+1)*sizeof(uint64_t));
+      b->levelNode[i]=malloc((2*(size_t)g->nodes+1)*sizeof(uint32_t));
+      if(b->frontBits[i] == NULL || b->levelKey[i] == NULL || b->levelNode[i] == NULL){
+        return -1;
+      }
+    }
+    b->hybrid=1;
+  }
+  for(int s=0;s<NUM_OF_STATES;s++)
+  {
+    b->dist[s]=malloc((g->nodes+1)*sizeof(uint16_t));
+    b->paths[s]=malloc((g->nodes+1)*sizeof(double));
+    b->seq[s]=malloc((g->nodes+1)*sizeof(uint32_t));
+    b->first[s]=malloc((g->nodes+1)*sizeof(uint32_t));
+    b->front[s]=malloc((g->nodes+1)*sizeof(uint32_t));
+    b->next[s]=malloc((g->nodes+1)*sizeof(uint32_t));
+    if(b->dist[s] == NULL || b->paths[s] == NULL || b->seq[s] == NULL || b->first[s] == NULL || b->front[s] == NULL || b->next[s] == NULL){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void bfsFree(struct ValleyFreeBfs *b)
+{
+  free(b->order);
+  for(int i=0;i<2;i++)
+  {
+    free(b->frontBits[i]);
+    free(b->levelKey[i]);
+    free(b->levelNode[i]);
+  }
+  for(int s=0;s<NUM_OF_STATES;s++)
+  {
+    free(b->dist[s]);
+    free(b->paths[s]);
+    free(b->seq[s]);
+    free(b->first[s]);
+    free(b->front[s]);
+    free(b->next[s]);
+  }
+  memset(b, 0, sizeof *b);
+}
+
+/* neighbours of u in relation r */
+#define NEIGHBOURS(g, r, u) (g)->adj[r]+(g)->off[r][u], (g)->off[r][(u)+1]-(g)->off[r][u]
+
+/* offers the paths of frontier entry from to all ASes in list, in state s */
+static inline void bfsRelax(struct ValleyFreeBfs *b, const uint32_t *list, uint32_t len, int s, uint16_t d, uint32_t from, double paths, uint32_t *count, uint32_t *seq)
+{
+  uint16_t *dist=b->dist[s];
+  for(uint32_t i=0;i<len;i++)
+  {
+    uint32_t v=list[i];
+    if(dist[v] == d){
+      b->paths[s][v]=b->paths[s][v]+paths;
+    }
+    else if(dist[v] > d && v != b->ignore){
+      dist[v]=d;
+      b->paths[s][v]=paths;
+      b->seq[s][v]=(*seq)++;
+      b->first[s][v]=from;
+      b->order[b->reached++]=v << 1 | s;
+      b->next[s][(*count)++]=v;
+    }
+  }
+  b->scanned=b->scanned+len;
+}
+
+/* entries in list r of v */
+static inline uint32_t listLength(const struct AsGraph *g, int r, uint32_t v)
+{
+  return g->off[r][v+1]-g->off[r][v];
+}
+
+/**************************************************************************
+ Looks for the predecessors of v among its neighbours in list r that are
+ in the frontier of state from. key orders the discoveries of the top-
+ down step: the place of the predecessor in the frontier (those of
+ STATE_CTOP first, at offset[from]+seq), then the list of the predecessor
+ that v is in (rel, in the order the top-down step goes through them)
+ and the position of v in that list.
+**************************************************************************/
+static inline void bfsParents(struct ValleyFreeBfs *b, const struct AsGraph *g, uint32_t v, int r, int from, int rel, const uint32_t *offset, uint64_t *best, uint32_t *first, double *paths)
+{
+  const uint64_t *bits=b->frontBits[from];
+  const uint32_t *list=g->adj[r], *twin=g->twin[r];
+  uint32_t end=g->off[r][v+1];
+
+  for(uint32_t e=g->off[r][v];e<end;e++)
+  {
+    uint32_t u=list[e];
+    if(bits[u >> 6] >> (u & 63) & 1){
+      uint64_t key=((uint64_t)(offset[from]+b->seq[from][u])*3+rel) << b->posBits | twin[e];
+      *paths=*paths+b->paths[from][u];
+      if(key < *best){
+        *best=key;
+        *first=u << 1 | from;
+      }
+    }
+  }
+  b->scanned=b->scanned+(end-g->off[r][v]);
+}
+
+/* bfsRelax for a step that sorts its ASes afterwards, with the key of bfsParents */
+static inline void bfsRelaxKeyed(struct ValleyFreeBfs *b, const struct AsGraph *g, int r, uint32_t u, int s, uint16_t d, uint32_t from, double paths, uint64_t rank, uint32_t *found, uint64_t *top)
+{
+  const uint32_t *list=g->adj[r]+g->off[r][u];
+  uint32_t len=listLength(g, r, u);
+  uint16_t *dist=b->dist[s];
+
+  for(uint32_t k=0;k<len;k++)
+  {
+    uint32_t v=list[k];
+    if(dist[v] == d){
+      b->paths[s][v]=b->paths[s][v]+paths;
+    }
+    else if(dist[v] > d && v != b->ignore){
+      uint64_t key=rank << b->posBits | k;
+      dist[v]=d;
+      b->paths[s][v]=paths;
+      b->first[s][v]=from;
+      b->levelKey[0][*found]=key;
+      b->levelNode[0][(*found)++]=v << 1 | s;
+      *top=key > *top ? key : *top;
+    }
+  }
+  b->scanned=b->scanned+len;
+}
+
+/* sorts the n ASes of a bottom-up step by key, returns where they ended up */
+static uint32_t *bfsSortLevel(struct ValleyFreeBfs *b, uint32_t n, uint64_t top)
+{
+  uint64_t *key=b->levelKey[0], *key2=b->levelKey[1], *tk;
+  uint32_t *node=b->levelNode[0], *node2=b->levelNode[1], *tn;
+  uint32_t count[1 << LEVEL_RADIX];
+
+  for(int shift=0;shift < 64 && (top >> shift) > 0;shift+=LEVEL_RADIX)
+  {
+    uint32_t at=0;
+    memset(count, 0, sizeof count);
+    for(uint32_t i=0;i<n;i++)
+    {
+      count[key[i] >> shift & ((1 << LEVEL_RADIX)-1)]++;
+    }
+    for(int k=0;k<1 << LEVEL_RADIX;k++)
+    {
+      uint32_t c=count[k];
+      count[k]=at;
+      at=at+c;
+    }
+    for(uint32_t i=0;i<n;i++)
+    {
+      uint32_t k=count[key[i] >> shift & ((1 << LEVEL_RADIX)-1)]++;
+      key2[k]=key[i];
+      node2[k]=node[i];
+    }
+    tk=key;
+    key=key2;
+    key2=tk;
+    tn=node;
+    node=node2;
+    node2=tn;
+  }
+  return node;
+}
+
+/**************************************************************************
+ The step to distance d for a frontier of n[s] ASes per state, with the
+ ASes of STATE_PTOC (of STATE_CTOP with POLICY_SHORTEST) looking for
+ their predecessors in that state bottom-up. The few ASes of STATE_CTOP
+ in a valley-free search still go on top-down. Fills next, count and seq
+ like the top-down step does.
+**************************************************************************/
+static void bfsBottomUp(struct ValleyFreeBfs *b, const struct AsGraph *g, uint16_t d, const uint32_t *n, uint32_t *count, uint32_t *seq)
+{
+  int up=b->policy == POLICY_SHORTEST ? STATE_CTOP : STATE_PTOC;
+  uint32_t offset[NUM_OF_STATES], found=0, *sorted;
+  uint64_t top=0;
+
+  memset(b->frontBits[up], 0, (g->nodes+63)/64*sizeof(uint64_t));
+  for(uint32_t i=0;i<n[up];i++)
+  {
+    uint32_t u=b->front[up][i];
+    b->frontBits[up][u >> 6]|=1ULL << (u & 63);
+  }
+  for(int s=0;s<NUM_OF_STATES;s++)
+  {
+    offset[s]=(s == STATE_PTOC ? n[STATE_CTOP] : 0)-(n[s] > 0 ? b->seq[s][b->front[s][0]] : 0);
+  }
+  if(up == STATE_PTOC){
+    for(uint32_t i=0;i<n[STATE_CTOP];i++)
+    {
+      uint32_t u=b->front[STATE_CTOP][i], from=u << 1 | STATE_CTOP;
+      double paths=b->paths[STATE_CTOP][u];
+      bfsRelaxKeyed(b, g, REL_PROVIDERS, u, STATE_CTOP, d, from, paths, (uint64_t)i*3, &found, &top);
+      bfsRelaxKeyed(b, g, REL_CUSTOMERS, u, STATE_PTOC, d, from, paths, (uint64_t)i*3+1, &found, &top);
+      bfsRelaxKeyed(b, g, REL_PEERS, u, STATE_PTOC, d, from, paths, (uint64_t)i*3+2, &found, &top);
+    }
+  }
+  for(uint32_t v=0;v<g->nodes;v++)
+  {
+    uint64_t best=UINT64_MAX;
+    uint32_t first=NO_NODE;
+    double paths=0;
+
+    if(b->dist[up][v] < d || v == b->ignore){
+      continue;
+    }
+    if(up == STATE_PTOC){
+      bfsParents(b, g, v, REL_PROVIDERS, STATE_PTOC, 0, offset, &best, &first, &paths);
+    }
+    else{
+      bfsParents(b, g, v, REL_CUSTOMERS, STATE_CTOP, 0, offset, &best, &first, &paths);
+      bfsParents(b, g, v, REL_PROVIDERS, STATE_CTOP, 1, offset, &best, &first, &paths);
+      bfsParents(b, g, v, REL_PEERS, STATE_CTOP, 2, offset, &best, &first, &paths);
+    }
+    if(best == UINT64_MAX){
+      continue;
+    }
+    if(b->dist[up][v] == d){
+      // found from STATE_CTOP above, which comes first
+      b->paths[up][v]=b->paths[up][v]+paths;
+      continue;
+    }
+    b->dist[up][v]=d;
+    b->paths[up][v]=paths;
+    b->first[up][v]=first;
+    b->levelKey[0][found]=best;
+    b->levelNode[0][found++]=v << 1 | up;
+    top=best > top ? best : top;
+  }
+  sorted=bfsSortLevel(b, found, top);
+  for(uint32_t i=0;i<found;i++)
+  {
+    uint32_t v=sorted[i] >> 1;
+    int s=sorted[i] & 1;
+    b->seq[s][v]=seq[s]++;
+    b->order[b->reached++]=sorted[i];
+    b->next[s][count[s]++]=v;
+  }
+}
+
+/* the entries a step into the bottom-up state looks at from v: top-down (out) or bottom-up */
+static inline uint32_t bfsUpEntries(const struct ValleyFreeBfs *b, const struct AsGraph *g, uint32_t v, int out)
+{
+  if(b->policy == POLICY_SHORTEST){
+    return listLength(g, REL_PROVIDERS, v)+listLength(g, REL_CUSTOMERS, v)+listLength(g, REL_PEERS, v);
+  }
+  return listLength(g, out ? REL_CUSTOMERS : REL_PROVIDERS, v);
+}
+
+/* the step to distance d from the frontier of n[s] ASes per state, top-down */
+static void bfsTopDown(struct ValleyFreeBfs *b, const struct AsGraph *g, uint16_t d, const uint32_t *n, uint32_t *count, uint32_t *seq)
+{
+  for(uint32_t i=0;i<n[STATE_CTOP];i++)
+  {
+    uint32_t u=b->front[STATE_CTOP][i], from=u << 1 | STATE_CTOP;
+    double paths=b->paths[STATE_CTOP][u];
+    bfsRelax(b, NEIGHBOURS(g, REL_PROVIDERS, u), STATE_CTOP, d, from, paths, &count[STATE_CTOP], &seq[STATE_CTOP]);
+    if(b->policy == POLICY_VALLEYFREE){
+      bfsRelax(b, NEIGHBOURS(g, REL_CUSTOMERS, u), STATE_PTOC, d, from, paths, &count[STATE_PTOC], &seq[STATE_PTOC]);
+      bfsRelax(b, NEIGHBOURS(g, REL_PEERS, u), STATE_PTOC, d, from, paths, &count[STATE_PTOC], &seq[STATE_PTOC]);
+    }
+    else if(b->policy == POLICY_SHORTEST){
+      bfsRelax(b, NEIGHBOURS(g, REL_CUSTOMERS, u), STATE_CTOP, d, from, paths, &count[STATE_CTOP], &seq[STATE_CTOP]);
+      bfsRelax(b, NEIGHBOURS(g, REL_PEERS, u), STATE_CTOP, d, from, paths, &count[STATE_CTOP], &seq[STATE_CTOP]);
+    }
+  }
+  for(uint32_t i=0;i<n[STATE_PTOC];i++)
+  {
+    uint32_t u=b->front[STATE_PTOC][i];
+    bfsRelax(b, NEIGHBOURS(g, REL_CUSTOMERS, u), STATE_PTOC, d, u << 1 | STATE_PTOC, b->paths[STATE_PTOC][u], &count[STATE_PTOC], &seq[STATE_PTOC]);
+  }
+}
+
+/**************************************************************************
+ Computes distances and path counts of every AS towards destination. All
+ ASes of a distance are expanded before any AS of the next, so the path
+ count of an AS is complete before it is passed on. A distance goes
+ bottom-up when the ASes not yet reached in the bottom-up state and
+ their entries to look at cost less than the entries of the frontier in
+ that state top-down.
+**************************************************************************/
+void bfsRun(struct ValleyFreeBfs *b, const struct AsGraph *g, uint32_t destination)
+{
+  uint32_t count[NUM_OF_STATES]={1,0}, seq[NUM_OF_STATES]={1,0};
+  uint64_t unreached=0;
+  int hybrid, up;
+
+  for(int s=0;s<NUM_OF_STATES;s++)
+  {
+    memset(b->dist[s], 0xff, g->nodes*sizeof(uint16_t));
+  }
+  b->destination=destination;
+  b->scanned=0;
+  b->dist[STATE_CTOP][destination]=1;
+  b->paths[STATE_CTOP][destination]=1;
+  b->seq[STATE_CTOP][destination]=0;
+  b->first[STATE_CTOP][destination]=NO_NODE;
+  b->order[0]=destination << 1 | STATE_CTOP;
+  b->reached=1;
+  b->front[STATE_CTOP][0]=destination;
+  b->maxDist=1;
+  b->bottomUp=0;
+  hybrid=b->hybrid && b->policy != POLICY_CTOP_ONLY;
+  up=b->policy == POLICY_SHORTEST ? STATE_CTOP : STATE_PTOC;
+  if(hybrid){
+    unreached=b->policy == POLICY_SHORTEST ? g->edges[REL_PROVIDERS]+g->edges[REL_CUSTOMERS]+g->edges[REL_PEERS]-bfsUpEntries(b, g, destination, 0) : g->edges[REL_PROVIDERS];
+  }
+  for(uint16_t d=2;count[STATE_CTOP]+count[STATE_PTOC] > 0 && d < DIST_INF;d++)
+  {
+    uint32_t n[NUM_OF_STATES]={count[STATE_CTOP],count[STATE_PTOC]};
+    uint64_t frontier=0;
+    count[STATE_CTOP]=0;
+    count[STATE_PTOC]=0;
+    for(uint32_t i=0;i<n[up] && hybrid;i++)
+    {
+      frontier=frontier+bfsUpEntries(b, g, b->front[up][i], 1);
+    }
+    if(hybrid && g->nodes/BOTTOM_UP_NODES+unreached < frontier*TOP_DOWN_ENTRY){
+      bfsBottomUp(b, g, d, n, count, seq);
+      b->bottomUp++;
+    }
+    else{
+      bfsTopDown(b, g, d, n, count, seq);
+    }
+    for(int s=0;s<NUM_OF_STATES;s++)
+    {
+      uint32_t *t=b->front[s];
+      b->front[s]=b->next[s];
+      b->next[s]=t;
+    }
+    for(uint32_t i=0;i<count[up] && hybrid;i++)
+    {
+      unreached=unreached-bfsUpEntries(b, g, b->front[up][i], 0);
+    }
+    if(count[STATE_CTOP]+count[STATE_PTOC] > 0){
+      b->maxDist=d;
+    }
+  }
+}
+
+/* treeDistances(v) of Matlab, DIST_INF if v cannot reach the destination */
+static inline uint16_t bfsDistance(const struct ValleyFreeBfs *b, uint32_t v)
+{
+  uint16_t c=b->dist[STATE_CTOP][v], p=b->dist[STATE_PTOC][v];
+  return c < p ? c : p;
+}
+
+/* size(shortestTree{v},1) of Matlab */
+static inline double bfsPathCount(const struct ValleyFreeBfs *b, uint32_t v)
+{
+  uint16_t c=b->dist[STATE_CTOP][v], p=b->dist[STATE_PTOC][v];
+  if(c == DIST_INF && p == DIST_INF){
+    return 0;
+  }
+  return (c <= p ? b->paths[STATE_CTOP][v] : 0)+(p <= c ? b->paths[STATE_PTOC][v] : 0);
+}
+
+/**************************************************************************
+ The neighbour lists in which the predecessors of any node in state s
+ are found (those of its neighbours one closer to the destination in
+ state states[i]), in the order the Matlab function appends their paths
+ to the node: lists expanded from STATE_CTOP first. Returns the number of
+ lists.
+**************************************************************************/
+static int bfsPredLists(const struct ValleyFreeBfs *b, int s, int rels[4], int states[4])
+{
+  if(b->policy == POLICY_SHORTEST){
+    for(int r=0;r<NUM_OF_RELS;r++)
+    {
+      rels[r]=r;
+      states[r]=STATE_CTOP;
+    }
+    return NUM_OF_RELS;
+  }
+  if(s == STATE_CTOP){
+    rels[0]=REL_CUSTOMERS;
+    states[0]=STATE_CTOP;
+    return 1;
+  }
+  rels[0]=REL_PROVIDERS;
+  states[0]=STATE_CTOP;
+  rels[1]=REL_PEERS;
+  states[1]=STATE_CTOP;
+  rels[2]=REL_PROVIDERS;
+  states[2]=STATE_PTOC;
+  return 3;
+}
+
+/**************************************************************************
+ Follows the discoverers from v to the destination. That is the path of
+ shortestBGPtreeDestination.m (and the first path of the Matlab tree in a
+ single state), taking STATE_CTOP on a tie like the Matlab function.
+ Returns the length of the path written to out, 0 if there is none.
+**************************************************************************/
+uint32_t bfsSinglePath(const struct ValleyFreeBfs *b, uint32_t v, uint32_t *out, uint32_t max)
+{
+  uint32_t e, len=0;
+
+  if(bfsDistance(b, v) == DIST_INF){
+    return 0;
+  }
+  e=v << 1 | (b->dist[STATE_CTOP][v] <= b->dist[STATE_PTOC][v] ? STATE_CTOP : STATE_PTOC);
+  while(e != NO_NODE && len < max)
+  {
+    out[len++]=e >> 1;
+    e=b->first[e & 1][e >> 1];
+  }
+  return e == NO_NODE ? len : 0;
+}
+
+/* a predecessor in the DAG: the next AS towards the destination */
+struct PathStep {
+  uint32_t node;
+  uint32_t seq;
+  int state;
+};
+
+static int compareSteps(const void *x, const void *y)
+{
+  const struct PathStep *a=x, *b=y;
+  if(a->state != b->state){
+    return a->state-b->state;
+  }
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/**************************************************************************
+ The predecessors of v in state s, in the order the Matlab function
+ appends their paths to v: those expanded from STATE_CTOP first, each in
+ the order it was discovered. A neighbour listed twice counts twice, as
+ in Matlab. out needs room for twice the degree of v.
+**************************************************************************/
+uint32_t bfsPredecessors(const struct ValleyFreeBfs *b, const struct AsGraph *g, uint32_t v, int s, struct PathStep *out)
+{
+  uint16_t d=b->dist[s][v]-1;
+  int rels[4], states[4], lists=bfsPredLists(b, s, rels, states);
+  uint32_t n=0;
+
+  for(int l=0;l<lists;l++)
+  {
+    for(uint32_t i=g->off[rels[l]][v];i<g->off[rels[l]][v+1];i++)
+    {
+      uint32_t u=g->adj[rels[l]][i];
+      if(b->dist[states[l]][u] == d){
+        out[n].node=u;
+        out[n].seq=b->seq[states[l]][u];
+        out[n].state=states[l];
+        n++;
+      }
+    }
+  }
+  qsort(out, n, sizeof *out, compareSteps);
+  return n;
+}
+
+typedef int (*PathVisitor)(const uint32_t *path, uint32_t len, void *arg);
+
+struct PathWalk {
+  const struct ValleyFreeBfs *b;
+  const struct AsGraph *g;
+  uint32_t *path;
+  uint64_t found;
+  uint64_t max;
+  PathVisitor visit;
+  void *arg;
+  int stop;
+};
+
+static void walkPaths(struct PathWalk *w, uint32_t v, int s, uint32_t at)
+{
+  struct PathStep *preds;
+  uint32_t n, deg;
+
+  w->path[at]=v;
+  if(v == w->b->destination && s == STATE_CTOP){
+    w->found++;
+    if(w->visit(w->path, at+1, w->arg) != 0 || w->found >= w->max){
+      w->stop=1;
+    }
+    return;
+  }
+  deg=w->g->off[REL_CUSTOMERS][v+1]-w->g->off[REL_CUSTOMERS][v];
+  deg=deg+2*(w->g->off[REL_PROVIDERS][v+1]-w->g->off[REL_PROVIDERS][v]);
+  deg=deg+w->g->off[REL_PEERS][v+1]-w->g->off[REL_PEERS][v];
+  if((preds=malloc((deg > 0 ? deg : 1)*sizeof *preds)) == NULL){
+    w->stop=1;
+    return;
+  }
+  n=bfsPredecessors(w->b, w->g, v, s, preds);
+  for(uint32_t i=0;i<n && !w->stop;i++)
+  {
+    walkPaths(w, preds[i].node, preds[i].state, at+1);
+  }
+  free(preds);
+}
+
+/**************************************************************************
+ Hands the shortest paths from source to the destination of the last run
+ to visit, one at a time as [source ... destination], in the order of
+ shortestTree{source} in Matlab: paths of STATE_PTOC before those of
+ STATE_CTOP on a tie. Stops after max paths or when visit returns
+ nonzero; returns the number of paths visited.
+**************************************************************************/
+uint64_t bfsPaths(const struct ValleyFreeBfs *b, const struct AsGraph *g, uint32_t source, uint64_t max, PathVisitor visit, void *arg)
+{
+  struct PathWalk w;
+  uint16_t c=b->dist[STATE_CTOP][source], p=b->dist[STATE_PTOC][source];
+
+  memset(&w, 0, sizeof w);
+  if(max == 0 || (c == DIST_INF && p == DIST_INF) || (w.path=malloc((b->maxDist+1)*sizeof(uint32_t))) == NULL){
+    return 0;
+  }
+  w.b=b;
+  w.g=g;
+  w.max=max;
+  w.visit=visit;
+  w.arg=arg;
+  if(p <= c){
+    walkPaths(&w, source, STATE_PTOC, 0);
+  }
+  if(c <= p && !w.stop){
+    walkPaths(&w, source, STATE_CTOP, 0);
+  }
+  free(w.path);
+  return w.found;
+}
+
+/**************************************************************************
+* Search cache
+*
+* The scripts run the BFS towards the same destinations and helper nodes
+* over and over, within a run and across runs and analyses (StoM and WtoD,
+* IP and NoIP all use the same stored triples). With ASGRAPH_BFS_CACHE set
+* to a file name, every finished search is kept in that file, which all
+* processes map shared: a slot holds the distances, path counts,
+* discoverers and discovery order of one search, i.e. all a later run
+* needs of the DAG, keyed by a digest of the graph, the root, the policy
+* and the ignored AS. Slots are reused least recently used first. The
+* file is created sparse with ASGRAPH_BFS_CACHE_MB megabytes (4096 by
+* default) of slots for graphs of up to the size of the first graph that
+* used it; a larger graph runs without the cache. Slots are looked up and
+* copied under a lock (a mutex between threads, flock between
+* processes), so a reader never sees a slot that is being overwritten.
+**************************************************************************/
+#define CACHE_MAGIC 0x3148434143534124ULL /* "$ASCACH1" */
+#define CACHE_DEFAULT_MB 4096
+
+struct CacheHeader {
+  uint64_t magic;
+  uint64_t nodes;    /* largest graph a slot holds */
+  uint64_t slots;
+  uint64_t slotSize;
+  uint64_t dataAt;
+  uint64_t size;
+  uint64_t clock;    /* last use stamp handed out */
+};
+
+struct CacheSlot {
+  uint64_t digest;
+  uint64_t used;     /* stamp of the last use, for LRU */
+  uint32_t root;
+  uint32_t ignore;
+  uint32_t reached;
+  uint16_t maxDist;
+  uint8_t policy;
+  uint8_t valid;
+};
+
+struct BfsCache {
+  int fd;
+  struct CacheHeader *h;
+  struct CacheSlot *slot;
+  uint8_t *data;
+  uint64_t digest;   /* of the graph of this process */
+  uint32_t nodes;
+  pthread_mutex_t lock;
+  uint64_t hits, misses, stores, evictions;
+};
+
+/* where the arrays of a slot start, for graphs of up to nodes ASes */
+static void cacheLayout(uint64_t nodes, uint64_t at[NUM_OF_STATES*3+1], uint64_t *size)
+{
+  uint64_t x=0;
+  for(int s=0;s<NUM_OF_STATES;s++)
+  {
+    at[s]=x;
+    x=align8(x+nodes*sizeof(uint16_t));
+    at[NUM_OF_STATES+s]=x;
+    x=align8(x+nodes*sizeof(uint32_t));
+    at[2*NUM_OF_STATES+s]=x;
+    x=x+nodes*sizeof(double);
+  }
+  at[3*NUM_OF_STATES]=x;
+  *size=align8(x+(2*nodes+1)*sizeof(uint32_t));
+}
+
+/* FNV-1a over the CSR arrays, so that a rebuilt snapshot misses */
+uint64_t graphDigest(const struct AsGraph *g)
+{
+  uint64_t h=0xcbf29ce484222325ULL^g->nodes;
+  for(uint32_t v=0;v<g->nodes;v++)
+  {
+    h=(h^g->asn[v])*0x100000001b3ULL;
+  }
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    for(uint32_t v=0;v<=g->nodes;v++)
+    {
+      h=(h^g->off[r][v])*0x100000001b3ULL;
+    }
+    for(uint64_t i=0;i<g->edges[r];i++)
+    {
+      h=(h^g->adj[r][i])*0x100000001b3ULL;
+    }
+  }
+  return h;
+}
+
+static void cacheLock(struct BfsCache *c)
+{
+  pthread_mutex_lock(&c->lock);
+  while(flock(c->fd, LOCK_EX) != 0 && errno == EINTR)
+  {
+  }
+}
+
+static void cacheUnlock(struct BfsCache *c)
+{
+  flock(c->fd, LOCK_UN);
+  pthread_mutex_unlock(&c->lock);
+}
+
+/**************************************************************************
+ Opens (or creates) the cache named by ASGRAPH_BFS_CACHE for graph g.
+ Returns NULL if it is not set or not usable; the searches then simply
+ run uncached.
+**************************************************************************/
+struct BfsCache *bfsCacheOpen(const struct AsGraph *g, int verbose)
+{
+  const char *path=getenv("ASGRAPH_BFS_CACHE"), *mb=getenv("ASGRAPH_BFS_CACHE_MB");
+  struct BfsCache *c;
+  struct CacheHeader h;
+  struct stat st;
+  uint64_t at[NUM_OF_STATES*3+1];
+  void *map;
+
+  if(path == NULL || *path == 0 || g->nodes == 0 || (c=calloc(1, sizeof *c)) == NULL){
+    return NULL;
+  }
+  if((c->fd=open(path, O_RDWR | O_CREAT, 0644)) < 0){
+    perror(path);
+    free(c);
+    return NULL;
+  }
+  while(flock(c->fd, LOCK_EX) != 0 && errno == EINTR)
+  {
+  }
+  if(fstat(c->fd, &st) != 0){
+    goto fail;
+  }
+  if(st.st_size == 0){
+    // the first user lays the file out, sparse
+    memset(&h, 0, sizeof h);
+    h.magic=CACHE_MAGIC;
+    h.nodes=g->nodes;
+    cacheLayout(h.nodes, at, &h.slotSize);
+    h.slots=(mb != NULL ? strtoull(mb, NULL, 10) : CACHE_DEFAULT_MB)*1000000ULL/h.slotSize;
+    h.slots=h.slots > 0 ? h.slots : 1;
+    h.dataAt=(align8(sizeof h+h.slots*sizeof(struct CacheSlot))+4095) & ~4095ULL;
+    h.size=h.dataAt+h.slots*h.slotSize;
+    if(ftruncate(c->fd, h.size) != 0 || pwrite(c->fd, &h, sizeof h, 0) != (ssize_t)sizeof h){
+      perror(path);
+      goto fail;
+    }
+  }
+  else if(pread(c->fd, &h, sizeof h, 0) != (ssize_t)sizeof h || h.magic != CACHE_MAGIC || h.size != (uint64_t)st.st_size){
+    fprintf(stderr,"%s: not a BFS cache of this version, running uncached\n",path);
+    goto fail;
+  }
+  if(h.nodes < g->nodes){
+    fprintf(stderr,"%s: made for graphs of up to %llu ASes, running uncached\n",path,(unsigned long long)h.nodes);
+    goto fail;
+  }
+  if((map=mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0)) == MAP_FAILED){
+    perror(path);
+    goto fail;
+  }
+  flock(c->fd, LOCK_UN);
+  c->h=map;
+  c->slot=(struct CacheSlot *)((uint8_t *)map+sizeof h);
+  c->data=(uint8_t *)map+h.dataAt;
+  c->digest=graphDigest(g);
+  c->nodes=g->nodes;
+  pthread_mutex_init(&c->lock, NULL);
+  if(verbose){
+    uint64_t used=0;
+    for(uint64_t i=0;i<h.slots;i++)
+    {
+      used=used+c->slot[i].valid;
+    }
+    printf("BFS cache:\t %s, %llu of %llu searches kept\n",path,(unsigned long long)used,(unsigned long long)h.slots);
+  }
+  return c;
+
+fail:
+  close(c->fd);
+  free(c);
+  return NULL;
+}
+
+void bfsCacheClose(struct BfsCache *c)
+{
+  if(c == NULL){
+    return;
+  }
+  munmap(c->h, c->h->size);
+  close(c->fd);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+/* the slot of the search b is about to run, or -1; under the lock */
+static int64_t cacheFind(const struct BfsCache *c, const struct ValleyFreeBfs *b, uint32_t root)
+{
+  for(uint64_t i=0;i<c->h->slots;i++)
+  {
+    const struct CacheSlot *x=&c->slot[i];
+    if(x->valid && x->digest == c->digest && x->root == root && x->policy == b->policy && x->ignore == b->ignore){
+      return (int64_t)i;
+    }
+  }
+  return -1;
+}
+
+/**************************************************************************
+ Fills b with the search towards root from the cache, as bfsRun would
+ have left it. Returns -1 if the search is not in the cache.
+**************************************************************************/
+static int bfsCacheGet(struct BfsCache *c, struct ValleyFreeBfs *b, uint32_t root)
+{
+  uint64_t at[NUM_OF_STATES*3+1], size;
+  uint32_t seq[NUM_OF_STATES]={0,0};
+  const uint8_t *p;
+  int64_t i;
+
+  cacheLock(c);
+  if((i=cacheFind(c, b, root)) < 0){
+    c->misses++;
+    cacheUnlock(c);
+    return -1;
+  }
+  p=c->data+(uint64_t)i*c->h->slotSize;
+  cacheLayout(c->h->nodes, at, &size);
+  for(int s=0;s<NUM_OF_STATES;s++)
+  {
+    memcpy(b->dist[s], p+at[s], c->nodes*sizeof(uint16_t));
+    memcpy(b->first[s], p+at[NUM_OF_STATES+s], c->nodes*sizeof(uint32_t));
+    memcpy(b->paths[s], p+at[2*NUM_OF_STATES+s], c->nodes*sizeof(double));
+  }
+  b->reached=c->slot[i].reached;
+  b->maxDist=c->slot[i].maxDist;
+  memcpy(b->order, p+at[3*NUM_OF_STATES], b->reached*sizeof(uint32_t));
+  c->slot[i].used=++c->h->clock;
+  c->hits++;
+  cacheUnlock(c);
+
+  // the sequence numbers are the ranks in the discovery order
+  for(uint32_t k=0;k<b->reached;k++)
+  {
+    b->seq[b->order[k] & 1][b->order[k] >> 1]=seq[b->order[k] & 1]++;
+  }
+  b->destination=root;
+  b->scanned=0;
+  return 0;
+}
+
+/* keeps the search just run in b, in place of the least recently used */
+static void bfsCachePut(struct BfsCache *c, const struct ValleyFreeBfs *b)
+{
+  uint64_t at[NUM_OF_STATES*3+1], size, oldest=UINT64_MAX;
+  struct CacheSlot *x;
+  uint8_t *p;
+  int64_t i=0;
+
+  cacheLock(c);
+  if(cacheFind(c, b, b->destination) >= 0){
+    cacheUnlock(c); // another thread or process was quicker
+    return;
+  }
+  for(uint64_t k=0;k<c->h->slots;k++)
+  {
+    uint64_t used=c->slot[k].valid ? c->slot[k].used : 0;
+    if(used < oldest){
+      oldest=used;
+      i=(int64_t)k;
+    }
+  }
+  x=&c->slot[i];
+  p=c->data+(uint64_t)i*c->h->slotSize;
+  c->evictions=c->evictions+x->valid;
+  x->valid=0;
+  cacheLayout(c->h->nodes, at, &size);
+  for(int s=0;s<NUM_OF_STATES;s++)
+  {
+    memcpy(p+at[s], b->dist[s], c->nodes*sizeof(uint16_t));
+    memcpy(p+at[NUM_OF_STATES+s], b->first[s], c->nodes*sizeof(uint32_t));
+    memcpy(p+at[2*NUM_OF_STATES+s], b->paths[s], c->nodes*sizeof(double));
+  }
+  memcpy(p+at[3*NUM_OF_STATES], b->order, b->reached*sizeof(uint32_t));
+  x->digest=c->digest;
+  x->root=b->destination;
+  x->ignore=b->ignore;
+  x->policy=(uint8_t)b->policy;
+  x->reached=b->reached;
+  x->maxDist=b->maxDist;
+  x->used=++c->h->clock;
+  x->valid=1;
+  c->stores++;
+  cacheUnlock(c);
+}
+
+/**************************************************************************
+ bfsRun through the cache of b, if it has one: a search that is in the
+ cache is copied out of it, any other one is run and kept.
+**************************************************************************/
+void bfsCached(struct ValleyFreeBfs *b, const struct AsGraph *g, uint32_t root)
+{
+  if(b->cache != NULL && bfsCacheGet(b->cache, b, root) == 0){
+    return;
+  }
+  bfsRun(b, g, root);
+  if(b->cache != NULL){
+    bfsCachePut(b->cache, b);
+  }
+}
+
+/* one line of cache statistics of this process */
+static void bfsCacheReport(const struct BfsCache *c)
+{
+  if(c != NULL){
+    printf("BFS cache:\t %llu hits, %llu misses, %llu kept (%llu evicted)\n",(unsigned long long)c->hits,(unsigned long long)c->misses,(unsigned long long)c->stores,(unsigned long long)c->evictions);
+  }
+}
+
+/**************************************************************************
+ Entry point of "asgraph info <as-rel file or snapshot>".
+**************************************************************************/
+int infoMode(int argc, char **argv)
+{
+  struct AsGraph g;
+  uint32_t maxDeg[NUM_OF_RELS]={0,0,0}, maxAt[NUM_OF_RELS]={0,0,0};
+  uint32_t stubs=0;
+
+  if(argc < 1){
+    fprintf(stderr,"usage: asgraph info <as-rel file or snapshot>\n");
+    return 1;
+  }
+  if(openGraph(&g, argv[0], 1) != 0){
+    return 1;
+  }
+  for(uint32_t v=0;v<g.nodes;v++)
+  {
+    for(int r=0;r<NUM_OF_RELS;r++)
+    {
+      uint32_t d=g.off[r][v+1]-g.off[r][v];
+      if(d > maxDeg[r]){
+        maxDeg[r]=d;
+        maxAt[r]=v;
+      }
+    }
+    stubs=stubs+(g.off[REL_CUSTOMERS][v+1] == g.off[REL_CUSTOMERS][v]);
+  }
+  printf("ASes:\t\t %u (%u without customers)\n",g.nodes,stubs);
+  for(int r=0;r<NUM_OF_RELS;r++)
+  {
+    printf("%-9s\t %llu entries, most at AS%u (%u)\n",relNames[r],(unsigned long long)g.edges[r],g.nodes ? g.asn[maxAt[r]] : 0,maxDeg[r]);
+  }
+  freeGraph(&g);
+  return 0;
+}
+
+/**************************************************************************
+ Entry point of "asgraph reorder <graph> <degree|rcm|hub> [snapshot]".
+ Writes the graph renumbered in that order to a snapshot, by default
+ <graph>.<order>.csr, which every mode opens like any other graph.
+**************************************************************************/
+int reorderMode(int argc, char **argv)
+{
+  struct AsGraph g, h;
+  char name[4096];
+  const char *out;
+  double mean, near;
+  int order=-1;
+  uint64_t t;
+
+  for(int i=0;argc > 1 && i<NUM_OF_ORDERS;i++)
+  {
+    order=strcmp(argv[1], orderNames[i]) == 0 ? i : order;
+  }
+  if(order < 0){
+    fprintf(stderr,"usage: asgraph reorder <graph> <degree|rcm|hub> [snapshot]\n");
+    return 1;
+  }
+  if(openGraph(&g, argv[0], 1) != 0){
+    return 1;
+  }
+  t=nowNs();
+  if(reorderGraph(&g, order, &h) != 0){
+    fprintf(stderr,"out of memory\n");
+    freeGraph(&g);
+    return 1;
+  }
+  t=nowNs()-t;
+  orderGap(&g, &mean, &near);
+  printf("Before:\t\t neighbours %.0f indices apart on average, %.1f%% within 32\n",mean,near);
+  orderGap(&h, &mean, &near);
+  printf("After:\t\t neighbours %.0f indices apart on average, %.1f%% within 32 (%s order, %.2f ms)\n",mean,near,orderNames[order],t/1e6);
+  snprintf(name, sizeof name, "%s.%s%s", argv[0], orderNames[order], SNAPSHOT_SUFFIX);
+  out=argc > 2 ? argv[2] : name;
+  if(writeSnapshot(&h, out) != 0){
+    freeGraph(&h);
+    freeGraph(&g);
+    return 1;
+  }
+  printf("Snapshot:\t %s written\n",out);
+  freeGraph(&h);
+  freeGraph(&g);
+  return 0;
+}
+
+static int printPath(const uint32_t *path, uint32_t len, void *arg)
+{
+  const struct AsGraph *g=arg;
+  for(uint32_t i=0;i<len;i++)
+  {
+    printf("%s%u",i ? " " : "\t ",g->asn[path[i]]);
+  }
+  printf("\n");
+  return 0;
+}
+
+static int countPath(const uint32_t *path, uint32_t len, void *arg)
+{
+  (void)path;
+  *(uint64_t *)arg+=len;
+  return 0;
+}
+
+/* looks up an AS number given on the command line */
+static int64_t argIndex(const struct AsGraph *g, const char *arg)
+{
+  int64_t v=asIndex(g, (uint32_t)strtoul(arg, NULL, 10));
+  if(v < 0){
+    fprintf(stderr,"AS%s is not in the graph\n",arg);
+  }
+  return v;
+}
+
+/**************************************************************************
+ Entry point of "asgraph bfs <graph> <destination AS> [source AS [max]]".
+ Without a source, prints how many ASes reach the destination at which
+ distance; with one, its distance, path count and first max paths.
+**************************************************************************/
+int bfsMode(int argc, char **argv)
+{
+  struct AsGraph g;
+  struct ValleyFreeBfs b;
+  int64_t dst, src=-1;
+  uint64_t t, max=10;
+
+  if(argc < 2){
+    fprintf(stderr,"usage: asgraph bfs <graph> <destination AS> [source AS [max paths]]\n");
+    return 1;
+  }
+  if(openGraph(&g, argv[0], 1) != 0){
+    return 1;
+  }
+  if((dst=argIndex(&g, argv[1])) < 0 || (argc > 2 && (src=argIndex(&g, argv[2])) < 0) || bfsCreate(&b, &g) != 0){
+    freeGraph(&g);
+    return 1;
+  }
+  if(argc > 3){
+    max=strtoull(argv[3], NULL, 10);
+  }
+  b.cache=bfsCacheOpen(&g, 1);
+  t=nowNs();
+  bfsCached(&b, &g, (uint32_t)dst);
+  t=nowNs()-t;
+  printf("BFS:\t\t %.3f ms, %llu adjacency entries scanned\n",t/1e6,(unsigned long long)b.scanned);
+
+  if(src < 0){
+    uint32_t reached=0;
+    double paths=0;
+    for(uint32_t v=0;v<g.nodes;v++)
+    {
+      if(bfsDistance(&b, v) != DIST_INF){
+        reached++;
+        paths=paths+bfsPathCount(&b, v);
+      }
+    }
+    printf("Reached:\t %u of %u ASes, %.0f shortest paths\n",reached,g.nodes,paths);
+    for(uint16_t d=1;d<=b.maxDist;d++)
+    {
+      uint32_t n=0;
+      for(uint32_t v=0;v<g.nodes;v++)
+      {
+        n=n+(bfsDistance(&b, v) == d);
+      }
+      printf("Distance %u:\t %u ASes\n",d,n);
+    }
+  }
+  else if(bfsDistance(&b, (uint32_t)src) == DIST_INF){
+    printf("AS%u has no valley-free path to AS%u\n",g.asn[src],g.asn[dst]);
+  }
+  else{
+    printf("Distance:\t %u\n",bfsDistance(&b, (uint32_t)src));
+    printf("Paths:\t\t %.0f, the first %llu:\n",bfsPathCount(&b, (uint32_t)src),(unsigned long long)max);
+    bfsPaths(&b, &g, (uint32_t)src, max, printPath, &g);
+  }
+  bfsCacheClose(b.cache);
+  bfsFree(&b);
+  freeGraph(&g);
+  return 0;
+}
+
+/* reads whitespace separated AS numbers from path, returns their count */
+static int64_t readDestinations(const struct AsGraph *g, const char *path, uint32_t **out)
+{
+  FILE *f=fopen(path, "r");
+  uint64_t n=0, cap=1024;
+  unsigned long asn;
+
+  if(f == NULL){
+    perror(path);
+    return -1;
+  }
+  *out=malloc(cap*sizeof **out);
+  while(*out != NULL && fscanf(f, "%lu", &asn) == 1)
+  {
+    int64_t v=asIndex(g, (uint32_t)asn);
+    if(v < 0){
+      fprintf(stderr,"%s: AS%lu is not in the graph, skipped\n",path,asn);
+      continue;
+    }
+    if(n == cap){
+      uint32_t *more=realloc(*out, 2*cap*sizeof **out);
+      if(more == NULL){
+        free(*out);
+        *out=NULL;
+        break;
+      }
+      *out=more;
+      cap=2*cap;
+    }
+    (*out)[n++]=(uint32_t)v;
+  }
+  fclose(f);
+  return *out != NULL ? (int64_t)n : -1;
+}
+
+/**************************************************************************
+ The destinations of the benchmarks: the AS numbers listed in file arg if
+ it is one, else arg (or n) random ASes, the same in every run.
+**************************************************************************/
+static int64_t pickDestinations(const struct AsGraph *g, const char *arg, int64_t n, uint32_t **out)
+{
+  uint64_t seed=1;
+
+  if(arg != NULL && access(arg, R_OK) == 0){
+    return readDestinations(g, arg, out);
+  }
+  if(arg != NULL){
+    n=strtoll(arg, NULL, 10);
+  }
+  *out=malloc((n > 0 ? n : 1)*sizeof **out);
+  for(int64_t i=0;i<n && *out != NULL;i++)
+  {
+    // splitmix64, so that every run picks the same destinations
+    uint64_t z=(seed+=0x9e3779b97f4a7c15ULL);
+    z=(z^(z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z >> 27))*0x94d049bb133111ebULL;
+    (*out)[i]=asAt(g, (uint32_t)((z^(z >> 31))%g->nodes));
+  }
+  return *out != NULL ? n : -1;
+}
+
+/**************************************************************************
+ Entry point of "asgraph bfsbench <graph> [destinations | file]". Runs
+ the BFS towards a number of random destinations (1000 by default), or
+ towards the AS numbers listed in a file, e.g. the one written by
+ benchShortestAllBGPtreeDestination.m, so that the time per destination
+ compares directly with the Matlab function. Next to the time it prints
+ how many paths the Matlab trees would have held, and what lazily
+ enumerating the first path of every AS (what a "Single" anonymity set
+ needs) costs on top of the BFS.
+**************************************************************************/
+int bfsBenchMode(int argc, char **argv)
+{
+  struct AsGraph g;
+  struct ValleyFreeBfs b;
+  uint32_t *dst=NULL;
+  int64_t n;
+  uint64_t total=0, worst=0, scanned=0, firstNs=0, firstLen=0;
+  double reached=0, paths=0, entries=0;
+
+  if(argc < 1){
+    fprintf(stderr,"usage: asgraph bfsbench <graph> [destinations | file of destination ASes]\n");
+    return 1;
+  }
+  if(openGraph(&g, argv[0], 1) != 0){
+    return 1;
+  }
+  if(g.nodes == 0 || bfsCreate(&b, &g) != 0){
+    freeGraph(&g);
+    return 1;
+  }
+  b.cache=bfsCacheOpen(&g, 1);
+  n=pickDestinations(&g, argc > 1 ? argv[1] : NULL, 1000, &dst);
+  if(n <= 0){
+    fprintf(stderr,"no destinations\n");
+    free(dst);
+    bfsFree(&b);
+    freeGraph(&g);
+    return 1;
+  }
+
+  for(int64_t i=0;i<n;i++)
+  {
+    uint64_t t=nowNs();
+    bfsCached(&b, &g, dst[i]);
+    t=nowNs()-t;
+    total=total+t;
+    worst=t > worst ? t : worst;
+    scanned=scanned+b.scanned;
+    for(uint32_t v=0;v<g.nodes;v++)
+    {
+      uint16_t d=bfsDistance(&b, v);
+      if(d != DIST_INF){
+        double p=bfsPathCount(&b, v);
+        reached=reached+1;
+        paths=paths+p;
+        entries=entries+p*d;
+      }
+    }
+    if(i == 0){
+      t=nowNs();
+      for(uint32_t v=0;v<g.nodes;v++)
+      {
+        bfsPaths(&b, &g, v, 1, countPath, &firstLen);
+      }
+      firstNs=nowNs()-t;
+    }
+  }
+  printf("Destinations:\t %lld\n",(long long)n);
+  printf("BFS:\t\t %.3f ms per destination on average, %.3f ms at most\n",total/1e6/n,worst/1e6);
+  printf("Scanned:\t %.1f M adjacency entries/s\n",scanned/(total/1e3));
+  printf("Reached:\t %.0f ASes per destination on average\n",reached/n);
+  printf("Paths:\t\t %.0f shortest paths per destination on average\n",paths/n);
+  printf("Matlab trees:\t %.1f MB of path matrices per destination on average\n",entries*8/n/1e6);
+  printf("First paths:\t %.3f ms for all %u ASes of the first destination (%llu hops)\n",firstNs/1e6,g.nodes,(unsigned long long)firstLen);
+  bfsCacheReport(b.cache);
+  bfsCacheClose(b.cache);
+  free(dst);
+  bfsFree(&b);
+  freeGraph(&g);
+  return 0;
+}
+
+/* whether two runs towards the same destination agree on everything bfsPaths uses */
+static int bfsSame(const struct ValleyFreeBfs *a, const struct ValleyFreeBfs *b)
+{
+  if(a->reached != b->reached || a->maxDist != b->maxDist || memcmp(a->order, b->order, a->reached*sizeof(uint32_t)) != 0){
+    return 0;
+  }
+  for(uint32_t i=0;i<a->reached;i++)
+  {
+    uint32_t v=a->order[i] >> 1;
+    int s=a->order[i] & 1;
+    if(a->dist[s][v] != b->dist[s][v] || a->paths[s][v] != b->paths[s][v] || a->first[s][v] != b->first[s][v] || a->seq[s][v] != b->seq[s][v]){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**************************************************************************
+ Entry point of "asgraph bfsdir <graph> [destinations | file] [policy]".
+ Runs the BFS towards every destination (100 random ones by default)
+ once top-down only and once choosing the direction per distance, and
+ prints both times (the better of three runs each), how many distances
+ went bottom-up and whether both runs agree. policy is valleyfree (the
+ default) or shortest.
+**************************************************************************/
+int bfsDirMode(int argc, char **argv)
+{
+  struct AsGraph g;
+  struct ValleyFreeBfs top, hyb;
+  uint32_t *dst=NULL;
+  int64_t n;
+  int policy=POLICY_VALLEYFREE, differ=0;
+  uint64_t topTotal=0, hybTotal=0, levels=0, upLevels=0, faster=0;
+
+  if(argc < 1){
+    fprintf(stderr,"usage: asgraph bfsdir <graph> [destinations | file of destination ASes] [valleyfree | shortest]\n");
+    return 1;
+  }
+  if(argc > 2 && strcmp(argv[2], "shortest") == 0){
+    policy=POLICY_SHORTEST;
+  }
+  if(openGraph(&g, argv[0], 1) != 0){
+    return 1;
+  }
+  if(g.twin[REL_PROVIDERS] == NULL && graphTwins(&g) != 0){
+    fprintf(stderr,"%s: relations not listed from both ends\n",argv[0]);
+    freeGraph(&g);
+    return 1;
+  }
+  if(g.nodes == 0 || bfsCreate(&top, &g) != 0 || bfsCreate(&hyb, &g) != 0){
+    freeGraph(&g);
+    return 1;
+  }
+  top.hybrid=0;
+  top.policy=policy;
+  hyb.policy=policy;
+  n=pickDestinations(&g, argc > 1 ? argv[1] : NULL, 100, &dst);
+  if(n <= 0){
+    fprintf(stderr,"no destinations\n");
+    free(dst);
+    bfsFree(&top);
+    bfsFree(&hyb);
+    freeGraph(&g);
+    return 1;
+  }
+
+  printf("AS\treached\tlevels\tbottom-up\ttop-down ms\thybrid ms\tsame\n");
+  for(int64_t i=0;i<n;i++)
+  {
+    uint64_t tTop=UINT64_MAX, tHyb=UINT64_MAX;
+    int same;
+    for(int k=0;k<3;k++)
+    {
+      uint64_t t=nowNs();
+      bfsRun(&top, &g, dst[i]);
+      t=nowNs()-t;
+      tTop=t < tTop ? t : tTop;
+      t=nowNs();
+      bfsRun(&hyb, &g, dst[i]);
+      t=nowNs()-t;
+      tHyb=t < tHyb ? t : tHyb;
+    }
+    same=bfsSame(&top, &hyb);
+    differ=differ+!same;
+    topTotal=topTotal+tTop;
+    hybTotal=hybTotal+tHyb;
+    levels=levels+top.maxDist;
+    upLevels=upLevels+hyb.bottomUp;
+    faster=faster+(tHyb < tTop);
+    printf("AS%u\t%u\t%u\t%u\t\t%.3f\t\t%.3f\t\t%s\n",g.asn[dst[i]],top.reached,top.maxDist,hyb.bottomUp,tTop/1e6,tHyb/1e6,same ? "yes" : "NO");
+  }
+  printf("Destinations:\t %lld (%s)\n",(long long)n,policy == POLICY_SHORTEST ? "shortest" : "valley-free");
+  printf("Top-down:\t %.3f ms per destination on average\n",topTotal/1e6/n);
+  printf("Hybrid:\t\t %.3f ms per destination on average, faster for %llu\n",hybTotal/1e6/n,(unsigned long long)faster);
+  printf("Bottom-up:\t %llu of %llu distances\n",(unsigned long long)upLevels,(unsigned long long)levels);
+  printf("Differing:\t %d destinations\n",differ);
+  free(dst);
+  bfsFree(&top);
+  bfsFree(&hyb);
+  freeGraph(&g);
+  return differ > 0;
+}
+
+/**************************************************************************
+* IP address space
+*
+* listIpsPerAS of readinASGraphDirected.m adds 2^(32-length) for every
+* line of the pfx2as file, so an AS that announces a /16 and a /24 inside
+* it counts the /24 twice, and a /24 of another AS inside the /16 counts
+* for both. Here the prefixes of a routeviews pfx2as file (plain or
+* gzipped, read line by line) go into a path-compressed binary trie, and
+* one walk over the trie gives every address to the origin of its most
+* specific prefix, as longest-prefix routing would deliver it. The sum
+* over all ASes is then exactly the announced address space, counting
+* the prefixes of several origins (MOAS, a_b, and AS sets, {a,b}) once
+* for each of them. The result is kept next to the graph (graph.ips,
+* tied to the graph by its digest) and read by "anonymity -i" like
+* the .mat files.
+**************************************************************************/
+#define IPS_MAGIC 0x3153504953414124ULL /* "$ASIPS1" */
+#define IPS_SUFFIX ".ips"
+#define TRIE_MAX_ORIGINS 64
+
+struct TrieNode {
+  uint32_t key;      /* the prefix, host bits zero */
+  uint32_t len;
+  uint32_t child[2]; /* NO_NODE if none */
+  uint32_t origins;  /* first origin AS in the pool, NO_NODE if no prefix */
+  uint32_t count;
+};
+
+struct PrefixTrie {
+  struct TrieNode *node;
+  uint32_t nodes, cap;
+  uint32_t *pool;    /* origin AS numbers */
+  uint64_t used, poolCap;
+};
+
+struct IpsHeader {
+  uint64_t magic;
+  uint64_t nodes;
+  uint64_t digest;   /* graphDigest of the graph the counts belong to */
+};
+
+static uint32_t prefixMask(uint32_t len)
+{
+  return len == 0 ? 0 : ~0U << (32-len);
+}
+
+static uint32_t trieNew(struct PrefixTrie *t, uint32_t key, uint32_t len)
+{
+  struct TrieNode *n;
+  if(t->nodes == t->cap){
+    uint32_t cap=t->cap ? 2*t->cap : 1024;
+    struct TrieNode *more=realloc(t->node, cap*sizeof *more);
+    if(more == NULL){
+      return NO_NODE;
+    }
+    t->node=more;
+    t->cap=cap;
+  }
+  n=&t->node[t->nodes];
+  n->key=key & prefixMask(len);
+  n->len=len;
+  n->child[0]=NO_NODE;
+  n->child[1]=NO_NODE;
+  n->origins=NO_NODE;
+  n->count=0;
+  return t->nodes++;
+}
+
+/* stores the origins of node n, merged with those it already has */
+static int trieOrigins(struct PrefixTrie *t, uint32_t n, const uint32_t *as, uint32_t count)
+{
+  struct TrieNode *x=&t->node[n];
+  uint32_t old=x->origins == NO_NODE ? 0 : x->count;
+  if(t->used+old+count > t->poolCap){
+    uint64_t cap=2*(t->poolCap+old+count);
+    uint32_t *more=realloc(t->pool, cap*sizeof *more);
+    if(more == NULL){
+      return -1;
+    }
+    t->pool=more;
+    t->poolCap=cap;
+  }
+  if(old > 0){
+    // a prefix listed twice: a fresh run with the union of both lists
+    memmove(t->pool+t->used, t->pool+x->origins, old*sizeof *t->pool);
+  }
+  x->origins=(uint32_t)t->used;
+  x->count=old;
+  for(uint32_t i=0;i<count;i++)
+  {
+    uint32_t k=0;
+    while(k < x->count && t->pool[x->origins+k] != as[i])
+    {
+      k++;
+    }
+    if(k == x->count){
+      t->pool[x->origins+x->count++]=as[i];
+    }
+  }
+  t->used=t->used+x->count;
+  return 0;
+}
+
+/**************************************************************************
+ Inserts prefix key/len with its origins. Nodes without a prefix of their
+ own only branch, so the trie has fewer than two nodes per prefix.
+**************************************************************************/
+int trieInsert(struct PrefixTrie *t, uint32_t key, uint32_t len, const uint32_t *as, uint32_t count)
+{
+  uint32_t n=0;
+
+  key=key & prefixMask(len);
+  if(t->nodes == 0 && trieNew(t, 0, 0) == NO_NODE){
+    return -1;
+  }
+  for(;;)
+  {
+    // node n covers key/len
+    uint32_t bit, c, common, x, diff;
+    if(t->node[n].len == len){
+      return trieOrigins(t, n, as, count);
+    }
+    bit=(key >> (31-t->node[n].len)) & 1;
+    if((c=t->node[n].child[bit]) == NO_NODE){
+      if((x=trieNew(t, key, len)) == NO_NODE){
+        return -1;
+      }
+      t->node[n].child[bit]=x;
+      return trieOrigins(t, x, as, count);
+    }
+    diff=t->node[c].key^key;
+    common=diff == 0 ? 32 : (uint32_t)__builtin_clz(diff);
+    common=common < len ? common : len;
+    common=common < t->node[c].len ? common : t->node[c].len;
+    if(common == t->node[c].len){
+      n=c;
+      continue;
+    }
+    // key/len and c part below common: a new node there takes both
+    if((x=trieNew(t, key, common)) == NO_NODE){
+      return -1;
+    }
+    t->node[n].child[bit]=x;
+    t->node[x].child[(t->node[c].key >> (31-common)) & 1]=c;
+    if(common == len){
+      return trieOrigins(t, x, as, count);
+    }
+    n=x;
+  }
+}
+
+struct IpsCount {
+  const struct AsGraph *g;
+  double *ips;
+  uint64_t announced; /* addresses under any prefix */
+  uint64_t outside;   /* addresses of origins not in the graph */
+  uint64_t moas;      /* addresses with more than one origin */
+  uint64_t shadowed;  /* prefixes more specific prefixes fully cover */
+};
+
+/* gives the addresses below n to their origins, returns how many there are */
+static uint64_t trieCount(const struct PrefixTrie *t, uint32_t n, struct IpsCount *c)
+{
+  const struct TrieNode *x=&t->node[n];
+  uint64_t below=0, own;
+
+  for(int i=0;i<2;i++)
+  {
+    below=below+(x->child[i] != NO_NODE ? trieCount(t, x->child[i], c) : 0);
+  }
+  if(x->origins == NO_NODE){
+    return below;
+  }
+  own=(1ULL << (32-x->len))-below;
+  c->shadowed=c->shadowed+(own == 0);
+  c->moas=c->moas+(x->count > 1 ? own : 0);
+  for(uint32_t i=0;i<x->count;i++)
+  {
+    int64_t v=asIndex(c->g, t->pool[x->origins+i]);
+    if(v < 0){
+      c->outside=c->outside+own;
+    }
+    else{
+      c->ips[v]=c->ips[v]+(double)own;
+    }
+  }
+  return 1ULL << (32-x->len);
+}
+
+/**************************************************************************
+ Parses one line of a pfx2as file, "prefix<tab>length<tab>origins" with
+ origins like 701, 701_702 or {701,702}. Returns the number of origins,
+ 0 for lines to skip (IPv6, comments).
+**************************************************************************/
+static uint32_t parsePfx2as(const char *p, uint32_t *key, uint32_t *len, uint32_t as[TRIE_MAX_ORIGINS])
+{
+  uint32_t octet[4], n=0;
+  char *end;
+  unsigned long x;
+
+  for(int i=0;i<4;i++)
+  {
+    x=strtoul(p, &end, 10);
+    if(end == p || x > 255 || (i < 3 && *end != '.')){
+      return 0;
+    }
+    octet[i]=(uint32_t)x;
+    p=end+(i < 3);
+  }
+  x=strtoul(p, &end, 10);
+  if(end == p || x > 32){
+    return 0;
+  }
+  *key=octet[0] << 24 | octet[1] << 16 | octet[2] << 8 | octet[3];
+  *len=(uint32_t)x;
+  for(p=end;*p != 0 && *p != '\n' && n < TRIE_MAX_ORIGINS;)
+  {
+    if(*p >= '0' && *p <= '9'){
+      as[n++]=(uint32_t)strtoul(p, &end, 10);
+      p=end;
+    }
+    else{
+      p++; // separators: blanks, _ , { }
+    }
+  }
+  return n;
+}
+
+/**************************************************************************
+ Reads the pfx2as file at path into a trie and counts the address space
+ of every AS of g into ips. Returns the number of prefixes, -1 on error.
+**************************************************************************/
+int64_t countAddressSpace(const struct AsGraph *g, const char *path, double *ips, struct IpsCount *c, uint64_t *naive)
+{
+  struct PrefixTrie t;
+  char line[1024];
+  uint32_t as[TRIE_MAX_ORIGINS], key, len, count;
+  int64_t prefixes=0;
+  gzFile f=gzopen(path, "rb");
+
+  if(f == NULL){
+    perror(path);
+    return -1;
+  }
+  memset(&t, 0, sizeof t);
+  memset(c, 0, sizeof *c);
+  *naive=0;
+  while(gzgets(f, line, sizeof line) != NULL)
+  {
+    if((count=parsePfx2as(line, &key, &len, as)) == 0){
+      continue;
+    }
+    if(trieInsert(&t, key, len, as, count) != 0){
+      prefixes=-1;
+      break;
+    }
+    *naive=*naive+(1ULL << (32-len));
+    prefixes++;
+  }
+  gzclose(f);
+  c->g=g;
+  c->ips=ips;
+  memset(ips, 0, g->nodes*sizeof *ips);
+  if(prefixes > 0){
+    c->announced=trieCount(&t, 0, c);
+  }
+  free(t.node);
+  free(t.pool);
+  return prefixes;
+}
+
+/* writes the counts of g to path, tied to g by its digest */
+int writeIps(const struct AsGraph *g, const double *ips, const char *path)
+{
+  struct IpsHeader h;
+  FILE *f=fopen(path, "wb");
+  int ok;
+
+  if(f == NULL){
+    perror(path);
+    return -1;
+  }
+  h.magic=IPS_MAGIC;
+  h.nodes=g->nodes;
+  h.digest=graphDigest(g);
+  ok=fwrite(&h, sizeof h, 1, f) == 1 && fwrite(ips, sizeof *ips, g->nodes, f) == g->nodes;
+  if(fclose(f) != 0 || !ok){
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Reads counts written by writeIps into ips (g->nodes entries). Returns 1
+ if path is no such file, -1 if it is one of another graph.
+**************************************************************************/
+int readIps(const struct AsGraph *g, const char *path, double *ips)
+{
+  struct IpsHeader h;
+  FILE *f=fopen(path, "rb");
+  int ok;
+
+  if(f == NULL || fread(&h, sizeof h, 1, f) != 1 || h.magic != IPS_MAGIC){
+    if(f != NULL){
+      fclose(f);
+    }
+    return 1;
+  }
+  ok=h.nodes == g->nodes && h.digest == graphDigest(g);
+  ok=ok && fread(ips, sizeof *ips, g->nodes, f) == g->nodes;
+  fclose(f);
+  if(!ok){
+    fprintf(stderr,"%s: counts of another graph, run \"asgraph ipspace\" again\n",path);
+    return -1;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Entry point of "asgraph ipspace <graph> <pfx2as file> [-o out.ips]
+ [-m out.mat]": counts the address space of every AS and writes it to
+ graph.ips, and with -m also as listIpsPerAS (with listOfNodes) to a
+ MAT-file for the Matlab scripts.
+**************************************************************************/
+int ipSpaceMode(int argc, char **argv)
+{
+  struct AsGraph g;
+  struct IpsCount c;
+  const char *out=NULL, *mat=NULL;
+  char name[4096];
+  double *ips;
+  uint64_t naive, t=nowNs();
+  uint32_t withSpace=0;
+  int64_t prefixes;
+  int opt, ret=0;
+
+  if(argc < 2){
+    fprintf(stderr,"usage: asgraph ipspace <graph> <pfx2as file> [-o out.ips] [-m out.mat]\n");
+    return 1;
+  }
+  optind=2;
+  while((opt=getopt(argc, argv, "o:m:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'o': out=optarg; break;
+      case 'm': mat=optarg; break;
+      default: return 1;
+    }
+  }
+  if(openGraph(&g, argv[0], 1) != 0){
+    return 1;
+  }
+  if((ips=calloc(g.nodes+1, sizeof *ips)) == NULL || (prefixes=countAddressSpace(&g, argv[1], ips, &c, &naive)) < 0){
+    free(ips);
+    freeGraph(&g);
+    return 1;
+  }
+  t=nowNs()-t;
+  for(uint32_t v=0;v<g.nodes;v++)
+  {
+    withSpace=withSpace+(ips[v] > 0);
+  }
+  printf("Prefixes:\t %lld in %.2f ms\n",(long long)prefixes,t/1e6);
+  printf("Announced:\t %llu addresses (%.1f%% of IPv4), %llu with several origins\n",(unsigned long long)c.announced,c.announced/42949672.96,(unsigned long long)c.moas);
+  printf("Per prefix:\t %llu addresses, as readinASGraphDirected.m adds them up\n",(unsigned long long)naive);
+  printf("Shadowed:\t %llu prefixes entirely covered by more specific ones\n",(unsigned long long)c.shadowed);
+  printf("ASes:\t\t %u of %u with address space, %llu addresses of origins not in the graph\n",withSpace,g.nodes,(unsigned long long)c.outside);
+
+  if(out == NULL){
+    snprintf(name, sizeof name, "%s%s", argv[0], IPS_SUFFIX);
+    out=name;
+  }
+  if(writeIps(&g, ips, out) != 0){
+    ret=1;
+  }
+  else{
+    printf("Saved:\t\t %s\n",out);
+  }
+  if(mat != NULL){
+    struct MatArray a[2];
+    snprintf(a[0].name, sizeof a[0].name, "listOfNodes");
+    snprintf(a[1].name, sizeof a[1].name, "listIpsPerAS");
+    a[0].rows=a[1].rows=g.nodes;
+    a[0].cols=a[1].cols=1;
+    a[0].data=malloc(g.nodes*sizeof(double));
+    a[1].data=malloc(g.nodes*sizeof(double));
+    // in the order of listOfNodes, whatever the order of the graph
+    for(uint32_t i=0;a[0].data != NULL && a[1].data != NULL && i<g.nodes;i++)
+    {
+      a[0].data[i]=g.asn[asAt(&g, i)];
+      a[1].data[i]=ips[asAt(&g, i)];
+    }
+    if(a[0].data == NULL || a[1].data == NULL || matWrite(mat, a, 2) != 0){
+      ret=1;
+    }
+    else{
+      printf("Saved:\t\t %s\n",mat);
+    }
+    free(a[0].data);
+    free(a[1].data);
+  }
+  free(ips);
+  freeGraph(&g);
+  return ret;
+}
+
+/**************************************************************************
+* Bitsets
+*
+* Anonymity sets as dense bitsets over the AS indices, 64 ASes to a word
+* and padded to whole 64 byte lines (a set of the 2014 graph is 5.8 KB).
+* Intersections and unions are plain word loops; the reductions, the
+* size of a set (a popcount) and its weight (the sum of listIpsPerAS over
+* its members) are provided scalar, with AVX2 and with AVX-512 and picked
+* at startup by bitsetInit from what the CPU supports, or from
+* ASGRAPH_SIMD=scalar|avx2|avx512. Weight arrays must be padded with
+* zeros to 64*words entries. As IP counts are integers, the weights come
+* out exact whichever order they are added in.
+**************************************************************************/
+
+#define BITSET_WORDS(n) ((((size_t)(n)+511)/512)*8)
+
+struct BitsetOps {
+  const char *name;
+  uint64_t (*count)(const uint64_t *a, size_t words);
+  uint64_t (*countAnd)(const uint64_t *a, const uint64_t *b, size_t words);
+  double (*weight)(const uint64_t *a, const double *w, size_t words);
+  double (*weightAnd)(const uint64_t *a, const uint64_t *b, const double *w, size_t words);
+};
+
+static inline void bitsetSet(uint64_t *a, uint32_t v)
+{
+  a[v >> 6]=a[v >> 6] | 1ULL << (v & 63);
+}
+
+static inline int bitsetHas(const uint64_t *a, uint32_t v)
+{
+  return (a[v >> 6] >> (v & 63)) & 1;
+}
+
+void bitsetAnd(uint64_t *out, const uint64_t *a, const uint64_t *b, size_t words)
+{
+  for(size_t i=0;i<words;i++)
+  {
+    out[i]=a[i] & b[i];
+  }
+}
+
+void bitsetOr(uint64_t *out, const uint64_t *a, const uint64_t *b, size_t words)
+{
+  for(size_t i=0;i<words;i++)
+  {
+    out[i]=a[i] | b[i];
+  }
+}
+
+void bitsetAndNot(uint64_t *out, const uint64_t *a, const uint64_t *b, size_t words)
+{
+  for(size_t i=0;i<words;i++)
+  {
+    out[i]=a[i] & ~b[i];
+  }
+}
+
+static uint64_t countScalar(const uint64_t *a, size_t words)
+{
+  uint64_t n=0;
+  for(size_t i=0;i<words;i++)
+  {
+    n=n+__builtin_popcountll(a[i]);
+  }
+  return n;
+}
+
+static uint64_t countAndScalar(const uint64_t *a, const uint64_t *b, size_t words)
+{
+  uint64_t n=0;
+  for(size_t i=0;i<words;i++)
+  {
+    n=n+__builtin_popcountll(a[i] & b[i]);
+  }
+  return n;
+}
+
+static inline double weightWord(uint64_t x, const double *w)
+{
+  double sum=0;
+  while(x)
+  {
+    sum=sum+w[__builtin_ctzll(x)];
+    x=x & (x-1);
+  }
+  return sum;
+}
+
+static double weightScalar(const uint64_t *a, const double *w, size_t words)
+{
+  double sum=0;
+  for(size_t i=0;i<words;i++)
+  {
+    sum=sum+weightWord(a[i], w+64*i);
+  }
+  return sum;
+}
+
+static double weightAndScalar(const uint64_t *a, const uint64_t *b, const double *w, size_t words)
+{
+  double sum=0;
+  for(size_t i=0;i<words;i++)
+  {
+    sum=sum+weightWord(a[i] & b[i], w+64*i);
+  }
+  return sum;
+}
+
+#if defined(__x86_64__)
+
+/* popcount of 256 bits by nibble lookup (Mula), summed per 64 bit lane */
+__attribute__((target("avx2"))) static inline __m256i popcount256(__m256i v)
+{
+  const __m256i lookup=_mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i low=_mm256_set1_epi8(0x0f);
+  __m256i lo=_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+  __m256i hi=_mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+  return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"))) static inline uint64_t sum256(__m256i v)
+{
+  return (uint64_t)_mm256_extract_epi64(v, 0)+_mm256_extract_epi64(v, 1)+_mm256_extract_epi64(v, 2)+_mm256_extract_epi64(v, 3);
+}
+
+__attribute__((target("avx2"))) static uint64_t countAvx2(const uint64_t *a, size_t words)
+{
+  __m256i n=_mm256_setzero_si256();
+  for(size_t i=0;i<words;i=i+4)
+  {
+    n=_mm256_add_epi64(n, popcount256(_mm256_load_si256((const __m256i *)(a+i))));
+  }
+  return sum256(n);
+}
+
+__attribute__((target("avx2"))) static uint64_t countAndAvx2(const uint64_t *a, const uint64_t *b, size_t words)
+{
+  __m256i n=_mm256_setzero_si256();
+  for(size_t i=0;i<words;i=i+4)
+  {
+    __m256i x=_mm256_and_si256(_mm256_load_si256((const __m256i *)(a+i)), _mm256_load_si256((const __m256i *)(b+i)));
+    n=_mm256_add_epi64(n, popcount256(x));
+  }
+  return sum256(n);
+}
+
+/**************************************************************************
+ The weights of the members among 64 ASes: 16 adds of 4 lanes under a
+ nibble of x, alternating between two accumulators to halve the chain of
+ dependent adds. Words with few members are cheaper bit by bit.
+**************************************************************************/
+#define SPARSE_WORD_AVX2 12
+#define SPARSE_WORD_AVX512 8
+
+#define WEIGHT_WORD_AVX2(acc0, acc1, x, w) do{ \
+    const __m256i bits_=_mm256_setr_epi64x(1, 2, 4, 8); \
+    const __m256i lo_=_mm256_set1_epi64x((int64_t)(x)); \
+    const __m256i hi_=_mm256_set1_epi64x((int64_t)((x) >> 4)); \
+    for(int c_=0;c_<16;c_=c_+2) \
+    { \
+      __m256i m0_=_mm256_cmpeq_epi64(_mm256_and_si256(_mm256_srli_epi64(lo_, 4*c_), bits_), bits_); \
+      __m256i m1_=_mm256_cmpeq_epi64(_mm256_and_si256(_mm256_srli_epi64(hi_, 4*c_), bits_), bits_); \
+      acc0=_mm256_add_pd(acc0, _mm256_and_pd(_mm256_loadu_pd((w)+4*c_), _mm256_castsi256_pd(m0_))); \
+      acc1=_mm256_add_pd(acc1, _mm256_and_pd(_mm256_loadu_pd((w)+4*c_+4), _mm256_castsi256_pd(m1_))); \
+    } \
+  } while(0)
+
+__attribute__((target("avx2"))) static double reduce256(__m256d acc0, __m256d acc1)
+{
+  double lane[4];
+  _mm256_storeu_pd(lane, _mm256_add_pd(acc0, acc1));
+  return lane[0]+lane[1]+lane[2]+lane[3];
+}
+
+__attribute__((target("avx2,popcnt"))) static double weightAvx2(const uint64_t *a, const double *w, size_t words)
+{
+  __m256d acc0=_mm256_setzero_pd(), acc1=_mm256_setzero_pd();
+  double sparse=0;
+  for(size_t i=0;i<words;i++)
+  {
+    if(__builtin_popcountll(a[i]) <= SPARSE_WORD_AVX2){
+      sparse=sparse+weightWord(a[i], w+64*i);
+    }
+    else{
+      WEIGHT_WORD_AVX2(acc0, acc1, a[i], w+64*i);
+    }
+  }
+  return sparse+reduce256(acc0, acc1);
+}
+
+__attribute__((target("avx2,popcnt"))) static double weightAndAvx2(const uint64_t *a, const uint64_t *b, const double *w, size_t words)
+{
+  __m256d acc0=_mm256_setzero_pd(), acc1=_mm256_setzero_pd();
+  double sparse=0;
+  for(size_t i=0;i<words;i++)
+  {
+    uint64_t x=a[i] & b[i];
+    if(__builtin_popcountll(x) <= SPARSE_WORD_AVX2){
+      sparse=sparse+weightWord(x, w+64*i);
+    }
+    else{
+      WEIGHT_WORD_AVX2(acc0, acc1, x, w+64*i);
+    }
+  }
+  return sparse+reduce256(acc0, acc1);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static uint64_t countAvx512(const uint64_t *a, size_t words)
+{
+  __m512i n=_mm512_setzero_si512();
+  for(size_t i=0;i<words;i=i+8)
+  {
+    n=_mm512_add_epi64(n, _mm512_popcnt_epi64(_mm512_load_si512(a+i)));
+  }
+  return _mm512_reduce_add_epi64(n);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static uint64_t countAndAvx512(const uint64_t *a, const uint64_t *b, size_t words)
+{
+  __m512i n=_mm512_setzero_si512();
+  for(size_t i=0;i<words;i=i+8)
+  {
+    n=_mm512_add_epi64(n, _mm512_popcnt_epi64(_mm512_and_si512(_mm512_load_si512(a+i), _mm512_load_si512(b+i))));
+  }
+  return _mm512_reduce_add_epi64(n);
+}
+
+/* the weights of the members among 64 ASes: 8 adds under a byte of x */
+#define WEIGHT_WORD_AVX512(acc0, acc1, x, w) do{ \
+    for(int c_=0;c_<8;c_=c_+2) \
+    { \
+      acc0=_mm512_mask_add_pd(acc0, (__mmask8)((x) >> 8*c_), acc0, _mm512_loadu_pd((w)+8*c_)); \
+      acc1=_mm512_mask_add_pd(acc1, (__mmask8)((x) >> (8*c_+8)), acc1, _mm512_loadu_pd((w)+8*c_+8)); \
+    } \
+  } while(0)
+
+__attribute__((target("avx512f,popcnt"))) static double weightAvx512(const uint64_t *a, const double *w, size_t words)
+{
+  __m512d acc0=_mm512_setzero_pd(), acc1=_mm512_setzero_pd();
+  double sparse=0;
+  for(size_t i=0;i<words;i++)
+  {
+    if(__builtin_popcountll(a[i]) <= SPARSE_WORD_AVX512){
+      sparse=sparse+weightWord(a[i], w+64*i);
+    }
+    else{
+      WEIGHT_WORD_AVX512(acc0, acc1, a[i], w+64*i);
+    }
+  }
+  return sparse+_mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+__attribute__((target("avx512f,popcnt"))) static double weightAndAvx512(const uint64_t *a, const uint64_t *b, const double *w, size_t words)
+{
+  __m512d acc0=_mm512_setzero_pd(), acc1=_mm512_setzero_pd();
+  double sparse=0;
+  for(size_t i=0;i<words;i++)
+  {
+    uint64_t x=a[i] & b[i];
+    if(__builtin_popcountll(x) <= SPARSE_WORD_AVX512){
+      sparse=sparse+weightWord(x, w+64*i);
+    }
+    else{
+      WEIGHT_WORD_AVX512(acc0, acc1, x, w+64*i);
+    }
+  }
+  return sparse+_mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+#endif
+
+static const struct BitsetOps bitsetImpls[]={
+  {"scalar", countScalar, countAndScalar, weightScalar, weightAndScalar},
+#if defined(__x86_64__)
+  {"avx2", countAvx2, countAndAvx2, weightAvx2, weightAndAvx2},
+  {"avx512", countAvx512, countAndAvx512, weightAvx512, weightAndAvx512},
+#endif
+};
+#define NUM_OF_BITSET_IMPLS ((int)(sizeof bitsetImpls/sizeof bitsetImpls[0]))
+
+static struct BitsetOps bitsetOps={"scalar", countScalar, countAndScalar, weightScalar, weightAndScalar};
+
+/* whether implementation i runs on this CPU */
+static int bitsetSupported(int i)
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if(strcmp(bitsetImpls[i].name,"avx2") == 0){
+    return __builtin_cpu_supports("avx2");
+  }
+  if(strcmp(bitsetImpls[i].name,"avx512") == 0){
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq");
+  }
+#endif
+  return 1;
+}
+
+/* picks the widest supported implementation, or the one asked for */
+void bitsetInit(void)
+{
+  const char *want=getenv("ASGRAPH_SIMD");
+
+  for(int i=0;i<NUM_OF_BITSET_IMPLS;i++)
+  {
+    if(bitsetSupported(i) && (want == NULL || strcmp(want, bitsetImpls[i].name) == 0)){
+      bitsetOps=bitsetImpls[i];
+    }
+  }
+  if(want != NULL && strcmp(want, bitsetOps.name) != 0){
+    fprintf(stderr,"ASGRAPH_SIMD=%s is not supported here, using %s\n",want,bitsetOps.name);
+  }
+}
+
+/* a zeroed bitset of n bits, or weights padded for it */
+uint64_t *bitsetAlloc(uint32_t n)
+{
+  uint64_t *a=aligned_alloc(64, BITSET_WORDS(n)*8);
+  if(a != NULL){
+    memset(a, 0, BITSET_WORDS(n)*8);
+  }
+  return a;
+}
+
+/**************************************************************************
+* Sender anonymity
+*
+* The experiments of computeShortestAllValleyfreeSenderAnonymityStoM.m
+* (and its NoBGB twin, with POLICY_SHORTEST) and of
+* computeshortestAllAnonymitySourceWtoD.m, run natively on a pool of
+* threads. Every experiment is a (source, destination, helper) triple,
+* either one of the stored triples or drawn at random like
+* useRandomNodes=1 does, and is independent of all others. Every worker
+* owns a range of experiments and takes them one at a time from its front;
+* a worker that runs dry steals the back half of the largest range left,
+* so that long experiments do not leave threads idle at the end.
+*
+* For StoM, Matlab checks every path of every source for the pair of ASes
+* the attacker sees. Here one pass over the shortest-path DAG towards M
+* answers it for all attacker positions of the experiment at once: every
+* DAG node carries a bit mask of the ASes of pathSM that lie on some path
+* from it to M, and a mask of the adjacent pairs of pathSM that lie on one
+* and the same path; the same masks along the first path only give the
+* "Single" variant. For WtoD, the sets are plain reachability from the
+* previous AS and need only the distances. Either way the sets end up as
+* bitsets: PHI's set is dPHI's intersected with the ASes at the distance
+* PHI reveals, and both sizes are a popcount or a weighted sum.
+**************************************************************************/
+
+#define ANON_MAX_PATH 32 /* ASes of pathSM, as bits of a mask */
+#define ANON_STOM 0
+#define ANON_WTOD 1
+#define ANON_TRIES 1000  /* random triples drawn for one experiment */
+#define ANON_NO_POS 0xff
+
+/* a PHI trace, as generateShortestValleyfreePHITrace.m returns it */
+struct PhiTrace {
+  uint32_t sm[ANON_MAX_PATH];
+  uint32_t wd[ANON_MAX_PATH];
+  uint32_t smLen;
+  uint32_t wdLen;
+  uint32_t wmLen;
+  uint32_t midwayAt; /* index of the midway node in sm */
+};
+
+/* the range of experiments a worker owns, begin in the low half */
+struct StealRange {
+  uint64_t range;
+} __attribute__((aligned(64)));
+
+struct AnonRun {
+  const struct AsGraph *g;
+  int analysis;             /* ANON_STOM or ANON_WTOD */
+  int policy;               /* POLICY_VALLEYFREE or POLICY_SHORTEST */
+  int startAtSecondNode;
+  int maxDist;              /* useMaxDist of the WtoD script */
+  const double *weights;    /* listIpsPerAS, NULL to count ASes */
+  const uint32_t *given[3]; /* stored source, destination, helper or NULL */
+  struct BfsCache *cache;   /* shared by all workers, or NULL */
+  uint64_t seed;
+  uint32_t experiments;
+  int workers;
+  struct StealRange *ranges;
+  // experiments x ANON_MAX_PATH, by row
+  double *phi, *dphi, *phiSingle, *dphiSingle, *edgeType;
+  uint8_t *positions;
+  uint8_t *failed;
+  uint64_t steals;
+};
+
+struct AnonWorker {
+  struct AnonRun *run;
+  int id;
+  pthread_t thread;
+  struct ValleyFreeBfs toM, toD;
+  uint32_t *mask[4][NUM_OF_STATES]; /* nodes, pairs, first nodes, first pairs */
+  uint8_t *posOf;
+  uint64_t *sets; /* PHI distance, then 2*ANON_MAX_PATH anonymity sets */
+};
+
+static uint64_t splitmix(uint64_t *state)
+{
+  uint64_t z=(*state+=0x9e3779b97f4a7c15ULL);
+  z=(z^(z >> 30))*0xbf58476d1ce4e5b9ULL;
+  z=(z^(z >> 27))*0x94d049bb133111ebULL;
+  return z^(z >> 31);
+}
+
+static int pathHas(const uint32_t *path, uint32_t len, uint32_t v)
+{
+  for(uint32_t i=0;i<len;i++)
+  {
+    if(path[i] == v){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**************************************************************************
+ The second half of a PHI trace, once t->sm is known and toD holds the
+ tree towards d: the path from M to d, then backtracking from M towards s
+ while the previous AS does not route to d over the current one. Returns
+ 0, or -1 if there is no trace.
+**************************************************************************/
+static int phiBacktrack(const struct ValleyFreeBfs *toD, struct PhiTrace *t)
+{
+  uint32_t prev[ANON_MAX_PATH], prevLen, at=t->smLen-1;
+
+  if((t->wdLen=bfsSinglePath(toD, t->sm[at], t->wd, ANON_MAX_PATH)) == 0){
+    return -1;
+  }
+  while(at > 0)
+  {
+    // as in Matlab, a previous AS without a path to d ends backtracking
+    prevLen=bfsSinglePath(toD, t->sm[at-1], prev, ANON_MAX_PATH);
+    if(prevLen == 0 || pathHas(prev, prevLen, t->sm[at])){
+      t->midwayAt=at;
+      t->wmLen=t->smLen-at-1;
+      return 0;
+    }
+    at--;
+    memcpy(t->wd, prev, prevLen*sizeof *prev);
+    t->wdLen=prevLen;
+  }
+  return -1;
+}
+
+/**************************************************************************
+ generateShortestValleyfreePHITrace.m (generateShortestNoBGBPHITrace.m for
+ POLICY_SHORTEST): the path s to M, then phiBacktrack. Leaves the tree
+ towards M in toM. Returns 0, or -1 if there is no trace.
+**************************************************************************/
+int phiTrace(const struct AsGraph *g, struct ValleyFreeBfs *toM, struct ValleyFreeBfs *toD, int policy, uint32_t s, uint32_t d, uint32_t m, struct PhiTrace *t)
+{
+  toM->policy=policy;
+  toM->ignore=NO_NODE;
+  toD->policy=policy;
+  toD->ignore=NO_NODE;
+  bfsCached(toM, g, m);
+  if((t->smLen=bfsSinglePath(toM, s, t->sm, ANON_MAX_PATH)) == 0){
+    return -1;
+  }
+  bfsCached(toD, g, d);
+  return phiBacktrack(toD, t);
+}
+
+/* the size of a, or of a & b: ASes counted or weighted by listIpsPerAS */
+static double anonSize(const struct AnonRun *run, const uint64_t *a, const uint64_t *b)
+{
+  size_t words=BITSET_WORDS(run->g->nodes);
+  if(run->weights != NULL){
+    return b != NULL ? bitsetOps.weightAnd(a, b, run->weights, words) : bitsetOps.weight(a, run->weights, words);
+  }
+  return b != NULL ? bitsetOps.countAnd(a, b, words) : bitsetOps.count(a, words);
+}
+
+/**************************************************************************
+ The masks of every DAG node towards M, in discovery order so that the
+ masks of all predecessors are final. Bit i of the node mask: sm[i] is on
+ a path from the node to M; bit i of the pair mask: sm[i-1] and sm[i] are
+ on one path.
+**************************************************************************/
+static void anonMasks(struct AnonWorker *w, const struct PhiTrace *t)
+{
+  const struct ValleyFreeBfs *b=&w->toM;
+  const struct AsGraph *g=w->run->g;
+  uint32_t *node[NUM_OF_STATES]={w->mask[0][0],w->mask[0][1]}, *pair[NUM_OF_STATES]={w->mask[1][0],w->mask[1][1]};
+  uint32_t *fNode[NUM_OF_STATES]={w->mask[2][0],w->mask[2][1]}, *fPair[NUM_OF_STATES]={w->mask[3][0],w->mask[3][1]};
+
+  for(uint32_t k=0;k<b->reached;k++)
+  {
+    uint32_t v=b->order[k] >> 1, pn=0, pp=0, fn=0, fp=0, i;
+    int s=b->order[k] & 1;
+    if(k > 0){
+      int rels[4], states[4], lists=bfsPredLists(b, s, rels, states);
+      uint16_t d=b->dist[s][v]-1;
+      uint32_t f=b->first[s][v];
+      for(int l=0;l<lists;l++)
+      {
+        const uint16_t *dist=b->dist[states[l]];
+        for(uint32_t j=g->off[rels[l]][v];j<g->off[rels[l]][v+1];j++)
+        {
+          uint32_t u=g->adj[rels[l]][j];
+          if(dist[u] == d){
+            pn=pn | node[states[l]][u];
+            pp=pp | pair[states[l]][u];
+          }
+        }
+      }
+      fn=fNode[f & 1][f >> 1];
+      fp=fPair[f & 1][f >> 1];
+    }
+    if((i=w->posOf[v]) != ANON_NO_POS){
+      pp=pp | (i > 0 ? ((pn >> (i-1)) & 1) << i : 0) | (i+1 < t->smLen ? ((pn >> (i+1)) & 1) << (i+1) : 0);
+      fp=fp | (i > 0 ? ((fn >> (i-1)) & 1) << i : 0) | (i+1 < t->smLen ? ((fn >> (i+1)) & 1) << (i+1) : 0);
+      pn=pn | 1U << i;
+      fn=fn | 1U << i;
+    }
+    node[s][v]=pn;
+    pair[s][v]=pp;
+    fNode[s][v]=fn;
+    fPair[s][v]=fp;
+  }
+}
+
+/**************************************************************************
+ One experiment of the StoM script: the anonymity sets of the attacker
+ positions on pathSM, starting at the second AS (or at the midway node).
+ Returns the number of positions.
+**************************************************************************/
+static uint32_t anonStoM(struct AnonWorker *w, const struct PhiTrace *t, uint32_t e)
+{
+  struct AnonRun *run=w->run;
+  const struct ValleyFreeBfs *b=&w->toM;
+  const struct AsGraph *g=run->g;
+  uint32_t firstBit=run->startAtSecondNode ? 1 : t->midwayAt, positions=t->smLen-firstBit;
+  uint32_t m=b->destination, wanted=0, selfBit=1U << (t->smLen-1);
+  double *phi=run->phi+(size_t)e*ANON_MAX_PATH, *dphi=run->dphi+(size_t)e*ANON_MAX_PATH;
+  double *phiS=run->phiSingle+(size_t)e*ANON_MAX_PATH, *dphiS=run->dphiSingle+(size_t)e*ANON_MAX_PATH;
+  uint32_t lastHop=t->smLen > 1 ? t->sm[t->smLen-2] : NO_NODE;
+  size_t words=BITSET_WORDS(g->nodes);
+  uint64_t *atLength=w->sets, *all=w->sets+words, *single=w->sets+(1+ANON_MAX_PATH)*words;
+
+  if(firstBit == 0){
+    return 0; // the midway node is the source, Matlab would index pathSM(0)
+  }
+  for(uint32_t i=0;i<t->smLen;i++)
+  {
+    w->posOf[t->sm[i]]=(uint8_t)i;
+  }
+  anonMasks(w, t);
+  for(uint32_t k=0;k<positions;k++)
+  {
+    wanted=wanted | 1U << (firstBit+k);
+    memset(all+k*words, 0, words*8);
+    memset(single+k*words, 0, words*8);
+  }
+  memset(atLength, 0, words*8);
+
+  // the sets of every position, and the ASes at PHI's known distance
+  for(uint32_t v=0;v<g->nodes;v++)
+  {
+    uint16_t c=b->dist[STATE_CTOP][v], p=b->dist[STATE_PTOC][v], d=c < p ? c : p;
+    uint32_t onAll, onSingle;
+    if(v == m){
+      // Matlab's tree of M holds M u M for every u that M is reached
+      // again from (see above): its providers, or all neighbours
+      int rels=run->policy == POLICY_SHORTEST ? NUM_OF_RELS : 1;
+      uint32_t firstU=NO_NODE, hasLast=0;
+      for(int r=0;r<rels;r++)
+      {
+        for(uint32_t j=g->off[r][m];j<g->off[r][m+1];j++)
+        {
+          firstU=firstU == NO_NODE ? g->adj[r][j] : firstU;
+          hasLast=hasLast || g->adj[r][j] == lastHop;
+        }
+      }
+      d=firstU == NO_NODE ? DIST_INF : 3;
+      onAll=hasLast ? selfBit : 0;
+      onSingle=firstU == lastHop ? selfBit : 0;
+    }
+    else if(d == DIST_INF){
+      continue;
+    }
+    else{
+      onAll=(c <= p ? w->mask[1][STATE_CTOP][v] : 0) | (p <= c ? w->mask[1][STATE_PTOC][v] : 0);
+      onSingle=p <= c ? w->mask[3][STATE_PTOC][v] : w->mask[3][STATE_CTOP][v];
+    }
+    if(d == t->smLen){
+      bitsetSet(atLength, v);
+    }
+    onAll=onAll & wanted;
+    onSingle=onSingle & wanted;
+    while(onAll)
+    {
+      bitsetSet(all+(__builtin_ctz(onAll)-firstBit)*words, v);
+      onAll=onAll & (onAll-1);
+    }
+    while(onSingle)
+    {
+      bitsetSet(single+(__builtin_ctz(onSingle)-firstBit)*words, v);
+      onSingle=onSingle & (onSingle-1);
+    }
+  }
+  // dPHI is the set, PHI the part of it at the distance of pathSM
+  for(uint32_t k=0;k<positions;k++)
+  {
+    dphi[k]=anonSize(run, all+k*words, NULL);
+    phi[k]=anonSize(run, all+k*words, atLength);
+    dphiS[k]=anonSize(run, single+k*words, NULL);
+    phiS[k]=anonSize(run, single+k*words, atLength);
+  }
+  for(uint32_t i=0;i<t->smLen;i++)
+  {
+    w->posOf[t->sm[i]]=ANON_NO_POS;
+  }
+  return positions;
+}
+
+static uint32_t countIn(const struct AsGraph *g, int r, uint32_t v, uint32_t x)
+{
+  uint32_t n=0;
+  for(uint32_t j=g->off[r][v];j<g->off[r][v+1];j++)
+  {
+    n=n+(g->adj[r][j] == x);
+  }
+  return n;
+}
+
+/**************************************************************************
+ One experiment of the WtoD script: for every AS A on pathWtoD after W, the
+ ASes that reach the previous AS without passing A, over any valley-free
+ path if A-1 is a provider of A and over customer-to-provider links only
+ otherwise. PHI only keeps those close enough to fit the PHI path length.
+**************************************************************************/
+static uint32_t anonWtoD(struct AnonWorker *w, const struct PhiTrace *t, uint32_t e)
+{
+  struct AnonRun *run=w->run;
+  const struct AsGraph *g=run->g;
+  struct ValleyFreeBfs *b=&w->toD;
+  double *phi=run->phi+(size_t)e*ANON_MAX_PATH, *dphi=run->dphi+(size_t)e*ANON_MAX_PATH;
+  double *edge=run->edgeType+(size_t)e*ANON_MAX_PATH;
+  uint32_t positions=0;
+  size_t words=BITSET_WORDS(g->nodes);
+  uint64_t *reach=w->sets, *upTo=w->sets+words, *tooClose=w->sets+2*words;
+
+  for(uint32_t at=t->wdLen-1;at >= 1;at--,positions++)
+  {
+    uint32_t cur=t->wd[at], prev=t->wd[at-1];
+    uint32_t phiLen=t->smLen-t->wmLen-1+at+1;
+    uint32_t isCtoP=countIn(g, REL_PROVIDERS, prev, cur), isPtoC=countIn(g, REL_PROVIDERS, cur, prev), isPtoP=countIn(g, REL_PEERS, cur, prev);
+    edge[positions]=isCtoP+2*isPtoC+3*isPtoP;
+    b->policy=isPtoC ? POLICY_VALLEYFREE : POLICY_CTOP_ONLY;
+    b->ignore=cur;
+    bfsCached(b, g, prev);
+    memset(w->sets, 0, 3*words*8);
+    for(uint32_t k=0;k<b->reached;k++)
+    {
+      uint32_t v=b->order[k] >> 1;
+      uint16_t d=bfsDistance(b, v);
+      if((b->order[k] & 1) == STATE_PTOC && b->dist[STATE_CTOP][v] != DIST_INF){
+        continue; // counted with its STATE_CTOP entry
+      }
+      if(v == prev){
+        // Matlab only reaches A-1 again over a provider other than A
+        d=DIST_INF;
+        if(b->policy == POLICY_VALLEYFREE && g->off[REL_PROVIDERS][v+1]-g->off[REL_PROVIDERS][v] > countIn(g, REL_PROVIDERS, v, cur)){
+          d=3;
+        }
+        if(d == DIST_INF){
+          continue;
+        }
+      }
+      bitsetSet(reach, v);
+      if(d <= phiLen-1){
+        bitsetSet(upTo, v);
+      }
+      if(run->maxDist > 0 && d <= (int)phiLen-1-run->maxDist){
+        bitsetSet(tooClose, v);
+      }
+    }
+    // PHI: reachable within the PHI path length, but not too close
+    bitsetAndNot(upTo, upTo, tooClose, words);
+    dphi[positions]=anonSize(run, reach, NULL);
+    phi[positions]=anonSize(run, upTo, NULL);
+  }
+  b->ignore=NO_NODE;
+  return positions;
+}
+
+/* one experiment, by index; a random one is drawn from its own seed */
+static void anonExperiment(struct AnonWorker *w, uint32_t e)
+{
+  struct AnonRun *run=w->run;
+  struct PhiTrace t;
+  uint32_t s, d, m, positions=0;
+  uint64_t rng=run->seed^((uint64_t)e*0xd1b54a32d192ed03ULL);
+  int ok=-1;
+
+  if(run->given[0] != NULL){
+    s=run->given[0][e];
+    d=run->given[1][e];
+    m=run->given[2][e];
+    ok=phiTrace(run->g, &w->toM, &w->toD, run->policy, s, d, m, &t);
+  }
+  for(int i=0;run->given[0] == NULL && i < ANON_TRIES && ok != 0;i++)
+  {
+    s=asAt(run->g, (uint32_t)(splitmix(&rng)%run->g->nodes));
+    d=asAt(run->g, (uint32_t)(splitmix(&rng)%run->g->nodes));
+    m=asAt(run->g, (uint32_t)(splitmix(&rng)%run->g->nodes));
+    ok=phiTrace(run->g, &w->toM, &w->toD, run->policy, s, d, m, &t);
+  }
+  if(ok == 0){
+    positions=run->analysis == ANON_STOM ? anonStoM(w, &t, e) : anonWtoD(w, &t, e);
+  }
+  run->positions[e]=(uint8_t)positions;
+  run->failed[e]=ok != 0;
+}
+
+/**************************************************************************
+ Takes the next experiment of worker id, stealing the back half of the
+ largest range left once its own is done. Returns -1 when all are taken.
+**************************************************************************/
+static int64_t anonNext(struct AnonRun *run, int id)
+{
+  struct StealRange *own=&run->ranges[id];
+
+  for(;;)
+  {
+    uint64_t r=__atomic_load_n(&own->range, __ATOMIC_ACQUIRE);
+    uint32_t begin=(uint32_t)r, end=(uint32_t)(r >> 32);
+    int victim=-1;
+    uint32_t most=0;
+    if(begin < end){
+      if(__atomic_compare_exchange_n(&own->range, &r, (uint64_t)end << 32 | (begin+1), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        return begin;
+      }
+      continue;
+    }
+    for(int i=0;i<run->workers;i++)
+    {
+      uint64_t x=__atomic_load_n(&run->ranges[i].range, __ATOMIC_RELAXED);
+      uint32_t left=(uint32_t)(x >> 32)-(uint32_t)x;
+      if(i != id && (uint32_t)x < (uint32_t)(x >> 32) && left > most){
+        most=left;
+        victim=i;
+      }
+    }
+    if(victim < 0){
+      return -1;
+    }
+    r=__atomic_load_n(&run->ranges[victim].range, __ATOMIC_ACQUIRE);
+    begin=(uint32_t)r;
+    end=(uint32_t)(r >> 32);
+    if(begin < end){
+      uint32_t mid=begin+(end-begin)/2;
+      if(__atomic_compare_exchange_n(&run->ranges[victim].range, &r, (uint64_t)mid << 32 | begin, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        // only this worker adds to its own, empty range
+        __atomic_store_n(&own->range, (uint64_t)end << 32 | mid, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&run->steals, 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+static void *anonWorker(void *arg)
+{
+  struct AnonWorker *w=arg;
+  int64_t e;
+
+  while((e=anonNext(w->run, w->id)) >= 0)
+  {
+    anonExperiment(w, (uint32_t)e);
+  }
+  return NULL;
+}
+
+/**************************************************************************
+ Runs all experiments of run on run->workers threads; the results are in
+ the per-experiment rows of run. Returns -1 if memory runs out.
+**************************************************************************/
+int anonRun(struct AnonRun *run)
+{
+  struct AnonWorker *w=calloc(run->workers, sizeof *w);
+  size_t cells=(size_t)run->experiments*ANON_MAX_PATH;
+  int ok=w != NULL, started=0;
+
+  run->ranges=aligned_alloc(64, run->workers*sizeof *run->ranges);
+  run->phi=calloc(cells, sizeof(double));
+  run->dphi=calloc(cells, sizeof(double));
+  run->phiSingle=calloc(cells, sizeof(double));
+  run->dphiSingle=calloc(cells, sizeof(double));
+  run->edgeType=calloc(cells, sizeof(double));
+  run->positions=calloc(run->experiments, 1);
+  run->failed=calloc(run->experiments, 1);
+  ok=ok && run->ranges != NULL && run->phi != NULL && run->dphi != NULL && run->phiSingle != NULL;
+  ok=ok && run->dphiSingle != NULL && run->edgeType != NULL && run->positions != NULL && run->failed != NULL;
+  for(int i=0;ok && i<run->workers;i++)
+  {
+    uint64_t begin=(uint64_t)run->experiments*i/run->workers, end=(uint64_t)run->experiments*(i+1)/run->workers;
+    run->ranges[i].range=end << 32 | begin;
+    w[i].run=run;
+    w[i].id=i;
+    ok=bfsCreate(&w[i].toM, run->g) == 0 && bfsCreate(&w[i].toD, run->g) == 0;
+    w[i].toM.cache=run->cache;
+    w[i].toD.cache=run->cache;
+    ok=ok && (w[i].posOf=malloc(run->g->nodes)) != NULL;
+    ok=ok && (w[i].sets=aligned_alloc(64, (1+2*ANON_MAX_PATH)*BITSET_WORDS(run->g->nodes)*8)) != NULL;
+    for(int k=0;ok && k<4;k++)
+    {
+      for(int s=0;ok && s<NUM_OF_STATES;s++)
+      {
+        ok=(w[i].mask[k][s]=malloc(run->g->nodes*sizeof(uint32_t))) != NULL;
+      }
+    }
+    if(ok){
+      memset(w[i].posOf, ANON_NO_POS, run->g->nodes);
+    }
+  }
+  for(int i=0;ok && i<run->workers && started == i;i++)
+  {
+    started=started+(pthread_create(&w[i].thread, NULL, anonWorker, &w[i]) == 0);
+  }
+  if(ok && started < run->workers){
+    // the ranges of the others stay in the victim scan and are stolen by the threads that did start
+    fprintf(stderr, "Only %d of %d workers could be started\n", started, run->workers);
+    ok=started > 0;
+  }
+  for(int i=0;i<started;i++)
+  {
+    pthread_join(w[i].thread, NULL);
+  }
+  for(int i=0;w != NULL && i<run->workers;i++)
+  {
+    bfsFree(&w[i].toM);
+    bfsFree(&w[i].toD);
+    free(w[i].posOf);
+    free(w[i].sets);
+    for(int k=0;k<4;k++)
+    {
+      for(int s=0;s<NUM_OF_STATES;s++)
+      {
+        free(w[i].mask[k][s]);
+      }
+    }
+  }
+  free(w);
+  return ok ? 0 : -1;
+}
+
+/* frees the results of anonRun */
+void anonRunFree(struct AnonRun *run)
+{
+  free(run->ranges);
+  free(run->phi);
+  free(run->dphi);
+  free(run->phiSingle);
+  free(run->dphiSingle);
+  free(run->edgeType);
+  free(run->positions);
+  free(run->failed);
+}
+
+/* rows experiments x cols of a per-experiment result, as a Matlab matrix */
+static struct MatArray anonMatrix(const char *name, const struct AnonRun *run, const double *rows, uint32_t cols)
+{
+  struct MatArray a;
+
+  snprintf(a.name, sizeof a.name, "%s", name);
+  a.rows=run->experiments;
+  a.cols=cols;
+  a.data=calloc((size_t)a.rows*cols+1, sizeof(double));
+  for(uint32_t e=0;a.data != NULL && e<a.rows;e++)
+  {
+    for(uint32_t k=0;k<cols && k<ANON_MAX_PATH;k++)
+    {
+      a.data[(size_t)k*a.rows+e]=rows[(size_t)e*ANON_MAX_PATH+k];
+    }
+  }
+  return a;
+}
+
+/**************************************************************************
+ The comparison columns: PHI in percent of dPHI for StoM, and for WtoD
+ what Matlab's anonymitySetsizeDPHI/anonymitySetsizePHI actually computes
+ for two row vectors, the least squares factor dot(D,P)/dot(P,P), in
+ every column of the experiment. Positions past the end stay 0.
+**************************************************************************/
+static void anonCompare(const struct AnonRun *run, const double *phi, const double *dphi, double *out)
+{
+  for(uint32_t e=0;e<run->experiments;e++)
+  {
+    size_t at=(size_t)e*ANON_MAX_PATH;
+    double dp=0, pp=0;
+    for(uint32_t k=0;k<run->positions[e];k++)
+    {
+      out[at+k]=phi[at+k]/dphi[at+k]*100;
+      dp=dp+dphi[at+k]*phi[at+k];
+      pp=pp+phi[at+k]*phi[at+k];
+    }
+    for(uint32_t k=0;run->analysis == ANON_WTOD && k<run->positions[e];k++)
+    {
+      out[at+k]=dp/pp;
+    }
+  }
+}
+
+/* loads a Matlab index vector (1-based) as dense indices */
+static uint32_t *loadIndices(const char *path, const char *name, const struct AsGraph *g, uint32_t *n)
+{
+  struct MatArray a;
+  uint32_t *out;
+
+  if(matRead(path, name, &a) != 0){
+    return NULL;
+  }
+  *n=a.rows*a.cols;
+  out=malloc((*n+1)*sizeof *out);
+  for(uint32_t i=0;out != NULL && i<*n;i++)
+  {
+    if(a.data[i] < 1 || a.data[i] > g->nodes){
+      fprintf(stderr,"%s: %s(%u)=%g is not an AS of the graph\n",path,name,i+1,a.data[i]);
+      free(out);
+      out=NULL;
+      break;
+    }
+    out[i]=asAt(g, (uint32_t)a.data[i]-1);
+  }
+  free(a.data);
+  return out;
+}
+
+/* the counts of "asgraph ipspace", or listIpsPerAS from a .mat file after
+   checking its listOfNodes is g's */
+static double *loadWeights(const char *path, const struct AsGraph *g)
+{
+  struct MatArray nodes, ips;
+  double *padded;
+  int r;
+
+  // the counts of "asgraph ipspace", padded as below
+  if((padded=aligned_alloc(64, BITSET_WORDS(g->nodes)*64*sizeof(double))) == NULL){
+    return NULL;
+  }
+  memset(padded, 0, BITSET_WORDS(g->nodes)*64*sizeof(double));
+  if((r=readIps(g, path, padded)) <= 0){
+    if(r < 0){
+      free(padded);
+      return NULL;
+    }
+    return padded;
+  }
+  free(padded);
+  if(matRead(path, "listIpsPerAS", &ips) != 0){
+    return NULL;
+  }
+  if(ips.rows*ips.cols != g->nodes){
+    fprintf(stderr,"%s: listIpsPerAS has %u entries, the graph %u ASes\n",path,ips.rows*ips.cols,g->nodes);
+    free(ips.data);
+    return NULL;
+  }
+  if(matRead(path, "listOfNodes", &nodes) == 0){
+    for(uint32_t i=0;i<g->nodes;i++)
+    {
+      if(nodes.rows*nodes.cols != g->nodes || nodes.data[i] != g->asn[asAt(g, i)]){
+        fprintf(stderr,"%s: listOfNodes differs from the graph\n",path);
+        free(nodes.data);
+        free(ips.data);
+        return NULL;
+      }
+    }
+    free(nodes.data);
+  }
+  // padded with zeros for the bitset reductions
+  if((padded=aligned_alloc(64, BITSET_WORDS(g->nodes)*64*sizeof(double))) != NULL){
+    memset(padded, 0, BITSET_WORDS(g->nodes)*64*sizeof(double));
+    for(uint32_t i=0;i<g->nodes;i++)
+    {
+      padded[asAt(g, i)]=ips.data[i];
+    }
+  }
+  free(ips.data);
+  return padded;
+}
+
+/**************************************************************************
+ Entry point of "asgraph anonymity <graph> <stom|wtod> [options]", see
+ usage and the README.
+**************************************************************************/
+int anonymityMode(int argc, char **argv)
+{
+  struct AsGraph g;
+  struct AnonRun run;
+  const char *experiments=NULL, *ips=NULL, *out=NULL;
+  char name[256];
+  uint32_t *given[3]={NULL,NULL,NULL}, widest=0, failed=0, n;
+  uint64_t t;
+  int opt, ret=1, counted=0;
+
+  memset(&run, 0, sizeof run);
+  run.experiments=1000;
+  run.seed=1;
+  run.startAtSecondNode=1;
+  run.workers=(int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(argc < 2 || (strcmp(argv[1],"stom") != 0 && strcmp(argv[1],"wtod") != 0)){
+    fprintf(stderr,"usage: asgraph anonymity <graph> <stom|wtod> [-e experiments.mat | -n count -s seed] [-i ips.mat] [-t threads] [-o out.mat] [-b] [-w] [-m maxDist]\n");
+    return 1;
+  }
+  run.analysis=strcmp(argv[1],"stom") == 0 ? ANON_STOM : ANON_WTOD;
+  optind=2;
+  while((opt=getopt(argc, argv, "e:n:s:i:t:o:bwm:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'e': experiments=optarg; break;
+      case 'n': run.experiments=(uint32_t)strtoul(optarg, NULL, 10); counted=1; break;
+      case 's': run.seed=strtoull(optarg, NULL, 10); break;
+      case 'i': ips=optarg; break;
+      case 't': run.workers=atoi(optarg); break;
+      case 'o': out=optarg; break;
+      case 'b': run.policy=POLICY_SHORTEST; break;
+      case 'w': run.startAtSecondNode=0; break;
+      case 'm': run.maxDist=atoi(optarg); break;
+      default: return 1;
+    }
+  }
+  if(run.workers < 1){
+    run.workers=1;
+  }
+  if(run.policy == POLICY_SHORTEST && run.analysis != ANON_STOM){
+    fprintf(stderr,"-b (no valley-freeness) is only defined for stom\n");
+    return 1;
+  }
+  if(openGraph(&g, argv[0], 1) != 0){
+    return 1;
+  }
+  run.g=&g;
+  run.cache=bfsCacheOpen(&g, 1);
+  bitsetInit();
+  if(ips != NULL && (run.weights=loadWeights(ips, &g)) == NULL){
+    goto done;
+  }
+  if(experiments != NULL){
+    static const char *names[3]={"sourceArray","destinationArray","helperNodeArray"};
+    for(int i=0;i<3;i++)
+    {
+      if((given[i]=loadIndices(experiments, names[i], &g, &n)) == NULL){
+        goto done;
+      }
+      // -n takes the first experiments of the file, like numOfExperiments
+      run.experiments=(i == 0 && !counted) || n < run.experiments ? n : run.experiments;
+      run.given[i]=given[i];
+    }
+  }
+  if(run.experiments == 0 || g.nodes == 0){
+    fprintf(stderr,"no experiments\n");
+    goto done;
+  }
+
+  t=nowNs();
+  if(anonRun(&run) != 0){
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  t=nowNs()-t;
+  for(uint32_t e=0;e<run.experiments;e++)
+  {
+    widest=run.positions[e] > widest ? run.positions[e] : widest;
+    failed=failed+run.failed[e];
+  }
+  printf("Experiments:\t %u (%u without a PHI trace), %s bitsets\n",run.experiments,failed,bitsetOps.name);
+  printf("Time:\t\t %.2f s on %d threads, %.1f experiments/s, %llu steals\n",t/1e9,run.workers,run.experiments/(t/1e9),(unsigned long long)run.steals);
+  bfsCacheReport(run.cache);
+
+  if(out == NULL){
+    snprintf(name, sizeof name, "sourceAnonymity%s%s%u%s.mat",run.analysis == ANON_STOM ? "StoM" : "WtoD",run.policy == POLICY_SHORTEST ? "NoBGB" : "",run.experiments,run.weights != NULL ? "IP" : "NoIP");
+    out=name;
+  }
+  if(run.analysis == ANON_STOM){
+    double *cmp=calloc((size_t)run.experiments*ANON_MAX_PATH, sizeof(double));
+    double *cmpSingle=calloc((size_t)run.experiments*ANON_MAX_PATH, sizeof(double));
+    uint32_t cols=widest > 2 ? widest : 2;
+    struct MatArray a[6];
+    if(cmp == NULL || cmpSingle == NULL){
+      fprintf(stderr,"out of memory\n");
+      goto done;
+    }
+    anonCompare(&run, run.phi, run.dphi, cmp);
+    anonCompare(&run, run.phiSingle, run.dphiSingle, cmpSingle);
+    // widths as the Matlab script leaves them: zeros(n,2) grown as needed
+    a[0]=anonMatrix("anonymitySetsizePHIAll", &run, run.phi, cols);
+    a[1]=anonMatrix("anonymitySetsizeDPHIAll", &run, run.dphi, cols);
+    a[2]=anonMatrix("anonymityComparisonAll", &run, cmp, widest);
+    a[3]=anonMatrix("anonymitySetsizePHIAllSingle", &run, run.phiSingle, cols);
+    a[4]=anonMatrix("anonymitySetsizeDPHIAllSingle", &run, run.dphiSingle, cols);
+    a[5]=anonMatrix("anonymityComparisonAllSingle", &run, cmpSingle, widest);
+    ret=matWrite(out, a, 6) == 0 ? 0 : 1;
+    for(int i=0;i<6;i++)
+    {
+      free(a[i].data);
+    }
+    free(cmp);
+    free(cmpSingle);
+  }
+  else{
+    double *cmp=calloc((size_t)run.experiments*ANON_MAX_PATH, sizeof(double));
+    struct MatArray a[4];
+    if(cmp == NULL){
+      fprintf(stderr,"out of memory\n");
+      goto done;
+    }
+    anonCompare(&run, run.phi, run.dphi, cmp);
+    a[0]=anonMatrix("anonymitySetsizePHIAll", &run, run.phi, widest);
+    a[1]=anonMatrix("anonymitySetsizeDPHIAll", &run, run.dphi, widest);
+    a[2]=anonMatrix("anonymitySetsizeComparisonAll", &run, cmp, widest);
+    a[3]=anonMatrix("edgetypeArrayAll", &run, run.edgeType, widest > 5 ? widest : 5);
+    ret=matWrite(out, a, 4) == 0 ? 0 : 1;
+    for(int i=0;i<4;i++)
+    {
+      free(a[i].data);
+    }
+    free(cmp);
+  }
+  if(ret == 0){
+    printf("Saved:\t\t %s\n",out);
+  }
+
+done:
+  for(int i=0;i<3;i++)
+  {
+    free(given[i]);
+  }
+  free((void *)run.weights);
+  anonRunFree(&run);
+  bfsCacheClose(run.cache);
+  freeGraph(&g);
+  return ret;
+}
+
+/**************************************************************************
+ Entry point of "asgraph orderbench <graph> [destinations [experiments]]".
+ Renumbers the graph in every order of reorderGraph and times, on one
+ thread, the BFS towards the same destinations (1000 random ones by
+ default) and the same random StoM experiments (200) in every order. The
+ orders take turns three times and the best round counts, so that they
+ all see the same machine. Both are checked against the ascending order.
+**************************************************************************/
+int orderBenchMode(int argc, char **argv)
+{
+  struct AsGraph g[1+NUM_OF_ORDERS];
+  struct ValleyFreeBfs b[1+NUM_OF_ORDERS];
+  struct AnonRun run[1+NUM_OF_ORDERS];
+  uint64_t bfsNs[1+NUM_OF_ORDERS], anonNs[1+NUM_OF_ORDERS];
+  uint32_t *dst=NULL, experiments=200;
+  uint32_t *reached=NULL;
+  int64_t n;
+  int ok=1, differ=0;
+
+  if(argc < 1){
+    fprintf(stderr,"usage: asgraph orderbench <graph> [destinations [experiments]]\n");
+    return 1;
+  }
+  if(argc > 2){
+    experiments=(uint32_t)strtoul(argv[2], NULL, 10);
+  }
+  memset(g, 0, sizeof g);
+  memset(b, 0, sizeof b);
+  memset(run, 0, sizeof run);
+  if(openGraph(&g[0], argv[0], 1) != 0){
+    return 1;
+  }
+  for(int o=0;ok && o<NUM_OF_ORDERS;o++)
+  {
+    ok=reorderGraph(&g[0], o, &g[1+o]) == 0;
+  }
+  // destinations in the order of listOfNodes, the same ASes in every order
+  n=ok && g[0].nodes > 0 ? pickDestinations(&g[0], argc > 1 ? argv[1] : NULL, 1000, &dst) : -1;
+  for(int64_t i=0;i<n;i++)
+  {
+    dst[i]=asRank(&g[0], dst[i]);
+  }
+  ok=ok && n > 0 && (reached=calloc(n, sizeof *reached)) != NULL;
+  for(int o=0;ok && o<=NUM_OF_ORDERS;o++)
+  {
+    ok=bfsCreate(&b[o], &g[o]) == 0;
+    bfsNs[o]=UINT64_MAX;
+    anonNs[o]=UINT64_MAX;
+    run[o].g=&g[o];
+    run[o].analysis=ANON_STOM;
+    run[o].startAtSecondNode=1;
+    run[o].seed=1;
+    run[o].experiments=experiments;
+    run[o].workers=1;
+  }
+
+  for(int round=0;ok && round<3;round++)
+  {
+    for(int o=0;ok && o<=NUM_OF_ORDERS;o++)
+    {
+      uint64_t t=nowNs();
+      for(int64_t i=0;i<n;i++)
+      {
+        bfsRun(&b[o], &g[o], asAt(&g[o], dst[i]));
+        if(round == 0 && o == 0){
+          reached[i]=b[o].reached;
+        }
+        else if(round == 0){
+          differ=differ+(reached[i] != b[o].reached);
+        }
+      }
+      t=nowNs()-t;
+      bfsNs[o]=t < bfsNs[o] ? t : bfsNs[o];
+
+      anonRunFree(&run[o]);
+      t=nowNs();
+      ok=anonRun(&run[o]) == 0;
+      t=nowNs()-t;
+      anonNs[o]=t < anonNs[o] ? t : anonNs[o];
+    }
+  }
+  for(int o=1;ok && o<=NUM_OF_ORDERS;o++)
+  {
+    size_t cells=(size_t)experiments*ANON_MAX_PATH;
+    differ=differ+(memcmp(run[o].phi, run[0].phi, cells*sizeof(double)) != 0 || memcmp(run[o].dphi, run[0].dphi, cells*sizeof(double)) != 0);
+  }
+
+  if(ok){
+    printf("Order\t\tgap\twithin 32\tBFS ms\tspeed-up\tStoM ms\tspeed-up\n");
+  }
+  for(int o=0;ok && o<=NUM_OF_ORDERS;o++)
+  {
+    double mean, near;
+    orderGap(&g[o], &mean, &near);
+    printf("%-9s\t%.0f\t%.1f%%\t\t%.3f\t%.2f\t\t%.2f\t%.2f\n",o == 0 ? "ascending" : orderNames[o-1],mean,near,bfsNs[o]/1e6/n,(double)bfsNs[0]/bfsNs[o],anonNs[o]/1e6/experiments,(double)anonNs[0]/anonNs[o]);
+  }
+  if(ok){
+    printf("Destinations:\t %lld, %u StoM experiments, best of 3 rounds\n",(long long)n,experiments);
+    printf("Differing:\t %d\n",differ);
+  }
+  else{
+    fprintf(stderr,"out of memory\n");
+  }
+  for(int o=0;o<=NUM_OF_ORDERS;o++)
+  {
+    anonRunFree(&run[o]);
+    bfsFree(&b[o]);
+    freeGraph(&g[o]);
+  }
+  free(reached);
+  free(dst);
+  return ok && differ == 0 ? 0 : 1;
+}
+
+/**************************************************************************
+* PHI traces
+*
+* generateSourceDestinationList.m draws (s, d, M) triples and keeps those
+* with a PHI trace, a valley-free path from s to d (for LAP) and, with IP
+* weights, address space at s and at d. Here the same runs for millions
+* of triples. Candidate k is drawn from its own seed like a random
+* experiment of anonRun, and the traces kept are the first feasible
+* candidates in order, so a seed gives the same traces on any number of
+* threads. Candidates are judged in batches: those without addresses are
+* dropped before any search; the others are grouped by M, so that one
+* search towards M gives pathSM for all of a group, and then by d, where
+* one search finishes the trace of all of a group. A batch thus needs at
+* most two searches per AS, however many candidates it holds.
+*
+* The traces go to a binary file: a TraceHeader, then for every trace a
+* TraceRecord followed by pathSM and pathWtoD as AS indices of the graph.
+* The midway node W is pathSM(midwayAt+1), which is also pathWtoD(1), and
+* pathWtoM is the rest of pathSM after W. dphi.c reads the same format.
+**************************************************************************/
+#define TRACE_MAGIC 0x3143525453414124ULL /* "$ASTRC1" */
+#define TRACE_BATCH (1 << 18)
+
+#define TRACE_DRAWN 0
+#define TRACE_HAS_SM 1
+#define TRACE_OK 2
+#define TRACE_NO_IPS 3
+#define TRACE_NO_SM 4
+#define TRACE_NO_LAP 5
+#define TRACE_NO_MIDWAY 6
+#define NUM_OF_TRACE_STATES 7
+
+struct TraceHeader {
+  uint64_t magic;
+  uint64_t nodes;
+  uint64_t digest;  /* graphDigest of the graph the indices belong to */
+  uint64_t traces;
+  uint64_t seed;
+  uint64_t policy;
+};
+
+struct TraceRecord {
+  uint32_t source;
+  uint32_t destination;
+  uint32_t helper;
+  uint8_t smLen;
+  uint8_t wdLen;
+  uint8_t midwayAt; /* index of W in pathSM */
+  uint8_t reserved;
+};
+
+struct TraceRun {
+  const struct AsGraph *g;
+  int policy;
+  const double *weights;  /* listIpsPerAS, NULL to keep ASes without */
+  uint64_t seed;
+  uint32_t candidates;    /* in the current batch */
+  uint32_t *s, *d, *m;
+  struct PhiTrace *t;
+  uint8_t *state;         /* TRACE_* of every candidate */
+  uint32_t *byRoot;       /* candidates grouped by M or by d */
+  uint32_t *groupAt;      /* groups+1 offsets into byRoot */
+  uint32_t *count;        /* nodes+1, for grouping */
+  uint32_t groups;
+  uint32_t nextGroup;
+  int phase;              /* TRACE_DRAWN: paths to M, TRACE_HAS_SM: to d */
+  uint64_t searches;
+};
+
+struct TraceWorker {
+  struct TraceRun *run;
+  pthread_t thread;
+  struct ValleyFreeBfs b;
+};
+
+/**************************************************************************
+ Groups the candidates in state want by root (M or d): a counting sort,
+ so a group keeps its candidates in order.
+**************************************************************************/
+static void traceGroup(struct TraceRun *run, const uint32_t *root, uint8_t want)
+{
+  uint32_t *count=run->count, at=0;
+
+  memset(count, 0, (run->g->nodes+1)*sizeof *count);
+  for(uint32_t c=0;c<run->candidates;c++)
+  {
+    count[root[c]]=count[root[c]]+(run->state[c] == want);
+  }
+  run->groups=0;
+  for(uint32_t v=0;v<run->g->nodes;v++)
+  {
+    uint32_t n=count[v];
+    if(n > 0){
+      run->groupAt[run->groups++]=at;
+    }
+    count[v]=at;
+    at=at+n;
+  }
+  run->groupAt[run->groups]=at;
+  for(uint32_t c=0;c<run->candidates;c++)
+  {
+    if(run->state[c] == want){
+      run->byRoot[count[root[c]]++]=c;
+    }
+  }
+  run->nextGroup=0;
+}
+
+/* takes groups until none is left: one search per group */
+static void *traceWorker(void *arg)
+{
+  struct TraceWorker *w=arg;
+  struct TraceRun *run=w->run;
+  uint32_t k;
+
+  while((k=__atomic_fetch_add(&run->nextGroup, 1, __ATOMIC_RELAXED)) < run->groups)
+  {
+    uint32_t first=run->byRoot[run->groupAt[k]];
+    int toM=run->phase == TRACE_DRAWN;
+    bfsCached(&w->b, run->g, toM ? run->m[first] : run->d[first]);
+    __atomic_fetch_add(&run->searches, 1, __ATOMIC_RELAXED);
+    for(uint32_t i=run->groupAt[k];i<run->groupAt[k+1];i++)
+    {
+      uint32_t c=run->byRoot[i];
+      struct PhiTrace *t=&run->t[c];
+      if(toM){
+        t->smLen=bfsSinglePath(&w->b, run->s[c], t->sm, ANON_MAX_PATH);
+        run->state[c]=t->smLen > 0 ? TRACE_HAS_SM : TRACE_NO_SM;
+      }
+      else if(bfsDistance(&w->b, run->s[c]) == DIST_INF){
+        run->state[c]=TRACE_NO_LAP;
+      }
+      else{
+        run->state[c]=phiBacktrack(&w->b, t) == 0 ? TRACE_OK : TRACE_NO_MIDWAY;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* one phase of a batch on all workers, the first on this thread */
+static void tracePhase(struct TraceRun *run, struct TraceWorker *w, int workers, int phase)
+{
+  int started;
+
+  run->phase=phase;
+  traceGroup(run, phase == TRACE_DRAWN ? run->m : run->d, (uint8_t)phase);
+  for(started=1;started<workers;started++)
+  {
+    if(pthread_create(&w[started].thread, NULL, traceWorker, &w[started]) != 0){
+      break;
+    }
+  }
+  traceWorker(&w[0]);
+  for(int i=1;i<started;i++)
+  {
+    pthread_join(w[i].thread, NULL);
+  }
+}
+
+/**************************************************************************
+ Entry point of "asgraph traces <graph> [-n traces] [-s seed] [-t threads]
+ [-b] [-i ips] [-o out.trace] [-m out.mat]", see usage and the README.
+**************************************************************************/
+int traceMode(int argc, char **argv)
+{
+  struct AsGraph g;
+  struct TraceRun run;
+  struct TraceWorker *w=NULL;
+  struct TraceHeader h;
+  const char *ips=NULL, *out=NULL, *mat=NULL;
+  char name[256];
+  FILE *f=NULL;
+  uint64_t wanted=1000, kept=0, next=0, drawn=0, t=nowNs(), rejected[NUM_OF_TRACE_STATES];
+  uint64_t smHops=0, wdHops=0, wmHops=0;
+  uint32_t batch=TRACE_BATCH, *keptAt[3]={NULL,NULL,NULL}, smMax=0;
+  double secs;
+  int opt, workers=(int)sysconf(_SC_NPROCESSORS_ONLN), ret=1, ok=1;
+
+  memset(&run, 0, sizeof run);
+  memset(rejected, 0, sizeof rejected);
+  run.seed=1;
+  if(argc < 1){
+    fprintf(stderr,"usage: asgraph traces <graph> [-n traces] [-s seed] [-t threads] [-b] [-i ips] [-o out.trace] [-m out.mat]\n");
+    return 1;
+  }
+  optind=1;
+  while((opt=getopt(argc, argv, "n:s:t:bi:o:m:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n': wanted=strtoull(optarg, NULL, 10); break;
+      case 's': run.seed=strtoull(optarg, NULL, 10); break;
+      case 't': workers=atoi(optarg); break;
+      case 'b': run.policy=POLICY_SHORTEST; break;
+      case 'i': ips=optarg; break;
+      case 'o': out=optarg; break;
+      case 'm': mat=optarg; break;
+      default: return 1;
+    }
+  }
+  workers=workers > 0 ? workers : 1;
+  if(openGraph(&g, argv[0], 1) != 0){
+    return 1;
+  }
+  run.g=&g;
+  if(g.nodes == 0 || wanted == 0){
+    fprintf(stderr,"no traces to generate\n");
+    goto done;
+  }
+  if(ips != NULL && (run.weights=loadWeights(ips, &g)) == NULL){
+    goto done;
+  }
+  if(out == NULL){
+    snprintf(name, sizeof name, "phiTraces%s%llu.trace",run.policy == POLICY_SHORTEST ? "NoBGB" : "",(unsigned long long)wanted);
+    out=name;
+  }
+  batch=wanted+wanted/4+64 < batch ? (uint32_t)(wanted+wanted/4+64) : batch;
+  run.s=malloc(batch*sizeof *run.s);
+  run.d=malloc(batch*sizeof *run.d);
+  run.m=malloc(batch*sizeof *run.m);
+  run.t=malloc(batch*sizeof *run.t);
+  run.state=malloc(batch);
+  run.byRoot=malloc(batch*sizeof *run.byRoot);
+  run.groupAt=malloc(((size_t)batch+1)*sizeof *run.groupAt);
+  run.count=malloc(((size_t)g.nodes+1)*sizeof *run.count);
+  ok=run.s != NULL && run.d != NULL && run.m != NULL && run.t != NULL && run.state != NULL;
+  ok=ok && run.byRoot != NULL && run.groupAt != NULL && run.count != NULL;
+  for(int i=0;ok && mat != NULL && i<3;i++)
+  {
+    ok=(keptAt[i]=malloc(wanted*sizeof(uint32_t))) != NULL;
+  }
+  ok=ok && (w=calloc(workers, sizeof *w)) != NULL;
+  for(int i=0;ok && i<workers;i++)
+  {
+    w[i].run=&run;
+    ok=bfsCreate(&w[i].b, &g) == 0;
+    w[i].b.policy=run.policy;
+    w[i].b.cache=NULL;
+  }
+  if(!ok){
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  if((f=fopen(out, "wb")) == NULL){
+    perror(out);
+    goto done;
+  }
+  memset(&h, 0, sizeof h);
+  ok=fwrite(&h, sizeof h, 1, f) == 1; // rewritten once the count is known
+
+  while(ok && kept < wanted)
+  {
+    // the batch is sized by the share of candidates kept so far
+    uint64_t need=kept > 0 ? (wanted-kept)*drawn/kept+(wanted-kept)/8+64 : batch;
+    run.candidates=need < batch ? (uint32_t)need : batch;
+    for(uint32_t c=0;c<run.candidates;c++)
+    {
+      uint64_t rng=run.seed^((next+c)*0xd1b54a32d192ed03ULL);
+      run.s[c]=asAt(&g, (uint32_t)(splitmix(&rng)%g.nodes));
+      run.d[c]=asAt(&g, (uint32_t)(splitmix(&rng)%g.nodes));
+      run.m[c]=asAt(&g, (uint32_t)(splitmix(&rng)%g.nodes));
+      run.state[c]=TRACE_DRAWN;
+      if(run.weights != NULL && (run.weights[run.s[c]] == 0 || run.weights[run.d[c]] == 0)){
+        run.state[c]=TRACE_NO_IPS;
+      }
+    }
+    tracePhase(&run, w, workers, TRACE_DRAWN);
+    tracePhase(&run, w, workers, TRACE_HAS_SM);
+    for(uint32_t c=0;ok && c<run.candidates && kept < wanted;c++)
+    {
+      struct PhiTrace *x=&run.t[c];
+      struct TraceRecord r;
+      drawn++;
+      if(run.state[c] != TRACE_OK){
+        rejected[run.state[c]]++;
+        continue;
+      }
+      memset(&r, 0, sizeof r);
+      r.source=run.s[c];
+      r.destination=run.d[c];
+      r.helper=run.m[c];
+      r.smLen=(uint8_t)x->smLen;
+      r.wdLen=(uint8_t)x->wdLen;
+      r.midwayAt=(uint8_t)x->midwayAt;
+      ok=fwrite(&r, sizeof r, 1, f) == 1 && fwrite(x->sm, sizeof *x->sm, x->smLen, f) == x->smLen && fwrite(x->wd, sizeof *x->wd, x->wdLen, f) == x->wdLen;
+      for(int i=0;mat != NULL && i<3;i++)
+      {
+        keptAt[i][kept]=asRank(&g, i == 0 ? r.source : i == 1 ? r.destination : r.helper)+1;
+      }
+      smHops=smHops+x->smLen;
+      wdHops=wdHops+x->wdLen;
+      wmHops=wmHops+x->wmLen;
+      smMax=x->smLen > smMax ? x->smLen : smMax;
+      kept++;
+    }
+    next=next+run.candidates;
+  }
+  h.magic=TRACE_MAGIC;
+  h.nodes=g.nodes;
+  h.digest=graphDigest(&g);
+  h.traces=kept;
+  h.seed=run.seed;
+  h.policy=run.policy;
+  ok=ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof h, 1, f) == 1;
+  if(fclose(f) != 0 || !ok){
+    perror(out);
+    f=NULL;
+    goto done;
+  }
+  f=NULL;
+  secs=(nowNs()-t)/1e9;
+  printf("Traces:\t\t %llu of %llu candidates\n",(unsigned long long)kept,(unsigned long long)drawn);
+  printf("Rejected:\t %llu without addresses, %llu without a path to M, %llu without a path to d, %llu without a midway node\n",(unsigned long long)rejected[TRACE_NO_IPS],(unsigned long long)rejected[TRACE_NO_SM],(unsigned long long)rejected[TRACE_NO_LAP],(unsigned long long)rejected[TRACE_NO_MIDWAY]);
+  printf("Searches:\t %llu, %.3f per trace\n",(unsigned long long)run.searches,run.searches/(double)kept);
+  printf("Time:\t\t %.2f s on %d threads, %.0f traces/s\n",secs,workers,kept/secs);
+  printf("Hops:\t\t pathSM %.2f on average (%u at most), pathWtoD %.2f, pathWtoM %.2f\n",smHops/(double)kept,smMax,wdHops/(double)kept,wmHops/(double)kept);
+  printf("Saved:\t\t %s\n",out);
+  ret=0;
+  if(mat != NULL){
+    static const char *names[3]={"sourceArray","destinationArray","helperNodeArray"};
+    struct MatArray a[3];
+    for(int i=0;i<3;i++)
+    {
+      snprintf(a[i].name, sizeof a[i].name, "%s", names[i]);
+      a[i].rows=1;
+      a[i].cols=(uint32_t)kept;
+      a[i].data=malloc((kept+1)*sizeof(double));
+      for(uint64_t k=0;a[i].data != NULL && k<kept;k++)
+      {
+        a[i].data[k]=keptAt[i][k];
+      }
+    }
+    if(a[0].data == NULL || a[1].data == NULL || a[2].data == NULL || matWrite(mat, a, 3) != 0){
+      ret=1;
+    }
+    else{
+      printf("Saved:\t\t %s\n",mat);
+    }
+    for(int i=0;i<3;i++)
+    {
+      free(a[i].data);
+    }
+  }
+
+done:
+  if(f != NULL){
+    fclose(f);
+  }
+  for(int i=0;w != NULL && i<workers;i++)
+  {
+    bfsFree(&w[i].b);
+  }
+  for(int i=0;i<3;i++)
+  {
+    free(keptAt[i]);
+  }
+  free(w);
+  free(run.s);
+  free(run.d);
+  free(run.m);
+  free(run.t);
+  free(run.state);
+  free(run.byRoot);
+  free(run.groupAt);
+  free(run.count);
+  free((void *)run.weights);
+  freeGraph(&g);
+  return ret;
+}
+
+/**************************************************************************
+ Entry point of "asgraph matdiff <a.mat> <b.mat> <variable>...": the
+ largest difference of each variable between two files, e.g. to check
+ native results against those saved by the Matlab scripts. Differences
+ below 1e-12 relative are rounding and do not count.
+**************************************************************************/
+int matDiffMode(int argc, char **argv)
+{
+  int ret=0;
+
+  if(argc < 3){
+    fprintf(stderr,"usage: asgraph matdiff <a.mat> <b.mat> <variable>...\n");
+    return 1;
+  }
+  for(int i=2;i<argc;i++)
+  {
+    struct MatArray a, b;
+    double worst=0;
+    uint64_t differ=0;
+    if(matRead(argv[0], argv[i], &a) != 0 || matRead(argv[1], argv[i], &b) != 0){
+      ret=1;
+      continue;
+    }
+    for(uint32_t c=0;c<a.cols || c<b.cols;c++)
+    {
+      for(uint32_t r=0;r<a.rows || r<b.rows;r++)
+      {
+        // a missing cell is 0, as in a matrix Matlab grew
+        double x=r < a.rows && c < a.cols ? a.data[(size_t)c*a.rows+r] : 0;
+        double y=r < b.rows && c < b.cols ? b.data[(size_t)c*b.rows+r] : 0;
+        double diff=x > y ? x-y : y-x;
+        if(diff != diff && x != x && y != y){
+          continue; // NaN in both
+        }
+        if(diff > 1e-12*(x > -x ? x : -x) || diff != diff){
+          differ++;
+          worst=diff > worst || diff != diff ? diff : worst;
+        }
+      }
+    }
+    printf("%-30s\t %ux%u vs %ux%u, %llu cells differ, by at most %g\n",argv[i],a.rows,a.cols,b.rows,b.cols,(unsigned long long)differ,worst);
+    ret=ret || differ > 0;
+    free(a.data);
+    free(b.data);
+  }
+  return ret;
+}
+
+/**************************************************************************
+ Entry point of "asgraph bitbench [ASes] [density %]". Times the bitset
+ reductions of every implementation this CPU supports on random sets of
+ the size of an anonymity set (46063 ASes, the 2014 graph, by default),
+ and checks that all of them agree.
+**************************************************************************/
+int bitBenchMode(int argc, char **argv)
+{
+  uint32_t n=argc > 0 ? (uint32_t)strtoul(argv[0], NULL, 10) : 46063;
+  double density=argc > 1 ? atof(argv[1])/100 : 0.5;
+  size_t words=BITSET_WORDS(n);
+  uint64_t *a=bitsetAlloc(n), *b=bitsetAlloc(n), rng=1, counts[4];
+  double *w=aligned_alloc(64, words*64*sizeof(double)), weights[4], expect[4]={0,0,0,0};
+  const int rounds=20000;
+  int ok;
+
+  if(n == 0 || a == NULL || b == NULL || w == NULL){
+    fprintf(stderr,"usage: asgraph bitbench [ASes] [density %%]\n");
+    return 1;
+  }
+  memset(w, 0, words*64*sizeof(double));
+  for(uint32_t v=0;v<n;v++)
+  {
+    // IP counts are sums of powers of two, like listIpsPerAS
+    w[v]=(double)(1ULL << (splitmix(&rng)%24));
+    if(splitmix(&rng)%1000000 < density*1000000){
+      bitsetSet(a, v);
+    }
+    if(splitmix(&rng)%1000000 < density*1000000){
+      bitsetSet(b, v);
+    }
+  }
+  printf("Sets:\t\t %u ASes, %zu bytes, %.0f%% and %.0f%% set\n",n,words*8,100.0*countScalar(a, words)/n,100.0*countScalar(b, words)/n);
+  printf("ns per set:\t count\t count&\t weight\t weight&\n");
+  for(int i=0;i<NUM_OF_BITSET_IMPLS;i++)
+  {
+    const struct BitsetOps *ops=&bitsetImpls[i];
+    uint64_t t[5];
+    volatile double sink=0;
+    if(!bitsetSupported(i)){
+      printf("%s:\t\t not supported by this CPU\n",ops->name);
+      continue;
+    }
+    t[0]=nowNs();
+    for(int r=0;r<rounds;r++)
+    {
+      sink=sink+(double)ops->count(a, words);
+    }
+    t[1]=nowNs();
+    for(int r=0;r<rounds;r++)
+    {
+      sink=sink+(double)ops->countAnd(a, b, words);
+    }
+    t[2]=nowNs();
+    for(int r=0;r<rounds;r++)
+    {
+      sink=sink+ops->weight(a, w, words);
+    }
+    t[3]=nowNs();
+    for(int r=0;r<rounds;r++)
+    {
+      sink=sink+ops->weightAnd(a, b, w, words);
+    }
+    t[4]=nowNs();
+    counts[0]=ops->count(a, words);
+    counts[1]=ops->countAnd(a, b, words);
+    weights[0]=ops->weight(a, w, words);
+    weights[1]=ops->weightAnd(a, b, w, words);
+    if(i == 0){
+      expect[0]=(double)counts[0];
+      expect[1]=(double)counts[1];
+      expect[2]=weights[0];
+      expect[3]=weights[1];
+    }
+    ok=(double)counts[0] == expect[0] && (double)counts[1] == expect[1] && weights[0] == expect[2] && weights[1] == expect[3];
+    printf("%s:\t\t %.0f\t %.0f\t %.0f\t %.0f%s\n",ops->name,(t[1]-t[0])/(double)rounds,(t[2]-t[1])/(double)rounds,(t[3]-t[2])/(double)rounds,(t[4]-t[3])/(double)rounds,ok ? "" : "\t\033[0;31mresults differ\033[0m");
+  }
+  free(a);
+  free(b);
+  free(w);
+  return 0;
+}
+
+void usage(void)
+{
+  fprintf(stderr,"usage: asgraph <mode> ...\n"
+                 "  info <as-rel file or snapshot>       parse (or map) the graph and print its size\n"
+                 "  reorder <graph> <degree|rcm|hub>     write a snapshot with the ASes renumbered for locality\n"
+                 "  orderbench <graph> [n [experiments]] time the BFS and StoM in every order of reorder\n"
+                 "  bfs <graph> <dst AS> [src AS [max]]  valley-free distances, path counts and paths\n"
+                 "  bfsbench <graph> [n | file]          time the BFS towards n or the listed destinations\n"
+                 "  bfsdir <graph> [n | file] [policy]   top-down against direction-optimizing BFS per destination\n"
+                 "  anonymity <graph> <stom|wtod> [...]  sender anonymity sets of PHI and dPHI, see README\n"
+                 "  ipspace <graph> <pfx2as> [-o] [-m]   address space per AS from a routeviews pfx2as file\n"
+                 "  traces <graph> [-n count] [...]      PHI traces of random (s, d, M) triples, see README\n"
+                 "  matdiff <a.mat> <b.mat> <var>...     compare variables of two MAT-files\n"
+                 "  bitbench [ASes] [density %%]         time the bitset reductions\n");
+}
+
+int main(int argc, char **argv)
+{
+  if(argc > 1 && strcmp(argv[1],"info") == 0){
+    return infoMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"bfs") == 0){
+    return bfsMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"bfsbench") == 0){
+    return bfsBenchMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"reorder") == 0){
+    return reorderMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"orderbench") == 0){
+    return orderBenchMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"bfsdir") == 0){
+    return bfsDirMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"anonymity") == 0){
+    return anonymityMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"ipspace") == 0){
+    return ipSpaceMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"traces") == 0){
+    return traceMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"matdiff") == 0){
+    return matDiffMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"bitbench") == 0){
+    return bitBenchMode(argc-2, argv+2);
+  }
+  usage();
+  return 1;
+}
@@ -0,0 +1,7 @@
+#!/bin/bash
+
+cd "$(dirname "$0")";
+
+rm -f asgraph;
+
+gcc -D_GNU_SOURCE=1 -Wall -Wchar-subscripts -Wformat-security -Wnested-externs -Wpointer-arith -Wshadow -Wstrict-prototypes -Wtype-limits -g -O2 -pthread -o asgraph asgraph.c -lz;
@@ -0,0 +1,63 @@
+% Authors: Georg T. Becker and Alexander Bajic
+% This code was published as part of the PETs 2020 publication
+%"dPHI: An improved high-speed network-layer anonymity protocol"
+% The complete code, copyright and readme can be found at https://github.com/AlexB030/dPHI
+% For questions, contact georg.becker@ ruhr-uni-bochum.de
+
+% Script to time shortestAllBGPtreeDestination for a number of random
+% destinations, to compare it with the native BFS of asgraph.c. The AS
+% numbers of the destinations are written to benchDestinations<year>.txt,
+% which "asgraph bfsbench" reads, so that both run on the same
+% destinations. The native tool reads the as-rel text file; for 2019 only
+% the .mat file is included, so the topology is written back to
+% caidaData\20190701.as-rel_fromMat.txt first if it does not exist yet.
+%
+% Compare with (run in this folder after ./asgraph.sh):
+%  ./asgraph bfsbench caidaData/20140901.as-rel_Modified.txt benchDestinations2014.txt
+%  ./asgraph bfsbench caidaData/20190701.as-rel_fromMat.txt benchDestinations2019.txt
+
+clc
+clear all
+
+use2019=0; % set to 1 for the 2019 topology
+numOfDestinations=100;
+
+if(use2019==1)
+    load('nographFrom2019withAll.mat','listOfNodes','sourceCellC','sourceCellP','sourceCellPtoP','sourceListPtoC','destinationListPtoC','sourceListPtoP','destinationListPtoP')
+    year='2019';
+    asRelFile='caidaData\20190701.as-rel_fromMat.txt';
+else
+    load('nographFrom2014withAll.mat','listOfNodes','sourceCellC','sourceCellP','sourceCellPtoP','sourceListPtoC','destinationListPtoC','sourceListPtoP','destinationListPtoP')
+    year='2014';
+    asRelFile='caidaData\20140901.as-rel_Modified.txt';
+end
+numOfNodes=size(listOfNodes,1);
+
+%write the topology in the a|b|rel format if there is no text file. The
+%internal numbers are translated back into AS numbers with listOfNodes.
+if(exist(asRelFile,'file')~=2)
+    fileID=fopen(asRelFile,'w');
+    fprintf(fileID,'%d|%d|-1\n',[listOfNodes(sourceListPtoC) listOfNodes(destinationListPtoC)]');
+    fprintf(fileID,'%d|%d|0\n',[listOfNodes(sourceListPtoP) listOfNodes(destinationListPtoP)]');
+    fclose(fileID);
+end
+
+rng(1);
+destinationArray=randi(numOfNodes,numOfDestinations,1);
+fileID=fopen(['benchDestinations' year '.txt'],'w');
+fprintf(fileID,'%d\n',listOfNodes(destinationArray));
+fclose(fileID);
+
+timePerDestination=zeros(numOfDestinations,1);
+numOfPaths=zeros(numOfDestinations,1);
+for(i=1:numOfDestinations)
+    tic
+    [shortestTree treeDistances] = shortestAllBGPtreeDestination(listOfNodes,sourceCellC,sourceCellP,sourceCellPtoP,destinationArray(i));
+    timePerDestination(i)=toc;
+    numOfPaths(i)=sum(cellfun(@(x) size(x,1),shortestTree));
+    disp(['destination ' num2str(i) ': ' num2str(timePerDestination(i)*1000) ' ms'])
+end
+
+disp(['Destinations: ' num2str(numOfDestinations)])
+disp(['Matlab: ' num2str(mean(timePerDestination)*1000) ' ms per destination on average, ' num2str(max(timePerDestination)*1000) ' ms at most'])
+disp(['Paths: ' num2str(mean(numOfPaths)) ' shortest paths per destination on average'])
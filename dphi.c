@@ -13,7 +13,7 @@
   be done by the intermediate nodes in the course of session
   establishment. Instructions on how to measure performance for various
   methods can be found in the extensive comments in the main method.
-  The relevant section starts at around line number 1540.
+  The relevant section is the main method at the end of this file.
 
 **********************************************************************/
 
@@ -22,12 +22,50 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include "aes_gcm.h"
 #include "sha256_mb.h"
 #include "x86intrin.h"
 #include "gcm_vectors.h"
 #include "types.h"
 
+/* the io_uring node loop is only built if the kernel headers are recent enough */
+#ifdef __has_include
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+# endif
+#endif
+#ifdef IORING_RECVSEND_FIXED_BUF
+# define HAVE_IO_URING 1
+#endif
+
+/* the same goes for the AF_XDP node loop, which needs kernel headers of 5.18 or newer */
+#ifdef __has_include
+# if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+#  include <linux/bpf.h>
+#  include <linux/if_ether.h>
+#  include <linux/if_link.h>
+#  include <linux/if_xdp.h>
+#  include <net/if.h>
+#  include <poll.h>
+#  include <signal.h>
+# endif
+#endif
+#if defined(BPF_F_XDP_HAS_FRAGS) && defined(XDP_SHARED_UMEM)
+# define HAVE_AF_XDP 1
+#endif
+
 #ifndef TEST_SEED
 # define TEST_SEED 0x1234
 #endif
@@ -102,6 +140,8 @@ struct Node {
   uint8_t midwayIv4[IV_SIZE];
   uint8_t midwayAt[TAG_SIZE];
   uint8_t origDest[4];
+  uint8_t midwayV2[VECTOR_LENGTH][4]; /* digest of V2 as W initialised it, see v2Digest */
+  uint8_t midwayV2Sid[16];           /* the SID of the session the digest belongs to */
 };
 
 /**************************************************************************
@@ -117,6 +157,16 @@ int compare( const void* a, const void* b)
      else return 1;
 }
 
+/**************************************************************************
+ Serialises one entry the way vectorToByteArray lays out the vector.
+**************************************************************************/
+void vectorToByteArrayEntry(const struct Vectorelement *element, uint8_t *bytes)
+{
+  memcpy(bytes,element->ct,TXT_SIZE);
+  memcpy(bytes+TXT_SIZE,element->iv,IV_SIZE);
+  memcpy(bytes+TXT_SIZE+IV_SIZE,element->at,TAG_SIZE);
+}
+
 /**************************************************************************
  TODO
 **************************************************************************/
@@ -289,6 +339,45 @@ void establishSessionKey(struct Node *node1, struct Node *node2)
   curve25519_donna(node1->sessionKey, node1->privKey, node2->pubKey);
 }
 
+/* a keypair of s for a single session, with its SID = Hash(pubS) at hand */
+struct Keypair {
+  uint8_t privKey[32];
+  uint8_t pubKey[32];
+  uint8_t sid[16];
+};
+
+/**************************************************************************
+ The steps that derive a session key, i.e. iAmHelper, iAmD and backAtS,
+ can leave the X25519 operation to a crypto worker (see ECDH offload).
+ With ECDH_ASK, sessionSecret only notes the public key and returns 0, so
+ that the handler returns PACKET_OFFLOADED and is called again with
+ ECDH_READY once the secret is there. Without ecdh or with ECDH_SYNC the
+ key is derived right away, as it always was.
+**************************************************************************/
+#define ECDH_SYNC 0
+#define ECDH_ASK 1
+#define ECDH_READY 2
+
+struct Ecdh {
+  int mode;
+  uint8_t point[32];
+  uint8_t secret[32];
+};
+
+int sessionSecret(struct Node *node, const uint8_t *point, struct Ecdh *ecdh)
+{
+  if(ecdh == NULL || ecdh->mode == ECDH_SYNC){
+    curve25519_donna(node->sessionKey, node->privKey, point);
+    return 1;
+  }
+  if(ecdh->mode == ECDH_ASK){
+    memcpy(ecdh->point, point, 32);
+    return 0;
+  }
+  memcpy(node->sessionKey, ecdh->secret, 32);
+  return 1;
+}
+
 /**************************************************************************
  This function initializes the various nodes with random data. The quality
  of randomnes of longterm keys is not important at this point as we only
@@ -311,6 +400,420 @@ struct Node initializeNode(struct Node node,int i)
   return node;
 }
 
+/**************************************************************************
+ Everything a node gets before the protocol starts: its longterm key and
+ address, its keypair and what it needs at hand should it become W.
+**************************************************************************/
+void bootstrapNode(struct Node *node, int id)
+{
+  uint64_t seed1, seed2;
+
+  *node=initializeNode(*node,id);
+  initPubPriv(node);
+
+  generateIv(node->midwayIv);
+  generateIv(node->midwayIv2);
+  generateIv(node->midwayIv3);
+  generateIv(node->midwayIv4);
+  rdrand64_step(&seed1);
+  rdrand64_step(&seed2);
+  memcpy(node->midwaySeed,&seed1,8);
+  memcpy(node->midwaySeed+8,&seed2,8);
+}
+
+
+/**************************************************************************
+* Telemetry
+*
+* Every thread that processes packets owns a slot of counters in a shared
+* memory segment: packets per H.status, calls, cycles and auth tag
+* failures per handler, and drops. A slot has a single writer, so counting
+* is a plain load and store without any locked instruction, and slots are
+* padded to whole cache lines so that no two threads ever write to the
+* same line. Readers (see statsMode) sum over all slots whenever they like
+* without any coordination with the writers; an aligned 64 bit store is
+* never seen torn on x86-64. A slot keeps its counts when its thread ends
+* and is picked up again by the next thread serving the same node, so
+* totals only ever grow. Threads that never attach (such as the walk-
+* through in main) count nothing.
+**************************************************************************/
+
+#define TELEMETRY_PATH "/dev/shm/dphi-telemetry"
+#define TELEMETRY_MAGIC 0x334c455449485064ULL /* "dPHITEL3" */
+#define TELEMETRY_SLOTS 64
+#define NUM_OF_STATUS (TRANSMISSION_PHASE_TO_D2+1)
+
+#define HANDLER_IAMS 0
+#define HANDLER_STOM 1
+#define HANDLER_IAMHELPER 2
+#define HANDLER_MTOS 3
+#define HANDLER_IAMWBACKTRACKING 4
+#define HANDLER_BACKATS 5
+#define HANDLER_FORWARDSTOW 6
+#define HANDLER_IAMWFORWARDTOD 7
+#define HANDLER_WTOD 8
+#define HANDLER_IAMD 9
+#define HANDLER_DTOW 10
+#define HANDLER_IAMWBACKTOS 11
+#define HANDLER_FINISHATS 12
+#define HANDLER_IAMWTRANSMISSIONTOD2 13
+#define HANDLER_FORWARDWTOD 14
+#define NUM_OF_HANDLERS 15
+#define HANDLER_NONE NUM_OF_HANDLERS /* delivered at d, no step to perform */
+
+/* what became of the handshakes that reached M (see admitHandshake) */
+#define ADMIT_ADMITTED 0
+#define ADMIT_DEFERRED 1
+#define ADMIT_DROPPED 2
+#define NUM_OF_ADMIT 3
+
+static const char *statusNames[NUM_OF_STATUS]={"session request","midway request","backtracking","midway reply","handshake to d","reply to W","reply to s","transmission to W","transmission to d"};
+static const char *handlerNames[NUM_OF_HANDLERS]={"iAmS","sToM","iAmHelper","mToS","iAmWbacktracking","backAtS","forwardStoW","iAmWforwardToD","wToD","iAmD","dToW","iAmWbackToS","finishAtS","iAmWTransmissionToD2","forwardWtoD"};
+
+struct TelemetrySlot {
+  int32_t owner; /* tid of the thread writing this slot, 0 if free */
+  int32_t node;  /* id of the node + 1, 0 if the slot was never used */
+  uint64_t packets[NUM_OF_STATUS];
+  uint64_t drops;
+  uint64_t calls[NUM_OF_HANDLERS];
+  uint64_t cycles[NUM_OF_HANDLERS];
+  uint64_t authFails[NUM_OF_HANDLERS];
+  uint64_t rejects[NUM_OF_HANDLERS];
+  uint64_t admission[NUM_OF_ADMIT];
+} __attribute__((aligned(64)));
+
+struct TelemetryRegion {
+  uint64_t magic;
+  struct TelemetrySlot slots[TELEMETRY_SLOTS];
+};
+
+static struct TelemetryRegion *telemetryRegion;
+static pthread_once_t telemetryOnce=PTHREAD_ONCE_INIT;
+static __thread struct TelemetrySlot *telemetry;
+
+/* the only writer of counter is the calling thread */
+static inline void telemetryAdd(uint64_t *counter, uint64_t v)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline void telemetryAuthFail(int handler)
+{
+  if(telemetry != NULL){
+    telemetryAdd(&telemetry->authFails[handler], 1);
+  }
+}
+
+static inline void telemetryReject(int handler)
+{
+  if(telemetry != NULL){
+    telemetryAdd(&telemetry->rejects[handler], 1);
+  }
+}
+
+static inline void telemetryDrop(void)
+{
+  if(telemetry != NULL){
+    telemetryAdd(&telemetry->drops, 1);
+  }
+}
+
+/* one packet through dispatchPacket: its status, the step taken, its cost */
+static inline void telemetryPacket(int status, int handler, uint64_t cycles, int drop)
+{
+  if(status < NUM_OF_STATUS){
+    telemetryAdd(&telemetry->packets[status], 1);
+  }
+  if(handler != HANDLER_NONE){
+    telemetryAdd(&telemetry->calls[handler], 1);
+    telemetryAdd(&telemetry->cycles[handler], cycles);
+  }
+  if(drop){
+    telemetryAdd(&telemetry->drops, 1);
+  }
+}
+
+/**************************************************************************
+ Maps the telemetry segment, creating it if it does not exist yet. Several
+ processes may race here (the AF_XDP nodes all start at once), which is
+ fine: ftruncate to the same size is idempotent and so is the magic.
+**************************************************************************/
+struct TelemetryRegion *telemetryMap(int writable)
+{
+  struct TelemetryRegion *region;
+  int fd=open(TELEMETRY_PATH, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+
+  if(fd < 0){
+    return NULL;
+  }
+  if(writable && ftruncate(fd, sizeof *region) < 0){
+    close(fd);
+    return NULL;
+  }
+  region=mmap(NULL, sizeof *region, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(region == MAP_FAILED){
+    return NULL;
+  }
+  if(writable && __atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC){
+    // left behind by an older layout of the slots
+    memset(region->slots, 0, sizeof region->slots);
+    __atomic_store_n(&region->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+  }
+  else if(__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC){
+    munmap(region, sizeof *region);
+    return NULL;
+  }
+  return region;
+}
+
+void telemetryMapOnce(void)
+{
+  telemetryRegion=telemetryMap(1);
+}
+
+/* a slot whose owner died without detaching is free again */
+int telemetryOwnerGone(int32_t owner)
+{
+  char path[32];
+  snprintf(path, sizeof path, "/proc/%d", owner);
+  return owner != 0 && access(path, F_OK) != 0;
+}
+
+/**************************************************************************
+ Claims a slot for the calling thread, which from now on counts for node
+ id. A free slot that served the same node before is preferred over one
+ never used, so that a restarted node carries on with its counts.
+**************************************************************************/
+void telemetryAttach(int id)
+{
+  int32_t tid=syscall(__NR_gettid);
+
+  pthread_once(&telemetryOnce, telemetryMapOnce);
+  if(telemetryRegion == NULL){
+    return;
+  }
+  for(int pass=0;pass<3;pass++)
+  {
+    for(int i=0;i<TELEMETRY_SLOTS;i++)
+    {
+      struct TelemetrySlot *slot=&telemetryRegion->slots[i];
+      int32_t node=__atomic_load_n(&slot->node, __ATOMIC_RELAXED);
+      int32_t owner=__atomic_load_n(&slot->owner, __ATOMIC_RELAXED);
+      if((pass == 0 && node != id+1) || (pass == 1 && node != 0)){
+        continue;
+      }
+      if(owner != 0 && !telemetryOwnerGone(owner)){
+        continue;
+      }
+      if(__atomic_compare_exchange_n(&slot->owner, &owner, tid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        if(node != id+1){
+          memset(slot->packets, 0, sizeof *slot - offsetof(struct TelemetrySlot, packets));
+        }
+        __atomic_store_n(&slot->node, id+1, __ATOMIC_RELEASE);
+        telemetry=slot;
+        return;
+      }
+    }
+  }
+}
+
+void telemetryDetach(void)
+{
+  if(telemetry != NULL){
+    __atomic_store_n(&telemetry->owner, 0, __ATOMIC_RELEASE);
+    telemetry=NULL;
+  }
+}
+
+/**************************************************************************
+* Hop tracer
+*
+* The rdtsc brackets in the handlers time one step in isolation. To see
+* where a whole handshake spends its time, dispatchPacket can record every
+* hop of sampled sessions: session, SID, node, handler, start and end.
+* Each thread writes into a ring of its own that overwrites its oldest
+* events, so recording is a handful of stores. The rings live in one shared mapping
+* set up in main before any node thread or process exists, so node
+* processes forked later (see shmMode) record where the parent can dump
+* them. traceDump writes all rings as Chrome trace-event JSON, one row per
+* node, with flow arrows that follow each session from hop to hop; load it
+* in chrome://tracing or https://ui.perfetto.dev.
+*
+* Tracing is enabled by setting DPHI_TRACE=n in the environment, which
+* samples one in n sessions. Sessions are told apart by the sequence number
+* the load generator gave them, as s uses the same SID for all of them
+* (the SID is the hash of its public key). When it is not set, the thread-
+* local ring pointer stays NULL and all a hop costs is one load of it and
+* one never-taken branch.
+**************************************************************************/
+
+#define TRACE_RINGS 64
+#define TRACE_EVENTS 16384 /* per ring, must be a power of two */
+
+struct TraceEvent {
+  uint64_t start;
+  uint64_t end;
+  uint32_t seq;
+  uint32_t sid; /* the first 4 bytes of H.sid */
+  uint8_t node;
+  uint8_t handler;
+  uint8_t status;
+  uint8_t reserved;
+};
+
+struct TraceRing {
+  uint32_t owner; /* 0 while unclaimed */
+  uint32_t node;
+  uint64_t head;
+  struct TraceEvent events[TRACE_EVENTS];
+};
+
+struct Tracer {
+  uint32_t sample;
+  uint32_t rings;
+  uint64_t tsc0; /* rdtsc and CLOCK_MONOTONIC at traceInit, to convert cycles to time */
+  uint64_t ns0;
+  struct TraceRing ring[TRACE_RINGS];
+};
+
+static struct Tracer *tracer;
+static __thread struct TraceRing *trace;
+
+static inline void traceHop(uint32_t seq, const struct Header *header, int id, int handler, int status, uint64_t start, uint64_t end)
+{
+  if(seq % tracer->sample != 0){
+    return;
+  }
+  struct TraceEvent *e=&trace->events[trace->head & (TRACE_EVENTS-1)];
+  e->start=start;
+  e->end=end;
+  e->seq=seq;
+  memcpy(&e->sid, header->sid, 4);
+  e->node=id;
+  e->handler=handler;
+  e->status=status;
+  __atomic_store_n(&trace->head, trace->head+1, __ATOMIC_RELEASE);
+}
+
+/**************************************************************************
+ Sets the tracer up if DPHI_TRACE asks for it. Must run before the first
+ node thread or process is started.
+**************************************************************************/
+void traceInit(void)
+{
+  const char *env=getenv("DPHI_TRACE");
+  struct timespec ts;
+  int sample=env != NULL ? atoi(env) : 0;
+
+  if(sample <= 0){
+    return;
+  }
+  tracer=mmap(NULL, sizeof *tracer, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(tracer == MAP_FAILED){
+    perror("trace");
+    tracer=NULL;
+    return;
+  }
+  tracer->sample=sample;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  tracer->tsc0=__rdtsc();
+  tracer->ns0=(uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+void traceAttach(int id)
+{
+  if(tracer == NULL){
+    return;
+  }
+  uint32_t i=__atomic_fetch_add(&tracer->rings, 1, __ATOMIC_RELAXED);
+  if(i >= TRACE_RINGS){
+    return;
+  }
+  tracer->ring[i].node=id;
+  tracer->ring[i].owner=syscall(__NR_gettid);
+  trace=&tracer->ring[i];
+}
+
+void traceDetach(void)
+{
+  trace=NULL;
+}
+
+/**************************************************************************
+* Packet verification
+*
+* Every handler that decrypts a routing entry or a payload checks the tag
+* it computes and drops the packet right away if it does not match, so
+* that a forged packet costs no more than its verification. Tags are
+* compared in constant time. Cheap checks come first: H.pos has to point
+* into the vector before anything is read through it, and M and d match
+* the SID against the hash of pubS before they spend an X25519 operation
+* on a packet. Handlers return PACKET_OK or the reason for the drop.
+**************************************************************************/
+
+#define PACKET_OK 0
+#define REJECT_MALFORMED 1
+#define REJECT_AUTH 2
+#define PACKET_OFFLOADED 3 /* not a reject, the step waits for its ECDH */
+#define REJECT_REPLAY 4
+
+int tagsEqual(const uint8_t *x, const uint8_t *y, int len)
+{
+  uint8_t diff=0;
+  for(int i=0;i<len;i++)
+  {
+    diff=diff | (x[i] ^ y[i]);
+  }
+  /* no early exit, whatever the compiler makes of the loop */
+  __asm__ volatile("" : "+r"(diff));
+  return diff == 0;
+}
+
+/**************************************************************************
+ Common exit of a handler that drops a packet. It closes the cycle
+ measurement where the handler has one, so that rejected packets are
+ measured at what they really cost, and counts the reason.
+**************************************************************************/
+int rejectPacket(int handler, int reason, uint64_t a, uint64_t *c1, uint64_t *c2)
+{
+  uint64_t b=__rdtsc();
+  if(c1 != NULL){
+    memcpy(c1,&a,8);
+    memcpy(c2,&b,8);
+  }
+  if(reason == REJECT_AUTH){
+    telemetryAuthFail(handler);
+  }
+  telemetryReject(handler);
+  return reason;
+}
+
+/**************************************************************************
+ Since handlers verify what they process, a step can no longer be repeated
+ on the header it already modified. What a step consumes, i.e. the header,
+ the payload and the state of the node, is saved once and restored before
+ every repetition instead.
+**************************************************************************/
+struct StepInput {
+  struct Header header;
+  struct Payload payload;
+  struct Node node;
+};
+
+void saveStep(struct StepInput *in, const struct Header *header, const struct Payload *payload, const struct Node *node)
+{
+  memcpy(&in->header, header, sizeof *header);
+  memcpy(&in->payload, payload, sizeof *payload);
+  memcpy(&in->node, node, sizeof *node);
+}
+
+void restoreStep(const struct StepInput *in, struct Header *header, struct Payload *payload, struct Node *node)
+{
+  memcpy(header, &in->header, sizeof *header);
+  memcpy(payload, &in->payload, sizeof *payload);
+  memcpy(node, &in->node, sizeof *node);
+}
 
 /**************************************************************************
 * In the following are different methods that are used for the different
@@ -325,7 +828,7 @@ struct Node initializeNode(struct Node node,int i)
  destination. The source sets up the communication request message. This
  relates to "Algorithm 1" in the paper's appendix.
 **************************************************************************/
-void iAmS(struct Node *node, struct Node *helperNode, struct Node *destNode,struct Header *header,struct Payload *payload,struct Header *headerStored)
+void iAmS(struct Node *node, struct Node *helperNode, struct Node *destNode,struct Header *header,struct Payload *payload,const struct Keypair *keys)
 {
   /* Quality of nonce irrelevant in toy example.
   Performance of this step is not subject to performance measurement.*/
@@ -333,13 +836,24 @@ void iAmS(struct Node *node, struct Node *helperNode, struct Node *destNode,stru
     node->nonce[i]=rand() % 256;
   }
 
+  // a fresh keypair, if s has one, is kept for the session just like the nonce
+  if(keys != NULL){
+    memcpy(node->privKey,keys->privKey,32);
+    memcpy(node->pubKey,keys->pubKey,32);
+  }
+
   //ks-M <- ECDH(pubM,privS)
   establishSessionKey(node,helperNode);
 
   //H.sid <- Hash(pubS)
-  uint8_t digest[32];
-  getHash(node->pubKey,digest,32);
-  memcpy(header->sid,digest,16);
+  if(keys != NULL){
+    memcpy(header->sid,keys->sid,16);
+  }
+  else{
+    uint8_t digest[32];
+    getHash(node->pubKey,digest,32);
+    memcpy(header->sid,digest,16);
+  }
 
   // now write to payload
   struct gcm_key_data gkey;
@@ -386,8 +900,8 @@ void iAmS(struct Node *node, struct Node *helperNode, struct Node *destNode,stru
   //H.status <- "toHelperNode"
   header->status=TO_HELPER_NODE;
 
-  //Hs <- H
-  memcpy(headerStored,header, sizeof *header);
+  //Hs <- H is left to the caller: it either keeps a reference to the
+  //packet buffer or copies the header (see keepStoredHeader)
   free(freshIv);
 }
 
@@ -396,12 +910,15 @@ void iAmS(struct Node *node, struct Node *helperNode, struct Node *destNode,stru
  s to Helper node M. This is the "Maidway Request" and relates to
  "Algorithm 2" in the paper's appendix.
 **************************************************************************/
-struct Header sToM(struct Header header, struct Node node, struct gcm_key_data gkey, uint8_t *freshIv, uint64_t * c1, uint64_t * c2)
+int sToM(struct Header *header, struct Node *node, struct gcm_key_data gkey, uint8_t *freshIv, uint64_t * c1, uint64_t * c2)
 {
   uint64_t a, b;
   /* in 'a' the cycle counter at the beginning of this function is stored
   for reference when measuring and storing it again at the end in 'b' */
   a=__rdtsc();
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_STOM, REJECT_MALFORMED, a, c1, c2);
+  }
 
   struct gcm_context_data gctx;
   uint8_t ingres[4], egres[4], pType, posV1, posV2;
@@ -427,7 +944,7 @@ struct Header sToM(struct Header header, struct Node node, struct gcm_key_data g
   }
 
   pType=0;
-  posV1=header.pos;
+  posV1=header->pos;
   /* the following will generate a number that is beyond the array size,
   so that it is obviously not a valid index and can be detected as such */
   posV2=rand() % 256 + VECTOR_LENGTH;
@@ -455,15 +972,15 @@ struct Header sToM(struct Header header, struct Node node, struct gcm_key_data g
   }
 
   // create authentication data and declare tag
-  memcpy(myAad, header.sid, 16);
-  if (header.pos == 0){
-    posPrev=(header.pos + VECTOR_LENGTH -1);
+  memcpy(myAad, header->sid, 16);
+  if (header->pos == 0){
+    posPrev=(header->pos + VECTOR_LENGTH -1);
   }
   else{
-    posPrev=(header.pos -1);
+    posPrev=(header->pos -1);
   }
 
-  memcpy(cPrev, header.v1[posPrev].ct, TXT_SIZE);
+  memcpy(cPrev, header->v1[posPrev].ct, TXT_SIZE);
   memcpy(myAad + 16, cPrev, TXT_SIZE);
 
   aes_gcm_enc_256(&gkey, &gctx, myCt, rp, TXT_SIZE, freshIv, myAad, AAD_SIZE, tag1, TAG_SIZE);
@@ -474,18 +991,18 @@ struct Header sToM(struct Header header, struct Node node, struct gcm_key_data g
   }
 
   // now save that stuff to the header an increase pos
-  memcpy(header.v1[header.pos].ct, myCt, TXT_SIZE);
-  memcpy(header.v1[header.pos].iv, freshIv, IV_SIZE);
-  memcpy(header.v1[header.pos].at, tag1, TAG_SIZE);
+  memcpy(header->v1[header->pos].ct, myCt, TXT_SIZE);
+  memcpy(header->v1[header->pos].iv, freshIv, IV_SIZE);
+  memcpy(header->v1[header->pos].at, tag1, TAG_SIZE);
 
   // increment position pointer in the header
-  header.pos=(header.pos + 1) % VECTOR_LENGTH;
+  header->pos=(header->pos + 1) % VECTOR_LENGTH;
 
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
   free(rp);
-  return header;
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -493,16 +1010,21 @@ struct Header sToM(struct Header header, struct Node node, struct gcm_key_data g
  helper node M. This is still the "Maidway Request" and likewise relates to
  "Algorithm 2" in the paper's appendix.
 **************************************************************************/
-struct Header iAmHelper(struct Node *node,struct Header header,struct Payload payload, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
+int iAmHelper(struct Node *node,struct Header *header,struct Payload *payload, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info, struct Ecdh *ecdh)
 {
   uint64_t a, b;
   a=__rdtsc();
   uint8_t digest[32];
 
-  //Assert(H.sid == Hash(P.pubS))
-  getHash(payload.pubKeyS,digest,32);
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_IAMHELPER, REJECT_MALFORMED, a, c1, c2);
+  }
+
+  //Assert(H.sid == Hash(P.pubS)), before spending an ECDH on the packet
+  getHash(payload->pubKeyS,digest,32);
+  int sidOk=tagsEqual(header->sid, digest, 16);
   if(info ==1){
-    if(memcmp(header.sid, digest, 16) == 0)
+    if(sidOk)
     {
       printf("\033[0;32m");
       printf("M: SID and PubS fit\n");
@@ -514,19 +1036,25 @@ struct Header iAmHelper(struct Node *node,struct Header header,struct Payload pa
       printf("\033[0m");
     }
   }
+  if(!sidOk){
+    return rejectPacket(HANDLER_IAMHELPER, REJECT_AUTH, a, c1, c2);
+  }
 
   //generate sessionkey for M
-  curve25519_donna(node->sessionKey, node->privKey, payload.pubKeyS);
+  if(!sessionSecret(node, payload->pubKeyS, ecdh)){
+    return PACKET_OFFLOADED;
+  }
 
   //decrypt payload
   struct gcm_context_data gctx;
   aes_gcm_pre_256(node->sessionKey, &gkey);
   uint8_t pt2[12];
   uint8_t tag2[TAG_SIZE];
-  aes_gcm_dec_256(&gkey, &gctx, pt2, payload.ct, 12, payload.iv, header.sid, 16, tag2, TAG_SIZE);
+  aes_gcm_dec_256(&gkey, &gctx, pt2, payload->ct, 12, payload->iv, header->sid, 16, tag2, TAG_SIZE);
 
+  int tagOk=tagsEqual(payload->at, tag2, TAG_SIZE);
   if(info ==1){
-    if(memcmp(payload.at, tag2, TAG_SIZE) == 0){
+    if(tagOk){
       printf("\033[0;32m");
       printf("M: auth tags ok\n");
       printf("\033[0m");
@@ -537,29 +1065,31 @@ struct Header iAmHelper(struct Node *node,struct Header header,struct Payload pa
       printf("\033[0m");
     }
   }
+  if(!tagOk){
+    return rejectPacket(HANDLER_IAMHELPER, REJECT_AUTH, a, c1, c2);
+  }
 
   //H.dest <- d
-  memcpy(header.dest,pt2,4);
+  memcpy(header->dest,pt2,4);
 
   //H.status <- "findMidway"
-  header.status=FIND_MIDWAY;
+  header->status=FIND_MIDWAY;
 
   //H.midway <- nmid
-  memcpy(header.midway,pt2+4,8);
+  memcpy(header->midway,pt2+4,8);
 
-  uint8_t position=header.pos;
+  uint8_t position=header->pos;
   if (position == 0){
     position=position+VECTOR_LENGTH;
   }
 
   position=(position-1)%VECTOR_LENGTH;
-  header.pos=position;
+  header->pos=position;
 
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
-
-  return header;
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -574,39 +1104,43 @@ struct Header iAmHelper(struct Node *node,struct Header header,struct Payload pa
  The same function here is used to cover "Algorithm 10" from the paper's
  appendix, as it, in principle, does the same thing: forwarding back to s.
 **************************************************************************/
-struct Header mToS(struct Header header, struct Node *node, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2, int info)
+int mToS(struct Header *header, struct Node *node, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2, int info)
 {
   uint64_t a, b;
   a=__rdtsc();
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_MTOS, REJECT_MALFORMED, a, c1, c2);
+  }
 
   struct gcm_context_data gctx;
   uint8_t tag2[TAG_SIZE];
   uint8_t myAad[AAD_SIZE]; /* 128 bit for SID + 128 bit for Cprev */
-  memcpy(myAad, header.sid, 16 * sizeof(uint8_t));
+  memcpy(myAad, header->sid, 16 * sizeof(uint8_t));
   uint8_t cPrev[TXT_SIZE];
   uint8_t posPrev;
-  if (header.pos == 0){
-    posPrev=(header.pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
+  if (header->pos == 0){
+    posPrev=(header->pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
   }
   else{
-    posPrev=(header.pos -1) % VECTOR_LENGTH;
+    posPrev=(header->pos -1) % VECTOR_LENGTH;
   }
 
-  memcpy(cPrev, header.v1[posPrev].ct, TXT_SIZE);
+  memcpy(cPrev, header->v1[posPrev].ct, TXT_SIZE);
   memcpy(myAad + 16, cPrev, TXT_SIZE * sizeof(uint8_t));
 
   uint8_t pt2[TXT_SIZE];
-  aes_gcm_dec_256(&gkey, &gctx, pt2, header.v1[header.pos].ct, TXT_SIZE, header.v1[header.pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  aes_gcm_dec_256(&gkey, &gctx, pt2, header->v1[header->pos].ct, TXT_SIZE, header->v1[header->pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
   if(DEBUG == 1){
     printf("Decryption:\n");
     printer("  used aad:       ",myAad,AAD_SIZE);
-    printer("  used  iv:       ",header.v1[header.pos].iv,16);
+    printer("  used  iv:       ",header->v1[header->pos].iv,16);
     printer("  myPt      :",pt2,TXT_SIZE);
-    printer("  tag1      :",header.v1[header.pos].at,TAG_SIZE);
+    printer("  tag1      :",header->v1[header->pos].at,TAG_SIZE);
     printer("  tag2      :",tag2,TAG_SIZE);
   }
+  int tagOk=tagsEqual(header->v1[header->pos].at, tag2, TAG_SIZE);
   if(info == 1){
-    if(memcmp(header.v1[header.pos].at, tag2, TAG_SIZE) == 0){
+    if(tagOk){
       printf("\033[0;32m");
       printf("Node %d: valid auth tag\n",node->id);
       printf("\033[0m");
@@ -617,12 +1151,15 @@ struct Header mToS(struct Header header, struct Node *node, struct gcm_key_data
       printf("\033[0m");
     }
   }
+  if(!tagOk){
+    return rejectPacket(HANDLER_MTOS, REJECT_AUTH, a, c1, c2);
+  }
 
-  header.pos=posPrev;
+  header->pos=posPrev;
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
-  return header;
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -631,40 +1168,44 @@ struct Header mToS(struct Header header, struct Node *node, struct gcm_key_data
 
  This function relates to parts of "Algorithm 3" in the paper's appendix.
 **************************************************************************/
-struct Header iAmWbacktracking(struct Header header, struct Node *node, struct gcm_key_data gkey, uint8_t *freshIv, uint8_t *freshIv2, uint64_t * c1, uint64_t * c2,int info)
+int iAmWbacktracking(struct Header *header, struct Node *node, struct gcm_key_data gkey, uint8_t *freshIv, uint8_t *freshIv2, uint64_t * c1, uint64_t * c2,int info)
 {
   uint64_t a, b;
   a=__rdtsc();
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_IAMWBACKTRACKING, REJECT_MALFORMED, a, c1, c2);
+  }
 
   struct gcm_context_data gctx;
   uint8_t tag2[TAG_SIZE];
   uint8_t myAad[AAD_SIZE]; /* 128 bit for SID + 128 bit for Cprev */
-  memcpy(myAad, header.sid, 16 * sizeof(uint8_t));
+  memcpy(myAad, header->sid, 16 * sizeof(uint8_t));
   uint8_t cPrev[TXT_SIZE];
   uint8_t posPrev;
-  if (header.pos == 0){
-    posPrev=(header.pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
+  if (header->pos == 0){
+    posPrev=(header->pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
   }
   else{
-    posPrev=(header.pos -1) % VECTOR_LENGTH;
+    posPrev=(header->pos -1) % VECTOR_LENGTH;
   }
 
-  memcpy(cPrev, header.v1[posPrev].ct, TXT_SIZE);
+  memcpy(cPrev, header->v1[posPrev].ct, TXT_SIZE);
   memcpy(myAad + 16, cPrev, TXT_SIZE * sizeof(uint8_t));
 
   // and now do the decrpytion
   uint8_t pt2[TXT_SIZE];
-  aes_gcm_dec_256(&gkey, &gctx, pt2, header.v1[header.pos].ct, TXT_SIZE, header.v1[header.pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  aes_gcm_dec_256(&gkey, &gctx, pt2, header->v1[header->pos].ct, TXT_SIZE, header->v1[header->pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
   if(DEBUG == 1){
     printf("Decryption:\n");
     printer("  used aad:       ",myAad,AAD_SIZE);
-    printer("  used  iv:       ",header.v1[header.pos].iv,16);
+    printer("  used  iv:       ",header->v1[header->pos].iv,16);
     printer("  myPt      :",pt2,TXT_SIZE);
-    printer("  tag1      :",header.v1[header.pos].at,TAG_SIZE);
+    printer("  tag1      :",header->v1[header->pos].at,TAG_SIZE);
     printer("  tag2      :",tag2,TAG_SIZE);
   }
+  int tagOk=tagsEqual(header->v1[header->pos].at, tag2, TAG_SIZE);
   if(info == 1){
-    if(memcmp(header.v1[header.pos].at, tag2, TAG_SIZE) == 0){
+    if(tagOk){
       printf("\033[0;32m");
       printf("Node %d: valid auth tag\n",node->id);
       printf("\033[0m");
@@ -675,12 +1216,15 @@ struct Header iAmWbacktracking(struct Header header, struct Node *node, struct g
       printf("\033[0m");
     }
   }
+  if(!tagOk){
+    return rejectPacket(HANDLER_IAMWBACKTRACKING, REJECT_AUTH, a, c1, c2);
+  }
 
   //R.type <- midway
   memset(pt2+8,1,1);
 
   //nmid <- H.midway
-  memcpy(node->nonce,header.midway,8);
+  memcpy(node->nonce,header->midway,8);
 
   //R.posV2 <- random(0,l-1)
   memset(pt2+10,(rand() % 12),1);
@@ -695,20 +1239,20 @@ struct Header iAmWbacktracking(struct Header header, struct Node *node, struct g
 
   //H.V1[H.pos] <- enc(newR,sid||cprev)
   uint8_t tag1[TAG_SIZE];
-  aes_gcm_enc_256(&gkey, &gctx, header.v1[header.pos].ct, pt2, TXT_SIZE, freshIv, myAad, AAD_SIZE, tag1, TAG_SIZE);
-  memcpy(header.v1[header.pos].iv, freshIv, IV_SIZE);
-  memcpy(header.v1[header.pos].at, tag1, TAG_SIZE);
+  aes_gcm_enc_256(&gkey, &gctx, header->v1[header->pos].ct, pt2, TXT_SIZE, freshIv, myAad, AAD_SIZE, tag1, TAG_SIZE);
+  memcpy(header->v1[header->pos].iv, freshIv, IV_SIZE);
+  memcpy(header->v1[header->pos].at, tag1, TAG_SIZE);
 
   //H.midway <- Hash(H.dest||nmid||H.V1) (4+8+VECTOR_LENGTH*(16+TXT_SIZE+TAG_SIZE))
   int vLen=4+8+(VECTOR_LENGTH*(16+TXT_SIZE+TAG_SIZE));
   uint8_t vectorToHash[vLen];
-  memcpy(vectorToHash,header.dest,4);
-  memcpy(vectorToHash+4,header.midway,8);
-  memcpy(vectorToHash+12,header.v1,VECTOR_LENGTH*(16+TXT_SIZE+TAG_SIZE));
+  memcpy(vectorToHash,header->dest,4);
+  memcpy(vectorToHash+4,header->midway,8);
+  memcpy(vectorToHash+12,header->v1,VECTOR_LENGTH*(16+TXT_SIZE+TAG_SIZE));
 
   uint8_t digest[32];
   getHash(vectorToHash,digest,32);
-  memcpy(header.midway,digest,16);
+  memcpy(header->midway,digest,16);
 
   if(DEBUG == 1){
     printer("digest:  ",digest,16);
@@ -716,20 +1260,19 @@ struct Header iAmWbacktracking(struct Header header, struct Node *node, struct g
 
   //H.dest <- enc(H.dest,H.sid)
   uint8_t pt3[4];
-  memcpy(pt3,header.dest,4);
-  aes_gcm_enc_256(&gkey, &gctx, header.dest, pt3, 4, freshIv2, header.sid, 16, tag1, TAG_SIZE);
+  memcpy(pt3,header->dest,4);
+  aes_gcm_enc_256(&gkey, &gctx, header->dest, pt3, 4, freshIv2, header->sid, 16, tag1, TAG_SIZE);
   memcpy(node->midwayIv, freshIv2, IV_SIZE);
   memcpy(node->midwayAt, tag1, TAG_SIZE);
 
   //H.status <- "midwayReply"
-  header.status=MIDWAY_REPLY;
+  header->status=MIDWAY_REPLY;
 
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
-  header.pos=posPrev;
-
-  return header;
+  header->pos=posPrev;
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -740,13 +1283,15 @@ struct Header iAmWbacktracking(struct Header header, struct Node *node, struct g
 
  This function relates "Algorithm 5" in the paper's appendix.
 **************************************************************************/
-void backAtS(struct Header *header, struct Header *headerStored, struct Node *node, struct Node *destNode, struct Payload *payload,int info)
+int backAtS(struct Header *header, const struct Header *headerStored, struct Node *node, struct Node *destNode, struct Payload *payload,int info, struct Ecdh *ecdh)
 {
   // this is a work-around since our entryAS, on the way from s to M, does not check if its predecessor was the client, therefore has NOT R.type=="entryNode" and therefore does not know that there is NO NEED to decrement H.pos on the way back.... i.e. it decrements one too many times, so we increment manually here again
   header->pos=(header->pos + 1) % VECTOR_LENGTH;
   //Assert(H.sid == Hs.sid && H.pos == Hs.pos)
+  int sidOk=tagsEqual(header->sid, headerStored->sid, 16);
+  int posOk=header->pos == headerStored->pos;
   if(info ==1){
-    if(memcmp(header->sid, headerStored->sid, 16) == 0){
+    if(sidOk){
       printf("\033[0;32m");
       printf("S got Midway_Reply with correct SID\n");
       printf("\033[0m");
@@ -756,7 +1301,7 @@ void backAtS(struct Header *header, struct Header *headerStored, struct Node *no
       printf("S got Midway_Reply with incorrect SID\n");
       printf("\033[0m");
     }
-    if(memcmp(&header->pos, &headerStored->pos, 1) == 0){
+    if(posOk){
       printf("\033[0;32m");
       printf("S got Midway_Reply with correct H.pos\n");
       printf("\033[0m");
@@ -767,6 +1312,9 @@ void backAtS(struct Header *header, struct Header *headerStored, struct Node *no
       printf("\033[0m");
     }
   }
+  if(!sidOk || !posOk){
+    return rejectPacket(HANDLER_BACKATS, REJECT_AUTH, 0, NULL, NULL);
+  }
 
   //omiting the pointer comparison here -> see algorithm 5(line 6) for details
 
@@ -781,8 +1329,9 @@ void backAtS(struct Header *header, struct Header *headerStored, struct Node *no
   getHash(vectorToHash,nrep,32);
 
   //Assert(nrep == H.midway)
+  int midwayOk=tagsEqual(header->midway,nrep,16);
   if(info ==1){
-    if(memcmp(header->midway,nrep,16) == 0){
+    if(midwayOk){
       printf("\033[0;32m");
       printf("S could verify H.midway\n");
       printf("\033[0m");
@@ -793,12 +1342,19 @@ void backAtS(struct Header *header, struct Header *headerStored, struct Node *no
       printf("\033[0m");
     }
   }
+  if(!midwayOk){
+    return rejectPacket(HANDLER_BACKATS, REJECT_AUTH, 0, NULL, NULL);
+  }
 
   //ks−d = ECDH(pubd, privs)
   if(DEBUG ==1){
     printer("old sessionKey:    ",node->sessionKey,32);
   }
-  establishSessionKey(node,destNode);
+  if(!sessionSecret(node, destNode->pubKey, ecdh)){
+    // called again with the secret, and H.pos as it came in
+    header->pos=(header->pos + VECTOR_LENGTH - 1) % VECTOR_LENGTH;
+    return PACKET_OFFLOADED;
+  }
   if(DEBUG ==1){
     printer("new sessionKey:    ",node->sessionKey,32);
   }
@@ -822,8 +1378,9 @@ void backAtS(struct Header *header, struct Header *headerStored, struct Node *no
   memcpy(payload->at,tag1,TAG_SIZE);
   memcpy(payload->iv,freshIv,IV_SIZE);
   memcpy(payload->pubKeyS,node->pubKey,32);
-  memcpy(headerStored,header, sizeof *header);
+  //Hs <- H, again up to the caller
   free(freshIv);
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -838,32 +1395,37 @@ void backAtS(struct Header *header, struct Header *headerStored, struct Node *no
  that only deal with forwarding, NOT the switch from V1 to V2 conducted by
  Midway node W.
 **************************************************************************/
-struct Header forwardStoW(struct Header header, struct Node *node, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
+int forwardStoW(struct Header *header, struct Node *node, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
 {
   uint64_t a, b;
   a=__rdtsc();
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_FORWARDSTOW, REJECT_MALFORMED, a, c1, c2);
+  }
 
   struct gcm_context_data gctx;
   uint8_t tag2[TAG_SIZE];
   uint8_t myAad[AAD_SIZE]; /* 128 bit for SID + 128 bit for Cprev */
-  memcpy(myAad, header.sid, 16 * sizeof(uint8_t));
+  memcpy(myAad, header->sid, 16 * sizeof(uint8_t));
   uint8_t cPrev[TXT_SIZE];
   uint8_t posPrev;
-  if (header.pos == 0){
-    posPrev=(header.pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
+  if (header->pos == 0){
+    posPrev=(header->pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
   }
   else{
-    posPrev=(header.pos -1) % VECTOR_LENGTH;
+    posPrev=(header->pos -1) % VECTOR_LENGTH;
   }
 
-  memcpy(cPrev, header.v1[posPrev].ct, TXT_SIZE);
+  memcpy(cPrev, header->v1[posPrev].ct, TXT_SIZE);
   memcpy(myAad + 16, cPrev, TXT_SIZE * sizeof(uint8_t));
 
   uint8_t pt2[TXT_SIZE];
-  aes_gcm_dec_256(&gkey, &gctx, pt2, header.v1[header.pos].ct, TXT_SIZE, header.v1[header.pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  aes_gcm_dec_256(&gkey, &gctx, pt2, header->v1[header->pos].ct, TXT_SIZE, header->v1[header->pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
 
+  int tagOk=tagsEqual(header->v1[header->pos].at, tag2, TAG_SIZE);
+  int posOk=header->pos == pt2[9];
   if(info ==1){
-    if(memcmp(&header.pos,pt2+9,1) == 0)
+    if(posOk)
     {
       printf("\033[0;32m");
       printf("Node %d: correct posV1 recovered\n",node->id);
@@ -875,13 +1437,45 @@ struct Header forwardStoW(struct Header header, struct Node *node, struct gcm_ke
       printf("\033[0m");
     }
   }
+  if(!tagOk || !posOk){
+    return rejectPacket(HANDLER_FORWARDSTOW, REJECT_AUTH, a, c1, c2);
+  }
 
-  header.pos=(header.pos +1) % VECTOR_LENGTH;
+  header->pos=(header->pos +1) % VECTOR_LENGTH;
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
+  return PACKET_OK;
+}
 
-  return header;
+/**************************************************************************
+ W needs V2 as it initialised it once more on the way back, to tell which
+ entries the nodes between W and d changed. Instead of running the seed
+ through AES-GCM again, iAmWforwardToD keeps a 32 bit digest of every
+ entry, which is all that check needs, together with the SID of the
+ session it belongs to. iAmWbackToS only falls back to expanding the seed
+ if another session overwrote the digest in the meantime, which happens
+ when sessions overlap and W keeps no state per SID.
+**************************************************************************/
+void v2Digest(const struct Vectorelement *v2, uint8_t digest[VECTOR_LENGTH][4])
+{
+  for(int n=0;n<VECTOR_LENGTH;n++)
+  {
+    uint64_t h=0x9e3779b97f4a7c15ULL, w;
+    const uint8_t *parts[3]={v2[n].ct, v2[n].at, v2[n].iv};
+    const int lens[3]={TXT_SIZE, TAG_SIZE, IV_SIZE};
+    for(int p=0;p<3;p++)
+    {
+      for(int i=0;i<lens[p];i=i+8)
+      {
+        w=0;
+        memcpy(&w, parts[p]+i, lens[p]-i < 8 ? lens[p]-i : 8);
+        h=(h ^ w)*0xff51afd7ed558ccdULL;
+        h=h ^ (h >> 32);
+      }
+    }
+    memcpy(digest[n], &h, 4);
+  }
 }
 
 /**************************************************************************
@@ -891,7 +1485,7 @@ struct Header forwardStoW(struct Header header, struct Node *node, struct gcm_ke
 
  This function relates to "Algorithm 6" in the paper's appendix.
 **************************************************************************/
-void iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
+int iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
 {
   uint64_t a,b;
   a=__rdtsc();
@@ -914,6 +1508,11 @@ void iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv,
   uint8_t pMid[17];
   uint8_t* rp = malloc(TXT_SIZE * sizeof(uint8_t));
 
+  if(header->pos >= VECTOR_LENGTH){
+    free(rp);
+    return rejectPacket(HANDLER_IAMWFORWARDTOD, REJECT_MALFORMED, a, c1, c2);
+  }
+
   // Alg6:2-4
   if (header->pos == 0){
     posPrev=(header->pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
@@ -927,12 +1526,14 @@ void iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv,
   memcpy(myAad + 16, cPrev, TXT_SIZE * sizeof(uint8_t));
 
   aes_gcm_dec_256(&gkey, &gctx, originalR, header->v1[header->pos].ct, TXT_SIZE, header->v1[header->pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  int entryOk=tagsEqual(header->v1[header->pos].at, tag2, TAG_SIZE) && originalR[9] < VECTOR_LENGTH && originalR[10] < VECTOR_LENGTH;
 
   // Alg6:6
   memcpy(encHdest,header->dest,4);
   aes_gcm_dec_256(&gkey, &gctx, header->dest, encHdest, 4, node->midwayIv, header->sid, 16, tag2, TAG_SIZE);
+  int destOk=tagsEqual(tag2, node->midwayAt, TAG_SIZE);
   if(info == 1){
-    if(memcmp(tag2, node->midwayAt, 16) == 0){
+    if(destOk){
       printf("\033[0;32m");
       printf("W: H.dest successfully reconstructed\n");
       printf("\033[0m");
@@ -943,6 +1544,10 @@ void iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv,
       printf("\033[0m");
     }
   }
+  if(!entryOk || !destOk){
+    free(rp);
+    return rejectPacket(HANDLER_IAMWFORWARDTOD, REJECT_AUTH, a, c1, c2);
+  }
 
   // Alg 6:8
   while(lenV2>16)
@@ -952,6 +1557,8 @@ void iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv,
     lenV2=lenV2-16;
     offset=offset+16;
   }
+  // the tail shorter than a seed is zero, as in the fallback of iAmWbackToS
+  memset(seedVector+offset,0,lenV2);
   // this is for the CPRNG
   //Alg 6:7
   // now encrypt the seed vector
@@ -967,6 +1574,8 @@ void iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv,
     memcpy(header->v2[n].iv,encSeedVector+offset,IV_SIZE);
     offset=offset+IV_SIZE;
   }
+  v2Digest(header->v2, node->midwayV2);
+  memcpy(node->midwayV2Sid, header->sid, 16);
 
   // Alg 6:9
   uint8_t distToD=6; /* fixed, counted 4 to 13 while omitting 5,6,7 as the lead to helper*/
@@ -1023,6 +1632,7 @@ void iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv,
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
   free(rp);
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -1032,10 +1642,13 @@ void iAmWforwardToD(struct Header *header, struct Node *node, uint8_t *freshIv,
 
  This function relates to "Algorithm 7" in the paper's appendix.
 **************************************************************************/
-struct Header wToD(struct Header header, struct Node node, struct gcm_key_data gkey, uint8_t *freshIv, uint64_t * c1, uint64_t * c2)
+int wToD(struct Header *header, struct Node *node, struct gcm_key_data gkey, uint8_t *freshIv, uint64_t * c1, uint64_t * c2)
 {
   uint64_t a, b;
   a=__rdtsc();
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_WTOD, REJECT_MALFORMED, a, c1, c2);
+  }
 
   struct gcm_context_data gctx;
   uint8_t ingres[4], egres[4], pType, posV1, posV2;
@@ -1061,7 +1674,7 @@ struct Header wToD(struct Header header, struct Node node, struct gcm_key_data g
   }
 
   pType=0;
-  posV2=header.pos;
+  posV2=header->pos;
   /* the following will generate a number that is beyond the array size, thus is obvious nonsense that can be detected as such */
   posV1=rand() % 256 + VECTOR_LENGTH;
 
@@ -1087,16 +1700,16 @@ struct Header wToD(struct Header header, struct Node node, struct gcm_key_data g
   }
 
   // create authentication data
-  memcpy(myAad, header.sid, 16);
+  memcpy(myAad, header->sid, 16);
 
-  if (header.pos == 0){
-    posPrev=(header.pos + VECTOR_LENGTH -1);
+  if (header->pos == 0){
+    posPrev=(header->pos + VECTOR_LENGTH -1);
   }
   else{
-    posPrev=(header.pos -1);
+    posPrev=(header->pos -1);
   }
 
-  memcpy(cPrev, header.v2[posPrev].ct, TXT_SIZE);
+  memcpy(cPrev, header->v2[posPrev].ct, TXT_SIZE);
   memcpy(myAad + 16, cPrev, TXT_SIZE);
 
   aes_gcm_enc_256(&gkey, &gctx, myCt, rp, TXT_SIZE, freshIv, myAad, AAD_SIZE, tag1, TAG_SIZE);
@@ -1107,78 +1720,193 @@ struct Header wToD(struct Header header, struct Node node, struct gcm_key_data g
   }
 
   // now save that stuff to the header an increase pos
-  memcpy(header.v2[header.pos].ct, myCt, TXT_SIZE);
-  memcpy(header.v2[header.pos].iv, freshIv, IV_SIZE);
-  memcpy(header.v2[header.pos].at, tag1, TAG_SIZE);
+  memcpy(header->v2[header->pos].ct, myCt, TXT_SIZE);
+  memcpy(header->v2[header->pos].iv, freshIv, IV_SIZE);
+  memcpy(header->v2[header->pos].at, tag1, TAG_SIZE);
 
-  header.pos=(header.pos + 1) % VECTOR_LENGTH;
+  header->pos=(header->pos + 1) % VECTOR_LENGTH;
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
   free(rp);
-  return header;
+  return PACKET_OK;
 }
 
 /**************************************************************************
- This function handles operations upon arrival at d. These comprise
- asserting the SID, establishing the session key with s and preparing data
- for checking at s later.
-
- This function relates to "Algorithm 8" in the paper's appendix.
+ d turns vectorSafe = Enc(V1) into Enc(V1||V2) under a fresh IV. Instead
+ of decrypting V1 into one buffer, serialising the live V1 and V2 into
+ another and encrypting all of that, the entries are serialised one at a
+ time: an entry of V1 is compared with the plaintext of its part of
+ vectorSafe and encrypted right back into the same place, the entries of
+ V2 follow. GCM carries its state from one entry to the next, so this is
+ a single pass over the data with nothing buffered beyond one entry. The
+ new ciphertext has replaced the old one by the time the tag is known,
+ which is fine since a packet that fails is dropped.
 **************************************************************************/
-void iAmD(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm_key_data gkey, struct Payload *payload, uint64_t * c1, uint64_t * c2,int info)
+#define ENTRY_SIZE (TXT_SIZE+IV_SIZE+TAG_SIZE)
+
+struct Reencrypt {
+  struct gcm_context_data dec;
+  struct gcm_context_data enc;
+  uint8_t diff;
+};
+
+void reencryptInit(struct Reencrypt *r, const struct gcm_key_data *gkey, uint8_t *ivIn, uint8_t *ivOut, const uint8_t *aad, int aadLen)
 {
-  uint64_t a, b;
-  a=__rdtsc();
-  uint8_t digest[32];
-  uint8_t tag2[TAG_SIZE];
-  int ctLen=VECTOR_LENGTH*(IV_SIZE+TXT_SIZE+TAG_SIZE);
-  struct gcm_context_data gctx;
-  uint8_t ptV1[ctLen];
-  uint8_t currentV1[2*ctLen];
+  aes_gcm_init_256(gkey, &r->dec, ivIn, aad, aadLen);
+  aes_gcm_init_256(gkey, &r->enc, ivOut, aad, aadLen);
+  r->diff=0;
+}
 
-  // Alg 8:2
-  getHash(payload->pubKeyS,digest,32);
-  if(info ==1){
-    if(memcmp(header->sid, digest, 16) == 0)
+/* decrypts len bytes of in (unless NULL), compares them with pt and encrypts pt to out, which may be in */
+void reencryptUpdate(struct Reencrypt *r, const struct gcm_key_data *gkey, uint8_t *out, const uint8_t *in, const uint8_t *pt, int len)
+{
+  uint8_t old[ENTRY_SIZE];
+
+  if(in != NULL){
+    aes_gcm_dec_256_update(gkey, &r->dec, old, in, len);
+    for(int i=0;i<len;i++)
     {
-      printf("\033[0;32m");
-      printf("D: SID and PubS fit\n");
-      printf("\033[0m");
-    }
-    else{
-      printf("\033[0;31m");
-      printf("D: SID and PubS do not fit\n");
-      printf("\033[0m");
+      r->diff=r->diff | (old[i] ^ pt[i]);
     }
   }
+  aes_gcm_enc_256_update(gkey, &r->enc, out, pt, len);
+}
 
-  // Alg 8:3
-  curve25519_donna(node->sessionKey, node->privKey, payload->pubKeyS);
+/* checks tagIn, writes the new tag to tagOut (which may be tagIn) and returns whether the plaintext matched */
+int reencryptFinalize(struct Reencrypt *r, const struct gcm_key_data *gkey, const uint8_t *tagIn, uint8_t *tagOut, int *tagOk)
+{
+  uint8_t tag[TAG_SIZE];
 
-  // Alg 8:4
-  aes_gcm_pre_256(node->sessionKey, &gkey);
-  aes_gcm_dec_256(&gkey, &gctx, ptV1, payload->vectorSafe, ctLen, payload->iv, header->sid, 16, tag2, TAG_SIZE);
+  aes_gcm_dec_256_finalize(gkey, &r->dec, tag, TAG_SIZE);
+  *tagOk=tagsEqual(tagIn, tag, TAG_SIZE);
+  aes_gcm_enc_256_finalize(gkey, &r->enc, tagOut, TAG_SIZE);
+  return r->diff == 0;
+}
 
-  if(info ==1){
-    if(memcmp(payload->at, tag2, 16) == 0)
-    {
-      printf("\033[0;32m");
-      printf("D: Decrypt V1 with correct Tag\n");
-      printf("\033[0m");
-    }
-    else{
+/* Alg 8:4-6 in one pass, returns whether vectorSafe held the live V1 */
+int reencryptVectorSafe(const struct gcm_key_data *gkey, struct Header *header, struct Payload *payload, uint8_t *freshIv, int *tagOk)
+{
+  struct Reencrypt r;
+  uint8_t entry[ENTRY_SIZE];
+  int offset=0;
+
+  reencryptInit(&r, gkey, payload->iv, freshIv, header->sid, 16);
+  for(int n=0;n<VECTOR_LENGTH;n++)
+  {
+    vectorToByteArrayEntry(&header->v1[n], entry);
+    reencryptUpdate(&r, gkey, payload->vectorSafe+offset, payload->vectorSafe+offset, entry, ENTRY_SIZE);
+    offset=offset+ENTRY_SIZE;
+  }
+  for(int n=0;n<VECTOR_LENGTH;n++)
+  {
+    vectorToByteArrayEntry(&header->v2[n], entry);
+    reencryptUpdate(&r, gkey, payload->vectorSafe+offset, NULL, entry, ENTRY_SIZE);
+    offset=offset+ENTRY_SIZE;
+  }
+  return reencryptFinalize(&r, gkey, payload->at, payload->at, tagOk);
+}
+
+/**************************************************************************
+ The same for a batch of handshakes at a busy d. ISA-L has no multi-buffer
+ GCM, so what a batch gains is that the header and payload of the next
+ handshake are on their way into the cache while the current one is
+ re-encrypted.
+**************************************************************************/
+struct ReencryptJob {
+  struct gcm_key_data gkey;
+  struct Header *header;
+  struct Payload *payload;
+  uint8_t *freshIv;
+  int tagOk;
+  int v1Ok;
+};
+
+static inline void prefetchRange(const void *p, size_t len)
+{
+  for(size_t off=0;off<len;off=off+64)
+  {
+    __builtin_prefetch((const uint8_t *)p+off, 1);
+  }
+}
+
+void reencryptBatch(struct ReencryptJob *jobs, int n)
+{
+  for(int i=0;i<n;i++)
+  {
+    if(i+1 < n){
+      prefetchRange(jobs[i+1].header->v1, sizeof jobs[i+1].header->v1);
+      prefetchRange(jobs[i+1].header->v2, sizeof jobs[i+1].header->v2);
+      prefetchRange(jobs[i+1].payload, sizeof *jobs[i+1].payload);
+    }
+    jobs[i].v1Ok=reencryptVectorSafe(&jobs[i].gkey, jobs[i].header, jobs[i].payload, jobs[i].freshIv, &jobs[i].tagOk);
+  }
+}
+
+/**************************************************************************
+ This function handles operations upon arrival at d. These comprise
+ asserting the SID, establishing the session key with s and preparing data
+ for checking at s later.
+
+ This function relates to "Algorithm 8" in the paper's appendix.
+**************************************************************************/
+int iAmD(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm_key_data gkey, struct Payload *payload, uint64_t * c1, uint64_t * c2,int info, struct Ecdh *ecdh)
+{
+  uint64_t a, b;
+  a=__rdtsc();
+  uint8_t digest[32];
+  int tagOk, v1Ok;
+
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_IAMD, REJECT_MALFORMED, a, c1, c2);
+  }
+
+  // Alg 8:2, before spending an ECDH on the packet
+  getHash(payload->pubKeyS,digest,32);
+  int sidOk=tagsEqual(header->sid, digest, 16);
+  if(info ==1){
+    if(sidOk)
+    {
+      printf("\033[0;32m");
+      printf("D: SID and PubS fit\n");
+      printf("\033[0m");
+    }
+    else{
       printf("\033[0;31m");
-      printf("D: Decrypt V1 with incorrect Tag\n");
+      printf("D: SID and PubS do not fit\n");
       printf("\033[0m");
     }
   }
+  if(!sidOk){
+    return rejectPacket(HANDLER_IAMD, REJECT_AUTH, a, c1, c2);
+  }
 
-  // Alg 8:5
-  vectorToByteArray(header->v1,currentV1);
+  // Alg 8:3
+  if(!sessionSecret(node, payload->pubKeyS, ecdh)){
+    return PACKET_OFFLOADED;
+  }
 
+  // Alg 8:4-6, decrypt V1, assert it and encrypt V1||V2 in one go
+  aes_gcm_pre_256(node->sessionKey, &gkey);
+  v1Ok=reencryptVectorSafe(&gkey,header,payload,freshIv,&tagOk);
+  if(info ==1){
+    if(tagOk)
+    {
+      printf("\033[0;32m");
+      printf("D: Decrypt V1 with correct Tag\n");
+      printf("\033[0m");
+    }
+    else{
+      printf("\033[0;31m");
+      printf("D: Decrypt V1 with incorrect Tag\n");
+      printf("\033[0m");
+    }
+  }
+  if(!tagOk){
+    return rejectPacket(HANDLER_IAMD, REJECT_AUTH, a, c1, c2);
+  }
   if(info ==1){
-    if(memcmp(currentV1, ptV1, ctLen) == 0)
+    if(v1Ok)
     {
       printf("\033[0;32m");
       printf("D: Assert V1 OK\n");
@@ -1190,11 +1918,9 @@ void iAmD(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm
       printf("\033[0m");
     }
   }
-
-  // Alg 8:6
-  vectorToByteArray(header->v2,ptV1);
-  memcpy(currentV1+ctLen,ptV1,ctLen);
-  aes_gcm_enc_256(&gkey, &gctx, payload->vectorSafe, currentV1, 2*ctLen, freshIv, header->sid, 16, payload->at, TAG_SIZE);
+  if(!v1Ok){
+    return rejectPacket(HANDLER_IAMD, REJECT_AUTH, a, c1, c2);
+  }
   memcpy(payload->iv,freshIv,IV_SIZE);
 
   // Alg 8:7
@@ -1211,6 +1937,7 @@ void iAmD(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm
   else{
     header->pos=(header->pos -1);
   }
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -1222,36 +1949,42 @@ void iAmD(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm
  appendix, that handle the forwarding of the message from d to W but NOT
  the operations upon arrivel at W.
 **************************************************************************/
-struct Header dToW(struct Header header, struct Node *node, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2)
+int dToW(struct Header *header, struct Node *node, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2)
 {
   uint64_t a, b;
   a=__rdtsc();
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_DTOW, REJECT_MALFORMED, a, c1, c2);
+  }
 
   struct gcm_context_data gctx;
 
   uint8_t tag2[TAG_SIZE];
   uint8_t myAad[AAD_SIZE]; /* 128 bit for SID + 128 bit for Cprev */
-  memcpy(myAad, header.sid, 16 * sizeof(uint8_t));
+  memcpy(myAad, header->sid, 16 * sizeof(uint8_t));
   uint8_t cPrev[TXT_SIZE];
   uint8_t posPrev;
-  if (header.pos == 0){
-    posPrev=(header.pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
+  if (header->pos == 0){
+    posPrev=(header->pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
   }
   else{
-    posPrev=(header.pos -1) % VECTOR_LENGTH;
+    posPrev=(header->pos -1) % VECTOR_LENGTH;
   }
 
-  memcpy(cPrev, header.v2[posPrev].ct, TXT_SIZE);
+  memcpy(cPrev, header->v2[posPrev].ct, TXT_SIZE);
   memcpy(myAad + 16, cPrev, TXT_SIZE * sizeof(uint8_t));
 
   uint8_t pt2[TXT_SIZE];
-  aes_gcm_dec_256(&gkey, &gctx, pt2, header.v2[header.pos].ct, TXT_SIZE, header.v2[header.pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  aes_gcm_dec_256(&gkey, &gctx, pt2, header->v2[header->pos].ct, TXT_SIZE, header->v2[header->pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  if(!tagsEqual(header->v2[header->pos].at, tag2, TAG_SIZE)){
+    return rejectPacket(HANDLER_DTOW, REJECT_AUTH, a, c1, c2);
+  }
 
-  header.pos=posPrev;
+  header->pos=posPrev;
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
-  return header;
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -1263,7 +1996,7 @@ struct Header dToW(struct Header header, struct Node *node, struct gcm_key_data
  This function relates to the part of "Algorithm 9" in the paper's
  appendix, where arrival at W is covered.
 **************************************************************************/
-void iAmWbackToS(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
+int iAmWbackToS(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
 {
   uint64_t a,b;
   a=__rdtsc();
@@ -1274,17 +2007,17 @@ void iAmWbackToS(struct Header *header, struct Node *node, uint8_t *freshIv, str
   uint8_t posV1, posV2, posPrevV2, posPrevV1;
   uint8_t myAad[AAD_SIZE];
   uint8_t pMid[17];
-  int lenV2=VECTOR_LENGTH*(IV_SIZE+TXT_SIZE+TAG_SIZE);
-  int copyLenV2=lenV2;
-  uint8_t seedVector[lenV2];
-  uint8_t encSeedVector[lenV2];
-  uint8_t seed[16];
+  uint8_t now[VECTOR_LENGTH][4];
   uint8_t aadForMAC[2*TXT_SIZE+16];
-  int offset=0;
+  int changed=0;
   uint8_t dummyCT[2], dummyPT[2];
 
   //generateIv(node->midwayIv4);
 
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_IAMWBACKTOS, REJECT_MALFORMED, a, c1, c2);
+  }
+
   // Alg 9:2
   posV2=header->pos;
   if (header->pos == 0){
@@ -1299,8 +2032,10 @@ void iAmWbackToS(struct Header *header, struct Node *node, uint8_t *freshIv, str
   memcpy(myAad, header->sid, 16 * sizeof(uint8_t));
   memcpy(myAad + 16, cPrevV2, TXT_SIZE * sizeof(uint8_t));
   aes_gcm_dec_256(&gkey, &gctx, originalRV2, header->v2[header->pos].ct, TXT_SIZE, header->v2[header->pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  int entryOk=tagsEqual(header->v2[header->pos].at, tag2, TAG_SIZE);
+  int posOk=originalRV2[10] == posV2;
   if(info == 1){
-    if(memcmp(originalRV2+10, &posV2, 1) == 0){
+    if(posOk){
       printf("\033[0;32m");
       printf("W: Pos ok\n");
       printf("\033[0m");
@@ -1311,11 +2046,17 @@ void iAmWbackToS(struct Header *header, struct Node *node, uint8_t *freshIv, str
       printf("\033[0m");
     }
   }
+  if(!entryOk || !posOk || originalRV2[9] >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_IAMWBACKTOS, REJECT_AUTH, a, c1, c2);
+  }
 
   // Alg 9:7-8
   memcpy(&posV1,originalRV2+9,1);
   memcpy(myAad + 16, header->v1[posV1].ct, TXT_SIZE * sizeof(uint8_t));
   aes_gcm_dec_256(&gkey, &gctx, pMid, header->midway, 17, node->midwayIv3, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  if(!tagsEqual(tag2, node->midwayAt, TAG_SIZE)){
+    return rejectPacket(HANDLER_IAMWBACKTOS, REJECT_AUTH, a, c1, c2);
+  }
 
   if (posV1 == 0){
     posPrevV1=(posV1 + VECTOR_LENGTH -1);
@@ -1324,26 +2065,41 @@ void iAmWbackToS(struct Header *header, struct Node *node, uint8_t *freshIv, str
     posPrevV1=(posV1 -1);
   }
 
-  // Alg 9:9-17 we omit the check for number of changed entries but generate the the original V2 as if we would
-  memcpy(seed,pMid,16);
-
-  while(lenV2>16)
-  {
-    memcpy(seedVector+offset,seed,16);
-    lenV2=lenV2-16;
-    offset=offset+16;
+  // Alg 9:9-17 we omit the check for number of changed entries but count them against the original V2
+  if(memcmp(node->midwayV2Sid, header->sid, 16) != 0){
+    // the digest belongs to another session, so V2 is expanded from the seed once more
+    int lenV2=VECTOR_LENGTH*(IV_SIZE+TXT_SIZE+TAG_SIZE);
+    uint8_t seedVector[lenV2];
+    struct Vectorelement original[VECTOR_LENGTH];
+    int offset=0;
+    for(offset=0;offset+16<lenV2;offset=offset+16)
+    {
+      memcpy(seedVector+offset,pMid,16);
+    }
+    memset(seedVector+offset,0,lenV2-offset);
+    aes_gcm_enc_256(&gkey, &gctx, seedVector, seedVector, lenV2, node->midwayIv2, header->sid, 16, tag2, TAG_SIZE);
+    offset=0;
+    for(int n=0;n<VECTOR_LENGTH;n++)
+    {
+      memcpy(original[n].ct,seedVector+offset,TXT_SIZE);
+      offset=offset+TXT_SIZE;
+      memcpy(original[n].at,seedVector+offset,TAG_SIZE);
+      offset=offset+TAG_SIZE;
+      memcpy(original[n].iv,seedVector+offset,IV_SIZE);
+      offset=offset+IV_SIZE;
+    }
+    v2Digest(original, node->midwayV2);
+    memcpy(node->midwayV2Sid, header->sid, 16);
   }
-  // TODO, hier muss doch noch der rest kopiert werden!?!?!
-  aes_gcm_enc_256(&gkey, &gctx, encSeedVector, seedVector, copyLenV2, node->midwayIv2, header->sid, 16, tag2, TAG_SIZE);
-  offset=0;
+  v2Digest(header->v2, now);
   for(int n=0;n<VECTOR_LENGTH;n++)
   {
-    memcpy(seedVector+offset,encSeedVector+offset,TXT_SIZE);
-    offset=offset+TXT_SIZE;
-    memcpy(seedVector+offset,encSeedVector+offset,TAG_SIZE);
-    offset=offset+TAG_SIZE;
-    memcpy(seedVector+offset,encSeedVector+offset,IV_SIZE);
-    offset=offset+IV_SIZE;
+    changed=changed+(memcmp(now[n], node->midwayV2[n], 4) != 0);
+  }
+  if(info == 1){
+    printf("\033[0;32m");
+    printf("W: %d entries of V2 changed since W initialised it\n",changed);
+    printf("\033[0m");
   }
 
   // Alg 9:18-21
@@ -1360,7 +2116,7 @@ void iAmWbackToS(struct Header *header, struct Node *node, uint8_t *freshIv, str
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
-
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -1370,7 +2126,7 @@ void iAmWbackToS(struct Header *header, struct Node *node, uint8_t *freshIv, str
  This function relates to the part of "Algorithm 11" in the paper's
  appendix, where arrival at W is covered.
 **************************************************************************/
-void finishAtS(struct Header *header, struct Header *headerStored, struct Node *node, struct Node *destNode, struct Payload *payload, struct gcm_key_data gkey, uint8_t *freshIv, uint64_t * c1, uint64_t * c2,int info)
+int finishAtS(struct Header *header, struct Header *headerStored, struct Node *node, struct Node *destNode, struct Payload *payload, struct gcm_key_data gkey, uint8_t *freshIv, uint64_t * c1, uint64_t * c2,int info)
 {
   // this is a work-around since our entryAS, on the way from s to M, does not check if its predecessor was the client, therefore has NOT R.type=="entryNode" and therefore does not know that there is NO NEED to decrement H.pos on the way back.... i.e. it decrements one too many times, so we increment manually here again
   header->pos=(header->pos + 1) % VECTOR_LENGTH;
@@ -1385,8 +2141,9 @@ void finishAtS(struct Header *header, struct Header *headerStored, struct Node *
 
   //Alg 11:3
   aes_gcm_dec_256(&gkey, &gctx, bothV, payload->vectorSafe, 2*ctLen, payload->iv, header->sid, 16, tag1, TAG_SIZE);
+  int tagOk=tagsEqual(payload->at, tag1, TAG_SIZE);
   if(info ==1){
-    if(memcmp(payload->at, tag1, TAG_SIZE) == 0)
+    if(tagOk)
     {
       printf("\033[0;32m");
       printf("S: TAG from V1||V2 ok\n");
@@ -1398,12 +2155,17 @@ void finishAtS(struct Header *header, struct Header *headerStored, struct Node *
       printf("\033[0m");
     }
   }
+  if(!tagOk){
+    return rejectPacket(HANDLER_FINISHATS, REJECT_AUTH, a, c1, c2);
+  }
 
   // Alg 11:4-5 comparison to stored header is missing here since stored header is incomplete (no deep copy)
   vectorToByteArray(header->v1,derivedV1);
   vectorToByteArray(header->v2,derivedV2);
+  int v1Ok=memcmp(derivedV1, bothV, ctLen) == 0;
+  int v2Ok=memcmp(derivedV2, bothV+ctLen, ctLen) == 0;
   if(info ==1){
-    if(memcmp(derivedV1, bothV, ctLen) == 0)
+    if(v1Ok)
     {
       printf("\033[0;32m");
       printf("S: V1 is correct\n");
@@ -1415,7 +2177,7 @@ void finishAtS(struct Header *header, struct Header *headerStored, struct Node *
       printf("\033[0m");
     }
 
-    if(memcmp(derivedV2, bothV+ctLen, ctLen) == 0)
+    if(v2Ok)
     {
       printf("\033[0;32m");
       printf("S: V2 is correct\n");
@@ -1427,6 +2189,9 @@ void finishAtS(struct Header *header, struct Header *headerStored, struct Node *
       printf("\033[0m");
     }
   }
+  if(!v1Ok || !v2Ok){
+    return rejectPacket(HANDLER_FINISHATS, REJECT_AUTH, a, c1, c2);
+  }
   if(DEBUG ==1){
     printer("derived V2:   \n",derivedV2,ctLen);
     printer("retrieved V2: \n",bothV+ctLen,ctLen);
@@ -1438,6 +2203,7 @@ void finishAtS(struct Header *header, struct Header *headerStored, struct Node *
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -1448,7 +2214,7 @@ void finishAtS(struct Header *header, struct Header *headerStored, struct Node *
  This function relates to the part of "Algorithm 12" where Midway node W
  performs the switch from V1 to V2.
 **************************************************************************/
-void iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
+int iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *freshIv, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
 {
   uint64_t a,b;
   a=__rdtsc();
@@ -1460,6 +2226,9 @@ void iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *fre
   uint8_t posPrevV1, posV1, posV2, dummyCT[2], dummyPT[2];
   uint8_t aadForMAC[2*TXT_SIZE+16];
   //aes_gcm_pre_256(node->longTermKey, &gkey);
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_IAMWTRANSMISSIONTOD2, REJECT_MALFORMED, a, c1, c2);
+  }
   posV1=header->pos;
   if (header->pos == 0){
     posPrevV1=(header->pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
@@ -1476,8 +2245,10 @@ void iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *fre
 
   memcpy(&posV2,pt2+10,1);
 
+  int entryOk=tagsEqual(header->v1[header->pos].at, tag2, TAG_SIZE);
+  int posOk=header->pos == pt2[9];
   if(info == 1){
-    if(memcmp(&header->pos,pt2+9,1) == 0)
+    if(posOk)
     {
       printf("\033[0;32m");
       printf("W: correct posV1 recovered\n");
@@ -1489,6 +2260,9 @@ void iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *fre
       printf("\033[0m");
     }
   }
+  if(!entryOk || !posOk || posV2 >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_IAMWTRANSMISSIONTOD2, REJECT_AUTH, a, c1, c2);
+  }
 
   // Alg 12:7-10
   memcpy(aadForMAC,header->v1[posV1].ct,TXT_SIZE);
@@ -1496,8 +2270,9 @@ void iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *fre
   memcpy(aadForMAC+TXT_SIZE+TXT_SIZE,header->sid,16);
   aes_gcm_enc_256(&gkey, &gctx, dummyCT, dummyPT, 0, node->midwayIv4, aadForMAC, 2*TXT_SIZE+16, tag2, TAG_SIZE);
 
+  int tagOk=tagsEqual(header->midway,tag2,TAG_SIZE);
   if(info == 1){
-    if(memcmp(header->midway,tag2,TAG_SIZE) == 0)
+    if(tagOk)
     {
       printf("\033[0;32m");
       printf("W: MAC V1||V2 correct\n");
@@ -1509,6 +2284,9 @@ void iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *fre
       printf("\033[0m");
     }
   }
+  if(!tagOk){
+    return rejectPacket(HANDLER_IAMWTRANSMISSIONTOD2, REJECT_AUTH, a, c1, c2);
+  }
 
   // Alg 12:11-12
   header->status=TRANSMISSION_PHASE_TO_D2;
@@ -1517,6 +2295,7 @@ void iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *fre
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -1525,32 +2304,37 @@ void iAmWTransmissionToD2(struct Header *header, struct Node *node, uint8_t *fre
 
  This function relates to "Algorithm 13" in the paper's appendix.
 **************************************************************************/
-struct Header forwardWtoD(struct Header header, struct Node *node, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
+int forwardWtoD(struct Header *header, struct Node *node, struct gcm_key_data gkey, uint64_t * c1, uint64_t * c2,int info)
 {
   uint64_t a, b;
   a=__rdtsc();
+  if(header->pos >= VECTOR_LENGTH){
+    return rejectPacket(HANDLER_FORWARDWTOD, REJECT_MALFORMED, a, c1, c2);
+  }
 
   struct gcm_context_data gctx;
   uint8_t tag2[TAG_SIZE];
   uint8_t myAad[AAD_SIZE]; /* 128 bit for SID + 128 bit for Cprev */
-  memcpy(myAad, header.sid, 16 * sizeof(uint8_t));
+  memcpy(myAad, header->sid, 16 * sizeof(uint8_t));
   uint8_t cPrev[TXT_SIZE];
   uint8_t posPrev;
-  if (header.pos == 0){
-    posPrev=(header.pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
+  if (header->pos == 0){
+    posPrev=(header->pos + VECTOR_LENGTH -1) % VECTOR_LENGTH;
   }
   else{
-    posPrev=(header.pos -1) % VECTOR_LENGTH;
+    posPrev=(header->pos -1) % VECTOR_LENGTH;
   }
 
-  memcpy(cPrev, header.v2[posPrev].ct, TXT_SIZE);
+  memcpy(cPrev, header->v2[posPrev].ct, TXT_SIZE);
   memcpy(myAad + 16, cPrev, TXT_SIZE * sizeof(uint8_t));
 
   uint8_t pt2[TXT_SIZE];
-  aes_gcm_dec_256(&gkey, &gctx, pt2, header.v2[header.pos].ct, TXT_SIZE, header.v2[header.pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
+  aes_gcm_dec_256(&gkey, &gctx, pt2, header->v2[header->pos].ct, TXT_SIZE, header->v2[header->pos].iv, myAad, AAD_SIZE, tag2, TAG_SIZE);
 
+  int tagOk=tagsEqual(header->v2[header->pos].at, tag2, TAG_SIZE);
+  int posOk=header->pos == pt2[10];
   if(info ==1){
-    if(memcmp(&header.pos,pt2+10,1) == 0)
+    if(posOk)
     {
       printf("\033[0;32m");
       printf("Node %d: correct posV2 recovered\n",node->id);
@@ -1562,13 +2346,15 @@ struct Header forwardWtoD(struct Header header, struct Node *node, struct gcm_ke
       printf("\033[0m");
     }
   }
+  if(!tagOk || !posOk){
+    return rejectPacket(HANDLER_FORWARDWTOD, REJECT_AUTH, a, c1, c2);
+  }
 
-  header.pos=(header.pos +1) % VECTOR_LENGTH;
+  header->pos=(header->pos +1) % VECTOR_LENGTH;
   b=__rdtsc();
   memcpy(c1,&a,8);
   memcpy(c2,&b,8);
-
-  return header;
+  return PACKET_OK;
 }
 
 /**************************************************************************
@@ -1834,124 +2620,5271 @@ int test_gcm_std_vectors(void)
 }
 
 /**************************************************************************
- In the main method, the previously defined functions are combined to
- iterate through all steps of the protocol.
+* In the following, the methods above are wired up so that each node of the
+* path from main can run on its own: it receives a packet, picks the step
+* of the protocol it has to perform based on H.status and the neighbour
+* the packet came from, and hands the packet on to the next hop. This is
+* used by the node daemons that put real packet I/O underneath the
+* cryptographic operations (see udpMode).
 **************************************************************************/
-int main(int argc, char **argv)
+
+#define NEW_SESSION 0 /* status of the request that makes s open a session */
+#define NODE_S 0
+#define NODE_W 4
+#define NODE_M 7
+#define NODE_D 13
+#define NUM_OF_PATH_NODES 14
+#define PACKET_DELIVERED -1
+#define PACKET_DROP -2
+
+#define PHI_MAX_PATH 256
+
+/* The path a session takes: s = sm[0], M = sm[smLen-1], W = sm[midway] =
+wd[0] and d = wd[wdLen-1], as node ids. On its way back from W to s,
+MIDWAY_REPLY is told apart by the id it came from, so the ids on sm have
+to grow from s to M (see phiPathLayout). */
+struct PhiPath {
+  int sm[PHI_MAX_PATH];
+  int wd[PHI_MAX_PATH];
+  int smLen;
+  int wdLen;
+  int s, w, m, d;
+};
+
+/* the pre-determined path from main: s -> 1..6 -> M and W -> 8..12 -> d */
+static const struct PhiPath defaultPath={
+  .sm={NODE_S,1,2,3,NODE_W,5,6,NODE_M},
+  .wd={NODE_W,8,9,10,11,12,NODE_D},
+  .smLen=8,
+  .wdLen=7,
+  .s=NODE_S, .w=NODE_W, .m=NODE_M, .d=NODE_D
+};
+
+/**************************************************************************
+ Numbers the nodes of a path with smLen nodes from s to M, of which W is
+ the one at midway, and wdLen nodes from W to d: s to M are 0..smLen-1
+ and the nodes after W follow on from there. phiPathLayout(p,8,7,4) is
+ defaultPath.
+**************************************************************************/
+void phiPathLayout(struct PhiPath *p, int smLen, int wdLen, int midway)
 {
-  /**************************************************************************
-   Init of some needed variables and population of structs
-  **************************************************************************/
-  srand(time(NULL));
-  uint64_t c1, c2, rdTest1, rdTest2;
+  for(int i=0;i<smLen;i++)
+  {
+    p->sm[i]=i;
+  }
+  p->wd[0]=midway;
+  for(int i=1;i<wdLen;i++)
+  {
+    p->wd[i]=smLen+i-1;
+  }
+  p->smLen=smLen;
+  p->wdLen=wdLen;
+  p->s=0;
+  p->w=midway;
+  p->m=smLen-1;
+  p->d=p->wd[wdLen-1];
+}
 
-  // declare header struct
+/* This is what travels between the nodes. seq and t0 are only there for
+the load generator to match replies and to measure latency. */
+struct Packet {
+  uint32_t seq;
+  uint16_t from;
+  uint16_t reserved;
+  uint64_t t0;
   struct Header header;
-  struct Header headerStored;
   struct Payload payload;
+};
 
-  memset(&header, 0, sizeof header);
-  memset(&payload, 0, sizeof payload);
+/**************************************************************************
+* Packet buffer pool
+*
+* Packets are received into buffers from a fixed pool instead of into the
+* stack or a malloc'd scratch area. Every buffer has some headroom in
+* front of the packet, kept free for an outer encapsulation (e.g. an
+* IP/UDP tunnel header) so one can be written without moving the packet;
+* no engine adds one yet. Every buffer also has a reference
+* count so that a node can keep a packet without copying it. This is what
+* s does with the header it has to remember (Hs <- H in iAmS and backAtS):
+* it takes a reference on the buffer the header arrived in and the buffer
+* only goes back to the pool once the next session replaces it.
+*
+* The free list is a lock-free stack whose head carries a tag in its upper
+* 32 bits against ABA. The pool memory is placed on the NUMA node of the
+* thread that creates it, which is the thread that uses it.
+**************************************************************************/
 
-  // init node keys and helper data
-  struct Node nodes[NUM_OF_NODES];
-  for (int i=0;i<NUM_OF_NODES;i++) {
-    nodes[i]=initializeNode(nodes[i],i);
-    initPubPriv(&nodes[i]);
+/* room for an outer encapsulation; keeps the packet itself 64 byte aligned */
+#define PKT_HEADROOM 56
+#define PBUF_NONE 0xffffffffU
+/* from linux/mempolicy.h */
+#ifndef MPOL_PREFERRED
+# define MPOL_PREFERRED 1
+#endif
+
+struct PacketBuf {
+  uint32_t refs;
+  uint32_t next;
+  uint8_t headroom[PKT_HEADROOM];
+  struct Packet pkt;
+} __attribute__((aligned(64)));
+
+struct PacketPool {
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t allocs __attribute__((aligned(64)));
+  uint64_t exhausted;
+  uint32_t inUse;
+  uint32_t peak;
+  uint32_t size __attribute__((aligned(64)));
+  int numaNode;
+  size_t bytes;
+  struct PacketBuf *bufs;
+};
 
-    generateIv(nodes[i].midwayIv);
-    generateIv(nodes[i].midwayIv2);
-    generateIv(nodes[i].midwayIv3);
-    generateIv(nodes[i].midwayIv4);
-    rdrand64_step(&rdTest1);
-    rdrand64_step(&rdTest2);
-    memcpy(nodes[i].midwaySeed,&rdTest1,8);
-    memcpy(nodes[i].midwaySeed+8,&rdTest2,8);
+/**************************************************************************
+ Creates a pool of size buffers on the NUMA node of the calling thread.
+ The binding is only a preference, so a node running out of memory falls
+ back to its neighbours rather than failing.
+**************************************************************************/
+struct PacketPool *pbufPoolCreate(uint32_t size)
+{
+  struct PacketPool *pool=aligned_alloc(64, sizeof *pool);
+  unsigned cpu=0, numaNode=0;
+  if(pool == NULL){
+    return NULL;
   }
+  memset(pool, 0, sizeof *pool);
+  pool->bytes=(size_t)size*sizeof(struct PacketBuf);
+  pool->bufs=mmap(NULL, pool->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(pool->bufs == MAP_FAILED){
+    free(pool);
+    return NULL;
+  }
+  if(syscall(__NR_getcpu, &cpu, &numaNode, NULL) == 0 && numaNode < 64){
+    unsigned long mask=1UL << numaNode;
+    /* fails without CONFIG_NUMA, first touch below does the same then */
+    syscall(__NR_mbind, pool->bufs, pool->bytes, MPOL_PREFERRED, &mask, 64, 0);
+  }
+  pool->numaNode=numaNode;
+  pool->size=size;
 
-  uint8_t *freshIv;
-  freshIv = malloc(IV_SIZE);
-  uint8_t *freshIv2;
-  freshIv2 = malloc(IV_SIZE);
-  struct gcm_key_data gkey;
+  /* touch every page now so the fast path never faults */
+  for(uint32_t i=0;i<size;i++)
+  {
+    pool->bufs[i].refs=0;
+    pool->bufs[i].next=(i+1 < size) ? i+1 : PBUF_NONE;
+  }
+  pool->head=size ? 0 : PBUF_NONE;
+  return pool;
+}
 
-  /**************************************************************************
-   Test of library functions to ensure correct operation (taken from
-   reference implementation in isa-l_crypto)
-  **************************************************************************/
-  printf("\033[0;35m");
-  printf("1. Following are tests for the GCM operations of isa-l_crypto:\n");
-  printf("\033[0m");
+void pbufPoolDestroy(struct PacketPool *pool)
+{
+  if(pool == NULL){
+    return;
+  }
+  munmap(pool->bufs, pool->bytes);
+  free(pool);
+}
 
+/* Takes a buffer off the free list with a reference count of 1. Returns
+NULL if the pool is exhausted. */
+struct PacketBuf *pbufAlloc(struct PacketPool *pool)
+{
+  uint64_t old=__atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+  uint64_t new;
+  uint32_t index, inUse, peak;
+
+  do{
+    index=(uint32_t)old;
+    if(index == PBUF_NONE){
+      __atomic_fetch_add(&pool->exhausted, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    new=(((old >> 32) + 1) << 32) | __atomic_load_n(&pool->bufs[index].next, __ATOMIC_RELAXED);
+  }while(!__atomic_compare_exchange_n(&pool->head, &old, new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+  pool->bufs[index].refs=1;
+  __atomic_fetch_add(&pool->allocs, 1, __ATOMIC_RELAXED);
+  inUse=__atomic_add_fetch(&pool->inUse, 1, __ATOMIC_RELAXED);
+  peak=__atomic_load_n(&pool->peak, __ATOMIC_RELAXED);
+  while(inUse > peak && !__atomic_compare_exchange_n(&pool->peak, &peak, inUse, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return &pool->bufs[index];
+}
 
-  int errors = 0;
-	int seed;
+void pbufGet(struct PacketBuf *buf)
+{
+  __atomic_fetch_add(&buf->refs, 1, __ATOMIC_RELAXED);
+}
 
-	if (argc == 1)
-		seed = TEST_SEED;
-	else
-		seed = atoi(argv[1]);
+/* Drops a reference and returns the buffer to the pool with the last one. */
+void pbufPut(struct PacketPool *pool, struct PacketBuf *buf)
+{
+  uint32_t index=buf - pool->bufs;
+  uint64_t old, new;
 
-	srand(seed);
-	printf("SEED: %d\n", seed);
+  if(__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0){
+    return;
+  }
+  __atomic_fetch_sub(&pool->inUse, 1, __ATOMIC_RELAXED);
+  old=__atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+  do{
+    buf->next=(uint32_t)old;
+    new=(((old >> 32) + 1) << 32) | index;
+  }while(!__atomic_compare_exchange_n(&pool->head, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-	errors += test_gcm_std_vectors();
+/* Returns the buffer pkt lives in if it is one of this pool's, NULL otherwise. */
+struct PacketBuf *pbufOf(struct PacketPool *pool, struct Packet *pkt)
+{
+  uintptr_t p=(uintptr_t)pkt, base=(uintptr_t)pool->bufs;
+  if(p < base || p >= base + pool->bytes){
+    return NULL;
+  }
+  return &pool->bufs[(p - base) / sizeof(struct PacketBuf)];
+}
 
-	if (0 == errors)
-		printf("...Pass\n");
-	else
-		printf("...Fail\n");
+void pbufPoolPrint(struct PacketPool *pool)
+{
+  printf("Buffer pool:\t %u buffers of %zu bytes on NUMA node %d, %u in use, peak %u, %llu allocations, %llu times exhausted\n",
+         pool->size, sizeof(struct PacketBuf), pool->numaNode, pool->inUse, pool->peak,
+         (unsigned long long)pool->allocs, (unsigned long long)pool->exhausted);
+}
 
-  /**************************************************************************
-   Perform steps of the protocol for one path to be established
-  **************************************************************************/
-  printf("\033[0;35m");
-  printf("\n\n2. Session establishment with help of the dPHI protocol for one pre-determined path:\n");
-  printf("\033[0m");
+/**************************************************************************
+ Monotonic wall clock in nanoseconds, used where rdtsc does not work,
+ i.e. whenever a measurement spans several threads or cores.
+**************************************************************************/
+uint64_t nowNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
 
-  /* Initilization at the source */
-  iAmS(&nodes[0],&nodes[7],&nodes[13],&header,&payload,&headerStored);
-  if(DEBUG == 1){
-    headerprint(&header);
-    payloadprint(&payload);
-  }
+/**************************************************************************
+* Handshake admission at M
+*
+* iAmHelper spends an X25519 operation on every packet that reaches M, so
+* a burst of handshakes can take the whole core away from the forwarding
+* work that shares it. With DPHI_ADMIT set, M admits handshakes through a
+* token bucket per ingress, i.e. per neighbour the packet came from:
+*
+*   DPHI_ADMIT=rate[:burst[:queue[:tail|prio]]]
+*   DPHI_ADMIT_INGRESS=from=rate[/prio],...
+*
+* rate is in handshakes per second and applies to every ingress unless
+* overridden. A handshake without a token is deferred into a bounded
+* queue, holding a reference on the pool buffer it was received into, and
+* resumed by the engine once its ingress has a token again. When the
+* queue is full, tail drop drops the arriving handshake, while prio evicts
+* the newest of the queued ones with a lower priority, if there is one,
+* and serves the queue by priority. Engines without a pool cannot hold on
+* to a packet, they drop instead of deferring.
+**************************************************************************/
 
-  /* now the message is on its way from s to M and routing nodes create their routing entries within V1. Please note, that in this simple example, there is no real routing information since the route is predetermined. Therefore, fake values are "made up" that are handled like real data to measure real processing timings. */
-  for(int i=1;i<7;i++)
-  {
-    aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
-    generateIv(freshIv);
-    header=sToM(header, nodes[i], gkey, freshIv, &c1, &c2);
-  }
+#define PACKET_DEFERRED -3
 
-  /*aes gcm precomputation is not done for node 7 as this node does not need to do any cryptographic operation with its longterm key. Instead, it performd the DH key agreement and then uses the session key to decrypt the payload containg the real destination of the source.*/
-  header=iAmHelper(&nodes[7],header,payload, gkey, &c1, &c2,1);
+#define ADMIT_INGRESS 16
+#define ADMIT_QUEUE_MAX 256
+#define ADMIT_TAIL_DROP 0
+#define ADMIT_PRIORITY 1
 
-  /* This is for consistency checks to see if the protocol worked correctly this far. */
-  if(true){
-    if(memcmp(nodes[0].sessionKey, nodes[7].sessionKey, 32) == 0){
-      printf("\033[0;32m");
-      printf("S and M derived identical Session Key\n");
-      printf("\033[0m");
-    }
-    else{
-      printf("\033[0;31m");
-      printf("S and M could not derive identical Session Key\n");
-      printf("\033[0m");
-    }
+#define ADMIT_NOW 0
 
-    //check if M determines correct d from encrypted payload
-    if(memcmp(header.dest, nodes[13].address, 4) == 0){
-      printf("\033[0;32m");
-      printf("M: correct Destination recovered\n");
-      printf("\033[0m");
+struct AdmitConfig {
+  int enabled;
+  int policy;
+  int queue;
+  double burst;
+  double rate[ADMIT_INGRESS];
+  int prio[ADMIT_INGRESS];
+};
+
+struct TokenBucket {
+  double rate;   /* tokens per nanosecond */
+  double burst;
+  double tokens;
+  uint64_t last;
+  int prio;
+  int pending;   /* handshakes of this ingress in the queue */
+};
+
+struct Admission {
+  int policy;
+  int queueSize;
+  int pending;
+  int resuming;
+  struct TokenBucket bucket[ADMIT_INGRESS];
+  struct PacketBuf *queue[ADMIT_QUEUE_MAX]; /* oldest first */
+  uint64_t counts[NUM_OF_ADMIT];
+};
+
+static struct AdmitConfig admitConfig;
+
+void admitInit(void)
+{
+  const char *env=getenv("DPHI_ADMIT");
+  const char *ingress=getenv("DPHI_ADMIT_INGRESS");
+  double rate=0, burst=16;
+  int queue=64;
+  char policy[8]="tail";
+
+  if(env == NULL || sscanf(env, "%lf:%lf:%d:%7s", &rate, &burst, &queue, policy) < 1 || rate <= 0){
+    return;
+  }
+  admitConfig.enabled=1;
+  admitConfig.policy=strcmp(policy, "prio") == 0 ? ADMIT_PRIORITY : ADMIT_TAIL_DROP;
+  admitConfig.queue=queue < 0 ? 0 : queue > ADMIT_QUEUE_MAX ? ADMIT_QUEUE_MAX : queue;
+  admitConfig.burst=burst < 1 ? 1 : burst;
+  for(int i=0;i<ADMIT_INGRESS;i++)
+  {
+    admitConfig.rate[i]=rate;
+  }
+  while(ingress != NULL && *ingress != '\0')
+  {
+    int from, prio=0, used=0;
+    if(sscanf(ingress, "%d=%lf%n/%d%n", &from, &rate, &used, &prio, &used) < 2){
+      break;
     }
-    else{
-      printf("\033[0;31m");
-      printf("M: wrong Destination recovered\n");
-      printf("\033[0m");
+    if(from >= 0 && from < ADMIT_INGRESS){
+      admitConfig.rate[from]=rate;
+      admitConfig.prio[from]=prio;
     }
-
+    ingress=strchr(ingress+used, ',');
+    ingress=ingress != NULL ? ingress+1 : NULL;
+  }
+}
+
+struct Admission *admitCreate(const struct AdmitConfig *cfg)
+{
+  struct Admission *adm;
+
+  if(!cfg->enabled || (adm=calloc(1, sizeof *adm)) == NULL){
+    return NULL;
+  }
+  adm->policy=cfg->policy;
+  adm->queueSize=cfg->queue;
+  for(int i=0;i<ADMIT_INGRESS;i++)
+  {
+    adm->bucket[i].rate=cfg->rate[i]/1e9;
+    adm->bucket[i].burst=cfg->burst;
+    adm->bucket[i].tokens=cfg->burst;
+    adm->bucket[i].prio=cfg->prio[i];
+  }
+  return adm;
+}
+
+/* gives back the queued buffers, must happen before their pool goes */
+void admitDestroy(struct Admission *adm, struct PacketPool *pool)
+{
+  if(adm == NULL){
+    return;
+  }
+  for(int i=0;i<adm->pending;i++)
+  {
+    pbufPut(pool, adm->queue[i]);
+  }
+  free(adm);
+}
+
+void admitCount(struct Admission *adm, int what)
+{
+  adm->counts[what]++;
+  if(telemetry != NULL){
+    telemetryAdd(&telemetry->admission[what], 1);
+  }
+}
+
+void admitRefill(struct TokenBucket *b, uint64_t now)
+{
+  b->tokens=b->tokens+(now-b->last)*b->rate;
+  if(b->tokens > b->burst){
+    b->tokens=b->burst;
+  }
+  b->last=now;
+}
+
+int admitToken(struct TokenBucket *b, uint64_t now)
+{
+  admitRefill(b, now);
+  if(b->tokens < 1){
+    return 0;
+  }
+  b->tokens=b->tokens-1;
+  return 1;
+}
+
+void admitRemove(struct Admission *adm, int i)
+{
+  adm->bucket[adm->queue[i]->pkt.from % ADMIT_INGRESS].pending--;
+  memmove(&adm->queue[i], &adm->queue[i+1], (adm->pending-i-1)*sizeof adm->queue[0]);
+  adm->pending--;
+}
+
+/**************************************************************************
+ Decides on a handshake that just arrived at M: ADMIT_NOW if it may go on
+ to iAmHelper right away, PACKET_DEFERRED if it was queued or PACKET_DROP.
+ Handshakes of an ingress never overtake those of the same ingress that
+ are still queued.
+**************************************************************************/
+int admitHandshake(struct Admission *adm, struct PacketPool *pool, struct Packet *pkt)
+{
+  struct TokenBucket *b=&adm->bucket[pkt->from % ADMIT_INGRESS];
+  struct PacketBuf *buf=pool != NULL ? pbufOf(pool, pkt) : NULL;
+
+  if(b->pending == 0 && admitToken(b, nowNs())){
+    admitCount(adm, ADMIT_ADMITTED);
+    return ADMIT_NOW;
+  }
+  if(buf == NULL || adm->queueSize == 0){
+    admitCount(adm, ADMIT_DROPPED);
+    return PACKET_DROP;
+  }
+  if(adm->pending == adm->queueSize){
+    int victim=-1;
+    if(adm->policy == ADMIT_PRIORITY){
+      for(int i=adm->pending-1;i>=0;i--)
+      {
+        int prio=adm->bucket[adm->queue[i]->pkt.from % ADMIT_INGRESS].prio;
+        if(prio < b->prio && (victim < 0 || prio < adm->bucket[adm->queue[victim]->pkt.from % ADMIT_INGRESS].prio)){
+          victim=i;
+        }
+      }
+    }
+    if(victim < 0){
+      admitCount(adm, ADMIT_DROPPED);
+      return PACKET_DROP;
+    }
+    pbufPut(pool, adm->queue[victim]);
+    admitRemove(adm, victim);
+    admitCount(adm, ADMIT_DROPPED);
+  }
+  pbufGet(buf);
+  adm->queue[adm->pending++]=buf;
+  b->pending++;
+  admitCount(adm, ADMIT_DEFERRED);
+  return PACKET_DEFERRED;
+}
+
+/**************************************************************************
+ Takes the next queued handshake whose ingress has a token again off the
+ queue, the oldest one or, with prio, the oldest of the highest priority.
+ The reference the queue held goes to the caller.
+**************************************************************************/
+struct PacketBuf *admitNext(struct Admission *adm)
+{
+  uint32_t seen=0;
+  uint64_t now;
+  int best=-1;
+
+  if(adm->pending == 0){
+    return NULL;
+  }
+  now=nowNs();
+  for(int i=0;i<adm->pending;i++)
+  {
+    int from=adm->queue[i]->pkt.from % ADMIT_INGRESS;
+    struct TokenBucket *b=&adm->bucket[from];
+
+    /* only the oldest handshake of an ingress is eligible */
+    if(seen & (1U << from)){
+      continue;
+    }
+    seen=seen | (1U << from);
+    admitRefill(b, now);
+    if(b->tokens < 1){
+      continue;
+    }
+    if(best < 0 || b->prio > adm->bucket[adm->queue[best]->pkt.from % ADMIT_INGRESS].prio){
+      best=i;
+    }
+    if(adm->policy != ADMIT_PRIORITY){
+      break;
+    }
+  }
+  if(best < 0){
+    return NULL;
+  }
+  struct PacketBuf *buf=adm->queue[best];
+  adm->bucket[buf->pkt.from % ADMIT_INGRESS].tokens--;
+  admitRemove(adm, best);
+  admitCount(adm, ADMIT_ADMITTED);
+  return buf;
+}
+
+/**************************************************************************
+* ECDH offload
+*
+* An X25519 operation takes as long as forwarding a few hundred packets.
+* With DPHI_ECDH_WORKERS=n, the nodes that derive session keys (s, M and
+* d) leave them to n crypto workers, as long as the packet sits in a
+* buffer of the node's pool: the handler runs up to the point where it
+* needs the secret and returns PACKET_OFFLOADED, the dispatcher submits a
+* job that holds a reference on the buffer, and the node goes on with
+* other packets. A worker puts the finished job on the completion queue of
+* the node that submitted it, from where the engine runs the handler once
+* more, now with the secret at hand (see resumeDeferred). Both queues are
+* bounded lock-free MPMC rings after Vyukov. A job that finds no room is
+* dropped rather than computed in place, so a node never waits for a
+* scalar multiplication. A job owns copies of the private key and the
+* point: with DPHI_KEYPOOL, the next iAmS overwrites the keypair in the
+* node while a worker may still be busy with the previous session.
+**************************************************************************/
+
+#define ECDH_QUEUE 1024 /* slots per queue, a power of two */
+#define ECDH_JOBS 256   /* jobs in flight per node, less than ECDH_QUEUE */
+#define ECDH_MAX_WORKERS 16
+
+struct Offload;
+
+struct EcdhJob {
+  struct Offload *owner;
+  struct PacketBuf *buf;
+  uint8_t privKey[32]; /* a copy, the node may go on with another session */
+  uint8_t point[32];
+  uint8_t secret[32];
+};
+
+struct EcdhCell {
+  uint64_t seq;
+  struct EcdhJob *job;
+};
+
+struct EcdhQueue {
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  struct EcdhCell cells[ECDH_QUEUE] __attribute__((aligned(64)));
+};
+
+/* one per node, only ever touched by the node's thread except for done */
+struct Offload {
+  struct EcdhQueue done;
+  struct EcdhJob jobs[ECDH_JOBS];
+  struct EcdhJob *idle[ECDH_JOBS];
+  int nIdle;
+  uint64_t submitted, completed, dropped;
+};
+
+struct EcdhPool {
+  struct EcdhQueue submit;
+  int workers;
+  pthread_t threads[ECDH_MAX_WORKERS];
+};
+
+static int ecdhWorkers;
+static struct EcdhPool *ecdhPool;
+static pthread_once_t ecdhOnce=PTHREAD_ONCE_INIT;
+
+void ecdhQueueInit(struct EcdhQueue *q)
+{
+  q->head=0;
+  q->tail=0;
+  for(uint64_t i=0;i<ECDH_QUEUE;i++)
+  {
+    q->cells[i].seq=i;
+  }
+}
+
+/* returns 0 if the queue is full */
+int ecdhPush(struct EcdhQueue *q, struct EcdhJob *job)
+{
+  uint64_t pos=__atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+  for(;;)
+  {
+    struct EcdhCell *cell=&q->cells[pos & (ECDH_QUEUE-1)];
+    int64_t diff=(int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE)-pos);
+    if(diff == 0){
+      if(__atomic_compare_exchange_n(&q->tail, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        cell->job=job;
+        __atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+    else if(diff < 0){
+      return 0;
+    }
+    else{
+      pos=__atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* returns NULL if the queue is empty */
+struct EcdhJob *ecdhPop(struct EcdhQueue *q)
+{
+  uint64_t pos=__atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+  for(;;)
+  {
+    struct EcdhCell *cell=&q->cells[pos & (ECDH_QUEUE-1)];
+    int64_t diff=(int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE)-(pos+1));
+    if(diff == 0){
+      if(__atomic_compare_exchange_n(&q->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        struct EcdhJob *job=cell->job;
+        __atomic_store_n(&cell->seq, pos+ECDH_QUEUE, __ATOMIC_RELEASE);
+        return job;
+      }
+    }
+    else if(diff < 0){
+      return NULL;
+    }
+    else{
+      pos=__atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void *ecdhWorker(void *arg)
+{
+  struct EcdhPool *pool=arg;
+  struct timespec nap={0,20000};
+  int idle=0;
+
+  for(;;)
+  {
+    struct EcdhJob *job=ecdhPop(&pool->submit);
+    if(job == NULL){
+      // stay responsive while jobs keep coming, get out of the way otherwise
+      if(++idle < 1000){
+        sched_yield();
+      }
+      else{
+        nanosleep(&nap, NULL);
+      }
+      continue;
+    }
+    idle=0;
+    curve25519_donna(job->secret, job->privKey, job->point);
+    // cannot fail, a node never has more jobs out than its queue holds
+    ecdhPush(&job->owner->done, job);
+  }
+  return NULL;
+}
+
+void ecdhStart(void)
+{
+  if(posix_memalign((void **)&ecdhPool, 64, sizeof *ecdhPool) != 0){
+    ecdhPool=NULL;
+    return;
+  }
+  ecdhQueueInit(&ecdhPool->submit);
+  ecdhPool->workers=0;
+  for(int i=0;i<ecdhWorkers && i<ECDH_MAX_WORKERS;i++)
+  {
+    if(pthread_create(&ecdhPool->threads[i], NULL, ecdhWorker, ecdhPool) == 0){
+      ecdhPool->workers++;
+    }
+  }
+}
+
+void ecdhInit(void)
+{
+  const char *env=getenv("DPHI_ECDH_WORKERS");
+  ecdhWorkers=env != NULL ? atoi(env) : 0;
+}
+
+/* the workers are started by the first node that needs them, in its process */
+struct Offload *offloadCreate(void)
+{
+  struct Offload *off;
+
+  if(ecdhWorkers <= 0){
+    return NULL;
+  }
+  pthread_once(&ecdhOnce, ecdhStart);
+  if(ecdhPool == NULL || ecdhPool->workers == 0 || posix_memalign((void **)&off, 64, sizeof *off) != 0){
+    return NULL;
+  }
+  ecdhQueueInit(&off->done);
+  for(int i=0;i<ECDH_JOBS;i++)
+  {
+    off->jobs[i].owner=off;
+    off->idle[i]=&off->jobs[i];
+  }
+  off->nIdle=ECDH_JOBS;
+  off->submitted=0;
+  off->completed=0;
+  off->dropped=0;
+  return off;
+}
+
+/* waits for the jobs still out and gives back their buffers */
+void offloadDestroy(struct Offload *off, struct PacketPool *pool)
+{
+  if(off == NULL){
+    return;
+  }
+  while(off->completed < off->submitted)
+  {
+    struct EcdhJob *job=ecdhPop(&off->done);
+    if(job == NULL){
+      sched_yield();
+      continue;
+    }
+    off->completed++;
+    pbufPut(pool, job->buf);
+  }
+  free(off);
+}
+
+/* queues X25519(privKey, point), both copied into the job; returns 0 if
+the job could not be queued, the packet is dropped then */
+int ecdhSubmit(struct Offload *off, struct PacketBuf *buf, const uint8_t *privKey, const uint8_t *point)
+{
+  struct EcdhJob *job;
+
+  if(off->nIdle == 0){
+    off->dropped++;
+    return 0;
+  }
+  job=off->idle[--off->nIdle];
+  job->buf=buf;
+  memcpy(job->privKey, privKey, 32);
+  memcpy(job->point, point, 32);
+  if(!ecdhPush(&ecdhPool->submit, job)){
+    off->idle[off->nIdle++]=job;
+    off->dropped++;
+    return 0;
+  }
+  pbufGet(buf);
+  off->submitted++;
+  return 1;
+}
+
+/**************************************************************************
+* Ephemeral keypairs at s
+*
+* With its static keypair, s would give away that two sessions are its
+* own through pubS (and the SID that is its hash), while a fresh keypair
+* costs a fixed-base scalar multiplication on every connect. With
+* DPHI_KEYPOOL=depth, a background thread keeps a ring of up to depth
+* ready-made keypairs, their SIDs already hashed, and iAmS takes one for
+* every session, so that opening a session only costs the variable-base
+* ECDH with M. backAtS goes on with the keypair iAmS took over. Should the
+* ring ever run dry, the keypair is made in place and counted as a miss.
+* The ring has a single producer and a single consumer, s's own thread.
+**************************************************************************/
+
+#define KEYPOOL_MAX 65536
+
+struct KeyPool {
+  uint64_t head __attribute__((aligned(64))); /* taken by s */
+  uint64_t tail __attribute__((aligned(64))); /* filled by the refill thread */
+  uint32_t size;
+  uint32_t low;       /* lowest depth s has seen */
+  int running;
+  uint64_t generated;
+  uint64_t taken;
+  uint64_t misses;
+  uint64_t busyNs;    /* time the refill thread spent generating */
+  uint64_t startNs;
+  pthread_t thread;
+  struct Keypair slots[];
+};
+
+static int keypoolDepth;
+
+void makeKeypair(struct Keypair *kp)
+{
+  static const uint8_t basepoint[32] = {9};
+  uint64_t r;
+  uint8_t digest[32];
+
+  for(int i=0;i<4;i++)
+  {
+    rdrand64_step(&r);
+    memcpy(kp->privKey+8*i, &r, 8);
+  }
+  kp->privKey[0] &= 248;
+  kp->privKey[31] &= 127;
+  kp->privKey[31] |= 64;
+  curve25519_donna(kp->pubKey, kp->privKey, basepoint);
+  getHash(kp->pubKey, digest, 32);
+  memcpy(kp->sid, digest, 16);
+}
+
+void *keypoolRefill(void *arg)
+{
+  struct KeyPool *pool=arg;
+  struct timespec nap={0,100000};
+
+  while(__atomic_load_n(&pool->running, __ATOMIC_ACQUIRE))
+  {
+    uint64_t tail=pool->tail;
+    uint64_t head=__atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    if(tail-head == pool->size){
+      nanosleep(&nap, NULL);
+      continue;
+    }
+    uint64_t a=nowNs();
+    while(tail-head < pool->size)
+    {
+      makeKeypair(&pool->slots[tail % pool->size]);
+      tail++;
+      __atomic_store_n(&pool->tail, tail, __ATOMIC_RELEASE);
+      __atomic_store_n(&pool->generated, pool->generated+1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&pool->busyNs, pool->busyNs+nowNs()-a, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+void keypoolInit(void)
+{
+  const char *env=getenv("DPHI_KEYPOOL");
+  keypoolDepth=env != NULL ? atoi(env) : 0;
+  keypoolDepth=keypoolDepth > KEYPOOL_MAX ? KEYPOOL_MAX : keypoolDepth;
+}
+
+struct KeyPool *keypoolCreate(int depth)
+{
+  struct KeyPool *pool;
+
+  if(depth <= 0 || posix_memalign((void **)&pool, 64, sizeof *pool+depth*sizeof pool->slots[0]) != 0){
+    return NULL;
+  }
+  memset(pool, 0, sizeof *pool);
+  pool->size=depth;
+  pool->low=depth;
+  pool->running=1;
+  pool->startNs=nowNs();
+  if(pthread_create(&pool->thread, NULL, keypoolRefill, pool) != 0){
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void keypoolDestroy(struct KeyPool *pool)
+{
+  if(pool == NULL){
+    return;
+  }
+  __atomic_store_n(&pool->running, 0, __ATOMIC_RELEASE);
+  pthread_join(pool->thread, NULL);
+  free(pool);
+}
+
+/* hands out the next keypair, made in place if the ring ran dry */
+void keypoolTake(struct KeyPool *pool, struct Keypair *kp)
+{
+  uint64_t head=pool->head;
+  uint64_t depth=__atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE)-head;
+
+  pool->taken++;
+  if(depth == 0){
+    pool->misses++;
+    pool->low=0;
+    makeKeypair(kp);
+    return;
+  }
+  memcpy(kp, &pool->slots[head % pool->size], sizeof *kp);
+  __atomic_store_n(&pool->head, head+1, __ATOMIC_RELEASE);
+  if(depth-1 < pool->low){
+    pool->low=depth-1;
+  }
+}
+
+void keypoolPrint(struct KeyPool *pool)
+{
+  uint64_t depth=__atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE)-__atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+  uint64_t generated=__atomic_load_n(&pool->generated, __ATOMIC_RELAXED);
+  uint64_t busyNs=__atomic_load_n(&pool->busyNs, __ATOMIC_RELAXED);
+  double seconds=(nowNs()-pool->startNs)/1e9;
+
+  printf("Keypair pool:\t depth %llu of %u (lowest %u), %llu taken, %llu made in place\n",
+         (unsigned long long)depth,pool->size,pool->low,(unsigned long long)pool->taken,(unsigned long long)pool->misses);
+  printf("Keypair refill:\t %.0f/s on average, %.0f/s while refilling\n",
+         generated/seconds,busyNs ? generated*1e9/busyNs : 0.0);
+}
+
+/**************************************************************************
+* Replay filter
+*
+* A setup packet that is sent again would have M redo its ECDH, W its
+* seed and IV work and d both. M, W and d therefore remember the SID
+* together with a value that is fresh for every session (the payload IV at
+* M and d, nmid in H.midway at W) in a blocked Bloom filter: all bits of a
+* key lie in one 64-bit word, so that a lookup is one memory access and
+* test-and-set is a single atomic OR, which needs no lock even if several
+* threads share the filter. Keys are remembered for one to two windows:
+* there are three generations of the filter, the current one that keys are
+* added to, the previous one that is only checked, and a spare one that a
+* background thread clears while it is not in use. At the end of a window
+* the thread moves the generations on by bumping an epoch, so that no
+* packet ever waits for the filter to be cleared. With 16 bits and 8
+* hashes per key, the false positive rate stays below 0.5% as long as no
+* more than capacity keys arrive per window.
+*
+*   DPHI_REPLAY=capacity[:seconds]   (default 1000000:10, 0 turns it off)
+**************************************************************************/
+
+#define REPLAY_BITS_PER_KEY 16
+#define REPLAY_HASHES 8
+#define REPLAY_GENERATIONS 3
+#define REPLAY_CLEAR_WORDS 16384 /* 128 kB */
+
+struct ReplayFilter {
+  uint64_t epoch __attribute__((aligned(64)));
+  uint64_t words;     /* per generation */
+  uint64_t windowNs;
+  uint64_t seed[2];
+  uint64_t rotations;
+  int running;
+  pthread_t thread;
+  uint64_t *gen[REPLAY_GENERATIONS];
+};
+
+static uint64_t replayCapacity=1000000;
+static double replayWindow=10;
+
+static inline uint64_t replayMix(uint64_t h)
+{
+  h=h ^ (h >> 33);
+  h=h*0xff51afd7ed558ccdULL;
+  h=h ^ (h >> 33);
+  h=h*0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 33);
+}
+
+/* the word of a generation a key lives in and its bits there */
+static inline uint64_t replayKey(const struct ReplayFilter *f, const uint8_t *sid, const uint8_t *nonce, int nonceLen, uint64_t *index)
+{
+  uint64_t w[4]={0,0,0,0};
+  uint64_t h, bits, mask=0;
+
+  memcpy(w, sid, 16);
+  memcpy(w+2, nonce, nonceLen < 16 ? nonceLen : 16);
+  h=replayMix(f->seed[0] ^ w[0]);
+  h=replayMix(h ^ w[1]);
+  h=replayMix(h ^ w[2]);
+  h=replayMix(h ^ w[3]);
+  *index=(uint64_t)(((unsigned __int128)h*f->words) >> 64);
+  bits=replayMix(h ^ f->seed[1]);
+  for(int i=0;i<REPLAY_HASHES;i++)
+  {
+    mask=mask | (1ULL << (bits & 63));
+    bits=bits >> 6;
+  }
+  return mask;
+}
+
+/**************************************************************************
+ Remembers sid with nonce (up to 16 bytes) and returns 1 if they were
+ seen already, in this window or the one before.
+**************************************************************************/
+int replaySeen(struct ReplayFilter *f, const uint8_t *sid, const uint8_t *nonce, int nonceLen)
+{
+  uint64_t index, epoch, old;
+  uint64_t mask=replayKey(f, sid, nonce, nonceLen, &index);
+
+  epoch=__atomic_load_n(&f->epoch, __ATOMIC_ACQUIRE);
+  old=__atomic_fetch_or(&f->gen[epoch % REPLAY_GENERATIONS][index], mask, __ATOMIC_RELAXED);
+  if((old & mask) == mask){
+    return 1;
+  }
+  old=__atomic_load_n(&f->gen[(epoch+REPLAY_GENERATIONS-1) % REPLAY_GENERATIONS][index], __ATOMIC_RELAXED);
+  return (old & mask) == mask;
+}
+
+void *replayRotate(void *arg)
+{
+  struct ReplayFilter *f=arg;
+  struct timespec nap={0,10000000};
+  uint64_t next=nowNs()+f->windowNs;
+
+  while(__atomic_load_n(&f->running, __ATOMIC_ACQUIRE))
+  {
+    if(nowNs() < next){
+      nanosleep(&nap, NULL);
+      continue;
+    }
+    uint64_t epoch=f->epoch+1;
+    __atomic_store_n(&f->epoch, epoch, __ATOMIC_RELEASE);
+    // what was the previous generation is not looked at anymore; it is
+    // cleared in pieces so that a node sharing the core is not held up
+    uint64_t *spare=f->gen[(epoch+1) % REPLAY_GENERATIONS];
+    for(uint64_t i=0;i<f->words;i=i+REPLAY_CLEAR_WORDS)
+    {
+      memset(spare+i, 0, (f->words-i < REPLAY_CLEAR_WORDS ? f->words-i : REPLAY_CLEAR_WORDS)*sizeof(uint64_t));
+      sched_yield();
+    }
+    __atomic_store_n(&f->rotations, f->rotations+1, __ATOMIC_RELAXED);
+    next=next+f->windowNs;
+  }
+  return NULL;
+}
+
+void replayInit(void)
+{
+  const char *env=getenv("DPHI_REPLAY");
+  unsigned long long capacity;
+  double window;
+  int n=env != NULL ? sscanf(env, "%llu:%lf", &capacity, &window) : 0;
+
+  if(n >= 1){
+    replayCapacity=capacity;
+  }
+  if(n == 2 && window > 0){
+    replayWindow=window;
+  }
+}
+
+struct ReplayFilter *replayCreate(uint64_t capacity, double window)
+{
+  struct ReplayFilter *f;
+
+  if(capacity == 0 || posix_memalign((void **)&f, 64, sizeof *f) != 0){
+    return NULL;
+  }
+  memset(f, 0, sizeof *f);
+  f->words=(capacity*REPLAY_BITS_PER_KEY+63)/64;
+  f->windowNs=(uint64_t)(window*1e9);
+  rdrand64_step(&f->seed[0]);
+  rdrand64_step(&f->seed[1]);
+  for(int i=0;i<REPLAY_GENERATIONS;i++)
+  {
+    if((f->gen[i]=calloc(f->words, sizeof(uint64_t))) == NULL){
+      for(int j=0;j<i;j++)
+      {
+        free(f->gen[j]);
+      }
+      free(f);
+      return NULL;
+    }
+  }
+  f->running=1;
+  if(pthread_create(&f->thread, NULL, replayRotate, f) != 0){
+    f->running=0;
+  }
+  return f;
+}
+
+void replayDestroy(struct ReplayFilter *f)
+{
+  if(f == NULL){
+    return;
+  }
+  if(f->running){
+    __atomic_store_n(&f->running, 0, __ATOMIC_RELEASE);
+    pthread_join(f->thread, NULL);
+  }
+  for(int i=0;i<REPLAY_GENERATIONS;i++)
+  {
+    free(f->gen[i]);
+  }
+  free(f);
+}
+
+/**************************************************************************
+* Session tables
+*
+* The walk-through keeps the state of a session (W's midway fields, the
+* session key, nonce and keypair of s) in struct Node and s's copy of the
+* header in its NodeCtx, which is fine for one session at a time. With
+* DPHI_SESSIONS=capacity, s and W keep it per SID instead: the dispatcher
+* loads the state of the packet's session into the node before the
+* handler runs and stores it back once the handler accepted the packet,
+* so that sessions in flight at the same time no longer overwrite each
+* other. Forged packets never get an entry. The table is set-associative:
+* a SID maps to a bucket of SESSION_WAYS entries, which is all a lookup
+* touches, and the least recently used entry of a full bucket makes room
+* for a new session. The udp, blocking, uring and shm engines turn the
+* tables on by themselves once more than one session is in flight (see
+* perSessionDefaults).
+*
+* A table belongs to one thread, and every engine runs a single thread
+* per node. How a node with several workers would split its sessions is
+* measured by the shardbench mode only: there each worker has its own
+* table, every packet is steered to the worker that owns its SID
+* (sessionOwner), much like RSS spreads flows over receive queues, and a
+* packet that arrives at any other worker is handed over to the owner, so
+* that the state of a session never bounces between caches.
+**************************************************************************/
+
+#define SESSION_WAYS 4
+
+struct SessionState {
+  uint8_t sid[16];
+  uint64_t used;
+  uint8_t sessionKey[32];
+  uint8_t nonce[8];
+  uint8_t midwaySeed[16];
+  uint8_t midwayIv[IV_SIZE];
+  uint8_t midwayIv2[IV_SIZE];
+  uint8_t midwayIv3[IV_SIZE];
+  uint8_t midwayIv4[IV_SIZE];
+  uint8_t midwayAt[TAG_SIZE];
+  uint8_t origDest[4];
+  uint8_t midwayV2[VECTOR_LENGTH][4];
+  uint8_t midwayV2Sid[16];
+  uint8_t privKey[32];
+  uint8_t pubKey[32];
+  struct PacketBuf *stored; /* Hs at s, released once the session is set up */
+} __attribute__((aligned(64)));
+
+struct SessionTable {
+  uint64_t buckets; /* a power of two */
+  uint64_t clock;
+  uint64_t lookups, misses, evictions;
+  struct SessionState *slots;
+};
+
+static uint64_t sessionCapacity;
+
+/**************************************************************************
+ The hash every thread and node agrees on. The low half picks the owner
+ of a session, the high half its bucket within the owner's table.
+**************************************************************************/
+static inline uint64_t sessionHash(const uint8_t *sid)
+{
+  uint64_t w[2];
+  memcpy(w, sid, 16);
+  return replayMix(w[0] ^ replayMix(w[1] ^ 0x9e3779b97f4a7c15ULL));
+}
+
+static inline int sessionOwner(const uint8_t *sid, int owners)
+{
+  return (int)(((sessionHash(sid) & 0xffffffffULL)*(uint64_t)owners) >> 32);
+}
+
+void sessionInit(void)
+{
+  const char *env=getenv("DPHI_SESSIONS");
+  if(env != NULL){
+    sessionCapacity=strtoull(env, NULL, 10);
+  }
+}
+
+struct SessionTable *sessionCreate(uint64_t capacity)
+{
+  struct SessionTable *t;
+  uint64_t buckets=1;
+
+  if(capacity == 0 || (t=calloc(1, sizeof *t)) == NULL){
+    return NULL;
+  }
+  // at most half full
+  while(buckets*SESSION_WAYS < 2*capacity)
+  {
+    buckets=buckets*2;
+  }
+  t->buckets=buckets;
+  if(posix_memalign((void **)&t->slots, 64, buckets*SESSION_WAYS*sizeof(struct SessionState)) != 0){
+    free(t);
+    return NULL;
+  }
+  memset(t->slots, 0, buckets*SESSION_WAYS*sizeof(struct SessionState));
+  return t;
+}
+
+void sessionDestroy(struct SessionTable *t, struct PacketPool *pool)
+{
+  if(t == NULL){
+    return;
+  }
+  for(uint64_t i=0;i<t->buckets*SESSION_WAYS;i++)
+  {
+    if(t->slots[i].stored != NULL){
+      pbufPut(pool, t->slots[i].stored);
+    }
+  }
+  free(t->slots);
+  free(t);
+}
+
+/**************************************************************************
+ Returns the entry of sid, or NULL if there is none and create is 0. A
+ new entry has its SID set and everything else cleared; a stored header
+ of the session it replaces goes back to pool. used == 0 marks free
+ slots, so the clock starts at 1.
+**************************************************************************/
+struct SessionState *sessionFind(struct SessionTable *t, struct PacketPool *pool, const uint8_t *sid, int create)
+{
+  struct SessionState *bucket=&t->slots[((sessionHash(sid) >> 32) & (t->buckets-1))*SESSION_WAYS];
+  struct SessionState *victim=&bucket[0];
+
+  t->lookups++;
+  for(int i=0;i<SESSION_WAYS;i++)
+  {
+    if(bucket[i].used != 0 && memcmp(bucket[i].sid, sid, 16) == 0){
+      bucket[i].used=++t->clock;
+      return &bucket[i];
+    }
+    if(bucket[i].used < victim->used){
+      victim=&bucket[i];
+    }
+  }
+  t->misses++;
+  if(!create){
+    return NULL;
+  }
+  if(victim->used != 0){
+    t->evictions++;
+  }
+  if(victim->stored != NULL){
+    pbufPut(pool, victim->stored);
+  }
+  memset(victim, 0, sizeof *victim);
+  memcpy(victim->sid, sid, 16);
+  victim->used=++t->clock;
+  return victim;
+}
+
+/* the steps whose state the next step of the session builds on */
+static inline int sessionStep(int handler)
+{
+  return handler == HANDLER_IAMS || handler == HANDLER_BACKATS || handler == HANDLER_FINISHATS ||
+         handler == HANDLER_IAMWBACKTRACKING || handler == HANDLER_IAMWFORWARDTOD || handler == HANDLER_IAMWBACKTOS;
+}
+
+/* the node takes on the state of the session ... */
+void sessionLoad(const struct SessionState *st, struct Node *node)
+{
+  memcpy(node->sessionKey, st->sessionKey, sizeof node->sessionKey);
+  memcpy(node->nonce, st->nonce, sizeof node->nonce);
+  memcpy(node->midwaySeed, st->midwaySeed, sizeof node->midwaySeed);
+  memcpy(node->midwayIv, st->midwayIv, IV_SIZE);
+  memcpy(node->midwayIv2, st->midwayIv2, IV_SIZE);
+  memcpy(node->midwayIv3, st->midwayIv3, IV_SIZE);
+  memcpy(node->midwayIv4, st->midwayIv4, IV_SIZE);
+  memcpy(node->midwayAt, st->midwayAt, TAG_SIZE);
+  memcpy(node->origDest, st->origDest, sizeof node->origDest);
+  memcpy(node->midwayV2, st->midwayV2, sizeof node->midwayV2);
+  memcpy(node->midwayV2Sid, st->midwayV2Sid, 16);
+  memcpy(node->privKey, st->privKey, sizeof node->privKey);
+  memcpy(node->pubKey, st->pubKey, sizeof node->pubKey);
+}
+
+/* ... and hands it back once the handler is done */
+void sessionStore(struct SessionState *st, const struct Node *node)
+{
+  memcpy(st->sessionKey, node->sessionKey, sizeof st->sessionKey);
+  memcpy(st->nonce, node->nonce, sizeof st->nonce);
+  memcpy(st->midwaySeed, node->midwaySeed, sizeof st->midwaySeed);
+  memcpy(st->midwayIv, node->midwayIv, IV_SIZE);
+  memcpy(st->midwayIv2, node->midwayIv2, IV_SIZE);
+  memcpy(st->midwayIv3, node->midwayIv3, IV_SIZE);
+  memcpy(st->midwayIv4, node->midwayIv4, IV_SIZE);
+  memcpy(st->midwayAt, node->midwayAt, TAG_SIZE);
+  memcpy(st->origDest, node->origDest, sizeof st->origDest);
+  memcpy(st->midwayV2, node->midwayV2, sizeof st->midwayV2);
+  memcpy(st->midwayV2Sid, node->midwayV2Sid, 16);
+  memcpy(st->privKey, node->privKey, sizeof st->privKey);
+  memcpy(st->pubKey, node->pubKey, sizeof st->pubKey);
+}
+
+/* everything a node needs to process packets on its own */
+struct NodeCtx {
+  struct Node *node;
+  struct Node *nodes;
+  struct gcm_key_data gkey;
+  struct PacketPool *pool;
+  struct PacketBuf *stored;
+  struct Admission *admit; /* only at M and only with DPHI_ADMIT */
+  struct Offload *offload; /* only at s, M and d and only with DPHI_ECDH_WORKERS */
+  struct EcdhJob *completed; /* the job whose handler is being resumed */
+  struct KeyPool *keys;      /* only at s and only with DPHI_KEYPOOL */
+  struct ReplayFilter *replay; /* at M, W and d */
+  struct SessionTable *sessions; /* at s and W with DPHI_SESSIONS */
+  const struct PhiPath *path;
+  uint8_t freshIv[IV_SIZE];
+  uint8_t freshIv2[IV_SIZE];
+  uint64_t packets;
+  int lastHandler;
+};
+
+/**************************************************************************
+ Returns the neighbour of node id on the given path in direction dir (+1
+ towards the end of the path, -1 towards its start) or PACKET_DROP if
+ there is none.
+**************************************************************************/
+int stepOnPath(const int *path, int len, int id, int dir)
+{
+  for(int i=0;i<len;i++)
+  {
+    if(path[i] == id){
+      if(i+dir < 0 || i+dir >= len){
+        return PACKET_DROP;
+      }
+      return path[i+dir];
+    }
+  }
+  return PACKET_DROP;
+}
+
+/**************************************************************************
+ Sets up the context of node id so that it can process packets without
+ any further help from main. The longterm key is expanded once here, just
+ like a router that is up and running would have it at hand already.
+**************************************************************************/
+void initNodeCtx(struct NodeCtx *ctx, struct Node *nodes, int id)
+{
+  memset(ctx, 0, sizeof *ctx);
+  ctx->node=&nodes[id];
+  ctx->nodes=nodes;
+  ctx->path=&defaultPath;
+  aes_gcm_pre_256(nodes[id].longTermKey, &ctx->gkey);
+  if(id == NODE_M){
+    ctx->admit=admitCreate(&admitConfig);
+  }
+  if(id == NODE_S || id == NODE_M || id == NODE_D){
+    ctx->offload=offloadCreate();
+  }
+  if(id == NODE_S){
+    ctx->keys=keypoolCreate(keypoolDepth);
+  }
+  if(id == NODE_M || id == NODE_W || id == NODE_D){
+    ctx->replay=replayCreate(replayCapacity, replayWindow);
+  }
+  if(id == NODE_S || id == NODE_W){
+    ctx->sessions=sessionCreate(sessionCapacity);
+  }
+}
+
+/* buffers for nodes whose engine does not receive into a pool of its own */
+#define PBUF_CLONE_POOL 8
+#define PBUF_CLONE_POOL_SESSIONS 1024 /* with a header per session in flight */
+
+/**************************************************************************
+ Hs <- H for the packet s is just about to send. If the packet sits in a
+ buffer of the node's pool, s only takes a reference on it: the engine
+ drops its own reference once the packet is handed to the kernel, which
+ copies it. Engines that keep modifying the very same buffer downstream
+ (shared memory, AF_XDP, io_uring) have no pool here, so the header is
+ cloned into a small pool created on first use. stored is ctx->stored, or
+ the slot of the session with DPHI_SESSIONS.
+**************************************************************************/
+void keepStoredHeader(struct NodeCtx *ctx, struct PacketBuf **stored, struct Packet *pkt)
+{
+  struct PacketBuf *buf=NULL;
+
+  if(ctx->pool != NULL){
+    buf=pbufOf(ctx->pool, pkt);
+  }
+  if(buf != NULL){
+    pbufGet(buf);
+  }
+  else{
+    if(ctx->pool == NULL){
+      ctx->pool=pbufPoolCreate(ctx->sessions != NULL ? PBUF_CLONE_POOL_SESSIONS : PBUF_CLONE_POOL);
+    }
+    if(ctx->pool == NULL || (buf=pbufAlloc(ctx->pool)) == NULL){
+      return;
+    }
+    memcpy(&buf->pkt.header, &pkt->header, sizeof pkt->header);
+  }
+  if(*stored != NULL){
+    pbufPut(ctx->pool, *stored);
+  }
+  *stored=buf;
+}
+
+/* releases what the engine and s hold on to once a node is done */
+void releaseNodeCtx(struct NodeCtx *ctx)
+{
+  if(ctx->stored != NULL){
+    pbufPut(ctx->pool, ctx->stored);
+    ctx->stored=NULL;
+  }
+  admitDestroy(ctx->admit, ctx->pool);
+  ctx->admit=NULL;
+  offloadDestroy(ctx->offload, ctx->pool);
+  ctx->offload=NULL;
+  keypoolDestroy(ctx->keys);
+  ctx->keys=NULL;
+  replayDestroy(ctx->replay);
+  ctx->replay=NULL;
+  sessionDestroy(ctx->sessions, ctx->pool);
+  ctx->sessions=NULL;
+  pbufPoolDestroy(ctx->pool);
+  ctx->pool=NULL;
+}
+
+/**************************************************************************
+ Whether the node has processed this setup packet before. Packets that
+ come back from admission or ECDH offload were checked on arrival.
+**************************************************************************/
+int replayed(struct NodeCtx *ctx, struct Packet *pkt, const uint8_t *nonce, int nonceLen)
+{
+  if(ctx->replay == NULL || ctx->completed != NULL || (ctx->admit != NULL && ctx->admit->resuming)){
+    return 0;
+  }
+  return replaySeen(ctx->replay, pkt->header.sid, nonce, nonceLen);
+}
+
+/* how the step at hand gets its X25519 result, see sessionSecret */
+void ecdhMode(struct NodeCtx *ctx, struct Packet *pkt, struct Ecdh *ecdh)
+{
+  if(ctx->completed != NULL){
+    ecdh->mode=ECDH_READY;
+    memcpy(ecdh->secret, ctx->completed->secret, 32);
+  }
+  else if(ctx->offload != NULL && ctx->pool != NULL && pbufOf(ctx->pool, pkt) != NULL){
+    ecdh->mode=ECDH_ASK;
+  }
+  else{
+    ecdh->mode=ECDH_SYNC;
+  }
+}
+
+/**************************************************************************
+ This function performs the very same sequence of operations as the
+ single-path walk-through in main, but one packet and one node at a time.
+ The step to perform follows from H.status, the role of the node on
+ ctx->path and, for MIDWAY_REPLY which travels both ways between s and W,
+ the direction the packet came from. Returns the id of the next hop, PACKET_DELIVERED once
+ a transmission-phase packet reached d or PACKET_DROP if the packet does
+ not belong here or the handler rejected it. s, M and d may also return
+ PACKET_DEFERRED, in which case the packet waits for admission or for its
+ ECDH and comes back through resumeDeferred.
+**************************************************************************/
+int dispatchPacket(struct NodeCtx *ctx, struct Packet *pkt)
+{
+  struct Node *node=ctx->node;
+  const struct PhiPath *path=ctx->path;
+  struct Header *header=&pkt->header;
+  struct gcm_key_data gkeyS;
+  struct Ecdh ecdh;
+  struct Keypair keys;
+  struct SessionState *session=NULL;
+  struct PacketBuf **stored=&ctx->stored;
+  uint64_t c1, c2;
+  int id=node->id;
+  int status=header->status;
+  int handler=HANDLER_NONE;
+  int drop=0;
+  int verdict=PACKET_OK;
+  int next;
+  uint64_t a=(telemetry != NULL || trace != NULL) ? __rdtsc() : 0;
+
+  /* the node takes on the state of the packet's session for the steps that build on it */
+  if(ctx->sessions != NULL && (status == MIDWAY_REPLY || status == REPLY_TO_W || status == REPLY_TO_S || status == TRANSMISSION_PHASE_TO_D1) && (session=sessionFind(ctx->sessions,ctx->pool,header->sid,0)) != NULL){
+    sessionLoad(session,node);
+    stored=&session->stored;
+  }
+
+  switch(status)
+  {
+    case NEW_SESSION:
+      if(id != path->s){
+        next=PACKET_DROP;
+        drop=1;
+        break;
+      }
+      handler=HANDLER_IAMS;
+      memset(header, 0, sizeof *header);
+      if(ctx->keys != NULL){
+        keypoolTake(ctx->keys,&keys);
+      }
+      iAmS(node,&ctx->nodes[path->m],&ctx->nodes[path->d],header,&pkt->payload,ctx->keys != NULL ? &keys : NULL);
+      if(ctx->sessions != NULL){
+        session=sessionFind(ctx->sessions,ctx->pool,header->sid,1);
+        stored=&session->stored;
+      }
+      keepStoredHeader(ctx,stored,pkt);
+      next=stepOnPath(path->sm,path->smLen,id,1);
+      break;
+
+    case TO_HELPER_NODE:
+      if(id == path->m && replayed(ctx,pkt,pkt->payload.iv,IV_SIZE)){
+        handler=HANDLER_IAMHELPER;
+        verdict=rejectPacket(handler,REJECT_REPLAY,0,NULL,NULL);
+        next=PACKET_DROP;
+        break;
+      }
+      if(id == path->m && ctx->admit != NULL && !ctx->admit->resuming && ctx->completed == NULL){
+        next=admitHandshake(ctx->admit,ctx->pool,pkt);
+        if(next == PACKET_DEFERRED){
+          return next;
+        }
+        if(next == PACKET_DROP){
+          drop=1;
+          break;
+        }
+      }
+      if(id == path->m){
+        handler=HANDLER_IAMHELPER;
+        ecdhMode(ctx,pkt,&ecdh);
+        verdict=iAmHelper(node,header,&pkt->payload,ctx->gkey,&c1,&c2,0,&ecdh);
+        next=stepOnPath(path->sm,path->smLen,id,-1);
+      }
+      else{
+        handler=HANDLER_STOM;
+        generateIv(ctx->freshIv);
+        verdict=sToM(header,node,ctx->gkey,ctx->freshIv,&c1,&c2);
+        next=stepOnPath(path->sm,path->smLen,id,1);
+      }
+      break;
+
+    case FIND_MIDWAY:
+      if(id == path->w && replayed(ctx,pkt,header->midway,16)){
+        handler=HANDLER_IAMWBACKTRACKING;
+        verdict=rejectPacket(handler,REJECT_REPLAY,0,NULL,NULL);
+        next=PACKET_DROP;
+        break;
+      }
+      if(id == path->w){
+        handler=HANDLER_IAMWBACKTRACKING;
+        generateIv(ctx->freshIv);
+        generateIv(ctx->freshIv2);
+        verdict=iAmWbacktracking(header,node,ctx->gkey,ctx->freshIv,ctx->freshIv2,&c1,&c2,0);
+      }
+      else{
+        handler=HANDLER_MTOS;
+        verdict=mToS(header,node,ctx->gkey,&c1,&c2,0);
+      }
+      next=stepOnPath(path->sm,path->smLen,id,-1);
+      break;
+
+    case MIDWAY_REPLY:
+      if(id == path->s){
+        handler=HANDLER_BACKATS;
+        ecdhMode(ctx,pkt,&ecdh);
+        verdict=backAtS(header,*stored ? &(*stored)->pkt.header : header,node,&ctx->nodes[path->d],&pkt->payload,0,&ecdh);
+        if(verdict == PACKET_OK){
+          keepStoredHeader(ctx,stored,pkt);
+        }
+        next=stepOnPath(path->sm,path->smLen,id,1);
+      }
+      else if(pkt->from > id){
+        /* still on the way back from W to s */
+        handler=HANDLER_MTOS;
+        verdict=mToS(header,node,ctx->gkey,&c1,&c2,0);
+        next=stepOnPath(path->sm,path->smLen,id,-1);
+      }
+      else if(id == path->w){
+        handler=HANDLER_IAMWFORWARDTOD;
+        generateIv(ctx->freshIv);
+        verdict=iAmWforwardToD(header,node,ctx->freshIv,ctx->gkey,&c1,&c2,0);
+        next=stepOnPath(path->wd,path->wdLen,id,1);
+      }
+      else{
+        handler=HANDLER_FORWARDSTOW;
+        verdict=forwardStoW(header,node,ctx->gkey,&c1,&c2,0);
+        next=stepOnPath(path->sm,path->smLen,id,1);
+      }
+      break;
+
+    case HANDSHAKE_TO_D:
+      if(id == path->d && replayed(ctx,pkt,pkt->payload.iv,IV_SIZE)){
+        handler=HANDLER_IAMD;
+        verdict=rejectPacket(handler,REJECT_REPLAY,0,NULL,NULL);
+        next=PACKET_DROP;
+        break;
+      }
+      generateIv(ctx->freshIv);
+      if(id == path->d){
+        handler=HANDLER_IAMD;
+        ecdhMode(ctx,pkt,&ecdh);
+        verdict=iAmD(header,node,ctx->freshIv,ctx->gkey,&pkt->payload,&c1,&c2,0,&ecdh);
+        next=stepOnPath(path->wd,path->wdLen,id,-1);
+      }
+      else{
+        handler=HANDLER_WTOD;
+        verdict=wToD(header,node,ctx->gkey,ctx->freshIv,&c1,&c2);
+        next=stepOnPath(path->wd,path->wdLen,id,1);
+      }
+      break;
+
+    case REPLY_TO_W:
+      if(id == path->w){
+        handler=HANDLER_IAMWBACKTOS;
+        generateIv(ctx->freshIv);
+        generateIv(node->midwayIv4);
+        verdict=iAmWbackToS(header,node,ctx->freshIv,ctx->gkey,&c1,&c2,0);
+        next=stepOnPath(path->sm,path->smLen,id,-1);
+      }
+      else{
+        handler=HANDLER_DTOW;
+        verdict=dToW(header,node,ctx->gkey,&c1,&c2);
+        next=stepOnPath(path->wd,path->wdLen,id,-1);
+      }
+      break;
+
+    case REPLY_TO_S:
+      if(id == path->s){
+        handler=HANDLER_FINISHATS;
+        generateIv(ctx->freshIv);
+        aes_gcm_pre_256(node->sessionKey, &gkeyS);
+        verdict=finishAtS(header,*stored ? &(*stored)->pkt.header : header,node,&ctx->nodes[path->d],&pkt->payload,gkeyS,ctx->freshIv,&c1,&c2,0);
+        // the session is set up, a table of them only keeps what s sends with
+        if(verdict == PACKET_OK && session != NULL && *stored != NULL){
+          pbufPut(ctx->pool, *stored);
+          *stored=NULL;
+        }
+        next=stepOnPath(path->sm,path->smLen,id,1);
+      }
+      else{
+        handler=HANDLER_MTOS;
+        verdict=mToS(header,node,ctx->gkey,&c1,&c2,0);
+        next=stepOnPath(path->sm,path->smLen,id,-1);
+      }
+      break;
+
+    case TRANSMISSION_PHASE_TO_D1:
+      if(id == path->w){
+        handler=HANDLER_IAMWTRANSMISSIONTOD2;
+        generateIv(ctx->freshIv);
+        verdict=iAmWTransmissionToD2(header,node,ctx->freshIv,ctx->gkey,&c1,&c2,0);
+        next=stepOnPath(path->wd,path->wdLen,id,1);
+      }
+      else{
+        handler=HANDLER_FORWARDSTOW;
+        verdict=forwardStoW(header,node,ctx->gkey,&c1,&c2,0);
+        next=stepOnPath(path->sm,path->smLen,id,1);
+      }
+      break;
+
+    case TRANSMISSION_PHASE_TO_D2:
+      if(id == path->d){
+        next=PACKET_DELIVERED;
+      }
+      else{
+        handler=HANDLER_FORWARDWTOD;
+        verdict=forwardWtoD(header,node,ctx->gkey,&c1,&c2,0);
+        next=stepOnPath(path->wd,path->wdLen,id,1);
+      }
+      break;
+
+    default:
+      next=PACKET_DROP;
+      drop=1;
+  }
+
+  /* the step goes on once a worker is done with its ECDH */
+  if(verdict == PACKET_OFFLOADED && ecdhSubmit(ctx->offload, pbufOf(ctx->pool, pkt), node->privKey, ecdh.point)){
+    return PACKET_DEFERRED;
+  }
+  /* the handler already counted why it rejected the packet */
+  if(verdict != PACKET_OK){
+    next=PACKET_DROP;
+  }
+  /* only what the handler accepted becomes the state of the session */
+  else if(ctx->sessions != NULL && sessionStep(handler)){
+    if(session == NULL){
+      session=sessionFind(ctx->sessions,ctx->pool,header->sid,1);
+    }
+    sessionStore(session,node);
+  }
+  ctx->lastHandler=handler;
+
+  if(telemetry != NULL || trace != NULL){
+    uint64_t b=__rdtsc();
+    if(telemetry != NULL){
+      telemetryPacket(status, handler, b-a, next == PACKET_DROP);
+    }
+    if(__builtin_expect(trace != NULL, 0) && !drop && verdict == PACKET_OK){
+      traceHop(pkt->seq, header, id, handler, status, a, b);
+    }
+  }
+  if(drop){
+    return PACKET_DROP;
+  }
+  ctx->packets++;
+  pkt->from=id;
+  return next;
+}
+
+/**************************************************************************
+ Runs the next deferred handshake whose turn has come through iAmHelper.
+ Returns its buffer, with the reference the queue held, and the next hop
+ in next, or NULL if none may go yet.
+**************************************************************************/
+struct PacketBuf *admitResume(struct NodeCtx *ctx, int *next)
+{
+  struct PacketBuf *buf;
+
+  if(ctx->admit == NULL || (buf=admitNext(ctx->admit)) == NULL){
+    return NULL;
+  }
+  ctx->admit->resuming=1;
+  *next=dispatchPacket(ctx, &buf->pkt);
+  ctx->admit->resuming=0;
+  return buf;
+}
+
+/**************************************************************************
+ Runs the handler of the next handshake whose ECDH a worker has finished
+ once more, now with the secret. Returns its buffer, with the reference
+ the job held, and the next hop in next, or NULL if no job is done yet.
+**************************************************************************/
+struct PacketBuf *offloadResume(struct NodeCtx *ctx, int *next)
+{
+  struct Offload *off=ctx->offload;
+  struct EcdhJob *job;
+
+  if(off == NULL || off->completed == off->submitted || (job=ecdhPop(&off->done)) == NULL){
+    return NULL;
+  }
+  off->completed++;
+  ctx->completed=job;
+  *next=dispatchPacket(ctx, &job->buf->pkt);
+  ctx->completed=NULL;
+  off->idle[off->nIdle++]=job;
+  return job->buf;
+}
+
+/* what engines call to get hold of deferred packets that may go on now */
+struct PacketBuf *resumeDeferred(struct NodeCtx *ctx, int *next)
+{
+  struct PacketBuf *buf=offloadResume(ctx, next);
+  return buf != NULL ? buf : admitResume(ctx, next);
+}
+
+int deferredPending(const struct NodeCtx *ctx)
+{
+  return (ctx->admit != NULL && ctx->admit->pending > 0) || (ctx->offload != NULL && ctx->offload->completed < ctx->offload->submitted);
+}
+
+/**************************************************************************
+ Sorts the first n values of cVector and prints median, tail and maximum.
+ Used for latency distributions, where the middle quartile that
+ cVectorAnalysis reports would hide exactly what we are interested in.
+**************************************************************************/
+void cVectorPercentiles(int n)
+{
+  if(n <= 0){
+    printf("no samples\n");
+    return;
+  }
+  qsort( cVector, n, sizeof(int), compare );
+  printf("p50 %d  p90 %d  p99 %d  max %d\n",cVector[n/2],cVector[(int)(n*0.9)],cVector[(int)(n*0.99)],cVector[n-1]);
+}
+
+/**************************************************************************
+ Orders trace events by session and time, so that each session can be
+ followed from hop to hop.
+**************************************************************************/
+int compareTraceEvents(const void *a, const void *b)
+{
+  const struct TraceEvent *x=a, *y=b;
+  if(x->seq != y->seq){
+    return x->seq < y->seq ? -1 : 1;
+  }
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/**************************************************************************
+ Writes what all rings hold to <DPHI_TRACE_FILE>-<tag>.json (the prefix
+ defaults to dphi-trace) and empties them for the next run. Must only be
+ called once the recording threads are done.
+**************************************************************************/
+void traceDump(const char *tag)
+{
+  static const char *roles[NUM_OF_PATH_NODES]={" (s)","","","",
+    " (W)","",""," (M)","","","","",""," (d)"};
+  const char *prefix=getenv("DPHI_TRACE_FILE");
+  char path[256], name[32];
+  int n=0, sessions=0;
+
+  if(tracer == NULL){
+    return;
+  }
+  int rings=tracer->rings < TRACE_RINGS ? tracer->rings : TRACE_RINGS;
+  // only [A-Za-z0-9-] of the tag make it into the file name
+  int len=0;
+  for(;tag[len] != 0 && len+1 < (int)sizeof name;len++)
+  {
+    char c=tag[len];
+    name[len]=((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-') ? c : '-';
+  }
+  name[len]=0;
+  len=snprintf(path, sizeof path, "%s-%s.json", prefix != NULL ? prefix : "dphi-trace", name);
+  if(len < 0 || len >= (int)sizeof path){
+    fprintf(stderr, "Trace: file name for %s too long, DPHI_TRACE_FILE has to be shorter\n", name);
+    return;
+  }
+  struct TraceEvent *events=malloc((size_t)rings*TRACE_EVENTS*sizeof *events);
+  if(events == NULL){
+    fprintf(stderr, "Trace: no memory for %d rings, nothing written\n", rings);
+    return;
+  }
+  for(int r=0;r<rings;r++)
+  {
+    struct TraceRing *ring=&tracer->ring[r];
+    uint64_t head=__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first=head > TRACE_EVENTS ? head-TRACE_EVENTS : 0;
+    for(uint64_t i=first;i<head;i++)
+    {
+      events[n]=ring->events[i & (TRACE_EVENTS-1)];
+      events[n].reserved=r;
+      n++;
+    }
+  }
+  qsort(events, n, sizeof *events, compareTraceEvents);
+
+  FILE *f=fopen(path, "w");
+  if(f == NULL){
+    perror(path);
+    free(events);
+    return;
+  }
+
+  double usPerCycle=(nowNs()-tracer->ns0)/1e3/(double)(__rdtsc()-tracer->tsc0);
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"Node %d%s\"}},\n",i,i,roles[i]);
+    fprintf(f, "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"sort_index\":%d}},\n",i,i);
+  }
+  for(int i=0;i<n;i++)
+  {
+    struct TraceEvent *e=&events[i];
+    int last=(i+1 == n || events[i+1].seq != e->seq);
+    int first=(i == 0 || events[i-1].seq != e->seq);
+    double ts=(double)(int64_t)(e->start-tracer->tsc0)*usPerCycle;
+    int tid=tracer->ring[e->reserved].owner;
+
+    fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"session\":%u,\"sid\":\"%08x\",\"cycles\":%llu}},\n",
+            e->handler < NUM_OF_HANDLERS ? handlerNames[e->handler] : "deliver",
+            e->status < NUM_OF_STATUS ? statusNames[e->status] : "unknown",
+            ts,(e->end-e->start)*usPerCycle,e->node,tid,e->seq,e->sid,(unsigned long long)(e->end-e->start));
+    // the arrows that connect the hops of one session
+    if(!(first && last)){
+      fprintf(f, "{\"name\":\"session\",\"cat\":\"session\",\"ph\":\"%s\",\"id\":%u,\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s},\n",
+              first ? "s" : last ? "f" : "t",e->seq,ts,e->node,tid,first ? "" : ",\"bp\":\"e\"");
+    }
+    sessions=sessions+first;
+  }
+  // JSON does not allow a trailing comma, so the list ends with an empty metadata event
+  fprintf(f, "{\"name\":\"trace_end\",\"ph\":\"M\",\"pid\":0,\"args\":{}}\n]}\n");
+  fclose(f);
+  printf("Trace:\t\t %d hops of %d sessions written to %s\n",n,sessions,path);
+
+  for(int r=0;r<rings;r++)
+  {
+    tracer->ring[r].head=0;
+  }
+  tracer->rings=0;
+  free(events);
+}
+
+/**************************************************************************
+* UDP node daemons
+*
+* Every node of the path binds its own UDP port on loopback and runs in
+* its own thread. Packets are received in batches with recvmmsg, processed
+* in the receive buffers by dispatchPacket and handed to the next hops with
+* a single sendmmsg per batch. A load generator thread plays the
+* application on top of s: it asks s to open sessions, keeps a window of
+* them in flight and takes the transmission-phase packets that reach d.
+**************************************************************************/
+
+#define UDP_BASE_PORT 47000
+#define UDP_BATCH 32
+#define UDP_POOL_SIZE (4*UDP_BATCH) /* packet buffers per node */
+#define UDP_GENERATOR NUM_OF_PATH_NODES /* port offset of the load generator */
+
+struct UdpNode {
+  struct NodeCtx ctx;
+  int fd;
+  uint64_t batches;
+  pthread_t thread;
+};
+
+static volatile int udpRunning;
+
+void udpAddress(struct sockaddr_in *addr, int id)
+{
+  memset(addr, 0, sizeof *addr);
+  addr->sin_family=AF_INET;
+  addr->sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  addr->sin_port=htons(UDP_BASE_PORT+id);
+}
+
+/**************************************************************************
+ Opens and binds the socket for node id. The receive timeout lets the
+ node threads notice the end of a run without any extra signalling.
+**************************************************************************/
+int udpSocket(int id)
+{
+  struct sockaddr_in addr;
+  struct timeval tv={0,100000};
+  int bufSize=8*1024*1024;
+  int fd=socket(AF_INET, SOCK_DGRAM, 0);
+
+  if(fd < 0){
+    perror("socket");
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof bufSize);
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof bufSize);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  udpAddress(&addr, id);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0){
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**************************************************************************
+ Hands out all prepared messages, sendmmsg may take fewer than asked for.
+**************************************************************************/
+void udpSendAll(int fd, struct mmsghdr *msgs, int n)
+{
+  int done=0;
+  while(done < n)
+  {
+    int r=sendmmsg(fd, msgs+done, n-done, 0);
+    if(r < 0){
+      if(errno == EINTR || errno == EAGAIN){
+        continue;
+      }
+      perror("sendmmsg");
+      return;
+    }
+    done=done+r;
+  }
+}
+
+void *udpNodeLoop(void *arg)
+{
+  struct UdpNode *un=arg;
+  struct PacketBuf *bufs[UDP_BATCH], *resumed[UDP_BATCH];
+  struct mmsghdr msgs[UDP_BATCH], out[2*UDP_BATCH];
+  struct iovec iovs[UDP_BATCH], resumedIovs[UDP_BATCH];
+  struct sockaddr_in peers[UDP_BATCH], resumedPeers[UDP_BATCH];
+
+  // created here so that the buffers end up on this thread's NUMA node
+  un->ctx.pool=pbufPoolCreate(UDP_POOL_SIZE);
+  if(un->ctx.pool == NULL){
+    perror("pbufPoolCreate");
+    return NULL;
+  }
+  telemetryAttach(un->ctx.node->id);
+  traceAttach(un->ctx.node->id);
+  memset(bufs, 0, sizeof bufs);
+
+  while(udpRunning)
+  {
+    // every slot gets a buffer, a batch shrinks while the pool is exhausted
+    int ready=0;
+    while(ready < UDP_BATCH)
+    {
+      if(bufs[ready] == NULL && (bufs[ready]=pbufAlloc(un->ctx.pool)) == NULL){
+        break;
+      }
+      iovs[ready].iov_base=&bufs[ready]->pkt;
+      iovs[ready].iov_len=sizeof(struct Packet);
+      memset(&msgs[ready], 0, sizeof msgs[ready]);
+      msgs[ready].msg_hdr.msg_iov=&iovs[ready];
+      msgs[ready].msg_hdr.msg_iovlen=1;
+      ready++;
+    }
+    if(ready == 0){
+      sched_yield();
+      continue;
+    }
+    // with handshakes waiting for admission the socket is only polled
+    int waiting=deferredPending(&un->ctx);
+    int n=recvmmsg(un->fd, msgs, ready, waiting ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+    if(n <= 0 && !waiting){
+      continue;
+    }
+    if(n > 0){
+      un->batches++;
+    }
+    else{
+      n=0;
+    }
+
+    // the packets are processed where they were received and sent from there
+    int nOut=0;
+    for(int i=0;i<n;i++)
+    {
+      if(msgs[i].msg_len != sizeof(struct Packet)){
+        continue;
+      }
+      int next=dispatchPacket(&un->ctx, &bufs[i]->pkt);
+      if(next == PACKET_DROP || next == PACKET_DEFERRED){
+        continue;
+      }
+      if(next == PACKET_DELIVERED){
+        next=UDP_GENERATOR;
+      }
+      udpAddress(&peers[i], next);
+      memset(&out[nOut], 0, sizeof out[nOut]);
+      out[nOut].msg_hdr.msg_name=&peers[i];
+      out[nOut].msg_hdr.msg_namelen=sizeof peers[i];
+      out[nOut].msg_hdr.msg_iov=&iovs[i];
+      out[nOut].msg_hdr.msg_iovlen=1;
+      nOut++;
+    }
+
+    // deferred handshakes whose turn has come go out with the batch
+    int nResumed=0, next;
+    while(nResumed < UDP_BATCH && (resumed[nResumed]=resumeDeferred(&un->ctx, &next)) != NULL)
+    {
+      if(next >= 0){
+        resumedIovs[nResumed].iov_base=&resumed[nResumed]->pkt;
+        resumedIovs[nResumed].iov_len=sizeof(struct Packet);
+        udpAddress(&resumedPeers[nResumed], next);
+        memset(&out[nOut], 0, sizeof out[nOut]);
+        out[nOut].msg_hdr.msg_name=&resumedPeers[nResumed];
+        out[nOut].msg_hdr.msg_namelen=sizeof resumedPeers[nResumed];
+        out[nOut].msg_hdr.msg_iov=&resumedIovs[nResumed];
+        out[nOut].msg_hdr.msg_iovlen=1;
+        nOut++;
+      }
+      nResumed++;
+    }
+    udpSendAll(un->fd, out, nOut);
+
+    // the kernel has its copy now, buffers s still refers to stay out of the pool
+    for(int i=0;i<n;i++)
+    {
+      pbufPut(un->ctx.pool, bufs[i]);
+      bufs[i]=NULL;
+    }
+    for(int i=0;i<nResumed;i++)
+    {
+      pbufPut(un->ctx.pool, resumed[i]);
+    }
+    if(n == 0 && nResumed == 0){
+      sched_yield();
+    }
+  }
+  for(int i=0;i<UDP_BATCH;i++)
+  {
+    if(bufs[i] != NULL){
+      pbufPut(un->ctx.pool, bufs[i]);
+    }
+  }
+  telemetryDetach();
+  traceDetach();
+  return NULL;
+}
+
+/**************************************************************************
+ Asks s to open count new sessions, numbered from seq onwards.
+**************************************************************************/
+void udpKick(int fd, struct Packet *kicks, uint32_t seq, int count)
+{
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iovs[UDP_BATCH];
+  struct sockaddr_in addr;
+
+  udpAddress(&addr, NODE_S);
+  while(count > 0)
+  {
+    int n=count < UDP_BATCH ? count : UDP_BATCH;
+    for(int i=0;i<n;i++)
+    {
+      kicks[i].seq=seq++;
+      kicks[i].from=UDP_GENERATOR;
+      kicks[i].header.status=NEW_SESSION;
+      kicks[i].t0=nowNs();
+      iovs[i].iov_base=&kicks[i];
+      iovs[i].iov_len=sizeof kicks[i];
+      memset(&msgs[i], 0, sizeof msgs[i]);
+      msgs[i].msg_hdr.msg_name=&addr;
+      msgs[i].msg_hdr.msg_namelen=sizeof addr;
+      msgs[i].msg_hdr.msg_iov=&iovs[i];
+      msgs[i].msg_hdr.msg_iovlen=1;
+    }
+    udpSendAll(fd, msgs, n);
+    count=count-n;
+  }
+}
+
+/**************************************************************************
+ Starts one thread per node of the path, each running loop on its own
+ socket, and stops them again. The node loops differ only in how they
+ move packets between socket and dispatchPacket. Should a node fail to
+ start, the ones already running are stopped and released again.
+**************************************************************************/
+int startNodes(struct UdpNode *un, struct Node *nodes, void *(*loop)(void *))
+{
+  udpRunning=1;
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    initNodeCtx(&un[i].ctx, nodes, i);
+    un[i].batches=0;
+    un[i].fd=udpSocket(i);
+    if(un[i].fd < 0 || pthread_create(&un[i].thread, NULL, loop, &un[i]) != 0){
+      fprintf(stderr,"node %d could not be started\n",i);
+      if(un[i].fd >= 0){
+        close(un[i].fd);
+      }
+      releaseNodeCtx(&un[i].ctx);
+      udpRunning=0;
+      for(int k=0;k<i;k++)
+      {
+        pthread_join(un[k].thread, NULL);
+        close(un[k].fd);
+        releaseNodeCtx(&un[k].ctx);
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void stopNodes(struct UdpNode *un, uint64_t *packets, uint64_t *batches, uint32_t *poolPeak, uint64_t *poolExhausted)
+{
+  udpRunning=0;
+  *packets=0;
+  *batches=0;
+  *poolPeak=0;
+  *poolExhausted=0;
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    pthread_join(un[i].thread, NULL);
+    close(un[i].fd);
+    *packets=*packets+un[i].ctx.packets;
+    *batches=*batches+un[i].batches;
+    if(un[i].ctx.pool != NULL){
+      *poolPeak=un[i].ctx.pool->peak > *poolPeak ? un[i].ctx.pool->peak : *poolPeak;
+      *poolExhausted=*poolExhausted+un[i].ctx.pool->exhausted;
+    }
+    releaseNodeCtx(&un[i].ctx);
+  }
+}
+
+/**************************************************************************
+ The load generator. It asks s to open total sessions and takes the
+ transmission-phase packets that reach d. With rate == 0 it runs closed-
+ loop and opens a new session whenever one completes, keeping window
+ sessions in flight. With rate > 0 sessions are opened open-loop at the
+ given rate per second (never more than window in flight), so that
+ different node loops can be compared at the same offered load. Latencies
+ end up in cVector, the return value is the wall clock time of the run.
+**************************************************************************/
+uint64_t loadGenerator(int genFd, int total, int window, int rate, int *completed, int *lost)
+{
+  struct Packet *pkts=malloc(UDP_BATCH * sizeof *pkts);
+  struct Packet *kicks=calloc(UDP_BATCH, sizeof *kicks);
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iovs[UDP_BATCH];
+  struct timeval tv={0,1000};
+  uint32_t seq=0;
+
+  setsockopt(genFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  *completed=0;
+  *lost=0;
+  uint64_t start=nowNs();
+  uint64_t lastReply=start;
+
+  while(*completed+*lost < total)
+  {
+    uint64_t now=nowNs();
+    int due=total;
+    if(rate > 0){
+      uint64_t byNow=(now-start)*(uint64_t)rate/1000000000ULL+1;
+      due=byNow < (uint64_t)total ? (int)byNow : total;
+    }
+    int inFlight=(int)seq-*completed-*lost;
+    int toSend=due-(int)seq;
+    if(toSend > window-inFlight){
+      toSend=window-inFlight;
+    }
+    if(toSend > 0){
+      udpKick(genFd, kicks, seq, toSend);
+      seq=seq+toSend;
+    }
+
+    for(int i=0;i<UDP_BATCH;i++)
+    {
+      iovs[i].iov_base=&pkts[i];
+      iovs[i].iov_len=sizeof *pkts;
+      memset(&msgs[i], 0, sizeof msgs[i]);
+      msgs[i].msg_hdr.msg_iov=&iovs[i];
+      msgs[i].msg_hdr.msg_iovlen=1;
+    }
+    int n=recvmmsg(genFd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+    now=nowNs();
+    if(n <= 0){
+      /* nothing came back for a whole second, so whatever is in flight got lost on the way */
+      if(now-lastReply > 1000000000ULL && seq > (uint32_t)(*completed+*lost)){
+        *lost=(int)seq-*completed;
+        lastReply=now;
+      }
+      continue;
+    }
+    lastReply=now;
+    for(int i=0;i<n && *completed < total;i++)
+    {
+      cVector[(*completed)++]=(int)(now-pkts[i].t0);
+    }
+  }
+  uint64_t elapsed=nowNs()-start;
+
+  free(pkts);
+  free(kicks);
+  return elapsed;
+}
+
+/**************************************************************************
+ With more than one session in flight, s needs a keypair (and with it a
+ SID) per session and s and W need to keep the state per SID, or the
+ sessions overwrite each other's state in struct Node and get dropped
+ once a handler rejects what it can no longer verify. So unless
+ DPHI_SESSIONS and DPHI_KEYPOOL say otherwise, a window above 1 turns
+ both on, sized for the window. Set to 0, they stay off with a warning.
+**************************************************************************/
+void perSessionDefaults(int window)
+{
+  if(window <= 1){
+    return;
+  }
+  if(getenv("DPHI_SESSIONS") == NULL && sessionCapacity == 0){
+    // W keeps a session until it gets evicted, so leave room for the ones that completed
+    sessionCapacity=window < KEYPOOL_MAX ? 4*window : 4*KEYPOOL_MAX;
+    sessionCapacity=sessionCapacity < 1024 ? 1024 : sessionCapacity;
+    printf("Sessions:	 state per SID for up to %llu sessions (DPHI_SESSIONS)\n",(unsigned long long)sessionCapacity);
+  }
+  if(getenv("DPHI_KEYPOOL") == NULL && keypoolDepth == 0){
+    keypoolDepth=window < KEYPOOL_MAX ? window : KEYPOOL_MAX;
+    printf("Keypool:	 %d keypairs (DPHI_KEYPOOL)\n",keypoolDepth);
+  }
+  if(sessionCapacity == 0 || keypoolDepth == 0){
+    fprintf(stderr, "Warning: window %d without DPHI_SESSIONS and DPHI_KEYPOOL, concurrent sessions overwrite each other's state and most of them get dropped\n", window);
+  }
+}
+
+/**************************************************************************
+ Runs one complete measurement: node threads with the given loop plus the
+ load generator, and prints what came out of it.
+**************************************************************************/
+int runNodes(const char *name, struct Node *nodes, void *(*loop)(void *), int total, int window, int rate)
+{
+  struct UdpNode *un=calloc(NUM_OF_PATH_NODES, sizeof *un);
+  uint64_t packets, batches, poolExhausted;
+  uint32_t poolPeak;
+  int completed, lost;
+
+  if(un == NULL){
+    return 1;
+  }
+  perSessionDefaults(window);
+  int genFd=udpSocket(UDP_GENERATOR);
+  if(genFd < 0 || startNodes(un, nodes, loop) < 0){
+    if(genFd >= 0){
+      close(genFd);
+    }
+    free(un);
+    return 1;
+  }
+
+  printf("\n%s: %d sessions, window %d, offered rate %d/s (0: closed loop)\n",name,total,window,rate);
+  uint64_t elapsed=loadGenerator(genFd, total, window, rate, &completed, &lost);
+  if(un[NODE_S].ctx.keys != NULL){
+    keypoolPrint(un[NODE_S].ctx.keys);
+  }
+  stopNodes(un, &packets, &batches, &poolPeak, &poolExhausted);
+  close(genFd);
+  traceDump(name);
+
+  printf("Sessions completed:\t %d (%d lost)\n",completed,lost);
+  printf("Sessions per second:\t %.0f\n",completed/(elapsed/1e9));
+  printf("Packets per second:\t %.0f (%.1f packets per wakeup)\n",packets/(elapsed/1e9),batches ? (double)packets/batches : 0.0);
+  printf("Buffer pools:\t peak %u buffers in use at one node, %llu times exhausted\n",poolPeak,(unsigned long long)poolExhausted);
+  printf("End-to-end latency [ns]: ");
+  cVectorPercentiles(completed);
+
+  free(un);
+  return 0;
+}
+
+/**************************************************************************
+ The baseline for the node loops: one blocking recv and one sendto per
+ packet, as a straightforward daemon would do it.
+**************************************************************************/
+void *blockingNodeLoop(void *arg)
+{
+  struct UdpNode *un=arg;
+  struct PacketBuf *buf;
+  struct sockaddr_in peer;
+
+  un->ctx.pool=pbufPoolCreate(UDP_POOL_SIZE);
+  if(un->ctx.pool == NULL){
+    perror("pbufPoolCreate");
+    return NULL;
+  }
+  telemetryAttach(un->ctx.node->id);
+  traceAttach(un->ctx.node->id);
+
+  while(udpRunning)
+  {
+    int next, waiting=deferredPending(&un->ctx);
+
+    while((buf=resumeDeferred(&un->ctx, &next)) != NULL)
+    {
+      if(next >= 0){
+        udpAddress(&peer, next);
+        sendto(un->fd, &buf->pkt, sizeof buf->pkt, 0, (struct sockaddr *)&peer, sizeof peer);
+      }
+      pbufPut(un->ctx.pool, buf);
+    }
+    if((buf=pbufAlloc(un->ctx.pool)) == NULL){
+      sched_yield();
+      continue;
+    }
+    if(recv(un->fd, &buf->pkt, sizeof buf->pkt, waiting ? MSG_DONTWAIT : 0) == sizeof buf->pkt){
+      un->batches++;
+      next=dispatchPacket(&un->ctx, &buf->pkt);
+      if(next == PACKET_DELIVERED){
+        next=UDP_GENERATOR;
+      }
+      if(next >= 0){
+        udpAddress(&peer, next);
+        sendto(un->fd, &buf->pkt, sizeof buf->pkt, 0, (struct sockaddr *)&peer, sizeof peer);
+      }
+    }
+    else if(waiting){
+      sched_yield();
+    }
+    pbufPut(un->ctx.pool, buf);
+  }
+  telemetryDetach();
+  traceDetach();
+  return NULL;
+}
+
+/**************************************************************************
+* io_uring node loop
+*
+* Each node sets up its own ring on its socket. A slab of packet buffers is
+* registered with the ring twice: as a provided buffer ring from which a
+* single multishot recv picks the buffer for every incoming datagram, and
+* as a fixed buffer that the sends of the processed packets refer to. A
+* packet is therefore received into the slab, processed where it landed
+* and sent from there, after which its slot goes back to the buffer ring.
+* The sends of one batch go out with a single io_uring_enter. They are
+* not linked, as the packets have nothing to do with each other: a send
+* that fails only drops its own packet. The ring is driven with raw
+* syscalls, so nothing but kernel headers of version 6.0 or newer is
+* needed.
+**************************************************************************/
+
+#ifdef HAVE_IO_URING
+
+#define URING_SLOTS 128 /* must be a power of two */
+#define URING_RECV (1ULL << 32)
+#define URING_SEND (2ULL << 32)
+
+struct Uring {
+  int fd;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  unsigned sqEntries, sqeTail;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize, sqesSize;
+};
+
+struct UringNode {
+  struct Uring ring;
+  struct Packet *slab;
+  struct io_uring_buf_ring *bufRing;
+  unsigned short bufTail;
+  struct sockaddr_in peers[URING_SLOTS];
+};
+
+void uringExit(struct Uring *r)
+{
+  if(r->sqes != NULL && r->sqes != MAP_FAILED){
+    munmap(r->sqes, r->sqesSize);
+  }
+  if(r->cqRing != NULL && r->cqRing != MAP_FAILED){
+    munmap(r->cqRing, r->cqRingSize);
+  }
+  if(r->sqRing != NULL && r->sqRing != MAP_FAILED){
+    munmap(r->sqRing, r->sqRingSize);
+  }
+  if(r->fd >= 0){
+    close(r->fd);
+  }
+  memset(r, 0, sizeof *r);
+  r->fd=-1;
+}
+
+/**************************************************************************
+ Creates the ring and maps submission queue, completion queue and SQEs.
+**************************************************************************/
+int uringInit(struct Uring *r, unsigned entries)
+{
+  struct io_uring_params p;
+
+  memset(r, 0, sizeof *r);
+  memset(&p, 0, sizeof p);
+  p.flags=IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  r->fd=syscall(__NR_io_uring_setup, entries, &p);
+  if(r->fd < 0){
+    /* older kernels do not know about the flags, they are only an optimization */
+    memset(&p, 0, sizeof p);
+    r->fd=syscall(__NR_io_uring_setup, entries, &p);
+  }
+  if(r->fd < 0){
+    perror("io_uring_setup");
+    return -1;
+  }
+
+  r->sqRingSize=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  r->cqRingSize=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  r->sqesSize=p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sqRing=mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cqRing=mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes=mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED || r->sqes == MAP_FAILED){
+    perror("mmap io_uring");
+    uringExit(r);
+    return -1;
+  }
+
+  r->sqHead=(unsigned *)((uint8_t *)r->sqRing+p.sq_off.head);
+  r->sqTail=(unsigned *)((uint8_t *)r->sqRing+p.sq_off.tail);
+  r->sqMask=(unsigned *)((uint8_t *)r->sqRing+p.sq_off.ring_mask);
+  r->sqArray=(unsigned *)((uint8_t *)r->sqRing+p.sq_off.array);
+  r->cqHead=(unsigned *)((uint8_t *)r->cqRing+p.cq_off.head);
+  r->cqTail=(unsigned *)((uint8_t *)r->cqRing+p.cq_off.tail);
+  r->cqMask=(unsigned *)((uint8_t *)r->cqRing+p.cq_off.ring_mask);
+  r->cqes=(struct io_uring_cqe *)((uint8_t *)r->cqRing+p.cq_off.cqes);
+  r->sqEntries=p.sq_entries;
+  r->sqeTail=*r->sqTail;
+  return 0;
+}
+
+
+/**************************************************************************
+ Returns a cleared SQE or NULL if the submission queue is full.
+**************************************************************************/
+struct io_uring_sqe *uringSqe(struct Uring *r)
+{
+  unsigned head=__atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE);
+  if(r->sqeTail-head >= r->sqEntries){
+    return NULL;
+  }
+  unsigned idx=r->sqeTail & *r->sqMask;
+  r->sqArray[idx]=idx;
+  r->sqeTail++;
+  memset(&r->sqes[idx], 0, sizeof r->sqes[idx]);
+  return &r->sqes[idx];
+}
+
+/**************************************************************************
+ Submits everything queued so far and waits for at least one completion
+ or the timeout, whatever comes first.
+**************************************************************************/
+int uringSubmitAndWait(struct Uring *r, long timeoutNs)
+{
+  struct __kernel_timespec ts={0, timeoutNs};
+  struct io_uring_getevents_arg arg;
+  unsigned toSubmit=r->sqeTail-*r->sqTail;
+
+  memset(&arg, 0, sizeof arg);
+  arg.ts=(uint64_t)(uintptr_t)&ts;
+  __atomic_store_n(r->sqTail, r->sqeTail, __ATOMIC_RELEASE);
+  return syscall(__NR_io_uring_enter, r->fd, toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+/**************************************************************************
+ Hands slot back to the kernel so that it can receive into it again.
+**************************************************************************/
+void uringProvide(struct UringNode *u, int slot)
+{
+  struct io_uring_buf *buf=&u->bufRing->bufs[u->bufTail & (URING_SLOTS-1)];
+  buf->addr=(uint64_t)(uintptr_t)&u->slab[slot];
+  buf->len=sizeof(struct Packet);
+  buf->bid=slot;
+  u->bufTail++;
+  __atomic_store_n(&u->bufRing->tail, u->bufTail, __ATOMIC_RELEASE);
+}
+
+int uringArmRecv(struct UringNode *u, int fd)
+{
+  struct io_uring_sqe *sqe=uringSqe(&u->ring);
+  if(sqe == NULL){
+    return -1;
+  }
+  sqe->opcode=IORING_OP_RECV;
+  sqe->fd=fd;
+  sqe->ioprio=IORING_RECV_MULTISHOT;
+  sqe->flags=IOSQE_BUFFER_SELECT;
+  sqe->buf_group=0;
+  sqe->user_data=URING_RECV;
+  return 0;
+}
+
+/**************************************************************************
+ Sets up ring, slab, buffer ring and fixed buffer for one node.
+**************************************************************************/
+int uringNodeInit(struct UringNode *u)
+{
+  struct io_uring_buf_reg reg;
+  struct iovec iov;
+
+  memset(u, 0, sizeof *u);
+  u->slab=MAP_FAILED;
+  u->bufRing=MAP_FAILED;
+  if(uringInit(&u->ring, 2*URING_SLOTS) < 0){
+    return -1;
+  }
+  u->slab=mmap(NULL, URING_SLOTS*sizeof(struct Packet), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  u->bufRing=mmap(NULL, URING_SLOTS*sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if(u->slab == MAP_FAILED || u->bufRing == MAP_FAILED){
+    perror("mmap slab");
+    return -1;
+  }
+
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr=(uint64_t)(uintptr_t)u->bufRing;
+  reg.ring_entries=URING_SLOTS;
+  reg.bgid=0;
+  if(syscall(__NR_io_uring_register, u->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+    perror("IORING_REGISTER_PBUF_RING");
+    return -1;
+  }
+  iov.iov_base=u->slab;
+  iov.iov_len=URING_SLOTS*sizeof(struct Packet);
+  if(syscall(__NR_io_uring_register, u->ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0){
+    perror("IORING_REGISTER_BUFFERS");
+    return -1;
+  }
+  for(int i=0;i<URING_SLOTS;i++)
+  {
+    uringProvide(u, i);
+  }
+  return 0;
+}
+
+/* undoes uringNodeInit, also one that failed halfway */
+void uringNodeFree(struct UringNode *u)
+{
+  uringExit(&u->ring);
+  if(u->slab != MAP_FAILED){
+    munmap(u->slab, URING_SLOTS*sizeof(struct Packet));
+  }
+  if(u->bufRing != MAP_FAILED){
+    munmap(u->bufRing, URING_SLOTS*sizeof(struct io_uring_buf));
+  }
+  free(u);
+}
+
+void *uringNodeLoop(void *arg)
+{
+  struct UdpNode *un=arg;
+  struct UringNode *u=malloc(sizeof *u);
+
+  if(u == NULL){
+    fprintf(stderr,"node %d: out of memory for its io_uring\n",un->ctx.node->id);
+    return NULL;
+  }
+  if(uringNodeInit(u) < 0 || uringArmRecv(u, un->fd) < 0){
+    fprintf(stderr,"node %d: io_uring could not be set up, the node does not run\n",un->ctx.node->id);
+    uringNodeFree(u);
+    return NULL;
+  }
+  telemetryAttach(un->ctx.node->id);
+  traceAttach(un->ctx.node->id);
+
+  while(udpRunning)
+  {
+    uringSubmitAndWait(&u->ring, 100000000L);
+
+    int rearm=0, received=0;
+    unsigned head=*u->ring.cqHead;
+    unsigned tail=__atomic_load_n(u->ring.cqTail, __ATOMIC_ACQUIRE);
+    for(;head != tail;head++)
+    {
+      struct io_uring_cqe *cqe=&u->ring.cqes[head & *u->ring.cqMask];
+      uint64_t kind=cqe->user_data & ~0xffffffffULL;
+      int slot=(int)(cqe->user_data & 0xffffffffULL);
+
+      if(kind == URING_SEND){
+        if(!(cqe->flags & IORING_CQE_F_NOTIF) && cqe->res < 0){
+          telemetryDrop();
+        }
+        /* a zero-copy send completes twice, the slot is free only after the notification */
+        if((cqe->flags & IORING_CQE_F_NOTIF) || !(cqe->flags & IORING_CQE_F_MORE)){
+          uringProvide(u, slot);
+        }
+        continue;
+      }
+
+      if(!(cqe->flags & IORING_CQE_F_MORE)){
+        rearm=1;
+      }
+      if(cqe->res <= 0 || !(cqe->flags & IORING_CQE_F_BUFFER)){
+        continue;
+      }
+      slot=cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      received++;
+
+      struct Packet *pkt=&u->slab[slot];
+      int next=PACKET_DROP;
+      if(cqe->res == sizeof *pkt){
+        next=dispatchPacket(&un->ctx, pkt);
+      }
+      struct io_uring_sqe *sqe=next == PACKET_DROP ? NULL : uringSqe(&u->ring);
+      if(sqe == NULL){
+        if(next != PACKET_DROP){
+          telemetryDrop();
+        }
+        uringProvide(u, slot);
+        continue;
+      }
+      if(next == PACKET_DELIVERED){
+        next=UDP_GENERATOR;
+      }
+      udpAddress(&u->peers[slot], next);
+      sqe->opcode=IORING_OP_SEND_ZC;
+      sqe->fd=un->fd;
+      sqe->addr=(uint64_t)(uintptr_t)pkt;
+      sqe->len=sizeof *pkt;
+      sqe->ioprio=IORING_RECVSEND_FIXED_BUF;
+      sqe->buf_index=0;
+      sqe->addr2=(uint64_t)(uintptr_t)&u->peers[slot];
+      sqe->addr_len=sizeof u->peers[slot];
+      sqe->user_data=URING_SEND | slot;
+    }
+    __atomic_store_n(u->ring.cqHead, head, __ATOMIC_RELEASE);
+    if(received > 0){
+      un->batches++;
+    }
+    if(rearm){
+      uringArmRecv(u, un->fd);
+    }
+  }
+
+  telemetryDetach();
+  traceDetach();
+  uringNodeFree(u);
+  return NULL;
+}
+
+#endif
+
+/**************************************************************************
+ Entry point of "dphi udp|blocking [sessions] [window] [rate]": starts one
+ daemon per node and drives the given number of full handshakes plus one
+ transmission-phase packet each through them (see loadGenerator).
+ Nodes drop packets their handler rejects, so with a window above 1 the
+ sessions in flight need their own SID and state: runNodes turns on the
+ keypool and the session tables for that (see perSessionDefaults) unless
+ they were switched off explicitly.
+**************************************************************************/
+int udpMode(struct Node *nodes, void *(*loop)(void *), int argc, char **argv)
+{
+  int total=argc > 0 ? atoi(argv[0]) : 10000;
+  int window=argc > 1 ? atoi(argv[1]) : 1;
+  int rate=argc > 2 ? atoi(argv[2]) : 0;
+
+  if(total <= 0 || total > NUM_OF_SIMS){
+    total=NUM_OF_SIMS;
+  }
+  if(window <= 0){
+    window=1;
+  }
+  printf("UDP node daemons on 127.0.0.1:%d-%d\n",UDP_BASE_PORT,UDP_BASE_PORT+NUM_OF_PATH_NODES-1);
+  const char *name=loop == blockingNodeLoop ? "blocking" : "recvmmsg/sendmmsg";
+#ifdef HAVE_IO_URING
+  if(loop == uringNodeLoop){
+    name="io_uring";
+  }
+#endif
+  return runNodes(name, nodes, loop, total, window, rate);
+}
+
+/**************************************************************************
+ Entry point of "dphi iobench [sessions] [rate]": runs the same offered
+ load (open-loop at rate sessions per second) through the blocking
+ baseline, the recvmmsg/sendmmsg loop and, if available, the io_uring
+ loop, one after the other.
+**************************************************************************/
+int ioBenchMode(struct Node *nodes, int argc, char **argv)
+{
+  int total=argc > 0 ? atoi(argv[0]) : 20000;
+  int rate=argc > 1 ? atoi(argv[1]) : 2000;
+
+  if(total <= 0 || total > NUM_OF_SIMS){
+    total=NUM_OF_SIMS;
+  }
+  runNodes("blocking", nodes, blockingNodeLoop, total, total, rate);
+  runNodes("recvmmsg/sendmmsg", nodes, udpNodeLoop, total, total, rate);
+#ifdef HAVE_IO_URING
+  runNodes("io_uring", nodes, uringNodeLoop, total, total, rate);
+#else
+  printf("\nio_uring: not available in this build (needs linux/io_uring.h of kernel 6.0 or newer)\n");
+#endif
+  return 0;
+}
+
+/**************************************************************************
+* Cost of a rejected packet
+*
+* One session is walked through the path with the very same dispatcher the
+* engines use, and the input of every hop is kept. The first hop of every
+* handler is then replayed over and over, as received and with one of
+* three forgeries: H.pos pointing out of the vector, a flipped SID byte
+* and a flipped tag (the payload tag where M, d and s check it, the
+* ciphertext of the routing entries anywhere else). Reported is the median
+* of the cycles dispatchPacket takes; a * marks packets that were not
+* dropped since the handler does not verify what was forged.
+**************************************************************************/
+
+#define REJECT_VARIANTS 4
+#define RECORD_MAX_HOPS 64
+
+struct RecordedHop {
+  int id;
+  struct Packet pkt;
+  struct Node node;
+  struct Header stored;
+};
+
+/**************************************************************************
+ Walks one session from s to d through the contexts in ctx and keeps what
+ every hop got to see in hops. first[h] is set to the index of the first
+ hop that ran handler h, or -1. Returns the number of hops or -1 if the
+ session did not make it to d.
+**************************************************************************/
+int recordSession(struct NodeCtx *ctx, struct Node *nodes, struct RecordedHop *hops, int *first)
+{
+  struct Packet *pkt=malloc(sizeof *pkt);
+  int id=NODE_S, next=NODE_S, n=0;
+
+  if(pkt == NULL){
+    return -1;
+  }
+  for(int h=0;h<NUM_OF_HANDLERS;h++)
+  {
+    first[h]=-1;
+  }
+  memset(pkt, 0, sizeof *pkt);
+  pkt->header.status=NEW_SESSION;
+  while(next >= 0 && n < RECORD_MAX_HOPS)
+  {
+    id=next;
+    hops[n].id=id;
+    memcpy(&hops[n].pkt, pkt, sizeof *pkt);
+    memcpy(&hops[n].node, &nodes[id], sizeof nodes[id]);
+    if(ctx[id].stored != NULL){
+      memcpy(&hops[n].stored, &ctx[id].stored->pkt.header, sizeof hops[n].stored);
+    }
+    next=dispatchPacket(&ctx[id], pkt);
+    if(ctx[id].lastHandler < NUM_OF_HANDLERS && first[ctx[id].lastHandler] < 0){
+      first[ctx[id].lastHandler]=n;
+    }
+    n++;
+  }
+  free(pkt);
+  if(next != PACKET_DELIVERED){
+    fprintf(stderr,"session did not reach d (hop %d at node %d)\n",n,id);
+    return -1;
+  }
+  return n;
+}
+
+void forgePacket(struct Packet *pkt, int handler, int variant)
+{
+  struct Header *header=&pkt->header;
+  int pos=header->pos % VECTOR_LENGTH;
+
+  switch(variant)
+  {
+    case 1:
+      header->pos=200;
+      break;
+    case 2:
+      header->sid[0]^=1;
+      break;
+    case 3:
+      if(handler == HANDLER_IAMHELPER || handler == HANDLER_IAMD || handler == HANDLER_FINISHATS){
+        pkt->payload.at[0]^=1;
+      }
+      else{
+        header->v1[pos].ct[0]^=1;
+        header->v2[pos].ct[0]^=1;
+      }
+      break;
+  }
+}
+
+int rejectBenchMode(struct Node *nodes, int argc, char **argv)
+{
+  static const char *variants[REJECT_VARIANTS]={"valid","bad pos","bad SID","bad tag"};
+  int iterations=argc > 0 ? atoi(argv[0]) : 10000;
+  struct NodeCtx ctx[NUM_OF_PATH_NODES];
+  struct RecordedHop *hops=malloc(RECORD_MAX_HOPS*sizeof *hops);
+  struct Packet *pkt=malloc(sizeof *pkt);
+  int first[NUM_OF_HANDLERS];
+  int next;
+
+  if(hops == NULL || pkt == NULL){
+    fprintf(stderr,"rejectbench: out of memory\n");
+    return 1;
+  }
+  if(iterations <= 0 || iterations > NUM_OF_SIMS){
+    iterations=NUM_OF_SIMS;
+  }
+  // replaying recorded packets is what this benchmark does
+  replayCapacity=0;
+  sessionCapacity=0;
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    initNodeCtx(&ctx[i], nodes, i);
+  }
+  if(recordSession(ctx, nodes, hops, first) < 0){
+    return 1;
+  }
+
+  printf("Cycles per packet in dispatchPacket, median of %d (* = not dropped):\n",iterations);
+  printf("%-20s","Handler");
+  for(int v=0;v<REJECT_VARIANTS;v++)
+  {
+    printf(" %10s",variants[v]);
+  }
+  printf("\n");
+
+  for(int h=0;h<NUM_OF_HANDLERS;h++)
+  {
+    struct RecordedHop *hop;
+    if(first[h] < 0 || h == HANDLER_IAMS){
+      continue;
+    }
+    hop=&hops[first[h]];
+    printf("%-20s",handlerNames[h]);
+    for(int v=0;v<REJECT_VARIANTS;v++)
+    {
+      int kept=0;
+      for(int q=0;q<iterations;q++)
+      {
+        uint64_t a, b;
+        memcpy(pkt, &hop->pkt, sizeof *pkt);
+        memcpy(&nodes[hop->id], &hop->node, sizeof hop->node);
+        if(ctx[hop->id].stored != NULL){
+          memcpy(&ctx[hop->id].stored->pkt.header, &hop->stored, sizeof hop->stored);
+        }
+        forgePacket(pkt, h, v);
+        a=__rdtsc();
+        next=dispatchPacket(&ctx[hop->id], pkt);
+        b=__rdtsc();
+        cVector[q]=(int)(b-a);
+        kept=kept || next != PACKET_DROP;
+      }
+      qsort( cVector, iterations, sizeof(int), compare );
+      printf(" %9d%s",cVector[iterations/2],v > 0 && kept ? "*" : " ");
+    }
+    printf("\n");
+  }
+
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    releaseNodeCtx(&ctx[i]);
+  }
+  free(pkt);
+  free(hops);
+  return 0;
+}
+
+/**************************************************************************
+* Forwarding under a handshake flood
+*
+* One core serves both as M and as a forwarding node on the way from s to
+* W. Handshakes, replayed from a recorded session, arrive open-loop at the
+* offered rate while there are always packets to forward, and the core
+* alternates between a batch of either, as a node loop does with what one
+* recvmmsg returns. Handshakes that find more than ADMIT_BENCH_BACKLOG
+* others waiting are lost, as they would be in a full socket buffer. Every
+* rate runs once without and once with admission at M.
+**************************************************************************/
+
+#define ADMIT_BENCH_BACKLOG 4096
+
+struct AdmitRun {
+  double handshakes; /* per second, through iAmHelper */
+  double forwarded;  /* per second */
+  uint64_t counts[NUM_OF_ADMIT];
+  uint64_t lost;
+};
+
+void admitBenchRun(struct NodeCtx *ctx, const struct RecordedHop *helper, const struct RecordedHop *fwd, double offered, double seconds, const struct AdmitConfig *cfg, struct AdmitRun *run)
+{
+  struct NodeCtx *m=&ctx[helper->id];
+  struct Packet *pkt=malloc(sizeof *pkt);
+  struct PacketBuf *buf;
+  uint64_t start, now, end, taken=0, handshakes=0, forwarded=0;
+  int next;
+
+  memset(run, 0, sizeof *run);
+  m->pool=pbufPoolCreate(ADMIT_QUEUE_MAX+UDP_BATCH);
+  m->admit=admitCreate(cfg);
+  if(pkt == NULL || m->pool == NULL){
+    free(pkt);
+    return;
+  }
+
+  start=nowNs();
+  end=start+(uint64_t)(seconds*1e9);
+  while((now=nowNs()) < end)
+  {
+    uint64_t due=(uint64_t)((now-start)*offered/1e9);
+    if(due-taken > ADMIT_BENCH_BACKLOG){
+      run->lost=run->lost+due-taken-ADMIT_BENCH_BACKLOG;
+      taken=due-ADMIT_BENCH_BACKLOG;
+    }
+    for(int i=0;i<UDP_BATCH && taken < due;i++,taken++)
+    {
+      if((buf=pbufAlloc(m->pool)) == NULL){
+        run->lost++;
+        continue;
+      }
+      memcpy(&buf->pkt, &helper->pkt, sizeof buf->pkt);
+      if(dispatchPacket(m, &buf->pkt) >= 0){
+        handshakes++;
+      }
+      pbufPut(m->pool, buf);
+    }
+    for(int i=0;i<UDP_BATCH && (buf=resumeDeferred(m, &next)) != NULL;i++)
+    {
+      if(next >= 0){
+        handshakes++;
+      }
+      pbufPut(m->pool, buf);
+    }
+    for(int i=0;i<UDP_BATCH;i++)
+    {
+      memcpy(pkt, &fwd->pkt, sizeof *pkt);
+      if(dispatchPacket(&ctx[fwd->id], pkt) >= 0){
+        forwarded++;
+      }
+    }
+  }
+  now=nowNs();
+  run->handshakes=handshakes*1e9/(now-start);
+  run->forwarded=forwarded*1e9/(now-start);
+  if(m->admit != NULL){
+    memcpy(run->counts, m->admit->counts, sizeof run->counts);
+  }
+  admitDestroy(m->admit, m->pool);
+  m->admit=NULL;
+  pbufPoolDestroy(m->pool);
+  m->pool=NULL;
+  free(pkt);
+}
+
+int admitBenchMode(struct Node *nodes, int argc, char **argv)
+{
+  static const double load[]={0, 0.5, 1, 2, 4};
+  double seconds=argc > 0 ? atof(argv[0]) : 1;
+  struct NodeCtx ctx[NUM_OF_PATH_NODES];
+  struct RecordedHop *hops=malloc(RECORD_MAX_HOPS*sizeof *hops);
+  struct AdmitConfig off, on;
+  struct AdmitRun run;
+  int first[NUM_OF_HANDLERS];
+  const struct RecordedHop *helper, *fwd;
+  double capacity;
+
+  if(hops == NULL){
+    fprintf(stderr,"admitbench: out of memory\n");
+    return 1;
+  }
+  if(seconds <= 0){
+    seconds=1;
+  }
+  // replaying recorded packets is what this benchmark does
+  replayCapacity=0;
+  sessionCapacity=0;
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    initNodeCtx(&ctx[i], nodes, i);
+  }
+  if(recordSession(ctx, nodes, hops, first) < 0 || first[HANDLER_IAMHELPER] < 0 || first[HANDLER_FORWARDSTOW] < 0){
+    return 1;
+  }
+  helper=&hops[first[HANDLER_IAMHELPER]];
+  fwd=&hops[first[HANDLER_FORWARDSTOW]];
+  admitDestroy(ctx[helper->id].admit, ctx[helper->id].pool);
+  ctx[helper->id].admit=NULL;
+
+  /* what one core manages when it does nothing but handshakes */
+  struct Packet *pkt=malloc(sizeof *pkt);
+  uint64_t a=nowNs();
+  for(int q=0;q<1000;q++)
+  {
+    memcpy(pkt, &helper->pkt, sizeof *pkt);
+    dispatchPacket(&ctx[helper->id], pkt);
+  }
+  capacity=1000*1e9/(nowNs()-a);
+  free(pkt);
+
+  memset(&off, 0, sizeof off);
+  memcpy(&on, &admitConfig, sizeof on);
+  if(!on.enabled){
+    /* a quarter of the core for handshakes from each ingress */
+    on.enabled=1;
+    on.policy=ADMIT_TAIL_DROP;
+    on.queue=64;
+    on.burst=16;
+    for(int i=0;i<ADMIT_INGRESS;i++)
+    {
+      on.rate[i]=capacity/4;
+    }
+  }
+  printf("Handshake capacity:\t %.0f/s on one core\n",capacity);
+  printf("Admission at M:\t\t %.0f/s from node %d, burst %.0f, queue %d, %s\n",on.rate[helper->pkt.from % ADMIT_INGRESS],helper->pkt.from,on.burst,on.queue,on.policy == ADMIT_PRIORITY ? "prio" : "tail drop");
+  printf("\n%12s %10s %14s %14s %12s %12s %12s %12s\n","offered/s","admission","handshakes/s","forwarded/s","admitted","deferred","dropped","lost");
+  for(unsigned l=0;l<sizeof load/sizeof load[0];l++)
+  {
+    for(int withAdmission=0;withAdmission<2;withAdmission++)
+    {
+      admitBenchRun(ctx, helper, fwd, load[l]*capacity, seconds, withAdmission ? &on : &off, &run);
+      printf("%12.0f %10s %14.0f %14.0f %12llu %12llu %12llu %12llu\n",load[l]*capacity,withAdmission ? "on" : "off",run.handshakes,run.forwarded,
+             (unsigned long long)run.counts[ADMIT_ADMITTED],(unsigned long long)run.counts[ADMIT_DEFERRED],(unsigned long long)run.counts[ADMIT_DROPPED],(unsigned long long)run.lost);
+    }
+  }
+
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    releaseNodeCtx(&ctx[i]);
+  }
+  free(hops);
+  return 0;
+}
+
+/**************************************************************************
+* Forwarding latency with and without ECDH offload
+*
+* As in admitbench, one core serves as M and as a forwarding node. Packets
+* to forward and handshakes arrive open-loop, each at a fixed rate, and
+* are processed in the order they arrive. The latency of a forwarded
+* packet is the time from its arrival until it has been processed. Without
+* offload, a packet that arrives behind a handshake waits for its X25519
+* operation; with offload, M only submits the job and finishes the
+* handshake from its completion queue while it waits for arrivals.
+**************************************************************************/
+
+struct EcdhRun {
+  int samples;       /* forwarding latencies in cVector */
+  double handshakes; /* completed per second */
+  uint64_t dropped;
+};
+
+void ecdhBenchRun(struct NodeCtx *ctx, const struct RecordedHop *helper, const struct RecordedHop *fwd, double fwdRate, double hsRate, double seconds, int offload, struct EcdhRun *run)
+{
+  struct NodeCtx *m=&ctx[helper->id];
+  struct Packet *pkt=malloc(sizeof *pkt);
+  struct PacketBuf *buf;
+  uint64_t fwdInterval=(uint64_t)(1e9/fwdRate), hsInterval=(uint64_t)(1e9/hsRate);
+  uint64_t start, end, now, nextFwd, nextHs, handshakes=0;
+  int next;
+
+  memset(run, 0, sizeof *run);
+  m->pool=pbufPoolCreate(ECDH_JOBS+8);
+  m->offload=offload ? offloadCreate() : NULL;
+  if(pkt == NULL || m->pool == NULL || (offload && m->offload == NULL)){
+    fprintf(stderr,"ecdhbench: could not set up M\n");
+    free(pkt);
+    return;
+  }
+
+  start=nowNs();
+  end=start+(uint64_t)(seconds*1e9);
+  nextFwd=start;
+  nextHs=start+hsInterval/2;
+  for(;;)
+  {
+    int isFwd=nextFwd <= nextHs;
+    uint64_t t=isFwd ? nextFwd : nextHs;
+    if(t >= end){
+      break;
+    }
+    // finished handshakes are taken care of until the next arrival
+    while((now=nowNs()) < t)
+    {
+      if((buf=resumeDeferred(m, &next)) != NULL){
+        handshakes=handshakes+(next >= 0);
+        pbufPut(m->pool, buf);
+      }
+    }
+    if(isFwd){
+      memcpy(pkt, &fwd->pkt, sizeof *pkt);
+      dispatchPacket(&ctx[fwd->id], pkt);
+      if(run->samples < NUM_OF_SIMS){
+        cVector[run->samples++]=(int)(nowNs()-t);
+      }
+      nextFwd=nextFwd+fwdInterval;
+    }
+    else{
+      if((buf=pbufAlloc(m->pool)) != NULL){
+        memcpy(&buf->pkt, &helper->pkt, sizeof buf->pkt);
+        next=dispatchPacket(m, &buf->pkt);
+        handshakes=handshakes+(next >= 0);
+        pbufPut(m->pool, buf);
+      }
+      else{
+        run->dropped++;
+      }
+      nextHs=nextHs+hsInterval;
+    }
+  }
+  run->handshakes=handshakes*1e9/(nowNs()-start);
+  if(m->offload != NULL){
+    run->dropped=run->dropped+m->offload->dropped;
+  }
+  offloadDestroy(m->offload, m->pool);
+  m->offload=NULL;
+  pbufPoolDestroy(m->pool);
+  m->pool=NULL;
+  free(pkt);
+}
+
+int ecdhBenchMode(struct Node *nodes, int argc, char **argv)
+{
+  double seconds=argc > 0 ? atof(argv[0]) : 1;
+  struct NodeCtx ctx[NUM_OF_PATH_NODES];
+  struct RecordedHop *hops=malloc(RECORD_MAX_HOPS*sizeof *hops);
+  struct Packet *pkt=malloc(sizeof *pkt);
+  struct EcdhRun run;
+  int first[NUM_OF_HANDLERS];
+  const struct RecordedHop *helper, *fwd;
+  double fwdNs, hsNs;
+  uint64_t a;
+
+  if(hops == NULL || pkt == NULL){
+    fprintf(stderr,"ecdhbench: out of memory\n");
+    return 1;
+  }
+  if(seconds <= 0){
+    seconds=1;
+  }
+  // takes effect unless the workers are running already
+  if(argc > 1 || ecdhWorkers <= 0){
+    ecdhWorkers=argc > 1 ? atoi(argv[1]) : 2;
+  }
+  // replaying recorded packets is what this benchmark does
+  replayCapacity=0;
+  sessionCapacity=0;
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    initNodeCtx(&ctx[i], nodes, i);
+  }
+  if(recordSession(ctx, nodes, hops, first) < 0 || first[HANDLER_IAMHELPER] < 0 || first[HANDLER_FORWARDSTOW] < 0){
+    return 1;
+  }
+  helper=&hops[first[HANDLER_IAMHELPER]];
+  fwd=&hops[first[HANDLER_FORWARDSTOW]];
+  admitDestroy(ctx[helper->id].admit, ctx[helper->id].pool);
+  ctx[helper->id].admit=NULL;
+  offloadDestroy(ctx[helper->id].offload, ctx[helper->id].pool);
+  ctx[helper->id].offload=NULL;
+
+  // the cost of either kind of packet when done in place
+  a=nowNs();
+  for(int q=0;q<1000;q++)
+  {
+    memcpy(pkt, &fwd->pkt, sizeof *pkt);
+    dispatchPacket(&ctx[fwd->id], pkt);
+  }
+  fwdNs=(nowNs()-a)/1000.0;
+  a=nowNs();
+  for(int q=0;q<1000;q++)
+  {
+    memcpy(pkt, &helper->pkt, sizeof *pkt);
+    dispatchPacket(&ctx[helper->id], pkt);
+  }
+  hsNs=(nowNs()-a)/1000.0;
+
+  // 40% of the core for forwarding, another 20% for handshakes
+  printf("Forwarding:\t %.0f packets/s offered (%.0f ns each)\n",0.4e9/fwdNs,fwdNs);
+  printf("Handshakes:\t %.0f/s offered (%.0f ns each in place)\n",0.2e9/hsNs,hsNs);
+  for(int offload=0;offload<2;offload++)
+  {
+    ecdhBenchRun(ctx, helper, fwd, 0.4e9/fwdNs, 0.2e9/hsNs, seconds, offload, &run);
+    if(offload){
+      printf("\nECDH offload to %d workers:\n",ecdhPool != NULL ? ecdhPool->workers : 0);
+    }
+    else{
+      printf("\nECDH in place:\n");
+    }
+    printf("Handshakes:\t %.0f/s completed, %llu dropped\n",run.handshakes,(unsigned long long)run.dropped);
+    printf("Forwarding latency [ns]: ");
+    cVectorPercentiles(run.samples);
+  }
+
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    releaseNodeCtx(&ctx[i]);
+  }
+  free(pkt);
+  free(hops);
+  return 0;
+}
+
+/**************************************************************************
+* Replay filter cost
+*
+* dphi replaybench [capacity] [window s] fills a filter with capacity
+* distinct keys (SID and nonce built from a counter) and reports the cycles
+* per test-and-set, checks that all of them are found again as replays and
+* measures the false positive rate on capacity fresh keys against what
+* the filter is sized for. Last, keys keep arriving at full speed while the
+* generations rotate every 50 ms, and the latency of batches of 256 lookups
+* shows whether a rotation ever holds up a packet.
+**************************************************************************/
+
+#define REPLAY_BENCH_BATCH 256
+
+static inline void replayBenchKey(uint64_t n, uint8_t *sid, uint8_t *nonce)
+{
+  uint64_t x=replayMix(n+1), y=replayMix(n ^ 0x9e3779b97f4a7c15ULL);
+  memcpy(sid, &x, 8);
+  memcpy(sid+8, &y, 8);
+  memcpy(nonce, &n, 8);
+  memset(nonce+8, 0, 8);
+}
+
+int replayBenchMode(int argc, char **argv)
+{
+  uint64_t capacity=argc > 0 ? strtoull(argv[0], NULL, 10) : 10000000;
+  double window=argc > 1 ? atof(argv[1]) : 60;
+  struct ReplayFilter *f;
+  uint8_t sid[16], nonce[16];
+  uint64_t a, hits=0, rotations;
+  double fp, expected;
+  int samples=0;
+
+  if(capacity == 0){
+    capacity=10000000;
+  }
+  if(window <= 0){
+    window=60;
+  }
+  if((f=replayCreate(capacity, window)) == NULL){
+    fprintf(stderr,"replaybench: out of memory\n");
+    return 1;
+  }
+  printf("Replay filter:\t %llu keys per window, %.1f MB per generation\n",(unsigned long long)capacity,f->words*8/1048576.0);
+
+  a=__rdtsc();
+  for(uint64_t n=0;n<capacity;n++)
+  {
+    replayBenchKey(n, sid, nonce);
+    hits=hits+replaySeen(f, sid, nonce, 16);
+  }
+  printf("Insert:\t\t %.1f cycles per key (%llu false positives while filling)\n",(double)(__rdtsc()-a)/capacity,(unsigned long long)hits);
+
+  hits=0;
+  a=__rdtsc();
+  for(uint64_t n=0;n<capacity;n++)
+  {
+    replayBenchKey(n, sid, nonce);
+    hits=hits+replaySeen(f, sid, nonce, 16);
+  }
+  printf("Replay:\t\t %.1f cycles per key, %llu of %llu caught\n",(double)(__rdtsc()-a)/capacity,(unsigned long long)hits,(unsigned long long)capacity);
+
+  // fresh keys are only looked up, so that all of them see a full filter
+  hits=0;
+  for(uint64_t n=capacity;n<2*capacity;n++)
+  {
+    uint64_t index, mask;
+    replayBenchKey(n, sid, nonce);
+    mask=replayKey(f, sid, nonce, 16, &index);
+    hits=hits+((f->gen[f->epoch % REPLAY_GENERATIONS][index] & mask) == mask);
+  }
+  fp=(double)hits/capacity;
+  // a blocked filter is a Bloom filter per word, with a Poisson number of keys per word
+  expected=0;
+  {
+    double lambda=64.0/REPLAY_BITS_PER_KEY, p=1, sum=0, clear=1;
+    for(int k=0;k<64;k++)
+    {
+      // clear is the chance that a given bit is still 0 after k keys
+      double set=1-clear, all=1;
+      for(int i=0;i<REPLAY_HASHES;i++)
+      {
+        all=all*set;
+        clear=clear*(1-1.0/64);
+      }
+      expected=expected+p*all;
+      sum=sum+p;
+      p=p*lambda/(k+1);
+    }
+    expected=expected/sum;
+  }
+  printf("False positives: %.4f%% on fresh keys (%.4f%% expected at capacity)\n",100*fp,100*expected);
+  replayDestroy(f);
+
+  // rotations under load
+  if((f=replayCreate(capacity, 0.05)) == NULL){
+    fprintf(stderr,"replaybench: out of memory\n");
+    return 1;
+  }
+  a=nowNs();
+  for(uint64_t n=0;samples < NUM_OF_SIMS && nowNs()-a < 1000000000ULL;)
+  {
+    uint64_t t=nowNs();
+    for(int q=0;q<REPLAY_BENCH_BATCH;q++,n++)
+    {
+      replayBenchKey(n, sid, nonce);
+      replaySeen(f, sid, nonce, 16);
+    }
+    cVector[samples++]=(int)(nowNs()-t);
+  }
+  rotations=__atomic_load_n(&f->rotations, __ATOMIC_RELAXED);
+  replayDestroy(f);
+  printf("Rotating:\t %llu rotations in 1 s, ns per %d keys: ",(unsigned long long)rotations,REPLAY_BENCH_BATCH);
+  cVectorPercentiles(samples);
+  return 0;
+}
+
+/**************************************************************************
+* Re-encryption at d
+*
+* dphi reencbench [handshakes] [batch] takes the packet that reaches d in
+* a recorded session and re-encrypts its vectorSafe over and over: the
+* way iAmD did it before (decrypt V1, serialise V1 and V2 into buffers,
+* encrypt), in a single pass with reencryptVectorSafe and in batches with
+* reencryptBatch. The packets are copies spread over a few MB, so that
+* like at a busy d they are not all in the cache when their turn comes.
+**************************************************************************/
+
+#define REENC_RING 4096
+#define REENC_BATCH_MAX 256
+
+/* Alg 8:4-6 as iAmD used to do them */
+int reencryptTwoPass(const struct gcm_key_data *gkey, struct Header *header, struct Payload *payload, uint8_t *freshIv, int *tagOk)
+{
+  int ctLen=VECTOR_LENGTH*ENTRY_SIZE;
+  struct gcm_context_data gctx;
+  uint8_t tag[TAG_SIZE];
+  uint8_t ptV1[ctLen];
+  uint8_t currentV1[2*ctLen];
+  int v1Ok;
+
+  aes_gcm_dec_256(gkey, &gctx, ptV1, payload->vectorSafe, ctLen, payload->iv, header->sid, 16, tag, TAG_SIZE);
+  *tagOk=tagsEqual(payload->at, tag, TAG_SIZE);
+  vectorToByteArray(header->v1,currentV1);
+  v1Ok=memcmp(currentV1, ptV1, ctLen) == 0;
+  vectorToByteArray(header->v2,ptV1);
+  memcpy(currentV1+ctLen,ptV1,ctLen);
+  aes_gcm_enc_256(gkey, &gctx, payload->vectorSafe, currentV1, 2*ctLen, freshIv, header->sid, 16, payload->at, TAG_SIZE);
+  return v1Ok;
+}
+
+int reencBenchMode(struct Node *nodes, int argc, char **argv)
+{
+  int total=argc > 0 ? atoi(argv[0]) : 100000;
+  int batch=argc > 1 ? atoi(argv[1]) : 32;
+  struct NodeCtx ctx[NUM_OF_PATH_NODES];
+  struct RecordedHop *hops=malloc(RECORD_MAX_HOPS*sizeof *hops);
+  struct Packet *ring=malloc(REENC_RING*sizeof *ring);
+  struct ReencryptJob *jobs=malloc(REENC_BATCH_MAX*sizeof *jobs);
+  struct gcm_key_data gkey;
+  const struct RecordedHop *atD;
+  uint8_t freshIv[IV_SIZE];
+  int first[NUM_OF_HANDLERS];
+  int tagOk, failed=0;
+
+  if(hops == NULL || ring == NULL || jobs == NULL){
+    fprintf(stderr,"reencbench: out of memory\n");
+    return 1;
+  }
+  if(total <= 0){
+    total=100000;
+  }
+  total=total < NUM_OF_SIMS ? total : NUM_OF_SIMS;
+  if(batch < 1 || batch > REENC_BATCH_MAX){
+    batch=32;
+  }
+  // replaying recorded packets is what this benchmark does
+  replayCapacity=0;
+  sessionCapacity=0;
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    initNodeCtx(&ctx[i], nodes, i);
+  }
+  if(recordSession(ctx, nodes, hops, first) < 0 || first[HANDLER_IAMD] < 0){
+    return 1;
+  }
+  atD=&hops[first[HANDLER_IAMD]];
+  aes_gcm_pre_256(nodes[NODE_D].sessionKey, &gkey);
+  generateIv(freshIv);
+
+  // both ways have to come up with the very same ciphertext
+  memcpy(&ring[0], &atD->pkt, sizeof ring[0]);
+  memcpy(&ring[1], &atD->pkt, sizeof ring[1]);
+  failed=!reencryptTwoPass(&gkey, &ring[0].header, &ring[0].payload, freshIv, &tagOk) || !tagOk;
+  failed=failed || !reencryptVectorSafe(&gkey, &ring[1].header, &ring[1].payload, freshIv, &tagOk) || !tagOk;
+  failed=failed || memcmp(&ring[0].payload, &ring[1].payload, sizeof ring[0].payload) != 0;
+  printf("Re-encryption:\t %d handshakes, batches of %d, %s\n",total,batch,failed ? "\033[0;31mresults differ\033[0m" : "results identical");
+
+  for(int variant=0;variant<3;variant++)
+  {
+    int samples=0;
+    for(int done=0;done<total;)
+    {
+      int n=total-done < REENC_RING ? total-done : REENC_RING;
+      for(int i=0;i<n;i++)
+      {
+        memcpy(&ring[i], &atD->pkt, sizeof ring[i]);
+      }
+      for(int i=0;i<n;)
+      {
+        uint64_t a=__rdtsc();
+        if(variant == 0){
+          failed=failed | !reencryptTwoPass(&gkey, &ring[i].header, &ring[i].payload, freshIv, &tagOk);
+          cVector[samples++]=(int)(__rdtsc()-a);
+          i++;
+        }
+        else if(variant == 1){
+          failed=failed | !reencryptVectorSafe(&gkey, &ring[i].header, &ring[i].payload, freshIv, &tagOk);
+          cVector[samples++]=(int)(__rdtsc()-a);
+          i++;
+        }
+        else{
+          int m=n-i < batch ? n-i : batch;
+          for(int j=0;j<m;j++)
+          {
+            memcpy(&jobs[j].gkey, &gkey, sizeof gkey);
+            jobs[j].header=&ring[i+j].header;
+            jobs[j].payload=&ring[i+j].payload;
+            jobs[j].freshIv=freshIv;
+          }
+          a=__rdtsc();
+          reencryptBatch(jobs, m);
+          uint64_t each=(__rdtsc()-a)/m;
+          for(int j=0;j<m;j++)
+          {
+            failed=failed | !jobs[j].v1Ok;
+            cVector[samples++]=(int)each;
+          }
+          i=i+m;
+        }
+      }
+      done=done+n;
+    }
+    printf("%s",variant == 0 ? "Two passes:\t " : variant == 1 ? "Single pass:\t " : "Batched:\t ");
+    printf("cycles per handshake ");
+    cVectorPercentiles(samples);
+  }
+  if(failed){
+    printf("\033[0;31mRe-encryption failed\033[0m\n");
+  }
+
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    releaseNodeCtx(&ctx[i]);
+  }
+  free(jobs);
+  free(ring);
+  free(hops);
+  return failed;
+}
+
+/**************************************************************************
+* AS-level paths
+*
+* The walk-through and all modes above send every session along the same
+* 14 nodes. dphi aspaths <file.trace> [traces] replays the PHI traces that
+* "asgraph traces" (see analysis/) draws on the CAIDA topology instead:
+* each trace is a path s to M through the ASes of pathSM and a path W to d
+* through those of pathWtoD, with W somewhere on pathSM. An AS becomes a
+* node, with keys of its own, the first time a trace runs through it and
+* keeps them for all further traces. Every trace is one full handshake
+* through dispatchPacket, from iAmS to finishAtS and the first packet of
+* the transmission phase on to d, with the nodes of the path numbered by
+* phiPathLayout. The options of the node daemons (DPHI_ADMIT,
+* DPHI_SESSIONS and so on) are not used here.
+*
+* Reported are the cycles from iAmS to finishAtS, in total and by path
+* length, and how many entries of V1 and V2 the paths take. The routers
+* between s and M take an entry of V1 each, W and the routers between W
+* and d one of V2 each. Both are rings of VECTOR_LENGTH entries, and the
+* first entry is authenticated together with the one before it, so a path
+* has room for VECTOR_LENGTH-1 of them. Beyond that, later routers
+* overwrite what earlier ones wrote and the handshake fails on the way
+* back; the table marks these with a *.
+**************************************************************************/
+
+#define ASPATH_MAGIC 0x3143525453414124ULL /* "$ASTRC1", see asgraph.c */
+
+/* the file layout of analysis/asgraph.c */
+struct AsPathHeader {
+  uint64_t magic;
+  uint64_t nodes;
+  uint64_t digest;
+  uint64_t traces;
+  uint64_t seed;
+  uint64_t policy;
+};
+
+struct AsPathRecord {
+  uint32_t source;
+  uint32_t destination;
+  uint32_t helper;
+  uint8_t smLen;
+  uint8_t wdLen;
+  uint8_t midwayAt;
+  uint8_t reserved;
+};
+
+/* an AS that a trace ran through, with its longterm key expanded once */
+struct AsNode {
+  struct Node node;
+  struct gcm_key_data gkey;
+};
+
+/**************************************************************************
+ The node of AS index as, set up the first time it is asked for.
+**************************************************************************/
+struct AsNode *asNode(struct AsNode **ases, uint32_t as, int *created)
+{
+  if(ases[as] == NULL){
+    if((ases[as]=malloc(sizeof *ases[as])) == NULL){
+      return NULL;
+    }
+    bootstrapNode(&ases[as]->node,(int)as);
+    aes_gcm_pre_256(ases[as]->node.longTermKey, &ases[as]->gkey);
+    (*created)++;
+  }
+  return ases[as];
+}
+
+int asPathsMode(int argc, char **argv)
+{
+  struct AsPathHeader h;
+  struct AsPathRecord r;
+  struct PhiPath *path=malloc(sizeof *path);
+  struct Node *hop=calloc(2*PHI_MAX_PATH, sizeof *hop);
+  struct NodeCtx *ctx=calloc(2*PHI_MAX_PATH, sizeof *ctx);
+  struct Packet *pkt=malloc(sizeof *pkt);
+  struct AsNode **ases=NULL;
+  uint32_t sm[PHI_MAX_PATH], wd[PHI_MAX_PATH];
+  uint64_t lenSessions[2*PHI_MAX_PATH], lenCycles[2*PHI_MAX_PATH], lenDone[2*PHI_MAX_PATH];
+  uint64_t slots[2][PHI_MAX_PATH], slotsDone[2][PHI_MAX_PATH];
+  uint64_t read=0, replayed=0, wIsM=0, wIsD=0, failed=0, dispatched=0;
+  uint64_t wanted, a, b;
+  int created=0, maxLen=0, maxSlots=0, ret=1;
+  FILE *f;
+
+  if(argc < 1){
+    fprintf(stderr,"usage: dphi aspaths <file.trace> [traces]\n");
+    return 1;
+  }
+  if((f=fopen(argv[0],"rb")) == NULL){
+    perror(argv[0]);
+    return 1;
+  }
+  if(fread(&h, sizeof h, 1, f) != 1 || h.magic != ASPATH_MAGIC || h.nodes == 0 || h.nodes > UINT32_MAX){
+    fprintf(stderr,"%s is no trace file of asgraph\n",argv[0]);
+    fclose(f);
+    return 1;
+  }
+  wanted=h.traces;
+  if(argc > 1 && strtoull(argv[1],NULL,10) < wanted){
+    wanted=strtoull(argv[1],NULL,10);
+  }
+  if(wanted > NUM_OF_SIMS){
+    wanted=NUM_OF_SIMS;
+  }
+  if(path == NULL || hop == NULL || ctx == NULL || pkt == NULL || (ases=calloc(h.nodes, sizeof *ases)) == NULL){
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  memset(lenSessions, 0, sizeof lenSessions);
+  memset(lenCycles, 0, sizeof lenCycles);
+  memset(lenDone, 0, sizeof lenDone);
+  memset(slots, 0, sizeof slots);
+  memset(slotsDone, 0, sizeof slotsDone);
+  printf("AS-level paths from %s: %llu of %llu traces over %llu ASes (seed %llu)\n",argv[0],(unsigned long long)wanted,(unsigned long long)h.traces,(unsigned long long)h.nodes,(unsigned long long)h.seed);
+
+  while(read < wanted)
+  {
+    struct AsNode *as;
+    int len, id, next, finished=0, bad=0;
+
+    if(fread(&r, sizeof r, 1, f) != 1 || fread(sm, sizeof *sm, r.smLen, f) != r.smLen || fread(wd, sizeof *wd, r.wdLen, f) != r.wdLen){
+      fprintf(stderr,"%s: trace %llu is cut short\n",argv[0],(unsigned long long)read);
+      goto done;
+    }
+    read++;
+    for(int i=0;i<r.smLen;i++)
+    {
+      bad=bad || sm[i] >= h.nodes;
+    }
+    for(int i=0;i<r.wdLen;i++)
+    {
+      bad=bad || wd[i] >= h.nodes;
+    }
+    if(bad || r.smLen < 2 || r.midwayAt == 0 || r.midwayAt >= r.smLen || r.wdLen == 0 || wd[0] != sm[r.midwayAt]){
+      fprintf(stderr,"%s: trace %llu is malformed\n",argv[0],(unsigned long long)read-1);
+      goto done;
+    }
+    // the simulator has W do its part on the way back from M and before d
+    if(r.midwayAt == r.smLen-1){
+      wIsM++;
+      continue;
+    }
+    if(r.wdLen < 2){
+      wIsD++;
+      continue;
+    }
+
+    phiPathLayout(path, r.smLen, r.wdLen, r.midwayAt);
+    len=r.smLen+r.wdLen-1;
+    for(int i=0;i<len;i++)
+    {
+      if((as=asNode(ases, i < r.smLen ? sm[i] : wd[i-r.smLen+1], &created)) == NULL){
+        fprintf(stderr,"out of memory\n");
+        goto done;
+      }
+      hop[i]=as->node;
+      hop[i].id=i;
+      ctx[i].node=&hop[i];
+      ctx[i].nodes=hop;
+      ctx[i].path=path;
+      memcpy(&ctx[i].gkey, &as->gkey, sizeof as->gkey);
+    }
+
+    memset(pkt, 0, sizeof *pkt);
+    pkt->seq=(uint32_t)replayed;
+    pkt->header.status=NEW_SESSION;
+    next=path->s;
+    a=__rdtsc();
+    b=a;
+    while(next >= 0)
+    {
+      id=next;
+      next=dispatchPacket(&ctx[id], pkt);
+      dispatched++;
+      if(!finished && id == path->s && ctx[id].lastHandler == HANDLER_FINISHATS){
+        b=__rdtsc();
+        finished=1;
+      }
+    }
+
+    int v1=r.smLen-2, v2=r.wdLen-1;
+    slots[0][v1]++;
+    slots[1][v2]++;
+    maxSlots=v1 > maxSlots ? v1 : maxSlots;
+    maxSlots=v2 > maxSlots ? v2 : maxSlots;
+    lenSessions[len]++;
+    maxLen=len > maxLen ? len : maxLen;
+    if(next != PACKET_DELIVERED || !finished){
+      failed++;
+      continue;
+    }
+    slotsDone[0][v1]++;
+    slotsDone[1][v2]++;
+    lenDone[len]++;
+    lenCycles[len]+=b-a;
+    cVector[replayed++]=(int)(b-a);
+  }
+
+  printf("ASes with a node:\t %d\n",created);
+  printf("Handshakes to d:\t %llu, %llu failed, %.1f dispatches each\n",(unsigned long long)replayed,(unsigned long long)failed,(replayed+failed) > 0 ? (double)dispatched/(replayed+failed) : 0.0);
+  printf("Not replayed:\t\t %llu with W = M, %llu with W = d\n",(unsigned long long)wIsM,(unsigned long long)wIsD);
+  printf("Cycles per handshake:\t ");
+  cVectorPercentiles((int)replayed);
+
+  printf("\nASes on the path  handshakes  to d  cycles (mean)  per AS\n");
+  for(int len=0;len<=maxLen;len++)
+  {
+    if(lenSessions[len] > 0){
+      printf("%17d  %10llu  %5llu",len,(unsigned long long)lenSessions[len],(unsigned long long)lenDone[len]);
+      if(lenDone[len] > 0){
+        printf("  %13llu  %6llu",(unsigned long long)(lenCycles[len]/lenDone[len]),(unsigned long long)(lenCycles[len]/lenDone[len]/len));
+      }
+      printf("\n");
+    }
+  }
+
+  printf("\nEntries of %d  V1 paths  to d  V2 paths  to d\n",VECTOR_LENGTH);
+  for(int n=0;n<=maxSlots;n++)
+  {
+    if(slots[0][n] > 0 || slots[1][n] > 0){
+      printf("%10d%s  %8llu  %5llu  %8llu  %5llu\n",n,n >= VECTOR_LENGTH ? " *" : "  ",(unsigned long long)slots[0][n],(unsigned long long)slotsDone[0][n],(unsigned long long)slots[1][n],(unsigned long long)slotsDone[1][n]);
+    }
+  }
+  ret=0;
+
+done:
+  for(int i=0;i<2*PHI_MAX_PATH && ctx != NULL;i++)
+  {
+    releaseNodeCtx(&ctx[i]);
+  }
+  for(uint64_t i=0;ases != NULL && i<h.nodes;i++)
+  {
+    free(ases[i]);
+  }
+  free(ases);
+  free(pkt);
+  free(ctx);
+  free(hop);
+  free(path);
+  fclose(f);
+  return ret;
+}
+
+/**************************************************************************
+* AF_XDP node loop
+*
+* For the fastest routers the kernel stack is bypassed. Every node runs as
+* its own process in its own network namespace (see xdp_topology.sh), with
+* one AF_XDP socket per veth towards a neighbour on the path. All sockets
+* of a node share a single UMEM, so a frame received on one interface is
+* processed right there and its descriptor is put on the TX ring of the
+* interface towards the next hop - the node itself never copies it. A
+* tiny XDP program redirects everything arriving on an interface to its
+* socket. It is attached in driver mode where the driver has one and in
+* generic mode otherwise, and the sockets are bound in zero-copy mode
+* where the driver supports it. In copy mode (generic XDP, and veth, which
+* has no zero-copy support) the kernel copies every frame into the UMEM on
+* receive and out of it on transmit, so what the veth topology measures
+* is copy-mode throughput. Program and maps are loaded with raw bpf
+* syscalls, so no libbpf/libxdp is needed.
+*
+* s first opens a session through the path and then floods transmission-
+* phase packets built from the header it got back, which are handled by
+* forwardStoW, iAmWTransmissionToD2 and forwardWtoD on the way to d. d
+* reports the rate at which they arrive.
+**************************************************************************/
+
+#ifdef HAVE_AF_XDP
+
+#define XDP_NUM_FRAMES 2048
+#define XDP_FRAME_SIZE 4096
+#define XDP_RING_SIZE 512
+#define XDP_BATCH 64
+#define XDP_MAX_IFACES 4
+#define DPHI_ETHERTYPE 0x88B5 /* IEEE 802 local experimental */
+/* with 2 bytes of headroom, the Packet behind the Ethernet header starts 8-byte aligned */
+#define XDP_HEADROOM 2
+#define XDP_FRAME_OFFSET (XDP_PACKET_HEADROOM+XDP_HEADROOM)
+
+struct XskRing {
+  uint32_t *producer;
+  uint32_t *consumer;
+  void *ring;
+  uint32_t mask;
+  void *map;
+  size_t mapSize;
+};
+
+struct XdpIface {
+  char name[IF_NAMESIZE];
+  int ifindex;
+  int peer;
+  int fd;
+  int mapFd, progFd, linkFd;
+  int native; /* the program runs in driver mode */
+  int kick;
+  struct XskRing fill, comp, rx, tx;
+};
+
+struct XdpNode {
+  struct NodeCtx ctx;
+  uint8_t *umem;
+  uint64_t freeFrames[XDP_NUM_FRAMES];
+  int numFree;
+  int numIfaces;
+  int zeroCopy; /* the UMEM is bound in zero-copy mode */
+  int copyOnly; /* do not even try */
+  struct XdpIface ifaces[XDP_MAX_IFACES];
+};
+
+static volatile int xdpRunning;
+
+void xdpStop(int sig)
+{
+  (void)sig;
+  xdpRunning=0;
+}
+
+int bpfCall(int cmd, union bpf_attr *attr)
+{
+  return syscall(__NR_bpf, cmd, attr, sizeof *attr);
+}
+
+/**************************************************************************
+ Loads the XDP program for one interface: it redirects every frame to the
+ socket registered for its RX queue in the interface's XSKMAP and falls
+ back to the kernel stack if there is none. Then attaches it through a
+ BPF link, which lives as long as this process: in driver mode if the
+ driver has XDP support, in generic (SKB) mode otherwise.
+**************************************************************************/
+int xdpAttach(struct XdpIface *xi)
+{
+  union bpf_attr attr;
+  char log[4096];
+
+  memset(&attr, 0, sizeof attr);
+  attr.map_type=BPF_MAP_TYPE_XSKMAP;
+  attr.key_size=4;
+  attr.value_size=4;
+  attr.max_entries=1;
+  xi->mapFd=bpfCall(BPF_MAP_CREATE, &attr);
+  if(xi->mapFd < 0){
+    perror("BPF_MAP_CREATE");
+    return -1;
+  }
+
+  struct bpf_insn prog[]={
+    /* r2 = ctx->rx_queue_index */
+    {.code=BPF_LDX | BPF_MEM | BPF_W, .dst_reg=BPF_REG_2, .src_reg=BPF_REG_1, .off=offsetof(struct xdp_md, rx_queue_index)},
+    /* r1 = xsks map (a 64 bit immediate takes two instructions) */
+    {.code=BPF_LD | BPF_DW | BPF_IMM, .dst_reg=BPF_REG_1, .src_reg=BPF_PSEUDO_MAP_FD, .imm=xi->mapFd},
+    {.code=0},
+    /* r3 = action if no socket is bound to that queue */
+    {.code=BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg=BPF_REG_3, .imm=XDP_PASS},
+    {.code=BPF_JMP | BPF_CALL, .imm=BPF_FUNC_redirect_map},
+    {.code=BPF_JMP | BPF_EXIT},
+  };
+
+  memset(&attr, 0, sizeof attr);
+  attr.prog_type=BPF_PROG_TYPE_XDP;
+  attr.insns=(uint64_t)(uintptr_t)prog;
+  attr.insn_cnt=sizeof prog / sizeof prog[0];
+  attr.license=(uint64_t)(uintptr_t)"Dual BSD/GPL";
+  attr.log_buf=(uint64_t)(uintptr_t)log;
+  attr.log_size=sizeof log;
+  attr.log_level=1;
+  log[0]=0;
+  xi->progFd=bpfCall(BPF_PROG_LOAD, &attr);
+  if(xi->progFd < 0){
+    perror("BPF_PROG_LOAD");
+    fprintf(stderr, "%s\n", log);
+    return -1;
+  }
+
+  memset(&attr, 0, sizeof attr);
+  attr.link_create.prog_fd=xi->progFd;
+  attr.link_create.target_ifindex=xi->ifindex;
+  attr.link_create.attach_type=BPF_XDP;
+  attr.link_create.flags=XDP_FLAGS_DRV_MODE;
+  xi->linkFd=bpfCall(BPF_LINK_CREATE, &attr);
+  xi->native=xi->linkFd >= 0;
+  if(xi->linkFd < 0){
+    attr.link_create.flags=XDP_FLAGS_SKB_MODE;
+    xi->linkFd=bpfCall(BPF_LINK_CREATE, &attr);
+  }
+  if(xi->linkFd < 0){
+    perror("BPF_LINK_CREATE");
+    return -1;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Maps one of the four rings of an AF_XDP socket.
+**************************************************************************/
+int xskMapRing(struct XskRing *r, int fd, struct xdp_ring_offset *off, size_t entrySize, off_t pgoff)
+{
+  r->mapSize=off->desc+XDP_RING_SIZE*entrySize;
+  r->map=mmap(NULL, r->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if(r->map == MAP_FAILED){
+    perror("mmap xsk ring");
+    return -1;
+  }
+  r->producer=(uint32_t *)((uint8_t *)r->map+off->producer);
+  r->consumer=(uint32_t *)((uint8_t *)r->map+off->consumer);
+  r->ring=(uint8_t *)r->map+off->desc;
+  r->mask=XDP_RING_SIZE-1;
+  return 0;
+}
+
+/* puts the bound socket of xi into the XSKMAP of its program */
+int xskRegister(struct XdpIface *xi)
+{
+  union bpf_attr attr;
+  int key=0;
+
+  memset(&attr, 0, sizeof attr);
+  attr.map_fd=xi->mapFd;
+  attr.key=(uint64_t)(uintptr_t)&key;
+  attr.value=(uint64_t)(uintptr_t)&xi->fd;
+  if(bpfCall(BPF_MAP_UPDATE_ELEM, &attr) < 0){
+    perror("BPF_MAP_UPDATE_ELEM");
+    return -1;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Creates the AF_XDP socket of one interface. The first socket of a node
+ registers the UMEM, all further ones share it. Since they are bound to
+ other devices, each of them still needs its own fill and completion ring.
+ The first socket asks for zero copy if its program runs in driver mode
+ and settles for copy mode if the driver cannot do it. The shared ones
+ inherit the mode and fail to bind if their driver cannot, see xdpMode.
+**************************************************************************/
+int xskOpen(struct XdpNode *xn, struct XdpIface *xi, int first)
+{
+  struct sockaddr_xdp sxdp;
+  struct xdp_mmap_offsets off;
+  socklen_t optlen=sizeof off;
+  int ringSize=XDP_RING_SIZE;
+
+  xi->fd=socket(AF_XDP, SOCK_RAW, 0);
+  if(xi->fd < 0){
+    perror("socket AF_XDP");
+    return -1;
+  }
+  if(first){
+    struct xdp_umem_reg mr;
+    memset(&mr, 0, sizeof mr);
+    mr.addr=(uint64_t)(uintptr_t)xn->umem;
+    mr.len=(uint64_t)XDP_NUM_FRAMES*XDP_FRAME_SIZE;
+    mr.chunk_size=XDP_FRAME_SIZE;
+    mr.headroom=XDP_HEADROOM;
+    if(setsockopt(xi->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof mr) < 0){
+      perror("XDP_UMEM_REG");
+      return -1;
+    }
+  }
+  if(setsockopt(xi->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize, sizeof ringSize) < 0 ||
+     setsockopt(xi->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize, sizeof ringSize) < 0 ||
+     setsockopt(xi->fd, SOL_XDP, XDP_RX_RING, &ringSize, sizeof ringSize) < 0 ||
+     setsockopt(xi->fd, SOL_XDP, XDP_TX_RING, &ringSize, sizeof ringSize) < 0){
+    perror("setsockopt xsk rings");
+    return -1;
+  }
+  if(getsockopt(xi->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0){
+    perror("XDP_MMAP_OFFSETS");
+    return -1;
+  }
+  if(xskMapRing(&xi->fill, xi->fd, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+     xskMapRing(&xi->comp, xi->fd, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+     xskMapRing(&xi->rx, xi->fd, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+     xskMapRing(&xi->tx, xi->fd, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0){
+    return -1;
+  }
+
+  memset(&sxdp, 0, sizeof sxdp);
+  sxdp.sxdp_family=AF_XDP;
+  sxdp.sxdp_ifindex=xi->ifindex;
+  sxdp.sxdp_queue_id=0;
+  if(first){
+    xn->zeroCopy=xi->native && !xn->copyOnly;
+    sxdp.sxdp_flags=xn->zeroCopy ? XDP_ZEROCOPY : XDP_COPY;
+    if(xn->zeroCopy && bind(xi->fd, (struct sockaddr *)&sxdp, sizeof sxdp) == 0){
+      return xskRegister(xi);
+    }
+    xn->zeroCopy=0;
+    sxdp.sxdp_flags=XDP_COPY;
+  }
+  else{
+    sxdp.sxdp_flags=XDP_SHARED_UMEM;
+    sxdp.sxdp_shared_umem_fd=xn->ifaces[0].fd;
+  }
+  if(bind(xi->fd, (struct sockaddr *)&sxdp, sizeof sxdp) < 0){
+    perror("bind AF_XDP");
+    return -1;
+  }
+  return xskRegister(xi);
+}
+
+/**************************************************************************
+ Ring helpers. The kernel is the other side of every ring, so the indices
+ owned by the kernel are read with acquire and ours published with
+ release semantics.
+**************************************************************************/
+uint32_t xskFreeSlots(struct XskRing *r)
+{
+  return XDP_RING_SIZE-(*r->producer-__atomic_load_n(r->consumer, __ATOMIC_ACQUIRE));
+}
+
+uint32_t xskAvailable(struct XskRing *r)
+{
+  return __atomic_load_n(r->producer, __ATOMIC_ACQUIRE)-*r->consumer;
+}
+
+void xskRefill(struct XdpNode *xn, struct XdpIface *xi)
+{
+  uint32_t n=xskFreeSlots(&xi->fill);
+  uint32_t prod=*xi->fill.producer;
+  uint64_t *addrs=xi->fill.ring;
+
+  // leave part of the frames for the other interfaces and for sending
+  if(n > XDP_RING_SIZE/2){
+    n=XDP_RING_SIZE/2;
+  }
+  for(uint32_t i=0;i<n && xn->numFree > XDP_BATCH;i++)
+  {
+    addrs[prod++ & xi->fill.mask]=xn->freeFrames[--xn->numFree];
+  }
+  __atomic_store_n(xi->fill.producer, prod, __ATOMIC_RELEASE);
+}
+
+void xskCompletions(struct XdpNode *xn, struct XdpIface *xi)
+{
+  uint32_t n=xskAvailable(&xi->comp);
+  uint32_t cons=*xi->comp.consumer;
+  uint64_t *addrs=xi->comp.ring;
+
+  for(uint32_t i=0;i<n;i++)
+  {
+    xn->freeFrames[xn->numFree++]=addrs[cons++ & xi->comp.mask] & ~(uint64_t)(XDP_FRAME_SIZE-1);
+  }
+  __atomic_store_n(xi->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/**************************************************************************
+ Puts a frame on the TX ring of the interface towards peer. Returns 0 if
+ there is no such interface or no room, the frame is then still ours.
+**************************************************************************/
+int xskSend(struct XdpNode *xn, int peer, uint64_t addr, uint32_t len)
+{
+  for(int i=0;i<xn->numIfaces;i++)
+  {
+    struct XdpIface *xi=&xn->ifaces[i];
+    if(xi->peer != peer){
+      continue;
+    }
+    if(xskFreeSlots(&xi->tx) == 0){
+      return 0;
+    }
+    struct xdp_desc *descs=xi->tx.ring;
+    uint32_t prod=*xi->tx.producer;
+    descs[prod & xi->tx.mask].addr=addr;
+    descs[prod & xi->tx.mask].len=len;
+    descs[prod & xi->tx.mask].options=0;
+    __atomic_store_n(xi->tx.producer, prod+1, __ATOMIC_RELEASE);
+    xi->kick=1;
+    return 1;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Sends the packet at s, i.e. a fresh frame is taken from the UMEM, filled
+ with pkt behind an Ethernet header and handed to the interface towards
+ peer. This is the only place where packet data is written into a frame.
+**************************************************************************/
+int xdpOriginate(struct XdpNode *xn, struct Packet *pkt, int peer)
+{
+  if(xn->numFree == 0){
+    return 0;
+  }
+  uint64_t addr=xn->freeFrames[--xn->numFree]+XDP_FRAME_OFFSET;
+  struct ethhdr *eth=(struct ethhdr *)(xn->umem+addr);
+  memset(eth->h_dest, 0xff, ETH_ALEN);
+  memset(eth->h_source, 0, ETH_ALEN);
+  eth->h_proto=htons(DPHI_ETHERTYPE);
+  memcpy(eth+1, pkt, sizeof *pkt);
+  if(!xskSend(xn, peer, addr, sizeof *eth+sizeof *pkt)){
+    xn->freeFrames[xn->numFree++]=addr-XDP_FRAME_OFFSET;
+    return 0;
+  }
+  return 1;
+}
+
+/* closes socket, rings and program of one interface, also a half-open one */
+void xdpCloseIface(struct XdpIface *xi)
+{
+  struct XskRing *rings[4]={&xi->fill, &xi->comp, &xi->rx, &xi->tx};
+
+  for(int r=0;r<4;r++)
+  {
+    if(rings[r]->map != NULL && rings[r]->map != MAP_FAILED){
+      munmap(rings[r]->map, rings[r]->mapSize);
+    }
+  }
+  if(xi->fd > 0){
+    close(xi->fd);
+  }
+  if(xi->linkFd > 0){
+    close(xi->linkFd);
+  }
+  if(xi->progFd > 0){
+    close(xi->progFd);
+  }
+  if(xi->mapFd > 0){
+    close(xi->mapFd);
+  }
+  memset(xi, 0, sizeof *xi);
+}
+
+void xdpCloseIfaces(struct XdpNode *xn)
+{
+  for(int i=0;i<xn->numIfaces;i++)
+  {
+    xdpCloseIface(&xn->ifaces[i]);
+  }
+  xn->numIfaces=0;
+}
+
+/**************************************************************************
+ Opens the interfaces given as <ifname>:<peer>, the first one registers
+ the UMEM. All frames go back to the node's free list first, so that a
+ second attempt starts over.
+**************************************************************************/
+int xdpOpenIfaces(struct XdpNode *xn, int argc, char **argv)
+{
+  xn->numFree=0;
+  for(int i=0;i<XDP_NUM_FRAMES;i++)
+  {
+    xn->freeFrames[xn->numFree++]=(uint64_t)i*XDP_FRAME_SIZE;
+  }
+  for(int i=0;i<argc && xn->numIfaces < XDP_MAX_IFACES;i++)
+  {
+    struct XdpIface *xi=&xn->ifaces[xn->numIfaces];
+    char *colon=strchr(argv[i], ':');
+    if(colon == NULL){
+      fprintf(stderr, "xdp: expected <ifname>:<peer>, got %s\n", argv[i]);
+      return -1;
+    }
+    memset(xi, 0, sizeof *xi);
+    snprintf(xi->name, sizeof xi->name, "%.*s", (int)(colon-argv[i]), argv[i]);
+    xi->peer=atoi(colon+1);
+    xi->ifindex=if_nametoindex(xi->name);
+    if(xi->ifindex == 0){
+      perror(xi->name);
+      return -1;
+    }
+    if(xdpAttach(xi) < 0 || xskOpen(xn, xi, xn->numIfaces == 0) < 0){
+      xdpCloseIface(xi);
+      return -1;
+    }
+    xskRefill(xn, xi);
+    xn->numIfaces++;
+  }
+  return 0;
+}
+
+/**************************************************************************
+ Entry point of "dphi xdp <id> <seconds> <ifname>:<peer> ...", run once
+ per node inside its namespace by xdp_topology.sh. Every node forwards
+ until it is stopped; s additionally opens a session and then floods the
+ path for the given number of seconds.
+**************************************************************************/
+int xdpMode(struct Node *nodes, int argc, char **argv)
+{
+  if(argc < 3){
+    fprintf(stderr, "usage: dphi xdp <id> <seconds> <ifname>:<peer> [<ifname>:<peer> ...]\n");
+    return 1;
+  }
+  struct XdpNode *xn=calloc(1, sizeof *xn);
+  int id=atoi(argv[0]);
+  int seconds=atoi(argv[1]);
+  struct pollfd pfds[XDP_MAX_IFACES];
+  struct Packet *pkt=calloc(1, sizeof *pkt);
+  struct Packet *flood=NULL;
+  uint64_t delivered=0, lastDelivered=0, sent=0;
+  int floodNext=PACKET_DROP;
+  char name[16];
+
+  if(id < 0 || id >= NUM_OF_PATH_NODES){
+    fprintf(stderr, "xdp: no such node %d\n", id);
+    return 1;
+  }
+  initNodeCtx(&xn->ctx, nodes, id);
+  xn->umem=mmap(NULL, (size_t)XDP_NUM_FRAMES*XDP_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if(xn->umem == MAP_FAILED){
+    perror("mmap umem");
+    return 1;
+  }
+  if(xdpOpenIfaces(xn, argc-2, argv+2) < 0){
+    if(!xn->zeroCopy){
+      return 1;
+    }
+    fprintf(stderr, "xdp: not every interface of node %d can share a zero-copy UMEM, trying again in copy mode\n", id);
+    xdpCloseIfaces(xn);
+    xn->copyOnly=1;
+    if(xdpOpenIfaces(xn, argc-2, argv+2) < 0){
+      return 1;
+    }
+  }
+  for(int i=0;i<xn->numIfaces;i++)
+  {
+    struct XdpIface *xi=&xn->ifaces[i];
+    printf("Node %d: %s, XDP in %s mode, AF_XDP in %s mode\n",id,xi->name,xi->native ? "driver" : "generic",xn->zeroCopy ? "zero-copy" : "copy");
+    pfds[i].fd=xi->fd;
+    pfds[i].events=POLLIN;
+  }
+
+  signal(SIGINT, xdpStop);
+  signal(SIGTERM, xdpStop);
+  telemetryAttach(id);
+  traceAttach(id);
+  xdpRunning=1;
+  uint64_t start=nowNs();
+  uint64_t lastReport=start, lastKick=0, floodStart=0;
+
+  while(xdpRunning)
+  {
+    int work=0;
+    uint64_t now=nowNs();
+
+    // s keeps asking for a session until one made it through the path
+    if(id == NODE_S && flood == NULL && now-lastKick > 1000000000ULL){
+      memset(pkt, 0, sizeof *pkt);
+      pkt->header.status=NEW_SESSION;
+      pkt->from=id;
+      int next=dispatchPacket(&xn->ctx, pkt);
+      xdpOriginate(xn, pkt, next);
+      lastKick=now;
+    }
+
+    // ... and floods it afterwards
+    if(flood != NULL){
+      if(now-floodStart > (uint64_t)seconds*1000000000ULL){
+        xdpRunning=0;
+      }
+      for(int i=0;i<XDP_BATCH;i++)
+      {
+        flood->seq=(uint32_t)sent;
+        if(!xdpOriginate(xn, flood, floodNext)){
+          break;
+        }
+        sent++;
+        work=1;
+      }
+    }
+
+    for(int i=0;i<xn->numIfaces;i++)
+    {
+      struct XdpIface *xi=&xn->ifaces[i];
+      xskCompletions(xn, xi);
+
+      uint32_t n=xskAvailable(&xi->rx);
+      if(n > XDP_BATCH){
+        n=XDP_BATCH;
+      }
+      uint32_t cons=*xi->rx.consumer;
+      struct xdp_desc *descs=xi->rx.ring;
+      for(uint32_t k=0;k<n;k++)
+      {
+        uint64_t addr=descs[cons & xi->rx.mask].addr;
+        uint32_t len=descs[cons & xi->rx.mask].len;
+        cons++;
+        struct ethhdr *eth=(struct ethhdr *)(xn->umem+addr);
+        int next=PACKET_DROP;
+
+        if(len == sizeof *eth+sizeof(struct Packet) && eth->h_proto == htons(DPHI_ETHERTYPE)){
+          // the handlers work on the packet right inside the UMEM frame
+          struct Packet *rxPkt=(struct Packet *)(eth+1);
+          next=dispatchPacket(&xn->ctx, rxPkt);
+          if(id == NODE_S && rxPkt->header.status == TRANSMISSION_PHASE_TO_D1 && flood == NULL){
+            if((flood=malloc(sizeof *flood)) == NULL){
+              fprintf(stderr, "Node %d: out of memory for the flood\n", id);
+              xdpRunning=0;
+            }
+            else{
+              memcpy(flood, rxPkt, sizeof *flood);
+              floodNext=next;
+              floodStart=nowNs();
+              printf("Node %d: session established, flooding for %d s\n",id,seconds);
+            }
+            next=PACKET_DROP;
+          }
+        }
+        if(next == PACKET_DELIVERED){
+          delivered++;
+        }
+        if(next < 0 || !xskSend(xn, next, addr, len)){
+          if(next >= 0){
+            telemetryDrop();
+          }
+          xn->freeFrames[xn->numFree++]=addr & ~(uint64_t)(XDP_FRAME_SIZE-1);
+        }
+      }
+      __atomic_store_n(xi->rx.consumer, cons, __ATOMIC_RELEASE);
+      if(n > 0){
+        work=1;
+      }
+    }
+
+    for(int i=0;i<xn->numIfaces;i++)
+    {
+      struct XdpIface *xi=&xn->ifaces[i];
+      if(xi->kick){
+        // copy mode and most zero-copy drivers need a syscall to start TX
+        sendto(xi->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        xi->kick=0;
+      }
+      xskRefill(xn, xi);
+    }
+
+    now=nowNs();
+    if(id == NODE_D && now-lastReport > 1000000000ULL){
+      if(delivered > lastDelivered){
+        printf("Node %d: %.3f Mpps\n",id,(delivered-lastDelivered)/((now-lastReport)/1e3));
+        fflush(stdout);
+      }
+      lastDelivered=delivered;
+      lastReport=now;
+    }
+    if(!work && flood == NULL){
+      poll(pfds, xn->numIfaces, 100);
+    }
+  }
+
+  double elapsed=(nowNs()-start)/1e9;
+  if(id == NODE_S){
+    double floodTime=flood != NULL ? (nowNs()-floodStart)/1e9 : 0;
+    printf("Node %d: %llu packets sent, %.3f Mpps\n",id,(unsigned long long)sent,floodTime > 0 ? sent/floodTime/1e6 : 0.0);
+  }
+  else if(id == NODE_D){
+    printf("Node %d: %llu packets delivered, %.3f Mpps over %.1f s\n",id,(unsigned long long)delivered,delivered/elapsed/1e6,elapsed);
+  }
+  else{
+    printf("Node %d: %llu packets processed, %.3f Mpps over %.1f s\n",id,(unsigned long long)xn->ctx.packets,xn->ctx.packets/elapsed/1e6,elapsed);
+  }
+
+  xdpCloseIfaces(xn);
+  telemetryDetach();
+  traceDetach();
+  snprintf(name, sizeof name, "xdp-%d", id);
+  traceDump(name);
+  munmap(xn->umem, (size_t)XDP_NUM_FRAMES*XDP_FRAME_SIZE);
+  free(flood);
+  free(pkt);
+  free(xn);
+  return 0;
+}
+
+#endif
+
+/**************************************************************************
+* Shared-memory path emulation
+*
+* Every node of the path runs as a process of its own, pinned to a core of
+* its own where there are enough of them. The processes are connected by
+* lock-free single-producer/single-consumer rings, one per direction of
+* every link, which live in a shared (hugepage-backed if possible) region
+* together with all packet buffers. Handing a packet to the next hop means
+* pushing the index of its buffer, the ~2 KB of header and payload stay
+* where they are and only move between caches when the next node touches
+* them. This makes the cross-core costs of the backtracking and forwarding
+* phases visible. The parent process plays the load generator and is the
+* only one that allocates and frees buffers; nodes hand packets they drop
+* back to it.
+**************************************************************************/
+
+#define SHM_GENERATOR NUM_OF_PATH_NODES
+#define SHM_ENDPOINTS (NUM_OF_PATH_NODES+1)
+#define SHM_RING_SIZE 256 /* must be a power of two */
+#define SHM_BUFFERS 1024
+#define SHM_RETURN 0x80000000U /* marks buffers that go back to the generator unprocessed */
+#define SHM_HIST_BUCKETS 128
+
+struct SpscRing {
+  uint32_t head __attribute__((aligned(64))); /* written by the consumer only */
+  uint32_t tail __attribute__((aligned(64))); /* written by the producer only */
+  uint32_t slots[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct ShmBuf {
+  uint64_t tSent; /* when the previous hop pushed this buffer */
+  struct Packet pkt;
+};
+
+struct ShmRegion {
+  int running;
+  struct SpscRing rings[SHM_ENDPOINTS][SHM_ENDPOINTS]; /* [from][to] */
+  uint64_t hopHist[NUM_OF_PATH_NODES][NUM_OF_STATUS][SHM_HIST_BUCKETS];
+  uint64_t handshakeHist[SHM_HIST_BUCKETS];
+  struct ShmBuf bufs[SHM_BUFFERS];
+};
+
+int spscPush(struct SpscRing *r, uint32_t v)
+{
+  uint32_t tail=r->tail;
+  if(tail-__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == SHM_RING_SIZE){
+    return 0;
+  }
+  r->slots[tail & (SHM_RING_SIZE-1)]=v;
+  __atomic_store_n(&r->tail, tail+1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int spscPop(struct SpscRing *r, uint32_t *v)
+{
+  uint32_t head=r->head;
+  if(head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)){
+    return 0;
+  }
+  *v=r->slots[head & (SHM_RING_SIZE-1)];
+  __atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**************************************************************************
+ Latencies are kept in histograms with four buckets per power of two, so
+ that processes can add them up in shared memory without keeping every
+ sample. histBucket maps nanoseconds to a bucket, histValue a bucket back
+ to the lower bound of its range.
+**************************************************************************/
+int histBucket(uint64_t ns)
+{
+  if(ns < 4){
+    return (int)ns;
+  }
+  int msb=63-__builtin_clzll(ns);
+  int b=4*(msb-1)+(int)((ns >> (msb-2)) & 3);
+  return b < SHM_HIST_BUCKETS ? b : SHM_HIST_BUCKETS-1;
+}
+
+uint64_t histValue(int b)
+{
+  if(b < 4){
+    return b;
+  }
+  return (uint64_t)(4 | (b & 3)) << (b/4-1);
+}
+
+void histPercentiles(const uint64_t *hist)
+{
+  uint64_t total=0, sum=0;
+  int pct[3]={50,90,99};
+  uint64_t val[3]={0,0,0};
+
+  for(int b=0;b<SHM_HIST_BUCKETS;b++)
+  {
+    total=total+hist[b];
+  }
+  if(total == 0){
+    printf("no samples\n");
+    return;
+  }
+  for(int b=0, p=0;b<SHM_HIST_BUCKETS && p<3;b++)
+  {
+    sum=sum+hist[b];
+    while(p < 3 && sum*100 >= total*pct[p]){
+      val[p++]=histValue(b);
+    }
+  }
+  printf("p50 %llu  p90 %llu  p99 %llu  (%llu samples)\n",(unsigned long long)val[0],(unsigned long long)val[1],(unsigned long long)val[2],(unsigned long long)total);
+}
+
+void pinToCore(int core)
+{
+  cpu_set_t set;
+  long cores=sysconf(_SC_NPROCESSORS_ONLN);
+
+  CPU_ZERO(&set);
+  CPU_SET(core % (cores > 0 ? cores : 1), &set);
+  sched_setaffinity(0, sizeof set, &set);
+}
+
+/**************************************************************************
+ The loop of one node process: it pops buffers from the rings of all its
+ neighbours (and the generator), processes them in place and pushes them
+ to the ring towards the next hop.
+**************************************************************************/
+void shmNodeLoop(struct ShmRegion *shm, struct Node *nodes, int id)
+{
+  struct NodeCtx ctx;
+  int idle=0;
+
+  initNodeCtx(&ctx, nodes, id);
+  pinToCore(id+1);
+  telemetryAttach(id);
+  traceAttach(id);
+
+  while(__atomic_load_n(&shm->running, __ATOMIC_ACQUIRE))
+  {
+    int work=0;
+    for(int from=0;from<SHM_ENDPOINTS;from++)
+    {
+      uint32_t idx;
+      struct SpscRing *in=&shm->rings[from][id];
+      while(spscPop(in, &idx))
+      {
+        struct ShmBuf *buf=&shm->bufs[idx];
+        uint8_t status=buf->pkt.header.status;
+        int next=dispatchPacket(&ctx, &buf->pkt);
+        uint64_t now=nowNs();
+
+        if(status < NUM_OF_STATUS){
+          __atomic_fetch_add(&shm->hopHist[id][status][histBucket(now-buf->tSent)], 1, __ATOMIC_RELAXED);
+        }
+        if(id == NODE_S && status == REPLY_TO_S){
+          __atomic_fetch_add(&shm->handshakeHist[histBucket(now-buf->pkt.t0)], 1, __ATOMIC_RELAXED);
+        }
+        if(next == PACKET_DELIVERED){
+          next=SHM_GENERATOR;
+        }
+        buf->tSent=now;
+        if(next < 0 || !spscPush(&shm->rings[id][next], idx)){
+          if(next >= 0){
+            telemetryDrop();
+          }
+          // the generator never stops draining its rings, so this always gets through
+          while(!spscPush(&shm->rings[id][SHM_GENERATOR], idx | SHM_RETURN)){
+            sched_yield();
+          }
+        }
+        work=1;
+      }
+    }
+    if(work){
+      idle=0;
+    }
+    else if(++idle > 1000){
+      sched_yield();
+    }
+  }
+  telemetryDetach();
+  traceDetach();
+}
+
+/**************************************************************************
+ Entry point of "dphi shm [sessions] [window]". Forks one process per node
+ and drives sessions through them just like the UDP load generator does.
+**************************************************************************/
+int shmMode(struct Node *nodes, int argc, char **argv)
+{
+  int total=argc > 0 ? atoi(argv[0]) : 10000;
+  int window=argc > 1 ? atoi(argv[1]) : 1;
+  size_t size=(sizeof(struct ShmRegion)+(2UL << 20)-1) & ~((2UL << 20)-1);
+  uint32_t freeBufs[SHM_BUFFERS];
+  int numFree=0, completed=0, lost=0, inFlight=0, started=0;
+  pid_t pids[NUM_OF_PATH_NODES];
+  const char *backing="2 MB hugepages";
+
+  if(total <= 0 || total > NUM_OF_SIMS){
+    total=NUM_OF_SIMS;
+  }
+  if(window <= 0){
+    window=1;
+  }
+  if(window > SHM_BUFFERS){
+    window=SHM_BUFFERS;
+  }
+  // before the fork, so that the node processes inherit it
+  perSessionDefaults(window);
+
+  struct ShmRegion *shm=mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if(shm == MAP_FAILED){
+    // no hugepages reserved, so at least ask for transparent ones
+    shm=mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shm == MAP_FAILED){
+      perror("mmap shared region");
+      return 1;
+    }
+    madvise(shm, size, MADV_HUGEPAGE);
+    backing="regular pages";
+  }
+  memset(shm, 0, size);
+  for(int i=SHM_BUFFERS-1;i>=0;i--)
+  {
+    freeBufs[numFree++]=i;
+  }
+  shm->running=1;
+
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    pids[i]=fork();
+    if(pids[i] == 0){
+      shmNodeLoop(shm, nodes, i);
+      _exit(0);
+    }
+  }
+  pinToCore(0);
+  printf("Shared-memory path: %d node processes, %.1f MB region on %s, %d sessions, window %d\n",NUM_OF_PATH_NODES,size/1048576.0,backing,total,window);
+
+  uint64_t start=nowNs();
+  uint64_t lastReply=start;
+  while(completed+lost < total)
+  {
+    int work=0;
+    while(started < total && inFlight < window && numFree > 0)
+    {
+      uint32_t idx=freeBufs[--numFree];
+      struct ShmBuf *buf=&shm->bufs[idx];
+      memset(&buf->pkt.header, 0, sizeof buf->pkt.header);
+      buf->pkt.header.status=NEW_SESSION;
+      buf->pkt.seq=started;
+      buf->pkt.from=SHM_GENERATOR;
+      buf->pkt.t0=nowNs();
+      buf->tSent=buf->pkt.t0;
+      if(!spscPush(&shm->rings[SHM_GENERATOR][NODE_S], idx)){
+        freeBufs[numFree++]=idx;
+        break;
+      }
+      started++;
+      inFlight++;
+    }
+
+    for(int from=0;from<NUM_OF_PATH_NODES;from++)
+    {
+      uint32_t idx;
+      while(spscPop(&shm->rings[from][SHM_GENERATOR], &idx))
+      {
+        uint64_t now=nowNs();
+        if(idx & SHM_RETURN){
+          lost++;
+        }
+        else{
+          cVector[completed++]=(int)(now-shm->bufs[idx].pkt.t0);
+        }
+        freeBufs[numFree++]=idx & ~SHM_RETURN;
+        inFlight--;
+        lastReply=now;
+        work=1;
+      }
+    }
+    if(!work){
+      if(nowNs()-lastReply > 5000000000ULL){
+        printf("No progress for 5 s, giving up\n");
+        break;
+      }
+      sched_yield();
+    }
+  }
+  uint64_t elapsed=nowNs()-start;
+
+  __atomic_store_n(&shm->running, 0, __ATOMIC_RELEASE);
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    waitpid(pids[i], NULL, 0);
+  }
+
+  printf("Sessions completed:\t %d (%d lost)\n",completed,lost);
+  printf("Sessions per second:\t %.0f\n",completed/(elapsed/1e9));
+  traceDump("shm");
+  printf("\nHandshake latency, request at s until reply processed at s [ns]:\n  ");
+  histPercentiles(shm->handshakeHist);
+  printf("End-to-end latency incl. first transmission to d [ns]:\n  ");
+  cVectorPercentiles(completed);
+
+  /* per-hop latency: from the push by the previous hop until this hop is done with the packet */
+  uint64_t hist[SHM_HIST_BUCKETS];
+  printf("\nPer-hop latency by phase [ns]:\n");
+  for(int st=0;st<NUM_OF_STATUS;st++)
+  {
+    memset(hist, 0, sizeof hist);
+    for(int i=0;i<NUM_OF_PATH_NODES;i++)
+    {
+      for(int b=0;b<SHM_HIST_BUCKETS;b++)
+      {
+        hist[b]=hist[b]+shm->hopHist[i][st][b];
+      }
+    }
+    printf("  %-18s ",statusNames[st]);
+    histPercentiles(hist);
+  }
+  printf("\nPer-hop latency by node [ns]:\n");
+  for(int i=0;i<NUM_OF_PATH_NODES;i++)
+  {
+    memset(hist, 0, sizeof hist);
+    for(int st=0;st<NUM_OF_STATUS;st++)
+    {
+      for(int b=0;b<SHM_HIST_BUCKETS;b++)
+      {
+        hist[b]=hist[b]+shm->hopHist[i][st][b];
+      }
+    }
+    printf("  Node %-13d ",i);
+    histPercentiles(hist);
+  }
+
+  munmap(shm, size);
+  return 0;
+}
+
+/**************************************************************************
+* Shared vs sharded session state
+*
+* dphi shardbench [max cores] [sessions] [packets per core] has 1, 2, 4,
+* ... worker threads process packets of random sessions that arrive at
+* random workers, the way a node sees them when any thread may take any
+* packet. Processing a packet means what the dispatcher does with a session
+* table: find the session, load its state into the node and store it back.
+* With shared state all workers use one table and take a striped spinlock
+* around every session, so session state and the table's LRU clock move
+* between the caches of the workers. With sharded state every worker owns
+* the table of the sessions sessionOwner assigns to it; a packet that
+* arrives at another worker is handed to the owner over a SPSC ring (one
+* per pair of workers, as in the shm mode) and the owner processes it along
+* with its own arrivals.
+**************************************************************************/
+
+#define SHARD_MAX_CORES 16
+#define SHARD_LOCKS 4096
+#define SHARD_DRAIN 32 /* own arrivals between looking at the rings */
+
+struct ShardBench {
+  int cores;
+  int sharded;
+  uint64_t sessions;
+  uint64_t perCore;
+  uint8_t *sids;
+  struct SessionTable *tables[SHARD_MAX_CORES];
+  uint32_t locks[SHARD_LOCKS];
+  pthread_barrier_t start;
+  struct SpscRing rings[SHARD_MAX_CORES][SHARD_MAX_CORES]; /* [from][to] */
+};
+
+struct ShardWorker {
+  uint64_t done __attribute__((aligned(64)));
+  uint64_t handoffs;
+  struct ShardBench *bench;
+  int core;
+  pthread_t thread;
+};
+
+static struct ShardWorker shardWorkers[SHARD_MAX_CORES];
+
+/* what the dispatcher does for a packet of a session at s or W */
+static inline void shardProcess(struct SessionTable *t, struct Node *node, const uint8_t *sid)
+{
+  struct SessionState *st=sessionFind(t, NULL, sid, 1);
+  sessionLoad(st, node);
+  node->midwayIv4[0]++;
+  sessionStore(st, node);
+}
+
+static inline void shardLock(uint32_t *lock)
+{
+  int spins=0;
+  while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+  {
+    while(__atomic_load_n(lock, __ATOMIC_RELAXED))
+    {
+      if(++spins < 64){
+        __builtin_ia32_pause();
+      }
+      else{
+        sched_yield();
+      }
+    }
+  }
+}
+
+/* processes whatever the other workers handed over, returns how much */
+int shardDrain(struct ShardWorker *w, struct Node *node)
+{
+  struct ShardBench *b=w->bench;
+  uint32_t idx;
+  int n=0;
+
+  for(int from=0;from<b->cores;from++)
+  {
+    while(spscPop(&b->rings[from][w->core], &idx))
+    {
+      shardProcess(b->tables[w->core], node, b->sids+16*(uint64_t)idx);
+      n++;
+    }
+  }
+  __atomic_store_n(&w->done, w->done+n, __ATOMIC_RELEASE);
+  return n;
+}
+
+void *shardWorker(void *arg)
+{
+  struct ShardWorker *w=arg;
+  struct ShardBench *b=w->bench;
+  struct Node node;
+  uint64_t rng=replayMix(w->core+1), total=b->perCore*b->cores, done;
+
+  memset(&node, 0, sizeof node);
+  pinToCore(w->core);
+  pthread_barrier_wait(&b->start);
+
+  for(uint64_t i=0;i<b->perCore;i++)
+  {
+    rng=rng ^ (rng << 13);
+    rng=rng ^ (rng >> 7);
+    rng=rng ^ (rng << 17);
+    uint32_t idx=(uint32_t)(((rng & 0xffffffffULL)*b->sessions) >> 32);
+    const uint8_t *sid=b->sids+16*(uint64_t)idx;
+
+    if(!b->sharded){
+      uint32_t *lock=&b->locks[(sessionHash(sid) >> 32) & (SHARD_LOCKS-1)];
+      shardLock(lock);
+      shardProcess(b->tables[0], &node, sid);
+      __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+      w->done++;
+      continue;
+    }
+    int owner=sessionOwner(sid, b->cores);
+    if(owner == w->core){
+      shardProcess(b->tables[owner], &node, sid);
+      w->done++;
+    }
+    else{
+      // the owner may be waiting for room in one of our rings
+      while(!spscPush(&b->rings[w->core][owner], idx))
+      {
+        if(shardDrain(w, &node) == 0){
+          sched_yield();
+        }
+      }
+      w->handoffs++;
+    }
+    if((i % SHARD_DRAIN) == 0){
+      shardDrain(w, &node);
+    }
+  }
+  __atomic_store_n(&w->done, w->done, __ATOMIC_RELEASE);
+
+  // packets for this worker may still be on their way
+  while(b->sharded)
+  {
+    done=0;
+    for(int c=0;c<b->cores;c++)
+    {
+      done=done+__atomic_load_n(&shardWorkers[c].done, __ATOMIC_ACQUIRE);
+    }
+    if(done >= total){
+      break;
+    }
+    if(shardDrain(w, &node) == 0){
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+/* packets per second with cores workers, handoffs the share handed over */
+double shardBenchRun(struct ShardBench *b, int cores, int sharded, double *handoffs)
+{
+  uint64_t capacity=sharded ? b->sessions/cores+1 : b->sessions;
+  uint64_t start, moved=0;
+  double rate;
+
+  b->cores=cores;
+  b->sharded=sharded;
+  memset(b->locks, 0, sizeof b->locks);
+  memset(b->rings, 0, sizeof b->rings);
+  for(int c=0;c<(sharded ? cores : 1);c++)
+  {
+    if((b->tables[c]=sessionCreate(capacity)) == NULL){
+      fprintf(stderr,"shardbench: out of memory\n");
+      for(int i=0;i<c;i++)
+      {
+        sessionDestroy(b->tables[i], NULL);
+      }
+      return 0;
+    }
+  }
+  // all sessions are known already, the run measures the steady state
+  for(uint64_t i=0;i<b->sessions;i++)
+  {
+    const uint8_t *sid=b->sids+16*i;
+    sessionFind(b->tables[sharded ? sessionOwner(sid, cores) : 0], NULL, sid, 1);
+  }
+
+  pthread_barrier_init(&b->start, NULL, cores+1);
+  for(int c=0;c<cores;c++)
+  {
+    memset(&shardWorkers[c], 0, sizeof shardWorkers[c]);
+    shardWorkers[c].bench=b;
+    shardWorkers[c].core=c;
+    pthread_create(&shardWorkers[c].thread, NULL, shardWorker, &shardWorkers[c]);
+  }
+  pthread_barrier_wait(&b->start);
+  start=nowNs();
+  for(int c=0;c<cores;c++)
+  {
+    pthread_join(shardWorkers[c].thread, NULL);
+    moved=moved+shardWorkers[c].handoffs;
+  }
+  rate=b->perCore*cores*1e9/(nowNs()-start);
+  pthread_barrier_destroy(&b->start);
+
+  for(int c=0;c<(sharded ? cores : 1);c++)
+  {
+    sessionDestroy(b->tables[c], NULL);
+  }
+  *handoffs=(double)moved/(b->perCore*cores);
+  return rate;
+}
+
+int shardBenchMode(int argc, char **argv)
+{
+  long online=sysconf(_SC_NPROCESSORS_ONLN);
+  int maxCores=argc > 0 ? atoi(argv[0]) : (int)online;
+  struct ShardBench *b;
+  double shared, sharded, handoffs, unused;
+
+  if(maxCores < 1){
+    maxCores=1;
+  }
+  if(maxCores > SHARD_MAX_CORES){
+    maxCores=SHARD_MAX_CORES;
+  }
+  if(posix_memalign((void **)&b, 64, sizeof *b) != 0){
+    fprintf(stderr,"shardbench: out of memory\n");
+    return 1;
+  }
+  memset(b, 0, sizeof *b);
+  b->sessions=argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+  b->perCore=argc > 2 ? strtoull(argv[2], NULL, 10) : 2000000;
+  if(b->sessions == 0 || b->sessions > 0xffffffffULL){
+    b->sessions=100000;
+  }
+  if(b->perCore == 0){
+    b->perCore=2000000;
+  }
+  if((b->sids=malloc(16*b->sessions)) == NULL){
+    fprintf(stderr,"shardbench: out of memory\n");
+    free(b);
+    return 1;
+  }
+  for(uint64_t i=0;i<b->sessions;i++)
+  {
+    uint64_t x=replayMix(i+1), y=replayMix(x);
+    memcpy(b->sids+16*i, &x, 8);
+    memcpy(b->sids+16*i+8, &y, 8);
+  }
+
+  printf("Sessions:\t %llu (%zu bytes of state each), %llu packets per core, %ld cores online\n",
+         (unsigned long long)b->sessions,sizeof(struct SessionState),(unsigned long long)b->perCore,online);
+  printf("cores     shared [Mpkt/s]   sharded [Mpkt/s]   handed over\n");
+  for(int cores=1;;cores=cores*2)
+  {
+    if(cores > maxCores){
+      cores=maxCores;
+    }
+    shared=shardBenchRun(b, cores, 0, &unused);
+    sharded=shardBenchRun(b, cores, 1, &handoffs);
+    printf("%5d %16.2f %18.2f %12.1f%%\n",cores,shared/1e6,sharded/1e6,100*handoffs);
+    if(cores == maxCores){
+      break;
+    }
+  }
+  free(b->sids);
+  free(b);
+  return 0;
+}
+
+/**************************************************************************
+* Telemetry reader
+*
+* "dphi stats [interval]" maps the telemetry segment read-only and sums the
+* slots of all threads that ever counted, per node. Without an interval it
+* prints the totals once, with an interval (in seconds) it keeps printing
+* the rates over the last interval. It never writes to the segment, so the
+* forwarding threads do not notice it beyond the cache lines it reads.
+**************************************************************************/
+
+void telemetrySum(struct TelemetrySlot *sum, const struct TelemetrySlot *slot)
+{
+  for(int st=0;st<NUM_OF_STATUS;st++)
+  {
+    sum->packets[st]=sum->packets[st]+__atomic_load_n(&slot->packets[st], __ATOMIC_RELAXED);
+  }
+  sum->drops=sum->drops+__atomic_load_n(&slot->drops, __ATOMIC_RELAXED);
+  for(int h=0;h<NUM_OF_HANDLERS;h++)
+  {
+    sum->calls[h]=sum->calls[h]+__atomic_load_n(&slot->calls[h], __ATOMIC_RELAXED);
+    sum->cycles[h]=sum->cycles[h]+__atomic_load_n(&slot->cycles[h], __ATOMIC_RELAXED);
+    sum->authFails[h]=sum->authFails[h]+__atomic_load_n(&slot->authFails[h], __ATOMIC_RELAXED);
+    sum->rejects[h]=sum->rejects[h]+__atomic_load_n(&slot->rejects[h], __ATOMIC_RELAXED);
+  }
+  for(int i=0;i<NUM_OF_ADMIT;i++)
+  {
+    sum->admission[i]=sum->admission[i]+__atomic_load_n(&slot->admission[i], __ATOMIC_RELAXED);
+  }
+}
+
+/* perNode[i] gets the sum over all slots of node i; returns the number of live threads */
+int telemetrySnapshot(struct TelemetryRegion *region, struct TelemetrySlot *perNode)
+{
+  int live=0;
+  memset(perNode, 0, NUM_OF_NODES*sizeof *perNode);
+  for(int i=0;i<TELEMETRY_SLOTS;i++)
+  {
+    struct TelemetrySlot *slot=&region->slots[i];
+    int32_t node=__atomic_load_n(&slot->node, __ATOMIC_ACQUIRE);
+    int32_t owner=__atomic_load_n(&slot->owner, __ATOMIC_RELAXED);
+    if(node <= 0 || node > NUM_OF_NODES){
+      continue;
+    }
+    telemetrySum(&perNode[node-1], slot);
+    if(owner != 0 && !telemetryOwnerGone(owner)){
+      live++;
+    }
+  }
+  return live;
+}
+
+/**************************************************************************
+ Prints now, or the rate from before to now if seconds > 0.
+**************************************************************************/
+void telemetryPrint(const struct TelemetrySlot *now, const struct TelemetrySlot *before, double seconds)
+{
+  struct TelemetrySlot total, prev;
+  const char *unit=seconds > 0 ? "/s" : "";
+  double div=seconds > 0 ? seconds : 1;
+  char packetsLabel[16], dropsLabel[16], authLabel[16], callsLabel[16], rejectsLabel[16];
+
+  snprintf(packetsLabel, sizeof packetsLabel, "packets%s", unit);
+  snprintf(dropsLabel, sizeof dropsLabel, "drops%s", unit);
+  snprintf(authLabel, sizeof authLabel, "auth fails%s", unit);
+  snprintf(callsLabel, sizeof callsLabel, "calls%s", unit);
+  snprintf(rejectsLabel, sizeof rejectsLabel, "rejects%s", unit);
+
+  memset(&total, 0, sizeof total);
+  memset(&prev, 0, sizeof prev);
+  printf("%-6s %16s %14s %14s %14s\n","Node",packetsLabel,dropsLabel,authLabel,"cycles/packet");
+  for(int i=0;i<NUM_OF_NODES;i++)
+  {
+    uint64_t packets=0, cycles=0, authFails=0;
+    uint64_t packetsBefore=0, cyclesBefore=0, authFailsBefore=0;
+    for(int st=0;st<NUM_OF_STATUS;st++)
+    {
+      packets=packets+now[i].packets[st];
+      packetsBefore=packetsBefore+(seconds > 0 ? before[i].packets[st] : 0);
+    }
+    for(int h=0;h<NUM_OF_HANDLERS;h++)
+    {
+      cycles=cycles+now[i].cycles[h];
+      authFails=authFails+now[i].authFails[h];
+      cyclesBefore=cyclesBefore+(seconds > 0 ? before[i].cycles[h] : 0);
+      authFailsBefore=authFailsBefore+(seconds > 0 ? before[i].authFails[h] : 0);
+    }
+    if(packets == 0){
+      continue;
+    }
+    uint64_t drops=now[i].drops-(seconds > 0 ? before[i].drops : 0);
+    packets=packets-packetsBefore;
+    printf("%-6d %16.0f %14.0f %14.0f %14.0f\n",i,packets/div,drops/div,(authFails-authFailsBefore)/div,packets ? (double)(cycles-cyclesBefore)/packets : 0.0);
+    telemetrySum(&total, &now[i]);
+    if(seconds > 0){
+      telemetrySum(&prev, &before[i]);
+    }
+  }
+
+  printf("\n%-20s %16s\n","Status",packetsLabel);
+  for(int st=0;st<NUM_OF_STATUS;st++)
+  {
+    printf("%-20s %16.0f\n",statusNames[st],(total.packets[st]-prev.packets[st])/div);
+  }
+
+  printf("\n%-20s %16s %12s %14s %14s\n","Handler",callsLabel,"cycles/call",rejectsLabel,authLabel);
+  for(int h=0;h<NUM_OF_HANDLERS;h++)
+  {
+    uint64_t calls=total.calls[h]-prev.calls[h];
+    printf("%-20s %16.0f %12.0f %14.0f %14.0f\n",handlerNames[h],calls/div,calls ? (double)(total.cycles[h]-prev.cycles[h])/calls : 0.0,(total.rejects[h]-prev.rejects[h])/div,(total.authFails[h]-prev.authFails[h])/div);
+  }
+
+  if(total.admission[ADMIT_ADMITTED]+total.admission[ADMIT_DEFERRED]+total.admission[ADMIT_DROPPED] > 0){
+    printf("\nHandshakes at M:\t %.0f admitted%s, %.0f deferred%s, %.0f dropped%s\n",
+           (total.admission[ADMIT_ADMITTED]-prev.admission[ADMIT_ADMITTED])/div,unit,
+           (total.admission[ADMIT_DEFERRED]-prev.admission[ADMIT_DEFERRED])/div,unit,
+           (total.admission[ADMIT_DROPPED]-prev.admission[ADMIT_DROPPED])/div,unit);
+  }
+}
+
+int statsMode(int argc, char **argv)
+{
+  int interval=argc > 0 ? atoi(argv[0]) : 0;
+  struct TelemetrySlot *now=calloc(NUM_OF_NODES, sizeof *now);
+  struct TelemetrySlot *before=calloc(NUM_OF_NODES, sizeof *before);
+  struct TelemetryRegion *region=telemetryMap(0);
+
+  if(region == NULL){
+    fprintf(stderr, "stats: no telemetry at %s, no node has run yet\n", TELEMETRY_PATH);
+    return 1;
+  }
+
+  int live=telemetrySnapshot(region, now);
+  if(interval <= 0){
+    printf("Telemetry:\t %d threads counting\n\n",live);
+    telemetryPrint(now, before, 0);
+  }
+  while(interval > 0)
+  {
+    memcpy(before, now, NUM_OF_NODES*sizeof *now);
+    uint64_t t0=nowNs();
+    sleep(interval);
+    live=telemetrySnapshot(region, now);
+    printf("\nTelemetry:\t %d threads counting, last %d s\n\n",live,interval);
+    telemetryPrint(now, before, (nowNs()-t0)/1e9);
+    fflush(stdout);
+  }
+
+  munmap(region, sizeof *region);
+  free(now);
+  free(before);
+  return 0;
+}
+
+/**************************************************************************
+ In the main method, the previously defined functions are combined to
+ iterate through all steps of the protocol.
+**************************************************************************/
+int main(int argc, char **argv)
+{
+  /**************************************************************************
+   Init of some needed variables and population of structs
+  **************************************************************************/
+  /* the telemetry reader needs no nodes of its own */
+  if(argc > 1 && strcmp(argv[1],"stats") == 0){
+    return statsMode(argc-2, argv+2);
+  }
+  traceInit();
+  admitInit();
+  ecdhInit();
+  keypoolInit();
+  replayInit();
+  sessionInit();
+
+  /* nodes that run as processes of their own must agree on all keys, so
+  they all bootstrap from the same seed */
+  if(argc > 1 && strcmp(argv[1],"xdp") == 0){
+    srand(TEST_SEED);
+  }
+  else{
+    srand(time(NULL));
+  }
+  uint64_t c1, c2;
+
+  // declare header struct
+  struct Header header;
+  struct Header headerStored;
+  struct Payload payload;
+  struct StepInput atStoM, atHelper, atMtoS, atWbacktracking, atWforwardToD;
+  struct StepInput atWtoD, atDtoW, atWbackToS, atStoW, atWtoD2;
+
+  memset(&header, 0, sizeof header);
+  memset(&payload, 0, sizeof payload);
+
+  // init node keys and helper data
+  struct Node nodes[NUM_OF_NODES];
+  for (int i=0;i<NUM_OF_NODES;i++) {
+    bootstrapNode(&nodes[i],i);
+  }
+
+  /**************************************************************************
+   Instead of the walk-through and measurement below, the nodes can also be
+   run as daemons that exchange real packets (see udpMode).
+  **************************************************************************/
+  if(argc > 1 && strcmp(argv[1],"udp") == 0){
+    return udpMode(nodes, udpNodeLoop, argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"blocking") == 0){
+    return udpMode(nodes, blockingNodeLoop, argc-2, argv+2);
+  }
+#ifdef HAVE_IO_URING
+  if(argc > 1 && strcmp(argv[1],"uring") == 0){
+    return udpMode(nodes, uringNodeLoop, argc-2, argv+2);
+  }
+#endif
+  if(argc > 1 && strcmp(argv[1],"iobench") == 0){
+    return ioBenchMode(nodes, argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"shm") == 0){
+    return shmMode(nodes, argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"rejectbench") == 0){
+    return rejectBenchMode(nodes, argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"admitbench") == 0){
+    return admitBenchMode(nodes, argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"ecdhbench") == 0){
+    return ecdhBenchMode(nodes, argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"replaybench") == 0){
+    return replayBenchMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"shardbench") == 0){
+    return shardBenchMode(argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"reencbench") == 0){
+    return reencBenchMode(nodes, argc-2, argv+2);
+  }
+  if(argc > 1 && strcmp(argv[1],"aspaths") == 0){
+    return asPathsMode(argc-2, argv+2);
+  }
+#ifdef HAVE_AF_XDP
+  if(argc > 1 && strcmp(argv[1],"xdp") == 0){
+    return xdpMode(nodes, argc-2, argv+2);
+  }
+#endif
+
+  uint8_t *freshIv;
+  freshIv = malloc(IV_SIZE);
+  uint8_t *freshIv2;
+  freshIv2 = malloc(IV_SIZE);
+  struct gcm_key_data gkey;
+
+  /**************************************************************************
+   Test of library functions to ensure correct operation (taken from
+   reference implementation in isa-l_crypto)
+  **************************************************************************/
+  printf("\033[0;35m");
+  printf("1. Following are tests for the GCM operations of isa-l_crypto:\n");
+  printf("\033[0m");
+
+
+  int errors = 0;
+	int seed;
+
+	if (argc == 1)
+		seed = TEST_SEED;
+	else
+		seed = atoi(argv[1]);
+
+	srand(seed);
+	printf("SEED: %d\n", seed);
+
+	errors += test_gcm_std_vectors();
+
+	if (0 == errors)
+		printf("...Pass\n");
+	else
+		printf("...Fail\n");
+
+  /**************************************************************************
+   Perform steps of the protocol for one path to be established
+  **************************************************************************/
+  printf("\033[0;35m");
+  printf("\n\n2. Session establishment with help of the dPHI protocol for one pre-determined path:\n");
+  printf("\033[0m");
+
+  /* Initilization at the source */
+  iAmS(&nodes[0],&nodes[7],&nodes[13],&header,&payload,NULL);
+  memcpy(&headerStored,&header, sizeof header);
+  if(DEBUG == 1){
+    headerprint(&header);
+    payloadprint(&payload);
+  }
+
+  /* now the message is on its way from s to M and routing nodes create their routing entries within V1. Please note, that in this simple example, there is no real routing information since the route is predetermined. Therefore, fake values are "made up" that are handled like real data to measure real processing timings. */
+  for(int i=1;i<7;i++)
+  {
+    aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
+    generateIv(freshIv);
+    if(i == 1){
+      saveStep(&atStoM, &header, &payload, &nodes[i]);
+    }
+    sToM(&header, &nodes[i], gkey, freshIv, &c1, &c2);
+  }
+
+  /*aes gcm precomputation is not done for node 7 as this node does not need to do any cryptographic operation with its longterm key. Instead, it performd the DH key agreement and then uses the session key to decrypt the payload containg the real destination of the source.*/
+  saveStep(&atHelper, &header, &payload, &nodes[7]);
+  iAmHelper(&nodes[7],&header,&payload, gkey, &c1, &c2,1,NULL);
+
+  /* This is for consistency checks to see if the protocol worked correctly this far. */
+  if(true){
+    if(memcmp(nodes[0].sessionKey, nodes[7].sessionKey, 32) == 0){
+      printf("\033[0;32m");
+      printf("S and M derived identical Session Key\n");
+      printf("\033[0m");
+    }
+    else{
+      printf("\033[0;31m");
+      printf("S and M could not derive identical Session Key\n");
+      printf("\033[0m");
+    }
+
+    //check if M determines correct d from encrypted payload
+    if(memcmp(header.dest, nodes[13].address, 4) == 0){
+      printf("\033[0;32m");
+      printf("M: correct Destination recovered\n");
+      printf("\033[0m");
+    }
+    else{
+      printf("\033[0;31m");
+      printf("M: wrong Destination recovered\n");
+      printf("\033[0m");
+    }
+
     //check if M determines correct nonce from encrypted payload
     if(memcmp(header.midway, nodes[0].nonce, 8) == 0){
       printf("\033[0;32m");
@@ -1973,12 +7906,16 @@ int main(int argc, char **argv)
       aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
       generateIv(freshIv);
       generateIv(freshIv2);
-      header=iAmWbacktracking(header, &nodes[i], gkey, freshIv, freshIv2, &c1, &c2,1);
+      saveStep(&atWbacktracking, &header, &payload, &nodes[i]);
+      iAmWbacktracking(&header, &nodes[i], gkey, freshIv, freshIv2, &c1, &c2,1);
     }
     else
     {
       aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
-      header=mToS(header, &nodes[i], gkey, &c1, &c2,1);
+      if(i == 6){
+        saveStep(&atMtoS, &header, &payload, &nodes[i]);
+      }
+      mToS(&header, &nodes[i], gkey, &c1, &c2,1);
     }
   }
 
@@ -1998,18 +7935,20 @@ int main(int argc, char **argv)
   }
 
   /* The message returned to s and s could perform some integrity checks such as counting the number of changed elements in the routing segment to verify that the message did not take an unpredicted route. However, we omit these checks as we know the path has not been tempered with. Also, operations at s are not in the scope of our performance measuring. */
-  backAtS(&header,&headerStored,&nodes[0],&nodes[13],&payload,1);
+  backAtS(&header,&headerStored,&nodes[0],&nodes[13],&payload,1,NULL);
+  memcpy(&headerStored,&header, sizeof header);
 
   // now the transmission to real destination d is triggered and the message is on its way from s to the midway node W, where further operations are required.
   for(int i=1;i<4;i++)
   {
     aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
-    header=forwardStoW(header, &nodes[i], gkey, &c1, &c2,1);
+    forwardStoW(&header, &nodes[i], gkey, &c1, &c2,1);
   }
 
   /* node 4 detects that it is the midway node W and will initiate communication to d. Among other things, this includes initialization of V2 */
   aes_gcm_pre_256(nodes[4].longTermKey, &gkey);
   generateIv(freshIv);
+  saveStep(&atWforwardToD, &header, &payload, &nodes[4]);
   iAmWforwardToD(&header, &nodes[4], freshIv, gkey, &c1, &c2,1);
 
   /* now the message is on its way to d and routing nodes create their routing entries. Please note, that in this simple example, there is no real routing information since the route is predetermined. Therefore, fake values are "made up" that are handled like real data */
@@ -2017,30 +7956,37 @@ int main(int argc, char **argv)
   {
     aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
     generateIv(freshIv);
-    header=wToD(header, nodes[i], gkey, freshIv, &c1, &c2);
+    if(i == 8){
+      saveStep(&atWtoD, &header, &payload, &nodes[i]);
+    }
+    wToD(&header, &nodes[i], gkey, freshIv, &c1, &c2);
   }
 
   /* the message arrives at d for the first time, where the session key with s is derived */
-  iAmD(&header, &nodes[13], freshIv, gkey, &payload, &c1, &c2,1);
+  iAmD(&header, &nodes[13], freshIv, gkey, &payload, &c1, &c2,1,NULL);
 
   /* now the message goes back from d to W. The intermediate nodes only have to look up their entries */
   for(int i=12;i>7;i--)
   {
     aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
-    header=dToW(header, &nodes[i], gkey, &c1, &c2);
+    if(i == 12){
+      saveStep(&atDtoW, &header, &payload, &nodes[i]);
+    }
+    dToW(&header, &nodes[i], gkey, &c1, &c2);
   }
 
   /* W receives the reply from d that is intended to go back to s. But before W does so, it could perform integrity checks on the header to find out if the routing segment exhibits the expected number of changed entries */
   generateIv(freshIv);
   generateIv(nodes[4].midwayIv4);
   aes_gcm_pre_256(nodes[4].longTermKey, &gkey);
+  saveStep(&atWbackToS, &header, &payload, &nodes[4]);
   iAmWbackToS(&header, &nodes[4], freshIv, gkey, &c1, &c2,1);
 
   /* now the mesage goes back from W to s. since this operation is 100% identical to the phase where the message goes from M to s, the same method is reused instead of inserting a duplicate */
   for(int i=3;i>0;i--)
   {
     aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
-    header=mToS(header, &nodes[i], gkey, &c1, &c2,1);
+    mToS(&header, &nodes[i], gkey, &c1, &c2,1);
   }
 
   /* the reply from d arrives at s, where the integrity of the routing segment is checked */
@@ -2052,19 +7998,23 @@ int main(int argc, char **argv)
   for(int i=1;i<4;i++)
   {
     aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
-    header=forwardStoW(header, &nodes[i], gkey, &c1, &c2,1);
+    if(i == 1){
+      saveStep(&atStoW, &header, &payload, &nodes[i]);
+    }
+    forwardStoW(&header, &nodes[i], gkey, &c1, &c2,1);
   }
 
   /* W notices that it is indeed the midway node and performs the neccessary operations, i.e. looking up the routing entry in V2 etc. */
   aes_gcm_pre_256(nodes[4].longTermKey, &gkey);
   generateIv(freshIv);
+  saveStep(&atWtoD2, &header, &payload, &nodes[4]);
   iAmWTransmissionToD2(&header, &nodes[4], freshIv, gkey, &c1, &c2,1);
 
   /* from W onwards, the routing nodes behave just like during transmission from s to W with the exception, that they perform their look ups in V2 */
   for(int i=8;i<13;i++)
   {
     aes_gcm_pre_256(nodes[i].longTermKey, &gkey);
-    header=forwardWtoD(header, &nodes[i], gkey, &c1, &c2,1);
+    forwardWtoD(&header, &nodes[i], gkey, &c1, &c2,1);
   }
 
 
@@ -2095,7 +8045,8 @@ int main(int argc, char **argv)
   generateIv(freshIv);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
-    header=sToM(header, nodes[1], gkey, freshIv, &c1, &c2);
+    restoreStep(&atStoM, &header, &payload, &nodes[1]);
+    sToM(&header, &nodes[1], gkey, freshIv, &c1, &c2);
     cVector[q]=(int)(c2-c1);
   }
   cVectorAnalysis();
@@ -2104,7 +8055,8 @@ int main(int argc, char **argv)
   printf("Midway Request for A == M:\t ");
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
-    header=iAmHelper(&nodes[7],header,payload, gkey, &c1, &c2,0);
+    restoreStep(&atHelper, &header, &payload, &nodes[7]);
+    iAmHelper(&nodes[7],&header,&payload, gkey, &c1, &c2,0,NULL);
     cVector[q]=(int)(c2-c1);
   }
   cVectorAnalysis();
@@ -2114,7 +8066,8 @@ int main(int argc, char **argv)
   aes_gcm_pre_256(nodes[6].longTermKey, &gkey);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
-    header=mToS(header, &nodes[6], gkey, &c1, &c2,0);
+    restoreStep(&atMtoS, &header, &payload, &nodes[6]);
+    mToS(&header, &nodes[6], gkey, &c1, &c2,0);
     cVector[q]=(int)(c2-c1);
   }
   cVectorAnalysis();
@@ -2126,7 +8079,8 @@ int main(int argc, char **argv)
   generateIv(freshIv2);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
-    header=iAmWbacktracking(header, &nodes[4], gkey, freshIv, freshIv2, &c1, &c2,0);
+    restoreStep(&atWbacktracking, &header, &payload, &nodes[4]);
+    iAmWbacktracking(&header, &nodes[4], gkey, freshIv, freshIv2, &c1, &c2,0);
     cVector[q]=(int)(c2-c1);
   }
   cVectorAnalysis();
@@ -2139,6 +8093,7 @@ int main(int argc, char **argv)
   generateIv(freshIv);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
+    restoreStep(&atWforwardToD, &header, &payload, &nodes[4]);
     iAmWforwardToD(&header, &nodes[4], freshIv, gkey, &c1, &c2,0);
     cVector[q]=(int)(c2-c1);
   }
@@ -2151,7 +8106,8 @@ int main(int argc, char **argv)
   generateIv(freshIv);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
-    header=wToD(header, nodes[8], gkey, freshIv, &c1, &c2);
+    restoreStep(&atWtoD, &header, &payload, &nodes[8]);
+    wToD(&header, &nodes[8], gkey, freshIv, &c1, &c2);
     cVector[q]=(int)(c2-c1);
   }
   cVectorAnalysis();
@@ -2162,7 +8118,8 @@ int main(int argc, char **argv)
   aes_gcm_pre_256(nodes[12].longTermKey, &gkey);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
-    header=dToW(header, &nodes[12], gkey, &c1, &c2);
+    restoreStep(&atDtoW, &header, &payload, &nodes[12]);
+    dToW(&header, &nodes[12], gkey, &c1, &c2);
     cVector[q]=(int)(c2-c1);
   }
   cVectorAnalysis();
@@ -2171,10 +8128,10 @@ int main(int argc, char **argv)
   /* Table 1, row 8 */
   printf("Handshake reply to s for A == W: ");
   generateIv(freshIv);
-  generateIv(nodes[4].midwayIv4);
   aes_gcm_pre_256(nodes[4].longTermKey, &gkey);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
+    restoreStep(&atWbackToS, &header, &payload, &nodes[4]);
     iAmWbackToS(&header, &nodes[4], freshIv, gkey, &c1, &c2,0);
     cVector[q]=(int)(c2-c1);
   }
@@ -2186,7 +8143,8 @@ int main(int argc, char **argv)
   aes_gcm_pre_256(nodes[1].longTermKey, &gkey);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
-    header=forwardStoW(header, &nodes[1], gkey, &c1, &c2,0);
+    restoreStep(&atStoW, &header, &payload, &nodes[1]);
+    forwardStoW(&header, &nodes[1], gkey, &c1, &c2,0);
     cVector[q]=(int)(c2-c1);
   }
   cVectorAnalysis();
@@ -2198,6 +8156,7 @@ int main(int argc, char **argv)
   generateIv(freshIv);
   for(int q=0;q<NUM_OF_SIMS;q++)
   {
+    restoreStep(&atWtoD2, &header, &payload, &nodes[4]);
     iAmWTransmissionToD2(&header, &nodes[4], freshIv, gkey, &c1, &c2,0);
     cVector[q]=(int)(c2-c1);
   }
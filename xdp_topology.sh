@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Builds the path from main out of network namespaces dphi0 (s) to dphi13 (d),
+# connected by veth pairs, and runs one AF_XDP node in each of them.
+# In namespace dphi<i>, the interface towards node <j> is called n<j>.
+# usage: ./xdp_topology.sh [seconds] [path to dphi binary]   (needs root)
+
+SECONDS_TO_RUN=${1:-10};
+DPHI=${2:-$(pwd)/aes/dphi};
+LINKS="0-1 1-2 2-3 3-4 4-5 5-6 6-7 4-8 8-9 9-10 10-11 11-12 12-13";
+
+cleanup() {
+  for i in $(seq 0 13); do
+    ip netns del dphi$i 2>/dev/null;
+  done
+}
+
+cleanup;
+for i in $(seq 0 13); do
+  ip netns add dphi$i;
+  ip netns exec dphi$i sysctl -qw net.ipv6.conf.all.disable_ipv6=1;
+  ip netns exec dphi$i ip link set lo up;
+done
+
+# frames carry a complete dPHI packet of about 2 KB, so the MTU is raised accordingly
+for l in $LINKS; do
+  a=${l%-*};
+  b=${l#*-};
+  ip link add n$b netns dphi$a mtu 3000 type veth peer name n$a netns dphi$b mtu 3000;
+  ip netns exec dphi$a ip link set n$b up;
+  ip netns exec dphi$b ip link set n$a up;
+done
+
+# everything but s is started first, s opens the session once the others are up
+for i in $(seq 13 -1 1); do
+  ifaces="";
+  for l in $LINKS; do
+    a=${l%-*};
+    b=${l#*-};
+    [ "$a" = "$i" ] && ifaces="$ifaces n$b:$b";
+    [ "$b" = "$i" ] && ifaces="$ifaces n$a:$a";
+  done
+  ip netns exec dphi$i $DPHI xdp $i $SECONDS_TO_RUN $ifaces > /tmp/dphi-xdp-$i.log 2>&1 &
+done
+sleep 1;
+
+ip netns exec dphi0 $DPHI xdp 0 $SECONDS_TO_RUN n1:1 &
+S_PID=$!;
+tail -f /tmp/dphi-xdp-13.log &
+TAIL_PID=$!;
+wait $S_PID;
+
+pkill -INT -f "$DPHI xdp";
+sleep 1;
+kill $TAIL_PID;
+cat /tmp/dphi-xdp-{1..12}.log;
+cleanup;